@@ -14,9 +14,11 @@ CXX 		?=
 CXXFLAGS 	:= -Wall -Werror -std=c++11
 DBGFLAGS 	:= -g -ggdb
 TESTFLAGS 	:= -fprofile-arcs -ftest-coverage --coverage
-LINKFLAGS 	:= -shared
+TRACEFLAGS 	:= -DTFTP_TRACE
+LINKFLAGS 	:= -shared -lz
 
 COBJFLAGS 	:= $(CXXFLAGS) -c -fPIC
 test: COBJFLAGS 	+= $(TESTFLAGS)
 test: LINKFLAGS 	+= -fprofile-arcs -lgcov
 debug: COBJFLAGS 	+= $(DBGFLAGS)
+trace: COBJFLAGS 	+= $(TRACEFLAGS)
@@ -6,7 +6,10 @@
 #define ITFTPCLIENT_H
 
 #include "tftp_api.h"
+#include "TFTPStatsTypes.h"
+#include <stdint.h>
 #include <string>
+#include <vector>
 
 /**
  * @brief Enum with possible return from interface functions.
@@ -51,6 +54,55 @@ typedef TftpClientOperationResult (*tftpfetchDataReceivedCallback) (
         void *context
 );
 
+/**
+ * @brief Enum with the directions of a client transfer.
+ * Possible values are:
+ * - TFTP_CLIENT_TRANSFER_SEND:         The client sends a file.
+ * - TFTP_CLIENT_TRANSFER_FETCH:        The client fetches a file.
+ */
+enum class TftpClientTransferDirection {
+    TFTP_CLIENT_TRANSFER_SEND = 0,
+    TFTP_CLIENT_TRANSFER_FETCH
+};
+
+/**
+ * @brief Enum with the transports a client can use.
+ * Possible values are:
+ * - TFTP_CLIENT_TRANSPORT_UDP:         TFTP over UDP, through the engine.
+ * - TFTP_CLIENT_TRANSPORT_LOCAL:       Blocks handed over in shared memory
+ *                                      to a server in the same process.
+ */
+enum class TftpClientTransport {
+    TFTP_CLIENT_TRANSPORT_UDP = 0,
+    TFTP_CLIENT_TRANSPORT_LOCAL
+};
+
+/**
+ * @brief Default bytes between two progress reports.
+ */
+#define TFTP_PROGRESS_DEFAULT_BYTES (64 * 1024)
+
+/**
+ * @brief TFTP progress callback. This callback is called from the
+ * transfer, between blocks, as the transfer moves the caller's data, so it
+ * should return quickly.
+ *
+ * @param[in]   direction       Direction of the transfer.
+ * @param[in]   bytes           Bytes of the caller's data moved so far.
+ * @param[in]   totalBytes      Bytes the transfer will move, or -1 if
+ *                              unknown.
+ * @param[in]   context         Context passed to the callback.
+ */
+typedef void (*tftpProgressCallback) (
+        TftpClientTransferDirection direction,
+        uint64_t bytes,
+        int64_t totalBytes,
+        void *context
+);
+
+class TFTPLatencyHistogram;
+class TFTPMappedSink;
+
 /**
  * @brief TFTP client interface.
  */
@@ -71,6 +123,24 @@ public:
             const int port
     ) = 0;
 
+    /**
+     * @brief Set the transport. With TFTP_CLIENT_TRANSPORT_LOCAL, when the
+     * connection is to a loopback address and a server in this process
+     * listens on the port, blocks go through a ring in shared memory to a
+     * thread of that server instead of through the UDP stack. Blocks,
+     * errors and callbacks on both sides keep their TFTP semantics, and a
+     * transfer returns once the server is done with the file. Otherwise
+     * transfers go over UDP. The default is TFTP_CLIENT_TRANSPORT_UDP.
+     *
+     * @param[in] transport the transport.
+     *
+     * @return TFTP_CLIENT_OK if success.
+     * @return TFTP_CLIENT_ERROR otherwise.
+     */
+    virtual TftpClientOperationResult setTransport(
+            const TftpClientTransport transport
+    ) = 0;
+
     /**
      * @brief Register TFTP error callback
      *
@@ -99,6 +169,42 @@ public:
             void *context
     ) = 0;
 
+    /**
+     * @brief Register TFTP progress callback, for both sends and fetches.
+     * Reports are coalesced as set by setProgressThreshold(), and the last
+     * one of a transfer carries all the bytes it moved. The total is known
+     * for sends of regular files and buffers, not for fetches. Delta sends
+     * report the bytes of the delta when one is sent. Pass nullptr to
+     * unregister, transfers then run without progress tracking.
+     *
+     * @param[in] callback the callback to register.
+     * @param[in] context the user context.
+     *
+     * @return TFTP_CLIENT_OK if success.
+     * @return TFTP_CLIENT_ERROR otherwise.
+     */
+    virtual TftpClientOperationResult registerTftpProgressCallback(
+            tftpProgressCallback callback,
+            void *context
+    ) = 0;
+
+    /**
+     * @brief Set how often progress is reported. A report is made once the
+     * given bytes were moved or the given time passed since the previous
+     * one. A zero threshold is ignored, with both zero every block is
+     * reported. Defaults to TFTP_PROGRESS_DEFAULT_BYTES and no interval.
+     *
+     * @param[in] thresholdBytes bytes between reports, 0 to ignore.
+     * @param[in] intervalMs milliseconds between reports, 0 to ignore.
+     *
+     * @return TFTP_CLIENT_OK if success.
+     * @return TFTP_CLIENT_ERROR otherwise.
+     */
+    virtual TftpClientOperationResult setProgressThreshold(
+            const uint64_t thresholdBytes,
+            const int intervalMs
+    ) = 0;
+
     /**
      * @brief Send a file through TFTP.
      *
@@ -127,6 +233,230 @@ public:
             const char *filename,
             FILE *fp
     ) = 0;
+
+    /**
+     * @brief Fetches a file through TFTP straight into a memory mapping.
+     * The sink must have been opened with TFTPMappedSink::openFile() or
+     * TFTPMappedSink::openAnonymous().
+     *
+     * @param[in] filename the name of the file to fetch.
+     * @param[in] sink the mapped sink to receive data.
+     *
+     * @return TFTP_CLIENT_OK if success.
+     * @return TFTP_CLIENT_ERROR otherwise.
+     */
+    virtual TftpClientOperationResult fetchFile(
+            const char *filename,
+            TFTPMappedSink &sink
+    ) = 0;
+
+    /**
+     * @brief Send memory through TFTP. Blocks are read straight from the
+     * caller's memory, with no stdio buffer or copy in between. The memory
+     * must stay unchanged until the call returns.
+     *
+     * @param[in] filename the name the server will save the file as.
+     * @param[in] data the content to send.
+     * @param[in] size the content size, may be 0.
+     *
+     * @return TFTP_CLIENT_OK if success.
+     * @return TFTP_CLIENT_ERROR otherwise.
+     */
+    virtual TftpClientOperationResult sendBuffer(
+            const char *filename,
+            const void *data,
+            const size_t size
+    ) = 0;
+
+    /**
+     * @brief Fetches a file through TFTP into a vector. The vector is
+     * cleared and grows as blocks arrive, geometrically, so the file is
+     * never truncated. Capacity already reserved is reused, reserve the
+     * expected size to avoid any reallocation.
+     *
+     * @param[in] filename the name of the file to fetch.
+     * @param[out] buffer the received content, empty on error.
+     *
+     * @return TFTP_CLIENT_OK if success.
+     * @return TFTP_CLIENT_ERROR otherwise.
+     */
+    virtual TftpClientOperationResult fetchToBuffer(
+            const char *filename,
+            std::vector<uint8_t> &buffer
+    ) = 0;
+
+    /**
+     * @brief Get a latency histogram. The client's counts are merged into
+     * the given histogram, so several clients can be combined into one.
+     * The open and close file latencies are only kept by the server.
+     *
+     * @param[in] metric the latency to get.
+     * @param[in,out] histogram the histogram to merge into.
+     *
+     * @return TFTP_CLIENT_OK if success.
+     * @return TFTP_CLIENT_ERROR otherwise.
+     */
+    virtual TftpClientOperationResult getLatencyHistogram(
+            const TftpLatencyMetric metric,
+            TFTPLatencyHistogram &histogram
+    ) = 0;
+
+    /**
+     * @brief Get count, min, max, mean and p50/p90/p99/p999 of a latency,
+     * in nanoseconds.
+     *
+     * @param[in] metric the latency to summarize.
+     * @param[out] summary the summary.
+     *
+     * @return TFTP_CLIENT_OK if success.
+     * @return TFTP_CLIENT_ERROR otherwise.
+     */
+    virtual TftpClientOperationResult getLatencySummary(
+            const TftpLatencyMetric metric,
+            TFTPLatencySummary *summary
+    ) = 0;
+
+    /**
+     * @brief Clear all latency histograms.
+     *
+     * @return TFTP_CLIENT_OK if success.
+     * @return TFTP_CLIENT_ERROR otherwise.
+     */
+    virtual TftpClientOperationResult resetLatencyStats() = 0;
+
+    /**
+     * @brief Enable compressed transfers. The first transfer after
+     * setConnection() asks the server whether it supports compression.
+     * If it does, files are sent and fetched compressed with zlib, and the
+     * fetch data received callback reports compressed block sizes. If it
+     * doesn't, transfers are done uncompressed. Disabled by default.
+     *
+     * The question is a read of the reserved name TFTP_COMPRESSION_SUFFIX,
+     * which servers of this library answer without calling their open
+     * callback, whether or not compression is enabled on them. Other
+     * servers see a read of a file named "?zlib".
+     *
+     * @param[in] enabled true to enable compression.
+     *
+     * @return TFTP_CLIENT_OK if success.
+     * @return TFTP_CLIENT_ERROR otherwise.
+     */
+    virtual TftpClientOperationResult setCompression(
+            const bool enabled
+    ) = 0;
+
+    /**
+     * @brief Get the compression statistics.
+     *
+     * @param[out] plainBytes file bytes moved by compressed transfers.
+     * @param[out] compressedBytes bytes sent or received for them.
+     *
+     * @return TFTP_CLIENT_OK if success.
+     * @return TFTP_CLIENT_ERROR otherwise.
+     */
+    virtual TftpClientOperationResult getCompressionStats(
+            uint64_t *plainBytes,
+            uint64_t *compressedBytes
+    ) = 0;
+
+    /**
+     * @brief Enable delta sends. sendFile() reads the file whole, reads the
+     * block hashes of the server's copy and sends only the blocks that
+     * changed. If the server doesn't support it, has no copy, or most of
+     * the file changed, the whole file is sent. Disabled by default.
+     *
+     * @param[in] enabled true to enable delta sends.
+     *
+     * @return TFTP_CLIENT_OK if success.
+     * @return TFTP_CLIENT_ERROR otherwise.
+     */
+    virtual TftpClientOperationResult setDeltaTransfer(
+            const bool enabled
+    ) = 0;
+
+    /**
+     * @brief Get the delta send statistics.
+     *
+     * @param[out] fileBytes bytes of the files sent with delta enabled.
+     * @param[out] sentBytes bytes sent for them, deltas or whole files.
+     *
+     * @return TFTP_CLIENT_OK if success.
+     * @return TFTP_CLIENT_ERROR otherwise.
+     */
+    virtual TftpClientOperationResult getDeltaStats(
+            uint64_t *fileBytes,
+            uint64_t *sentBytes
+    ) = 0;
+
+    /**
+     * @brief Enable striped transfers. Files of at least threshold bytes
+     * are split into byte ranges, moved over concurrent sessions, one per
+     * range, see ITFTPServer::setStripedTransfer(). Once all ranges are
+     * moved, the size and CRC-32 of the server's copy are checked against
+     * the bytes moved. Sends of regular files and buffers, and fetches into
+     * regular files and buffers are striped, compressed and delta
+     * transfers are not. Fetches read the size of the file first. The first
+     * striped transfer after setConnection() asks the server whether it
+     * supports ranges, if it doesn't, files are moved in one session. The
+     * fetch data received callback isn't called for ranges, and progress
+     * is reported once the whole file is moved. Ranges that time out, or
+     * that a busy server rejects with a "WAIT" message, are moved again a
+     * few times. Disabled by default.
+     *
+     * The question is a read of the reserved name TFTP_RANGE_SUFFIX, which
+     * servers of this library answer without calling their open callback,
+     * whether or not striping is enabled on them. Other servers see a read
+     * of a file named "?range=".
+     *
+     * @param[in] stripes the number of concurrent sessions, 1 to disable.
+     * @param[in] threshold the size from which files are striped.
+     *
+     * @return TFTP_CLIENT_OK if success.
+     * @return TFTP_CLIENT_ERROR otherwise.
+     */
+    virtual TftpClientOperationResult setStriping(
+            const int stripes,
+            const uint64_t threshold
+    ) = 0;
+
+    /**
+     * @brief Adapt the number of concurrent sessions of striped transfers
+     * to losses, the way TCP adapts its congestion window. Files are split
+     * into more, smaller ranges, and the window of ranges in flight starts
+     * at one, doubles while ranges are moved cleanly, then grows by one a
+     * round, up to the stripes set with setStriping(). A loss halves it.
+     * Losses are ranges that time out or are rejected with a "WAIT"
+     * message, and blocks that come past the engine's retransmission
+     * timeout. The window is kept from one transfer to the next, and
+     * starts over with setConnection() and setStriping(). Disabled by
+     * default, all stripes are then in flight at once.
+     *
+     * @param[in] enabled true to adapt the window.
+     *
+     * @return TFTP_CLIENT_OK if success.
+     * @return TFTP_CLIENT_ERROR otherwise.
+     */
+    virtual TftpClientOperationResult setAdaptiveStriping(
+            const bool enabled
+    ) = 0;
+
+    /**
+     * @brief Get the striped transfer statistics.
+     *
+     * @param[out] files the number of files moved striped.
+     * @param[out] bytes the bytes of those files.
+     * @param[out] window the current window of sessions in flight.
+     * @param[out] losses the number of losses ranges saw.
+     *
+     * @return TFTP_CLIENT_OK if success.
+     * @return TFTP_CLIENT_ERROR otherwise.
+     */
+    virtual TftpClientOperationResult getStripingStats(
+            uint64_t *files,
+            uint64_t *bytes,
+            int *window,
+            uint64_t *losses
+    ) = 0;
 };
 
 #endif //ITFTPCLIENT_H
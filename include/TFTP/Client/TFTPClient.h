@@ -6,6 +6,18 @@
 #define TFTPCLIENT_H
 
 #include "ITFTPClient.h"
+#include "TFTPCompressionStream.h"
+#include "TFTPCongestionWindow.h"
+#include "TFTPDelta.h"
+#include "TFTPLatencyHistogram.h"
+#include "TFTPLocalTransport.h"
+#include "TFTPMemoryStream.h"
+#include "TFTPProgressStream.h"
+#include "TFTPRangeStream.h"
+#include "TFTPTimedStream.h"
+
+#include <memory>
+#include <mutex>
 
 /**
  * @brief TFTP client implementation.
@@ -20,6 +32,10 @@ public:
             const int port
     ) override;
 
+    TftpClientOperationResult setTransport(
+            const TftpClientTransport transport
+    ) override;
+
     TftpClientOperationResult registerTftpErrorCallback(
             tftpErrorCallback callback,
             void *context
@@ -30,6 +46,16 @@ public:
             void *context
     ) override;
 
+    TftpClientOperationResult registerTftpProgressCallback(
+            tftpProgressCallback callback,
+            void *context
+    ) override;
+
+    TftpClientOperationResult setProgressThreshold(
+            const uint64_t thresholdBytes,
+            const int intervalMs
+    ) override;
+
     TftpClientOperationResult sendFile(
             const char *filename,
             FILE *fp
@@ -40,8 +66,215 @@ public:
             FILE *fp
     ) override;
 
+    TftpClientOperationResult fetchFile(
+            const char *filename,
+            TFTPMappedSink &sink
+    ) override;
+
+    TftpClientOperationResult sendBuffer(
+            const char *filename,
+            const void *data,
+            const size_t size
+    ) override;
+
+    TftpClientOperationResult fetchToBuffer(
+            const char *filename,
+            std::vector<uint8_t> &buffer
+    ) override;
+
+    TftpClientOperationResult getLatencyHistogram(
+            const TftpLatencyMetric metric,
+            TFTPLatencyHistogram &histogram
+    ) override;
+
+    TftpClientOperationResult getLatencySummary(
+            const TftpLatencyMetric metric,
+            TFTPLatencySummary *summary
+    ) override;
+
+    TftpClientOperationResult resetLatencyStats() override;
+
+    TftpClientOperationResult setCompression(
+            const bool enabled
+    ) override;
+
+    TftpClientOperationResult getCompressionStats(
+            uint64_t *plainBytes,
+            uint64_t *compressedBytes
+    ) override;
+
+    TftpClientOperationResult setDeltaTransfer(
+            const bool enabled
+    ) override;
+
+    TftpClientOperationResult getDeltaStats(
+            uint64_t *fileBytes,
+            uint64_t *sentBytes
+    ) override;
+
+    TftpClientOperationResult setStriping(
+            const int stripes,
+            const uint64_t threshold
+    ) override;
+
+    TftpClientOperationResult setAdaptiveStriping(
+            const bool enabled
+    ) override;
+
+    TftpClientOperationResult getStripingStats(
+            uint64_t *files,
+            uint64_t *bytes,
+            int *window,
+            uint64_t *losses
+    ) override;
+
 private:
+    enum class TftpServerSupport {
+        TFTP_SUPPORT_UNKNOWN = 0,
+        TFTP_SUPPORTED,
+        TFTP_UNSUPPORTED
+    };
+
+    // A session moving ranges of striped transfers, and the error the
+    // server answered its last range with.
+    struct StripeSession {
+        std::unique_ptr<TFTPClient> client;
+        TFTPRangeStream stream;
+        bool failed;
+        short errorCode;
+        std::string errorMessage;
+    };
+
     TftpHandlerPtr clientHandler;
+    std::string host;
+    int port;
+    TftpClientTransport transport;
+
+    TftpOperationResult transferFile(
+            const char *name,
+            FILE *fp,
+            const bool fetch
+    );
+
+    TftpOperationResult transferLocal(
+            TFTPLocalSection &section,
+            FILE *fp
+    );
+
+    TftpOperationResult sendStream(
+            std::string name,
+            FILE *fp,
+            const std::chrono::steady_clock::time_point start
+    );
+
+    TftpOperationResult fetchStream(
+            std::string name,
+            FILE *fp,
+            const std::chrono::steady_clock::time_point start
+    );
+
+    TftpOperationResult sendWithProgress(
+            const std::string &name,
+            FILE *fp,
+            const int64_t totalBytes,
+            const std::chrono::steady_clock::time_point start
+    );
+
+    TftpOperationResult fetchWithProgress(
+            const std::string &name,
+            FILE *fp,
+            const std::chrono::steady_clock::time_point start
+    );
+
+    TftpOperationResult sendWithDelta(
+            const std::string &name,
+            const char *data,
+            const size_t size,
+            const std::chrono::steady_clock::time_point start
+    );
+
+    TftpOperationResult sendFileWithDelta(
+            const std::string &name,
+            FILE *fp,
+            const off_t position,
+            const uint64_t size,
+            const std::chrono::steady_clock::time_point start
+    );
+
+    bool sendDelta(
+            const std::string &name,
+            FILE *delta,
+            const uint64_t deltaSize,
+            const uint64_t fileSize,
+            const std::chrono::steady_clock::time_point start
+    );
+
+    bool fetchHashes(
+            const std::string &name,
+            TFTPBlockHashes &hashes,
+            const std::chrono::steady_clock::time_point start
+    );
+
+    bool useStriping();
+
+    bool probeSupport(
+            const char *suffix,
+            TftpServerSupport &support
+    );
+
+    bool fetchAnswer(
+            const std::string &request,
+            std::string &answer
+    );
+
+    bool fetchChecksum(
+            const std::string &name,
+            TFTPBlockHashes &checksum
+    );
+
+    bool fetchStripedChecksum(
+            const std::string &name,
+            TFTPBlockHashes &checksum
+    );
+
+    bool truncateStriped(
+            const std::string &name,
+            const uint64_t size
+    );
+
+    TftpOperationResult transferStriped(
+            const std::string &name,
+            const int descriptor,
+            char *memory,
+            const uint64_t base,
+            const uint64_t size,
+            const bool fetch,
+            const TFTPBlockHashes *expected
+    );
+
+    static ssize_t bufferWrite(
+            void *cookie,
+            const char *buffer,
+            size_t size
+    );
+
+    bool useCompression();
+
+    FILE *openCompressionStream(
+            FILE *fp,
+            const bool write
+    );
+
+    FILE *openTimedStream(
+            FILE *fp,
+            const bool write,
+            const std::chrono::steady_clock::time_point start
+    );
+
+    void recordLatency(
+            const TftpLatencyMetric metric,
+            const std::chrono::steady_clock::time_point start
+    );
 
     static TftpOperationResult tftpErrorCbk (
             short error_code,
@@ -54,10 +287,53 @@ private:
             void *context
     );
 
+    static TftpClientOperationResult stripeErrorCbk (
+            short error_code,
+            std::string &error_message,
+            void *context
+    );
+
     void *tftpErrorCtx;
     tftpErrorCallback _tftpErrorCallback;
     void *tftpFetchDataReceivedCtx;
     tftpfetchDataReceivedCallback _tftpFetchDataReceivedCallback;
+    void *tftpProgressCtx;
+    tftpProgressCallback _tftpProgressCallback;
+    uint64_t progressBytes;
+    int progressIntervalMs;
+    TFTPProgressStream progressStream;
+
+    TFTPLatencyHistogram latency[(int) TftpLatencyMetric::TFTP_LATENCY_METRIC_COUNT];
+    TFTPTimedStream timedStream;
+
+    bool compressionEnabled;
+    bool quietRequest;
+    // The server rejected the last request as busy.
+    bool serverBusy;
+    TftpServerSupport compressionSupport;
+    TFTPCompressionStats compressionStats;
+    TFTPCompressionStream compressionStream;
+
+    bool deltaEnabled;
+    uint64_t deltaFileBytes;
+    uint64_t deltaSentBytes;
+    TFTPMemoryStream memoryStream;
+
+    int stripeCount;
+    uint64_t stripeThreshold;
+    TftpServerSupport stripingSupport;
+    uint64_t stripedFiles;
+    uint64_t stripedBytes;
+    bool adaptiveStriping;
+    TFTPCongestionWindow stripeWindow;
+    // Reused across transfers.
+    std::vector<std::unique_ptr<StripeSession>> stripeSessions;
+    // Error the transfer failed with.
+    std::mutex stripeMutex;
+    uint64_t stripeLosses;
+    bool stripeFailed;
+    short stripeErrorCode;
+    std::string stripeErrorMessage;
 };
 
 #endif //TFTPCLIENT_H
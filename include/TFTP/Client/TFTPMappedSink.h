@@ -0,0 +1,130 @@
+#ifndef TFTPMAPPEDSINK_H
+#define TFTPMAPPEDSINK_H
+
+#include "ITFTPClient.h"
+
+#include <stdint.h>
+#include <stdio.h>
+
+/**
+ * @brief Fetch target that stores received blocks straight into a memory
+ * mapping, either of an output file or of an anonymous region.
+ *
+ * The stream handed to the engine is unbuffered, so each block is copied
+ * once from the engine into the mapping. The mapping starts at the size
+ * hint, rounded up to whole pages, and grows geometrically with mremap()
+ * when the file is larger. Unlike fmemopen(), a transfer never gets
+ * silently truncated. If the mapping can't grow, the write fails and so
+ * does the fetch.
+ */
+class TFTPMappedSink {
+public:
+    TFTPMappedSink();
+    ~TFTPMappedSink();
+
+    /**
+     * @brief Receive into an anonymous mapping. Use release() to take
+     * ownership of the received data.
+     *
+     * @param[in] sizeHint the expected file size, or 0 if unknown.
+     *
+     * @return TFTP_CLIENT_OK if success.
+     * @return TFTP_CLIENT_ERROR otherwise.
+     */
+    TftpClientOperationResult openAnonymous(
+            const size_t sizeHint
+    );
+
+    /**
+     * @brief Receive into a memory-mapped output file. The file is created
+     * or truncated, and is cut to the received size on close().
+     *
+     * @param[in] path the output file path.
+     * @param[in] sizeHint the expected file size, or 0 if unknown.
+     *
+     * @return TFTP_CLIENT_OK if success.
+     * @return TFTP_CLIENT_ERROR otherwise.
+     */
+    TftpClientOperationResult openFile(
+            const char *path,
+            const size_t sizeHint
+    );
+
+    /**
+     * @brief Get the stream the engine writes into.
+     *
+     * @return the stream, or NULL if the sink isn't open.
+     */
+    FILE *getStream();
+
+    /**
+     * @brief Get the received data. Valid until the next write, close() or
+     * release().
+     *
+     * @return the start of the mapping, or NULL if the sink isn't open.
+     */
+    const uint8_t *getData() const;
+
+    /**
+     * @brief Get the number of bytes received.
+     *
+     * @return the received size.
+     */
+    size_t getSize() const;
+
+    /**
+     * @brief Hand the anonymous mapping off to the caller and close the
+     * sink. The caller must munmap(data, mappedSize) when done.
+     *
+     * @param[out] data the start of the mapping.
+     * @param[out] size the number of bytes received.
+     * @param[out] mappedSize the length of the mapping.
+     *
+     * @return TFTP_CLIENT_OK if success.
+     * @return TFTP_CLIENT_ERROR otherwise.
+     */
+    TftpClientOperationResult release(
+            void **data,
+            size_t *size,
+            size_t *mappedSize
+    );
+
+    /**
+     * @brief Close the sink. A file-backed sink is cut to the received size
+     * and unmapped, an anonymous sink that wasn't released is unmapped.
+     *
+     * @return TFTP_CLIENT_OK if success.
+     * @return TFTP_CLIENT_ERROR otherwise.
+     */
+    TftpClientOperationResult close();
+
+private:
+    TftpClientOperationResult openMapping(
+            const size_t sizeHint
+    );
+
+    bool reserve(
+            const size_t capacity
+    );
+
+    static ssize_t streamWrite(
+            void *cookie,
+            const char *buffer,
+            size_t size
+    );
+
+    static int streamSeek(
+            void *cookie,
+            off64_t *offset,
+            int whence
+    );
+
+    FILE *stream;
+    int fd;
+    uint8_t *mapping;
+    size_t mappedSize;
+    size_t size;
+    size_t position;
+};
+
+#endif //TFTPMAPPEDSINK_H
@@ -0,0 +1,100 @@
+#ifndef TFTPPROGRESSSTREAM_H
+#define TFTPPROGRESSSTREAM_H
+
+#include "ITFTPClient.h"
+
+#include <chrono>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/types.h>
+
+/**
+ * @brief Stream that passes reads and writes through to a source FILE and
+ * reports the bytes moved to a progress callback.
+ *
+ * Reports are coalesced: one is made once the byte threshold or the
+ * interval since the previous report is reached, and a last one when the
+ * stream is closed if bytes were moved since, or if none was made. The clock is only read when
+ * an interval is set. The source is not closed by the stream. The object
+ * can be opened again after its stream is closed.
+ */
+class TFTPProgressStream {
+public:
+    TFTPProgressStream();
+    ~TFTPProgressStream() = default;
+
+    TFTPProgressStream(const TFTPProgressStream &) = delete;
+    TFTPProgressStream &operator=(const TFTPProgressStream &) = delete;
+
+    /**
+     * @brief Open the stream.
+     *
+     * @param[in] source the FILE to read from or write to.
+     * @param[in] direction TFTP_CLIENT_TRANSFER_SEND to read from the
+     * source, TFTP_CLIENT_TRANSFER_FETCH to write to it.
+     * @param[in] totalBytes the bytes the transfer will move, or -1 if
+     * unknown.
+     * @param[in] callback the progress callback.
+     * @param[in] context the context passed to the callback.
+     * @param[in] thresholdBytes bytes between reports, 0 to ignore.
+     * @param[in] intervalMs milliseconds between reports, 0 to ignore.
+     *
+     * @return the stream to hand to the engine, or NULL on error.
+     */
+    FILE *open(
+            FILE *source,
+            const TftpClientTransferDirection direction,
+            const int64_t totalBytes,
+            tftpProgressCallback callback,
+            void *context,
+            const uint64_t thresholdBytes,
+            const int intervalMs
+    );
+
+private:
+    void account(
+            const size_t length
+    );
+
+    void report();
+
+    static ssize_t streamRead(
+            void *cookie,
+            char *buffer,
+            size_t size
+    );
+
+    static ssize_t streamWrite(
+            void *cookie,
+            const char *buffer,
+            size_t size
+    );
+
+    static int streamSeek(
+            void *cookie,
+            off64_t *offset,
+            int whence
+    );
+
+    static int streamClose(
+            void *cookie
+    );
+
+    static const size_t STREAM_BUFFER_SIZE = 512;
+
+    FILE *source;
+    FILE *stream;
+    TftpClientTransferDirection direction;
+    int64_t totalBytes;
+    tftpProgressCallback callback;
+    void *context;
+    uint64_t thresholdBytes;
+    std::chrono::steady_clock::duration interval;
+    uint64_t bytes;
+    uint64_t reportedBytes;
+    bool reported;
+    std::chrono::steady_clock::time_point reportedAt;
+    char streamBuffer[STREAM_BUFFER_SIZE];
+};
+
+#endif //TFTPPROGRESSSTREAM_H
@@ -0,0 +1,79 @@
+#ifndef TFTPBLOCKRING_H
+#define TFTPBLOCKRING_H
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/**
+ * @brief Single-producer single-consumer ring of TFTP blocks.
+ *
+ * The writer copies each block into a slot and the reader copies it out,
+ * the slots are the only memory the two sides share. Blocks keep TFTP
+ * semantics: up to BLOCK_SIZE bytes each, and a shorter one, possibly
+ * empty, ends the transfer. A full ring makes the writer wait, like a
+ * sender waiting for ACKs, and an empty one the reader. Neither side takes
+ * the lock unless it has to wait.
+ */
+class TFTPBlockRing {
+public:
+    TFTPBlockRing();
+    ~TFTPBlockRing() = default;
+
+    TFTPBlockRing(const TFTPBlockRing &) = delete;
+    TFTPBlockRing &operator=(const TFTPBlockRing &) = delete;
+
+    /**
+     * @brief Write a block, waiting for a free slot.
+     *
+     * @param[in] data the block.
+     * @param[in] size the block size, at most BLOCK_SIZE.
+     *
+     * @return false if the ring was aborted.
+     */
+    bool push(
+            const char *data,
+            const size_t size
+    );
+
+    /**
+     * @brief Read a block, waiting for one.
+     *
+     * @param[out] buffer the block, BLOCK_SIZE bytes at least.
+     *
+     * @return the block size, or -1 if the ring was aborted.
+     */
+    ssize_t pop(
+            char *buffer
+    );
+
+    /**
+     * @brief Abort the transfer. Both sides are woken and every later
+     * call fails.
+     */
+    void abort();
+
+    static const size_t BLOCK_SIZE = 512;
+    static const size_t SLOT_COUNT = 16;
+
+private:
+    struct Slot {
+        size_t length;
+        char data[BLOCK_SIZE];
+    };
+
+    void wake();
+
+    Slot slots[SLOT_COUNT];
+    std::atomic<uint64_t> head;
+    std::atomic<uint64_t> tail;
+    std::atomic<bool> aborted;
+    std::atomic<int> waiters;
+    std::mutex mutex;
+    std::condition_variable changed;
+};
+
+#endif //TFTPBLOCKRING_H
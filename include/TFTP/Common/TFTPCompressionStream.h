@@ -0,0 +1,122 @@
+#ifndef TFTPCOMPRESSIONSTREAM_H
+#define TFTPCOMPRESSIONSTREAM_H
+
+#include <atomic>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/types.h>
+#include <vector>
+#include <zlib.h>
+
+/**
+ * @brief Suffix a client appends to the requested file name to ask for a
+ * zlib-compressed transfer. Requesting the suffix alone probes whether the
+ * server supports compression.
+ */
+#define TFTP_COMPRESSION_SUFFIX "?zlib"
+
+/**
+ * @brief Compression statistics. Plain bytes are file bytes, compressed
+ * bytes are the bytes sent or received over TFTP for them.
+ */
+struct TFTPCompressionStats {
+    std::atomic<uint64_t> plainBytes;
+    std::atomic<uint64_t> compressedBytes;
+};
+
+/**
+ * @brief Stream that compresses or decompresses, with zlib, between the
+ * engine and a source FILE.
+ *
+ * Opened for reading, the engine reads the compressed form of the source.
+ * Opened for writing, what the engine writes is decompressed into the
+ * source. The source is not closed by the stream. The object can be opened
+ * again after its stream is closed, so it can be pooled.
+ */
+class TFTPCompressionStream {
+public:
+    TFTPCompressionStream();
+    ~TFTPCompressionStream();
+
+    TFTPCompressionStream(const TFTPCompressionStream &) = delete;
+    TFTPCompressionStream &operator=(const TFTPCompressionStream &) = delete;
+
+    /**
+     * @brief Open the stream.
+     *
+     * @param[in] source the FILE to compress from or decompress into.
+     * @param[in] write true to decompress writes, false to compress reads.
+     * @param[in] stats the statistics to update, or nullptr.
+     *
+     * @return the stream to hand to the engine, or NULL on error.
+     */
+    FILE *open(
+            FILE *source,
+            const bool write,
+            TFTPCompressionStats *stats
+    );
+
+    /**
+     * @brief Get the source FILE.
+     *
+     * @return the source FILE.
+     */
+    FILE *getSource();
+
+    /**
+     * @brief Compress a whole buffer.
+     *
+     * @param[in] data the data to compress.
+     * @param[in] size the data size.
+     * @param[out] compressed the compressed data.
+     *
+     * @return true if success.
+     */
+    static bool compress(
+            const void *data,
+            const size_t size,
+            std::vector<char> &compressed
+    );
+
+private:
+    static ssize_t streamRead(
+            void *cookie,
+            char *buffer,
+            size_t size
+    );
+
+    static ssize_t streamWrite(
+            void *cookie,
+            const char *buffer,
+            size_t size
+    );
+
+    static int streamSeek(
+            void *cookie,
+            off64_t *offset,
+            int whence
+    );
+
+    static int streamClose(
+            void *cookie
+    );
+
+    static const size_t STREAM_BUFFER_SIZE = 512;
+    static const size_t CHUNK_SIZE = 16384;
+
+    FILE *source;
+    FILE *stream;
+    bool write;
+    bool deflateReady;
+    bool inflateReady;
+    bool sourceEnd;
+    bool finished;
+    off64_t position;
+    TFTPCompressionStats *stats;
+    z_stream deflater;
+    z_stream inflater;
+    std::vector<char> chunk;
+    char streamBuffer[STREAM_BUFFER_SIZE];
+};
+
+#endif //TFTPCOMPRESSIONSTREAM_H
@@ -0,0 +1,88 @@
+#ifndef TFTPCONGESTIONWINDOW_H
+#define TFTPCONGESTIONWINDOW_H
+
+#include <condition_variable>
+#include <mutex>
+#include <stdint.h>
+
+/**
+ * @brief Congestion window over units of work in flight, the sessions of a
+ * striped transfer.
+ *
+ * The window starts at one and grows by one for each unit moved cleanly,
+ * doubling every round, up to the slow start threshold (slow start). Past
+ * it, it grows by one each full window moved (additive increase). A loss
+ * sets the threshold to half the window and the window to it
+ * (multiplicative decrease). Units that started before a decrease count as
+ * one loss with it, so a burst of losses halves the window once. The
+ * window never exceeds the maximum. A fixed window stays at the maximum.
+ */
+class TFTPCongestionWindow {
+public:
+    TFTPCongestionWindow();
+    ~TFTPCongestionWindow() = default;
+
+    TFTPCongestionWindow(const TFTPCongestionWindow &) = delete;
+    TFTPCongestionWindow &operator=(const TFTPCongestionWindow &) = delete;
+
+    /**
+     * @brief Start over, in slow start. Call with nothing in flight.
+     *
+     * @param[in] maxWindow the largest window, at least 1.
+     * @param[in] adaptive false to keep the window at maxWindow.
+     */
+    void reset(
+            const int maxWindow,
+            const bool adaptive
+    );
+
+    /**
+     * @brief Wait for room in the window and take it.
+     *
+     * @return the epoch to pass to release().
+     */
+    uint64_t acquire();
+
+    /**
+     * @brief Give back the room taken by acquire().
+     *
+     * @param[in] epoch the epoch acquire() returned.
+     * @param[in] lost true if the unit saw a loss.
+     * @param[in] moved true if the unit was moved, the window only grows
+     * with units moved without a loss.
+     */
+    void release(
+            const uint64_t epoch,
+            const bool lost,
+            const bool moved
+    );
+
+    /**
+     * @brief Get the current window.
+     *
+     * @return the window.
+     */
+    int getWindow();
+
+    /**
+     * @brief Get the number of losses seen since the last reset.
+     *
+     * @return the losses.
+     */
+    uint64_t getLosses();
+
+private:
+    std::mutex mutex;
+    std::condition_variable released;
+    bool adaptive;
+    int maxWindow;
+    int window;
+    int threshold;
+    int inFlight;
+    // Units moved since the window last grew past the threshold.
+    int acknowledged;
+    uint64_t epoch;
+    uint64_t losses;
+};
+
+#endif //TFTPCONGESTIONWINDOW_H
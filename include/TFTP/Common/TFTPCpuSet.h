@@ -0,0 +1,55 @@
+#ifndef TFTPCPUSET_H
+#define TFTPCPUSET_H
+
+#include <sched.h>
+#include <vector>
+
+/**
+ * @brief Set of CPUs a thread is pinned to.
+ *
+ * An empty set leaves threads where the kernel puts them. Memory first
+ * touched by a pinned thread is allocated on the NUMA node of its CPUs,
+ * so buffers a pinned thread allocates stay local to it.
+ */
+class TFTPCpuSet {
+public:
+    TFTPCpuSet();
+    ~TFTPCpuSet() = default;
+
+    /**
+     * @brief Set the CPUs.
+     *
+     * @param[in] cpus the CPU numbers, empty to clear the set.
+     *
+     * @return true if success, false if a CPU number is out of range.
+     */
+    bool assign(
+            const std::vector<int> &cpus
+    );
+
+    /**
+     * @brief Check whether the set has CPUs.
+     *
+     * @return true if the set is not empty.
+     */
+    bool isSet() const;
+
+    /**
+     * @brief Pin the calling thread to the set. Does nothing on an empty
+     * set.
+     *
+     * @param[out] previous if not null, receives the CPUs the thread could
+     * run on before.
+     *
+     * @return true if success.
+     */
+    bool pinCurrentThread(
+            TFTPCpuSet *previous = nullptr
+    ) const;
+
+private:
+    cpu_set_t cpus;
+    bool set;
+};
+
+#endif //TFTPCPUSET_H
@@ -0,0 +1,298 @@
+#ifndef TFTPDELTA_H
+#define TFTPDELTA_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/types.h>
+#include <vector>
+
+/**
+ * @brief Suffix a client appends to the file name to read the block hashes
+ * of the server's copy of the file.
+ */
+#define TFTP_HASHES_SUFFIX "?hashes"
+
+/**
+ * @brief Suffix a client appends to the file name to write a delta against
+ * the server's copy of the file instead of the whole file.
+ */
+#define TFTP_DELTA_SUFFIX "?delta"
+
+/**
+ * @brief Suffix a client appends to the file name to read the size and
+ * checksum of the server's copy of the file, without the block hashes.
+ */
+#define TFTP_CHECKSUM_SUFFIX "?checksum"
+
+/**
+ * @brief Size of the blocks files are compared in.
+ */
+#define TFTP_DELTA_BLOCK_SIZE 4096
+
+/**
+ * @brief Hashes of the blocks of a file, and a checksum of the whole file.
+ */
+struct TFTPBlockHashes {
+    uint64_t size;
+    uint32_t blockSize;
+    uint32_t checksum;
+    std::vector<uint64_t> hashes;
+};
+
+/**
+ * @brief Block-hash delta encoding.
+ *
+ * The receiver of a file sends the hashes of the blocks of its copy. The
+ * sender then sends a delta: the blocks whose hashes differ, with the
+ * checksums of both versions. The receiver copies the other blocks from its
+ * copy and checks the result against the new version's checksum.
+ */
+class TFTPDelta {
+public:
+    /**
+     * @brief Hash content.
+     *
+     * @param[in] data the content.
+     * @param[in] size the content size.
+     * @param[out] hashes the hashes.
+     */
+    static void hash(
+            const char *data,
+            const size_t size,
+            TFTPBlockHashes &hashes
+    );
+
+    /**
+     * @brief Hash a file as it is read, without holding it in memory.
+     *
+     * @param[in] file the FILE to read.
+     * @param[out] hashes the hashes.
+     *
+     * @return true if success.
+     */
+    static bool hashFile(
+            FILE *file,
+            TFTPBlockHashes &hashes
+    );
+
+    /**
+     * @brief Get the size and checksum of a file as it is read, leaving the
+     * block hashes empty.
+     *
+     * @param[in] file the FILE to read.
+     * @param[out] hashes the size and checksum.
+     *
+     * @return true if success.
+     */
+    static bool checksumFile(
+            FILE *file,
+            TFTPBlockHashes &hashes
+    );
+
+    /**
+     * @brief Serialize hashes, to send them.
+     *
+     * @param[in] hashes the hashes.
+     * @param[out] encoded the serialized hashes.
+     */
+    static void encodeHashes(
+            const TFTPBlockHashes &hashes,
+            std::vector<char> &encoded
+    );
+
+    /**
+     * @brief Parse serialized hashes.
+     *
+     * @param[in] data the serialized hashes.
+     * @param[in] size the data size.
+     * @param[out] hashes the hashes.
+     *
+     * @return true if the data is valid.
+     */
+    static bool decodeHashes(
+            const char *data,
+            const size_t size,
+            TFTPBlockHashes &hashes
+    );
+
+    /**
+     * @brief Serialize the size and checksum of hashes, without the block
+     * hashes.
+     *
+     * @param[in] hashes the hashes.
+     * @param[out] encoded the serialized size and checksum.
+     */
+    static void encodeChecksum(
+            const TFTPBlockHashes &hashes,
+            std::vector<char> &encoded
+    );
+
+    /**
+     * @brief Parse a serialized size and checksum.
+     *
+     * @param[in] data the serialized size and checksum.
+     * @param[in] size the data size.
+     * @param[out] hashes the size and checksum, with no block hashes.
+     *
+     * @return true if the data is valid.
+     */
+    static bool decodeChecksum(
+            const char *data,
+            const size_t size,
+            TFTPBlockHashes &hashes
+    );
+
+    /**
+     * @brief Build the delta turning the hashed content into new content.
+     *
+     * @param[in] data the new content.
+     * @param[in] size the new content size.
+     * @param[in] base the hashes of the receiver's content.
+     * @param[out] delta the delta.
+     */
+    static void encodeDelta(
+            const char *data,
+            const size_t size,
+            const TFTPBlockHashes &base,
+            std::vector<char> &delta
+    );
+
+    /**
+     * @brief Build the delta turning the hashed content into part of a
+     * file, reading the file where needed instead of holding it in memory.
+     *
+     * @param[in] descriptor the file descriptor, its offset is left alone.
+     * @param[in] offset the offset of the new content in the file.
+     * @param[in] size the new content size.
+     * @param[in] base the hashes of the receiver's content.
+     * @param[out] delta the FILE to write the delta to.
+     *
+     * @return true if success.
+     */
+    static bool encodeDeltaFile(
+            const int descriptor,
+            const off_t offset,
+            const uint64_t size,
+            const TFTPBlockHashes &base,
+            FILE *delta
+    );
+
+    /**
+     * @brief Read a whole FILE.
+     *
+     * @param[in] file the FILE to read.
+     * @param[out] content the content.
+     *
+     * @return true if success.
+     */
+    static bool readAll(
+            FILE *file,
+            std::vector<char> &content
+    );
+
+    static const size_t HASHES_HEADER_SIZE = 28;
+    static const size_t CHECKSUM_SIZE = 20;
+    static const size_t DELTA_HEADER_SIZE = 40;
+    static const size_t RECORD_HEADER_SIZE = 8;
+};
+
+/**
+ * @brief Stream that applies a delta written to it, writing the rebuilt
+ * file into a target FILE.
+ *
+ * The blocks that didn't change are copied from a base FILE, read where
+ * they are rather than held in memory. The delta is checked against the
+ * base's size and checksum as soon as its header is written, and the
+ * rebuilt file against the new checksum once the last record is written,
+ * so a bad delta fails the transfer before it completes. The target must
+ * not be the base, and neither is closed by the stream. The object can be
+ * opened again after its stream is closed, so it can be pooled.
+ */
+class TFTPDeltaStream {
+public:
+    TFTPDeltaStream();
+    ~TFTPDeltaStream() = default;
+
+    TFTPDeltaStream(const TFTPDeltaStream &) = delete;
+    TFTPDeltaStream &operator=(const TFTPDeltaStream &) = delete;
+
+    /**
+     * @brief Open the stream.
+     *
+     * @param[in] target the FILE to write the rebuilt file to.
+     * @param[in] base the receiver's content the delta applies to.
+     * @param[in] baseSum the size and checksum of the base.
+     *
+     * @return the stream to hand to the engine, or NULL on error.
+     */
+    FILE *open(
+            FILE *target,
+            FILE *base,
+            const TFTPBlockHashes &baseSum
+    );
+
+    /**
+     * @brief Get the target FILE.
+     *
+     * @return the target FILE.
+     */
+    FILE *getTarget();
+
+    /**
+     * @brief Get the base FILE.
+     *
+     * @return the base FILE.
+     */
+    FILE *getBase();
+
+private:
+    static ssize_t streamWrite(
+            void *cookie,
+            const char *buffer,
+            size_t size
+    );
+
+    static int streamClose(
+            void *cookie
+    );
+
+    bool parseHeader();
+
+    bool copyBase(
+            const uint64_t end
+    );
+
+    bool output(
+            const char *data,
+            const size_t size
+    );
+
+    bool finish();
+
+    static const size_t COPY_BUFFER_SIZE = 16 * TFTP_DELTA_BLOCK_SIZE;
+
+    FILE *target;
+    FILE *stream;
+    FILE *base;
+    uint64_t baseSize;
+    uint32_t baseChecksum;
+    std::vector<char> copyBuffer;
+
+    char header[TFTPDelta::DELTA_HEADER_SIZE];
+    size_t headerLength;
+    bool headerDone;
+    char record[TFTPDelta::RECORD_HEADER_SIZE];
+    size_t recordLength;
+    bool inRecord;
+    bool finished;
+    bool failed;
+
+    uint64_t newSize;
+    uint32_t newChecksum;
+    uint32_t recordsLeft;
+    uint64_t recordLeft;
+    uint64_t written;
+    uint32_t checksum;
+};
+
+#endif //TFTPDELTA_H
@@ -0,0 +1,99 @@
+#ifndef TFTPLATENCYHISTOGRAM_H
+#define TFTPLATENCYHISTOGRAM_H
+
+#include "TFTPStatsTypes.h"
+
+#include <atomic>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * @brief HDR-style latency histogram.
+ *
+ * Values are counted in log-linear buckets: exact below 128 ns, then 64
+ * buckets per power of two, so any reported value is within 1/64 of the
+ * recorded one, up to about 2.4 hours. Recording is lock-free and can be
+ * done from any thread. Histograms kept by different threads, clients or
+ * servers can be merged.
+ */
+class TFTPLatencyHistogram {
+public:
+    TFTPLatencyHistogram();
+    ~TFTPLatencyHistogram() = default;
+
+    TFTPLatencyHistogram(const TFTPLatencyHistogram &) = delete;
+    TFTPLatencyHistogram &operator=(const TFTPLatencyHistogram &) = delete;
+
+    /**
+     * @brief Record a latency.
+     *
+     * @param[in] value the latency, in nanoseconds.
+     */
+    void record(
+            const uint64_t value
+    );
+
+    /**
+     * @brief Add the counts of another histogram to this one.
+     *
+     * @param[in] other the histogram to merge.
+     */
+    void merge(
+            const TFTPLatencyHistogram &other
+    );
+
+    /**
+     * @brief Clear all counts.
+     */
+    void reset();
+
+    /**
+     * @brief Get the number of recorded values.
+     *
+     * @return the number of recorded values.
+     */
+    uint64_t getCount() const;
+
+    /**
+     * @brief Get the value at a percentile.
+     *
+     * @param[in] percentile the percentile, from 0 to 100.
+     *
+     * @return the value, in nanoseconds, or 0 if the histogram is empty.
+     */
+    uint64_t getValueAtPercentile(
+            const double percentile
+    ) const;
+
+    /**
+     * @brief Get count, min, max, mean and p50/p90/p99/p999.
+     *
+     * @param[out] summary the summary.
+     */
+    void getSummary(
+            TFTPLatencySummary *summary
+    ) const;
+
+private:
+    static size_t bucketIndex(
+            const uint64_t value
+    );
+
+    static uint64_t bucketValue(
+            const size_t index
+    );
+
+    static const int SUB_BUCKET_BITS = 7;
+    static const int MAX_VALUE_BITS = 44;
+    static const size_t SUB_BUCKETS = 1 << SUB_BUCKET_BITS;
+    static const size_t BUCKET_COUNT =
+            SUB_BUCKETS + (MAX_VALUE_BITS - SUB_BUCKET_BITS) * (SUB_BUCKETS / 2);
+
+    std::atomic<uint64_t> counts[BUCKET_COUNT];
+    std::atomic<uint64_t> count;
+    std::atomic<uint64_t> sum;
+    std::atomic<uint64_t> min;
+    std::atomic<uint64_t> max;
+};
+
+#endif //TFTPLATENCYHISTOGRAM_H
@@ -0,0 +1,168 @@
+#ifndef TFTPLOCALTRANSPORT_H
+#define TFTPLOCALTRANSPORT_H
+
+#include "TFTPBlockRing.h"
+
+#include <stdint.h>
+#include <string>
+#include <thread>
+
+/**
+ * @brief TFTP error codes local sections fail with, the ones the engine
+ * uses for the same failures.
+ */
+#define TFTP_LOCAL_ERROR_UNDEFINED 0
+#define TFTP_LOCAL_ERROR_NOT_FOUND 1
+#define TFTP_LOCAL_ERROR_DISK_FULL 3
+
+/**
+ * @brief One transfer over the local transport, shared by the client that
+ * requested it and the server thread that serves it.
+ *
+ * The client owns the object. The server fills in the outcome and the
+ * client reads it once it has joined the server thread.
+ */
+class TFTPLocalSection {
+public:
+    TFTPLocalSection(
+            const std::string &filename,
+            const bool write
+    );
+    ~TFTPLocalSection() = default;
+
+    TFTPLocalSection(const TFTPLocalSection &) = delete;
+    TFTPLocalSection &operator=(const TFTPLocalSection &) = delete;
+
+    /**
+     * @brief Get the section on the calling thread, set by the server
+     * thread serving it.
+     *
+     * @return the section, or nullptr if the thread serves none.
+     */
+    static TFTPLocalSection *current();
+
+    /**
+     * @brief Set the section served by the calling thread.
+     *
+     * @param[in] section the section, or nullptr.
+     */
+    static void setCurrent(
+            TFTPLocalSection *section
+    );
+
+    /**
+     * @brief Fail the transfer: record the error the client gets and
+     * abort the ring. Only the first error is kept.
+     *
+     * @param[in] code the TFTP error code.
+     * @param[in] message the error message, the one set by the server
+     * when it has set one.
+     */
+    void fail(
+            const short code,
+            const char *message
+    );
+
+    /**
+     * @brief Wait for the server thread to be done with the section.
+     */
+    void join();
+
+    std::string filename;
+    bool write;
+    uint64_t id;
+    TFTPBlockRing ring;
+    std::thread serverThread;
+
+    // Written by the server thread, read by the client after join().
+    bool succeeded;
+    bool failed;
+    short errorCode;
+    std::string errorMessage;
+    std::string serverMessage;
+};
+
+/**
+ * @brief Starts a local section on the server listening on a port.
+ *
+ * @param[in] section the section to serve.
+ * @param[in] context the context registered with the port.
+ *
+ * @return true if a server thread was started for the section.
+ */
+typedef bool (*tftpLocalSectionStarter) (
+        TFTPLocalSection *section,
+        void *context
+);
+
+/**
+ * @brief Process-wide registry of the ports served by servers in this
+ * process, through which clients hand them transfers directly instead of
+ * going through the UDP stack.
+ */
+class TFTPLocalTransport {
+public:
+    /**
+     * @brief Serve a port to local clients.
+     *
+     * @param[in] port the port.
+     * @param[in] starter the function starting sections.
+     * @param[in] context the context passed to the starter.
+     */
+    static void registerPort(
+            const int port,
+            tftpLocalSectionStarter starter,
+            void *context
+    );
+
+    /**
+     * @brief Stop serving a port to local clients. Once it returns, no
+     * new section is started with the context.
+     *
+     * @param[in] port the port.
+     * @param[in] context the context it was registered with.
+     */
+    static void unregisterPort(
+            const int port,
+            void *context
+    );
+
+    /**
+     * @brief Hand a section to the server on a port.
+     *
+     * @param[in] port the port.
+     * @param[in] section the section.
+     *
+     * @return true if it was started, false if no server in this process
+     * serves the port.
+     */
+    static bool startSection(
+            const int port,
+            TFTPLocalSection *section
+    );
+
+    /**
+     * @brief Check whether a server in this process serves a port. It
+     * does once its startListening() has begun.
+     *
+     * @param[in] port the port.
+     *
+     * @return true if local clients are served on the port.
+     */
+    static bool isServed(
+            const int port
+    );
+
+    /**
+     * @brief Check whether a host names this machine's loopback.
+     *
+     * @param[in] host the host.
+     *
+     * @return true for localhost and loopback addresses.
+     */
+    static bool isLoopback(
+            const char *host
+    );
+};
+
+#endif //TFTPLOCALTRANSPORT_H
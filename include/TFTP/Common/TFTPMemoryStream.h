@@ -0,0 +1,60 @@
+#ifndef TFTPMEMORYSTREAM_H
+#define TFTPMEMORYSTREAM_H
+
+#include <stdio.h>
+#include <sys/types.h>
+
+/**
+ * @brief Read-only stream over caller-owned memory.
+ *
+ * Unlike fmemopen(), reads of whole 512-byte blocks or more are copied
+ * straight from the memory into the reader's buffer without going through
+ * a stdio buffer, and empty buffers are allowed. The memory must stay valid until the stream is closed. The
+ * object can be opened again after its stream is closed, so it can be
+ * pooled.
+ */
+class TFTPMemoryStream {
+public:
+    TFTPMemoryStream();
+    ~TFTPMemoryStream() = default;
+
+    /**
+     * @brief Open a read stream over the memory.
+     *
+     * @param[in] data the memory to read from.
+     * @param[in] size the memory size.
+     *
+     * @return the stream, or NULL on error.
+     */
+    FILE *open(
+            const void *data,
+            const size_t size
+    );
+
+private:
+    static ssize_t streamRead(
+            void *cookie,
+            char *buffer,
+            size_t size
+    );
+
+    static int streamSeek(
+            void *cookie,
+            off64_t *offset,
+            int whence
+    );
+
+    static int streamClose(
+            void *cookie
+    );
+
+    static const size_t STREAM_BUFFER_SIZE = 512;
+
+    const char *data;
+    size_t size;
+    size_t position;
+    FILE *stream;
+    char streamBuffer[STREAM_BUFFER_SIZE];
+};
+
+#endif //TFTPMEMORYSTREAM_H
@@ -0,0 +1,80 @@
+#ifndef TFTPOBJECTPOOL_H
+#define TFTPOBJECTPOOL_H
+
+#include <mutex>
+#include <stddef.h>
+#include <vector>
+
+/**
+ * @brief Pool of reusable objects.
+ *
+ * Objects are allocated the first time the pool runs dry and are then
+ * recycled forever, so once the pool has grown to the peak number of
+ * objects in use, acquire() and release() do no heap allocation. Released
+ * objects are not destroyed: callers reinitialize them after acquire(),
+ * which lets objects keep the capacity of their buffers across uses.
+ */
+template <typename T>
+class TFTPObjectPool {
+public:
+    TFTPObjectPool() = default;
+
+    ~TFTPObjectPool() {
+        for (T *object : objects) {
+            delete object;
+        }
+    }
+
+    TFTPObjectPool(const TFTPObjectPool &) = delete;
+    TFTPObjectPool &operator=(const TFTPObjectPool &) = delete;
+
+    /**
+     * @brief Get an object from the pool, allocating one if none is free.
+     *
+     * @return the object, or nullptr if allocation failed.
+     */
+    T *acquire() {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!freeObjects.empty()) {
+            T *object = freeObjects.back();
+            freeObjects.pop_back();
+            return object;
+        }
+
+        T *object = new T();
+        objects.push_back(object);
+        // Keep room for every object so release() never reallocates.
+        freeObjects.reserve(objects.size());
+        return object;
+    }
+
+    /**
+     * @brief Return an object to the pool.
+     *
+     * @param[in] object an object obtained from acquire().
+     */
+    void release(T *object) {
+        if (object == nullptr) {
+            return;
+        }
+        std::lock_guard<std::mutex> lock(mutex);
+        freeObjects.push_back(object);
+    }
+
+    /**
+     * @brief Get the number of objects the pool has allocated.
+     *
+     * @return the number of objects owned by the pool.
+     */
+    size_t getAllocatedCount() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return objects.size();
+    }
+
+private:
+    std::mutex mutex;
+    std::vector<T *> objects;
+    std::vector<T *> freeObjects;
+};
+
+#endif //TFTPOBJECTPOOL_H
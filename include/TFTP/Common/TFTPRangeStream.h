@@ -0,0 +1,222 @@
+#ifndef TFTPRANGESTREAM_H
+#define TFTPRANGESTREAM_H
+
+#include <chrono>
+#include <stdint.h>
+#include <stdio.h>
+#include <string>
+#include <sys/types.h>
+
+/**
+ * @brief Suffix a client appends to the file name, followed by the range,
+ * to read or write only a byte range of the file, see TFTPRange.
+ */
+#define TFTP_RANGE_SUFFIX "?range="
+
+/**
+ * @brief Suffix a client appends to the file name to read the size of the
+ * file, to decide whether to stripe it, see TFTPRangeStream::decodeSize().
+ */
+#define TFTP_SIZE_SUFFIX "?size"
+
+/**
+ * @brief Byte range of a file, written after TFTP_RANGE_SUFFIX as
+ * OFFSET:LENGTH, or OFFSET:LENGTH:TOTAL when writing a file of TOTAL bytes.
+ */
+struct TFTPRange {
+    uint64_t offset;
+    uint64_t length;
+    // Size of the whole file, 0 when not given.
+    uint64_t total;
+};
+
+/**
+ * @brief Stream that moves a byte range of a file, keeping the CRC-32 of
+ * the bytes moved.
+ *
+ * The range is read from or written to a FILE, which is seeked to the
+ * range first, to a file descriptor, with positioned reads and writes so
+ * several ranges of one descriptor can be moved at once, or to memory.
+ * Reads end with the range, writes past it fail. A FILE is flushed once
+ * the whole range is written. Closing the stream fails
+ * if less than the whole range was moved. The source is not closed.
+ *
+ * Blocks that come much later than the ones before, past the retransmission
+ * timeout of the engine, are counted as stalls: the block or its ACK was
+ * lost. The object can be opened again after its stream is closed, so it
+ * can be pooled.
+ */
+class TFTPRangeStream {
+public:
+    TFTPRangeStream();
+    ~TFTPRangeStream() = default;
+
+    TFTPRangeStream(const TFTPRangeStream &) = delete;
+    TFTPRangeStream &operator=(const TFTPRangeStream &) = delete;
+
+    /**
+     * @brief Open the stream over a range of a FILE.
+     *
+     * @param[in] source the FILE, seeked to offset.
+     * @param[in] offset the range offset in the FILE.
+     * @param[in] length the range length.
+     * @param[in] write true to write the range, false to read it.
+     *
+     * @return the stream, or NULL on error.
+     */
+    FILE *open(
+            FILE *source,
+            const uint64_t offset,
+            const uint64_t length,
+            const bool write
+    );
+
+    /**
+     * @brief Open the stream over a range of a file descriptor.
+     *
+     * @param[in] descriptor the file descriptor, its offset is left alone.
+     * @param[in] offset the range offset in the file.
+     * @param[in] length the range length.
+     * @param[in] write true to write the range, false to read it.
+     *
+     * @return the stream, or NULL on error.
+     */
+    FILE *open(
+            const int descriptor,
+            const uint64_t offset,
+            const uint64_t length,
+            const bool write
+    );
+
+    /**
+     * @brief Open the stream over memory holding the range.
+     *
+     * @param[in] memory the memory, at least length bytes.
+     * @param[in] length the range length.
+     * @param[in] write true to write the range, false to read it.
+     *
+     * @return the stream, or NULL on error.
+     */
+    FILE *open(
+            char *memory,
+            const uint64_t length,
+            const bool write
+    );
+
+    /**
+     * @brief Get the source FILE.
+     *
+     * @return the source FILE, or NULL if the range isn't of a FILE.
+     */
+    FILE *getSource();
+
+    /**
+     * @brief Get the CRC-32 of the bytes moved.
+     *
+     * @return the CRC-32, of the whole range once the stream is closed.
+     */
+    uint32_t getChecksum();
+
+    /**
+     * @brief Get the number of stalls seen since the stream was opened.
+     *
+     * @return the stalls.
+     */
+    uint64_t getStalls();
+
+    /**
+     * @brief Write a range as it follows TFTP_RANGE_SUFFIX.
+     *
+     * @param[in] range the range.
+     *
+     * @return the range.
+     */
+    static std::string encodeRange(
+            const TFTPRange &range
+    );
+
+    /**
+     * @brief Parse a range as it follows TFTP_RANGE_SUFFIX.
+     *
+     * @param[in] text the range.
+     * @param[out] range the range.
+     *
+     * @return true if the range is valid.
+     */
+    static bool decodeRange(
+            const char *text,
+            TFTPRange &range
+    );
+
+    /**
+     * @brief Write a file size as read after TFTP_SIZE_SUFFIX.
+     *
+     * @param[in] size the size.
+     *
+     * @return the size, in decimal.
+     */
+    static std::string encodeSize(
+            const uint64_t size
+    );
+
+    /**
+     * @brief Parse a file size as read after TFTP_SIZE_SUFFIX.
+     *
+     * @param[in] text the size.
+     * @param[in] length the text length, it isn't terminated.
+     * @param[out] size the size.
+     *
+     * @return true if the size is valid.
+     */
+    static bool decodeSize(
+            const char *text,
+            const size_t length,
+            uint64_t *size
+    );
+
+private:
+    FILE *open(
+            const bool write
+    );
+
+    static ssize_t streamRead(
+            void *cookie,
+            char *buffer,
+            size_t size
+    );
+
+    static ssize_t streamWrite(
+            void *cookie,
+            const char *buffer,
+            size_t size
+    );
+
+    static int streamClose(
+            void *cookie
+    );
+
+    void countBlock();
+
+    static const size_t STREAM_BUFFER_SIZE = 512;
+    // Below any engine retransmission timeout.
+    static const int STALL_MIN_MS = 250;
+
+    FILE *source;
+    int descriptor;
+    char *memory;
+    FILE *stream;
+    bool write;
+    bool failed;
+    uint64_t offset;
+    uint64_t length;
+    uint64_t position;
+    uint32_t checksum;
+    std::chrono::steady_clock::time_point lastBlock;
+    // Smoothed gap between blocks and its deviation, in milliseconds.
+    double gap;
+    double gapDeviation;
+    uint64_t stalls;
+    char streamBuffer[STREAM_BUFFER_SIZE];
+};
+
+#endif //TFTPRANGESTREAM_H
@@ -0,0 +1,44 @@
+#ifndef TFTPSTATSTYPES_H
+#define TFTPSTATSTYPES_H
+
+#include <stdint.h>
+
+/**
+ * @brief Latencies kept by the client and the server.
+ * Possible values are:
+ * - TFTP_LATENCY_SECTION_DURATION:     Whole transfer, request to last block.
+ * - TFTP_LATENCY_FIRST_BLOCK:          Request to the first block moving
+ *                                      through the file.
+ * - TFTP_LATENCY_BLOCK_ROUND_TRIP:     Time between consecutive blocks, which
+ *                                      in lockstep TFTP is the DATA to ACK
+ *                                      round trip.
+ * - TFTP_LATENCY_OPEN_FILE:            Open file callback (server only).
+ * - TFTP_LATENCY_CLOSE_FILE:           Close file callback (server only).
+ * - TFTP_LATENCY_DURABILITY:           Making an uploaded file durable, syncs
+ *                                      and rename included (server only).
+ */
+enum class TftpLatencyMetric {
+    TFTP_LATENCY_SECTION_DURATION = 0,
+    TFTP_LATENCY_FIRST_BLOCK,
+    TFTP_LATENCY_BLOCK_ROUND_TRIP,
+    TFTP_LATENCY_OPEN_FILE,
+    TFTP_LATENCY_CLOSE_FILE,
+    TFTP_LATENCY_DURABILITY,
+    TFTP_LATENCY_METRIC_COUNT
+};
+
+/**
+ * @brief Summary of a latency histogram. All values are in nanoseconds.
+ */
+struct TFTPLatencySummary {
+    uint64_t count;
+    uint64_t min;
+    uint64_t max;
+    double mean;
+    uint64_t p50;
+    uint64_t p90;
+    uint64_t p99;
+    uint64_t p999;
+};
+
+#endif //TFTPSTATSTYPES_H
@@ -0,0 +1,93 @@
+#ifndef TFTPTIMEDSTREAM_H
+#define TFTPTIMEDSTREAM_H
+
+#include "TFTPLatencyHistogram.h"
+
+#include <atomic>
+#include <chrono>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/types.h>
+
+/**
+ * @brief Stream that passes reads and writes through to a source FILE and
+ * times them.
+ *
+ * The engine moves one block per read or write and waits for the peer in
+ * between, so the first call is timed from the request and each later one
+ * from the previous call, which is the block round trip. The source is not
+ * closed by the stream. The object can be opened again after its stream is
+ * closed, so it can be pooled.
+ */
+class TFTPTimedStream {
+public:
+    TFTPTimedStream();
+    ~TFTPTimedStream() = default;
+
+    /**
+     * @brief Open the stream.
+     *
+     * @param[in] source the FILE to read from or write to.
+     * @param[in] write true to open for writing, false for reading.
+     * @param[in] start when the request was received or sent.
+     * @param[in] firstBlock the histogram for the first block.
+     * @param[in] roundTrip the histogram for the following blocks.
+     * @param[in] bytes if not null, counts the bytes moved.
+     *
+     * @return the stream to hand to the engine, or NULL on error.
+     */
+    FILE *open(
+            FILE *source,
+            const bool write,
+            const std::chrono::steady_clock::time_point start,
+            TFTPLatencyHistogram *firstBlock,
+            TFTPLatencyHistogram *roundTrip,
+            std::atomic<uint64_t> *bytes = nullptr
+    );
+
+    /**
+     * @brief Get the source FILE.
+     *
+     * @return the source FILE.
+     */
+    FILE *getSource();
+
+private:
+    void recordBlock();
+
+    static ssize_t streamRead(
+            void *cookie,
+            char *buffer,
+            size_t size
+    );
+
+    static ssize_t streamWrite(
+            void *cookie,
+            const char *buffer,
+            size_t size
+    );
+
+    static int streamSeek(
+            void *cookie,
+            off64_t *offset,
+            int whence
+    );
+
+    static int streamClose(
+            void *cookie
+    );
+
+    static const size_t STREAM_BUFFER_SIZE = 512;
+
+    FILE *source;
+    FILE *stream;
+    bool firstCall;
+    size_t largestWrite;
+    std::chrono::steady_clock::time_point last;
+    TFTPLatencyHistogram *firstBlock;
+    TFTPLatencyHistogram *roundTrip;
+    std::atomic<uint64_t> *bytes;
+    char streamBuffer[STREAM_BUFFER_SIZE];
+};
+
+#endif //TFTPTIMEDSTREAM_H
@@ -0,0 +1,261 @@
+#ifndef ITRANSFERSCHEDULER_H
+#define ITRANSFERSCHEDULER_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string>
+#include <vector>
+
+/**
+ * @brief Enum with possible return from interface functions.
+ * Possible return values are:
+ * - TRANSFER_SCHEDULER_OK:             Operation was successful.
+ * - TRANSFER_SCHEDULER_ERROR:          Generic error.
+ */
+enum class TransferSchedulerOperationResult {
+    TRANSFER_SCHEDULER_OK = 0,
+    TRANSFER_SCHEDULER_ERROR
+};
+
+/**
+ * @brief Enum with possible transfer directions.
+ * Possible values are:
+ * - TRANSFER_SEND:                     Send the file to the target.
+ * - TRANSFER_FETCH:                    Fetch the file from the target.
+ */
+enum class TransferDirection {
+    TRANSFER_SEND = 0,
+    TRANSFER_FETCH
+};
+
+/**
+ * @brief Enum with possible job status.
+ * Possible values are:
+ * - TRANSFER_JOB_OK:                   Job has been successfully completed.
+ * - TRANSFER_JOB_ERROR:                Job has failed and won't be retried.
+ */
+enum class TransferJobStatus {
+    TRANSFER_JOB_OK = 0,
+    TRANSFER_JOB_ERROR
+};
+
+typedef uint64_t TransferJobId;
+
+/**
+ * @brief Transfer job description.
+ *
+ * - host, port:    the target to connect to.
+ * - direction:     whether to send or fetch the file.
+ * - filename:      the remote file name.
+ * - fp:            the source (send) or sink (fetch). The scheduler does not
+ *                  close it. It is seeked back to its offset at submission
+ *                  before each retry, a job on a stream that can't seek is
+ *                  not retried.
+ * - priority:      jobs with higher priority are started first. Jobs with the
+ *                  same priority start in submission order.
+ * - maxRetries:    how many times a transient failure is retried.
+ */
+struct TransferJob {
+    std::string host;
+    int port;
+    TransferDirection direction;
+    std::string filename;
+    FILE *fp;
+    int priority;
+    int maxRetries;
+};
+
+/**
+ * @brief Aggregate progress of every job submitted to the scheduler.
+ */
+struct TransferProgress {
+    uint64_t submittedJobs;
+    uint64_t pendingJobs;
+    uint64_t runningJobs;
+    uint64_t completedJobs;
+    uint64_t failedJobs;
+    uint64_t retries;
+    uint64_t bytesFetched;
+};
+
+/**
+ * @brief Job finished callback. This callback is called from a scheduler
+ * worker when a job completes or fails for good.
+ *
+ * @param[in] id the job identifier returned by submitJob().
+ * @param[in] status the final job status.
+ * @param[in] errorMessage the last TFTP error message received, if any.
+ * @param[in] context the user context.
+ *
+ * @return TRANSFER_SCHEDULER_OK if success.
+ * @return TRANSFER_SCHEDULER_ERROR otherwise.
+ */
+typedef TransferSchedulerOperationResult (*transferJobFinishedCallback) (
+        TransferJobId id,
+        TransferJobStatus status,
+        std::string &errorMessage,
+        void *context
+);
+
+/**
+ * @brief Progress callback. This callback is called from a scheduler
+ * worker whenever a job starts, is retried or finishes.
+ *
+ * @param[in] progress the aggregate progress.
+ * @param[in] context the user context.
+ *
+ * @return TRANSFER_SCHEDULER_OK if success.
+ * @return TRANSFER_SCHEDULER_ERROR otherwise.
+ */
+typedef TransferSchedulerOperationResult (*transferProgressCallback) (
+        const TransferProgress &progress,
+        void *context
+);
+
+/**
+ * @brief Transfer scheduler interface. Runs TFTP transfers to many targets
+ * over a shared pool of workers.
+ */
+class ITransferScheduler {
+public:
+    virtual ~ITransferScheduler() = default;
+
+    /**
+     * @brief Set the maximum number of transfers running at once. This is
+     * the size of the worker pool. Must be called before start().
+     * The default is 4.
+     *
+     * @param[in] maxTransfers the global concurrency limit.
+     *
+     * @return TRANSFER_SCHEDULER_OK if success.
+     * @return TRANSFER_SCHEDULER_ERROR otherwise.
+     */
+    virtual TransferSchedulerOperationResult setMaxConcurrentTransfers(
+            const int maxTransfers
+    ) = 0;
+
+    /**
+     * @brief Set the maximum number of transfers running at once against
+     * the same host and port. The default is 1.
+     *
+     * @param[in] maxTransfers the per-host concurrency limit.
+     *
+     * @return TRANSFER_SCHEDULER_OK if success.
+     * @return TRANSFER_SCHEDULER_ERROR otherwise.
+     */
+    virtual TransferSchedulerOperationResult setMaxTransfersPerHost(
+            const int maxTransfers
+    ) = 0;
+
+    /**
+     * @brief Set the delay before a failed job is retried. If the target
+     * answered with an ARINC 615A "WAIT:<seconds>" message, the requested
+     * time is used instead, up to an hour. A WAIT message without a
+     * positive number of seconds gets this delay. The default is 1000
+     * milliseconds.
+     *
+     * @param[in] delay the retry delay in milliseconds.
+     *
+     * @return TRANSFER_SCHEDULER_OK if success.
+     * @return TRANSFER_SCHEDULER_ERROR otherwise.
+     */
+    virtual TransferSchedulerOperationResult setRetryDelay(
+            const int delay
+    ) = 0;
+
+    /**
+     * @brief Pin the workers to a set of CPUs, so each client's buffers
+     * stay on the NUMA node of those CPUs. Must be called before start().
+     * By default workers are not pinned.
+     *
+     * @param[in] cpus the CPU numbers, empty to unpin.
+     *
+     * @return TRANSFER_SCHEDULER_OK if success.
+     * @return TRANSFER_SCHEDULER_ERROR otherwise.
+     */
+    virtual TransferSchedulerOperationResult setCpuAffinity(
+            const std::vector<int> &cpus
+    ) = 0;
+
+    /**
+     * @brief Register job finished callback.
+     *
+     * @param[in] callback the callback to register.
+     * @param[in] context the user context.
+     *
+     * @return TRANSFER_SCHEDULER_OK if success.
+     * @return TRANSFER_SCHEDULER_ERROR otherwise.
+     */
+    virtual TransferSchedulerOperationResult registerJobFinishedCallback(
+            transferJobFinishedCallback callback,
+            void *context
+    ) = 0;
+
+    /**
+     * @brief Register progress callback.
+     *
+     * @param[in] callback the callback to register.
+     * @param[in] context the user context.
+     *
+     * @return TRANSFER_SCHEDULER_OK if success.
+     * @return TRANSFER_SCHEDULER_ERROR otherwise.
+     */
+    virtual TransferSchedulerOperationResult registerProgressCallback(
+            transferProgressCallback callback,
+            void *context
+    ) = 0;
+
+    /**
+     * @brief Queue a transfer job. Jobs may be submitted before or after
+     * start().
+     *
+     * @param[in] job the job to run.
+     * @param[out] id the job identifier. May be null.
+     *
+     * @return TRANSFER_SCHEDULER_OK if success.
+     * @return TRANSFER_SCHEDULER_ERROR otherwise.
+     */
+    virtual TransferSchedulerOperationResult submitJob(
+            const TransferJob &job,
+            TransferJobId *id
+    ) = 0;
+
+    /**
+     * @brief Start the worker pool.
+     *
+     * @return TRANSFER_SCHEDULER_OK if success.
+     * @return TRANSFER_SCHEDULER_ERROR otherwise.
+     */
+    virtual TransferSchedulerOperationResult start() = 0;
+
+    /**
+     * @brief Block until every submitted job has completed or failed.
+     *
+     * @return TRANSFER_SCHEDULER_OK if success.
+     * @return TRANSFER_SCHEDULER_ERROR otherwise.
+     */
+    virtual TransferSchedulerOperationResult waitIdle() = 0;
+
+    /**
+     * @brief Stop the worker pool. Running transfers are completed, pending
+     * jobs stay queued until start() is called again.
+     *
+     * @return TRANSFER_SCHEDULER_OK if success.
+     * @return TRANSFER_SCHEDULER_ERROR otherwise.
+     */
+    virtual TransferSchedulerOperationResult stop() = 0;
+
+    /**
+     * @brief Get aggregate progress.
+     *
+     * @param[out] progress the aggregate progress.
+     *
+     * @return TRANSFER_SCHEDULER_OK if success.
+     * @return TRANSFER_SCHEDULER_ERROR otherwise.
+     */
+    virtual TransferSchedulerOperationResult getProgress(
+            TransferProgress &progress
+    ) = 0;
+};
+
+#endif //ITRANSFERSCHEDULER_H
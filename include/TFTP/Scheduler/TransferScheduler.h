@@ -0,0 +1,110 @@
+#ifndef TRANSFERSCHEDULER_H
+#define TRANSFERSCHEDULER_H
+
+#include "ITransferScheduler.h"
+#include "TFTPCpuSet.h"
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <map>
+#include <mutex>
+#include <string>
+#include <sys/types.h>
+#include <thread>
+#include <vector>
+
+/**
+ * @brief Transfer scheduler implementation. Each worker owns a TFTPClient
+ * that is reconnected to the host of every job it picks up.
+ */
+class TransferScheduler : public ITransferScheduler {
+public:
+    TransferScheduler();
+    virtual ~TransferScheduler();
+
+    TransferSchedulerOperationResult setMaxConcurrentTransfers(
+            const int maxTransfers
+    ) override;
+
+    TransferSchedulerOperationResult setMaxTransfersPerHost(
+            const int maxTransfers
+    ) override;
+
+    TransferSchedulerOperationResult setRetryDelay(
+            const int delay
+    ) override;
+
+    TransferSchedulerOperationResult setCpuAffinity(
+            const std::vector<int> &cpus
+    ) override;
+
+    TransferSchedulerOperationResult registerJobFinishedCallback(
+            transferJobFinishedCallback callback,
+            void *context
+    ) override;
+
+    TransferSchedulerOperationResult registerProgressCallback(
+            transferProgressCallback callback,
+            void *context
+    ) override;
+
+    TransferSchedulerOperationResult submitJob(
+            const TransferJob &job,
+            TransferJobId *id
+    ) override;
+
+    TransferSchedulerOperationResult start() override;
+
+    TransferSchedulerOperationResult waitIdle() override;
+
+    TransferSchedulerOperationResult stop() override;
+
+    TransferSchedulerOperationResult getProgress(
+            TransferProgress &progress
+    ) override;
+
+private:
+    typedef std::chrono::steady_clock Clock;
+
+    struct QueuedJob {
+        TransferJobId id;
+        TransferJob job;
+        int attempts;
+        Clock::time_point notBefore;
+        // Offset of fp at submission, where retries start again.
+        off_t startOffset;
+    };
+
+    static std::string hostKey(const TransferJob &job);
+
+    void workerLoop();
+
+    bool pickJob(QueuedJob &job, Clock::time_point &wakeUp);
+
+    void notifyProgress();
+
+    std::mutex mutex;
+    std::condition_variable jobsChanged;
+    std::vector<std::thread> workers;
+    bool running;
+
+    std::vector<QueuedJob> queue;
+    // Keyed by hostKey().
+    std::map<std::string, int> runningPerHost;
+    TransferJobId nextJobId;
+    TransferProgress progress;
+    std::atomic<uint64_t> bytesFetched;
+
+    int maxConcurrentTransfers;
+    int maxTransfersPerHost;
+    int retryDelay;
+    TFTPCpuSet workerCpus;
+
+    void *jobFinishedCtx;
+    transferJobFinishedCallback _jobFinishedCallback;
+    void *progressCtx;
+    transferProgressCallback _progressCallback;
+};
+
+#endif //TRANSFERSCHEDULER_H
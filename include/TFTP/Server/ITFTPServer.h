@@ -6,7 +6,10 @@
 #define ITFTPSERVER_H
 
 #include "tftpd_api.h"
+#include "TFTPStatsTypes.h"
+#include <stdint.h>
 #include <string>
+#include <vector>
 
 /**
  * @brief Enum with possible return from interface functions.
@@ -32,8 +35,68 @@ enum class TftpServerSectionStatus {
     TFTP_SERVER_SECTION_UNDEFINED
 };
 
+/**
+ * @brief Enum with the durability policies for uploaded files.
+ * Possible values are:
+ * - TFTP_DURABILITY_NONE:          Files are closed, the kernel writes them
+ *                                  back in its own time.
+ * - TFTP_DURABILITY_FDATASYNC:     Each file is synced with fdatasync()
+ *                                  before it is closed.
+ * - TFTP_DURABILITY_GROUP_COMMIT:  Files closed by concurrent sections are
+ *                                  synced together, with one syncfs() per
+ *                                  filesystem every group commit interval.
+ *                                  syncfs() writes back every dirty file of
+ *                                  the filesystem, other processes' too, so
+ *                                  prefer it on filesystems the server
+ *                                  mostly has to itself.
+ * - TFTP_DURABILITY_ATOMIC_RENAME: Files are written to a temporary file,
+ *                                  synced, and renamed over the target once
+ *                                  the section succeeded, readers see the
+ *                                  old or the whole new file.
+ */
+enum class TftpDurabilityMode {
+    TFTP_DURABILITY_NONE = 0,
+    TFTP_DURABILITY_FDATASYNC,
+    TFTP_DURABILITY_GROUP_COMMIT,
+    TFTP_DURABILITY_ATOMIC_RENAME
+};
+
 typedef SectionId TftpSectionId;
 class ITFTPSection;
+class TFTPLatencyHistogram;
+struct TFTPFileMetadata;
+
+/**
+ * @brief Enum with the direction of a transfer, seen from the server.
+ * Possible values are:
+ * - TFTP_TRANSFER_READ:                The client reads a file (RRQ).
+ * - TFTP_TRANSFER_WRITE:               The client writes a file (WRQ).
+ */
+enum class TftpTransferDirection {
+    TFTP_TRANSFER_READ = 0,
+    TFTP_TRANSFER_WRITE
+};
+
+/**
+ * @brief Snapshot of an active section, see ITFTPServer::listSections().
+ * The file name is the one requested, without the compression and delta
+ * suffixes. Bytes are the bytes moved through the engine so far,
+ * compressed or delta encoded when the transfer is. For a range of a
+ * striped transfer, the window is the number of ranges of the file the
+ * client has in flight in the same direction, its current window, see
+ * ITFTPClient::setAdaptiveStriping(). It is 1 for other transfers.
+ */
+struct TFTPSectionInfo {
+    TftpSectionId id;
+    std::string clientIp;
+    int serverPort;
+    std::string filename;
+    TftpTransferDirection direction;
+    uint64_t bytes;
+    double bytesPerSecond;
+    uint64_t ageMs;
+    int window;
+};
 
 /**
  * @brief Callback for new section. This callback is called when a
@@ -136,6 +199,40 @@ public:
             const int port
     ) = 0;
 
+    /**
+     * @brief Add another port for the TFTP Server to listen on. A single
+     * server instance serves all its ports with the same callbacks, and
+     * each section reports the port it arrived on through
+     * ITFTPSection::getServerPort(). Ports must be added before calling
+     * startListening().
+     *
+     * @param[in] port the extra port to listen on.
+     *
+     * @return TFTP_SERVER_OK if success.
+     * @return TFTP_SERVER_ERROR otherwise.
+     */
+    virtual TftpServerOperationResult addPort(
+            const int port
+    ) = 0;
+
+    /**
+     * @brief Pin the listener of a port, and the engine threads serving
+     * the sections that arrive on it, to a set of CPUs. Giving each port
+     * the CPUs of one socket keeps a port's packet and file buffers on its
+     * NUMA node. Must be called before startListening(). By default
+     * threads are not pinned.
+     *
+     * @param[in] port the port, set with setPort() or addPort().
+     * @param[in] cpus the CPU numbers, empty to unpin.
+     *
+     * @return TFTP_SERVER_OK if success.
+     * @return TFTP_SERVER_ERROR otherwise.
+     */
+    virtual TftpServerOperationResult setCpuAffinity(
+            const int port,
+            const std::vector<int> &cpus
+    ) = 0;
+
     /**
      * @brief Set timeout. This is the time the server will wait for a client
      * to send a request. If the client doesn't send a request within this time,
@@ -151,9 +248,515 @@ public:
             const int timeout
     ) = 0;
 
+    /**
+     * @brief Set drain timeout. When the server stops listening, the
+     * startListening() function waits up to this time for in-flight sections
+     * to finish before returning. The default is 0, which means the server
+     * returns as soon as the listen loop exits. Destroying the server
+     * waits for in-flight sections too, since they call back into it, up
+     * to this time but at least 5 seconds. A section still running after
+     * that is abandoned.
+     *
+     * @param[in] timeout the drain timeout in milliseconds.
+     *
+     * @return TFTP_SERVER_OK if success.
+     * @return TFTP_SERVER_ERROR otherwise.
+     */
+    virtual TftpServerOperationResult setDrainTimeout(
+            const int timeout
+    ) = 0;
+
+    /**
+     * @brief Set read-ahead depth. When it is greater than 0, every file
+     * opened for reading, either by the default open or by the open file
+     * callback, is prefetched this many blocks ahead on a background thread.
+     * DATA packets are then served from memory. The default is 0, which
+     * disables read-ahead.
+     *
+     * @param[in] depth the number of blocks to prefetch.
+     *
+     * @return TFTP_SERVER_OK if success.
+     * @return TFTP_SERVER_ERROR otherwise.
+     */
+    virtual TftpServerOperationResult setReadAheadDepth(
+            const int depth
+    ) = 0;
+
+    /**
+     * @brief Get read-ahead statistics. A hit is a read served from
+     * prefetched data, a miss is a read that had to wait for the disk.
+     *
+     * @param[out] hits the number of reads served from prefetched data.
+     * @param[out] misses the number of reads that had to wait.
+     *
+     * @return TFTP_SERVER_OK if success.
+     * @return TFTP_SERVER_ERROR otherwise.
+     */
+    virtual TftpServerOperationResult getReadAheadStats(
+            uint64_t *hits,
+            uint64_t *misses
+    ) = 0;
+
+    /**
+     * @brief Get a latency histogram. The server's counts are merged into
+     * the given histogram, so several servers can be combined into one.
+     *
+     * @param[in] metric the latency to get.
+     * @param[in,out] histogram the histogram to merge into.
+     *
+     * @return TFTP_SERVER_OK if success.
+     * @return TFTP_SERVER_ERROR otherwise.
+     */
+    virtual TftpServerOperationResult getLatencyHistogram(
+            const TftpLatencyMetric metric,
+            TFTPLatencyHistogram &histogram
+    ) = 0;
+
+    /**
+     * @brief Get count, min, max, mean and p50/p90/p99/p999 of a latency,
+     * in nanoseconds.
+     *
+     * @param[in] metric the latency to summarize.
+     * @param[out] summary the summary.
+     *
+     * @return TFTP_SERVER_OK if success.
+     * @return TFTP_SERVER_ERROR otherwise.
+     */
+    virtual TftpServerOperationResult getLatencySummary(
+            const TftpLatencyMetric metric,
+            TFTPLatencySummary *summary
+    ) = 0;
+
+    /**
+     * @brief Clear all latency histograms.
+     *
+     * @return TFTP_SERVER_OK if success.
+     * @return TFTP_SERVER_ERROR otherwise.
+     */
+    virtual TftpServerOperationResult resetLatencyStats() = 0;
+
+    /**
+     * @brief Set the window for duplicate request detection, in
+     * milliseconds. A request with the same client address, opcode and file
+     * name as a section started less than window ago, which hasn't heard
+     * from its client yet, is treated as a retransmission: it doesn't open
+     * the file or run any callback. Its section waits for the original to
+     * finish, at most until the window of the original ends, then fails.
+     *
+     * The engine doesn't give the client port, so it isn't part of the key:
+     * two transfers of the same file by the same host that start together
+     * are also treated as duplicates. Keep the window just above the
+     * clients' retransmission timeout. Local transport sections are never
+     * duplicates. The default is 0, which disables detection.
+     *
+     * While detection is enabled, the section started callback is called
+     * when the file is opened instead of when the request arrives, so it
+     * is not called for duplicates.
+     *
+     * @param[in] window the detection window, in milliseconds.
+     *
+     * @return TFTP_SERVER_OK if success.
+     * @return TFTP_SERVER_ERROR otherwise.
+     */
+    virtual TftpServerOperationResult setDuplicateRequestWindow(
+            const int window
+    ) = 0;
+
+    /**
+     * @brief Get how many duplicate requests were suppressed.
+     *
+     * @param[out] count the number of suppressed requests.
+     *
+     * @return TFTP_SERVER_OK if success.
+     * @return TFTP_SERVER_ERROR otherwise.
+     */
+    virtual TftpServerOperationResult getSuppressedDuplicates(
+            uint64_t *count
+    ) = 0;
+
+    /**
+     * @brief Enable compressed transfers. Clients asking for it, by adding
+     * TFTP_COMPRESSION_SUFFIX to the file name, get the file compressed
+     * with zlib on reads and send it compressed on writes. The callbacks see
+     * the file name without the suffix and the file content uncompressed.
+     * Other clients are not affected. Disabled by default.
+     *
+     * @param[in] enabled true to enable compression.
+     *
+     * @return TFTP_SERVER_OK if success.
+     * @return TFTP_SERVER_ERROR otherwise.
+     */
+    virtual TftpServerOperationResult setCompression(
+            const bool enabled
+    ) = 0;
+
+    /**
+     * @brief Set the size of the cache of compressed files. Regular files,
+     * opened by the server or by the open file callback, are compressed
+     * once and served from the cache until they change. Other FILEs, such
+     * as fmemopen ones, and files larger than the cache are compressed
+     * during the transfer. The default is 32 MiB, 0 disables the cache.
+     *
+     * @param[in] size the cache size, in bytes.
+     *
+     * @return TFTP_SERVER_OK if success.
+     * @return TFTP_SERVER_ERROR otherwise.
+     */
+    virtual TftpServerOperationResult setCompressionCacheSize(
+            const size_t size
+    ) = 0;
+
+    /**
+     * @brief Get the compression statistics.
+     *
+     * @param[out] plainBytes file bytes moved by compressed transfers.
+     * @param[out] compressedBytes bytes sent or received for them.
+     * @param[out] cacheHits compressed reads served from the cache.
+     *
+     * @return TFTP_SERVER_OK if success.
+     * @return TFTP_SERVER_ERROR otherwise.
+     */
+    virtual TftpServerOperationResult getCompressionStats(
+            uint64_t *plainBytes,
+            uint64_t *compressedBytes,
+            uint64_t *cacheHits
+    ) = 0;
+
+    /**
+     * @brief Enable delta writes. A client asking for the file name with
+     * TFTP_HASHES_SUFFIX reads the block hashes of the server's copy. It
+     * may then write the file name with TFTP_DELTA_SUFFIX, sending only the
+     * blocks that changed. The server rebuilds the file from the blocks
+     * and the unchanged parts of its copy, read where needed, and checks
+     * it against the client's checksum. Without an open file callback the
+     * file is rebuilt beside the target and renamed over it; with one, it
+     * is rebuilt into a temporary file and copied into the file the
+     * callback opens for writing once it checked out. A delta that
+     * doesn't apply fails the transfer and leaves the file untouched.
+     * Disabled by default.
+     *
+     * @param[in] enabled true to enable delta writes.
+     *
+     * @return TFTP_SERVER_OK if success.
+     * @return TFTP_SERVER_ERROR otherwise.
+     */
+    virtual TftpServerOperationResult setDeltaTransfer(
+            const bool enabled
+    ) = 0;
+
+    /**
+     * @brief Enable striped transfers. A client asking for the file name
+     * with TFTP_RANGE_SUFFIX and a range reads or writes only that range,
+     * so one file can be moved over several sessions at once. Ranges are
+     * written in place, without truncating the file: it only grows as the
+     * ranges are written, up to the limit set by setStripedFileLimit(). The
+     * open file callback is called with mode "r+" for them, it must open
+     * the file without truncating it, creating it if needed. Atomic rename
+     * doesn't apply to ranges. A client asking for the file name with
+     * TFTP_SIZE_SUFFIX reads the size of the file, and with
+     * TFTP_CHECKSUM_SUFFIX its size and checksum, to check it once all
+     * ranges are moved. Disabled by default.
+     *
+     * @param[in] enabled true to enable striped transfers.
+     *
+     * @return TFTP_SERVER_OK if success.
+     * @return TFTP_SERVER_ERROR otherwise.
+     */
+    virtual TftpServerOperationResult setStripedTransfer(
+            const bool enabled
+    ) = 0;
+
+    /**
+     * @brief Set the largest file striped writes may make. A range write
+     * ending past it, or giving a larger total size, is rejected. The
+     * default is 4 GiB.
+     *
+     * @param[in] limit the limit, in bytes.
+     *
+     * @return TFTP_SERVER_OK if success.
+     * @return TFTP_SERVER_ERROR otherwise.
+     */
+    virtual TftpServerOperationResult setStripedFileLimit(
+            const uint64_t limit
+    ) = 0;
+
+    /**
+     * @brief Set how uploaded files are made durable. Atomic rename needs
+     * the file name, it only applies to files the server opens itself,
+     * files opened by the open file callback are synced with fdatasync()
+     * instead. The time spent is kept in the TFTP_LATENCY_DURABILITY
+     * histogram. The default is TFTP_DURABILITY_NONE.
+     *
+     * @param[in] mode the durability mode.
+     *
+     * @return TFTP_SERVER_OK if success.
+     * @return TFTP_SERVER_ERROR otherwise.
+     */
+    virtual TftpServerOperationResult setDurabilityMode(
+            const TftpDurabilityMode mode
+    ) = 0;
+
+    /**
+     * @brief Set how long a group commit collects files before syncing
+     * them. Longer intervals make fewer syncs and slower closes, each sync
+     * writes back the whole filesystem, see TFTP_DURABILITY_GROUP_COMMIT.
+     * The default is 10 milliseconds.
+     *
+     * @param[in] interval the interval in milliseconds.
+     *
+     * @return TFTP_SERVER_OK if success.
+     * @return TFTP_SERVER_ERROR otherwise.
+     */
+    virtual TftpServerOperationResult setGroupCommitInterval(
+            const int interval
+    ) = 0;
+
+    /**
+     * @brief Get durability counters.
+     *
+     * @param[out] files the number of uploaded files made durable.
+     * @param[out] syncs the number of sync calls made for them.
+     * @param[out] failed the number of uploads received whole that couldn't
+     * be renamed into place or whose directory couldn't be synced. Their
+     * sections report TFTP_SERVER_SECTION_ERROR to the finished callback.
+     *
+     * @return TFTP_SERVER_OK if success.
+     * @return TFTP_SERVER_ERROR otherwise.
+     */
+    virtual TftpServerOperationResult getDurabilityStats(
+            uint64_t *files,
+            uint64_t *syncs,
+            uint64_t *failed
+    ) = 0;
+
+    /**
+     * @brief Set the large-file mode of files the server opens itself.
+     * Files read that are at least threshold bytes, and files written once
+     * that much was written, are moved with O_DIRECT through pooled
+     * aligned buffers instead of stdio, so multi-gigabyte images don't
+     * evict the page cache. Read-ahead doesn't apply to them. Filesystems
+     * that refuse O_DIRECT get buffered I/O with the moved pages dropped
+     * from the cache. A zero threshold, the default, disables the mode.
+     *
+     * @param[in] threshold the size in bytes above which a file is large.
+     * @param[in] hugePages whether to back the buffers with huge pages.
+     *
+     * @return TFTP_SERVER_OK if success.
+     * @return TFTP_SERVER_ERROR otherwise.
+     */
+    virtual TftpServerOperationResult setLargeFileMode(
+            const uint64_t threshold,
+            const bool hugePages
+    ) = 0;
+
+    /**
+     * @brief Get large-file counters.
+     *
+     * @param[out] files the number of files moved in large-file mode.
+     * @param[out] bytes the number of bytes moved in large-file mode.
+     * @param[out] buffered the number of those files that couldn't use
+     * O_DIRECT.
+     *
+     * @return TFTP_SERVER_OK if success.
+     * @return TFTP_SERVER_ERROR otherwise.
+     */
+    virtual TftpServerOperationResult getLargeFileStats(
+            uint64_t *files,
+            uint64_t *bytes,
+            uint64_t *buffered
+    ) = 0;
+
+    /**
+     * @brief Index the metadata of the files of a directory: size,
+     * modification time, CRC-32 and block hashes. The index is built by
+     * several threads before this returns, then kept current with
+     * inotify. Block hash requests of delta transfers are then answered
+     * from the index instead of reading the file, whether the file was
+     * opened by the server or by the open file callback. Only regular
+     * files directly in the directory are indexed. An empty directory
+     * drops the index, there is none by default.
+     *
+     * @param[in] directory the directory to index.
+     * @param[in] threads the number of threads to build the index with,
+     * 0 for one per CPU.
+     *
+     * @return TFTP_SERVER_OK if success.
+     * @return TFTP_SERVER_ERROR otherwise.
+     */
+    virtual TftpServerOperationResult setMetadataIndex(
+            const std::string &directory,
+            const int threads
+    ) = 0;
+
+    /**
+     * @brief Get the indexed metadata of a file, to check its integrity
+     * or validate a cached copy without reading it.
+     *
+     * @param[in] filename the path of the file.
+     * @param[out] metadata the metadata.
+     *
+     * @return TFTP_SERVER_OK if success.
+     * @return TFTP_SERVER_ERROR if the file isn't indexed as it is now.
+     */
+    virtual TftpServerOperationResult getFileMetadata(
+            const std::string &filename,
+            TFTPFileMetadata &metadata
+    ) = 0;
+
+    /**
+     * @brief Get metadata index counters.
+     *
+     * @param[out] files the number of files indexed.
+     * @param[out] hits the number of lookups answered from the index.
+     * @param[out] misses the number of lookups that weren't.
+     *
+     * @return TFTP_SERVER_OK if success.
+     * @return TFTP_SERVER_ERROR otherwise.
+     */
+    virtual TftpServerOperationResult getMetadataIndexStats(
+            uint64_t *files,
+            uint64_t *hits,
+            uint64_t *misses
+    ) = 0;
+
+    /**
+     * @brief Get a snapshot of the sections transferring a file right now.
+     * Blocks only bump per-section atomic counters. The section table is
+     * locked just long enough to take a reference to each section's
+     * record, which is read after the lock is released, and never while a
+     * block moves, so it can be polled often.
+     *
+     * @param[out] sections the active sections, oldest last.
+     *
+     * @return TFTP_SERVER_OK if success.
+     * @return TFTP_SERVER_ERROR otherwise.
+     */
+    virtual TftpServerOperationResult listSections(
+            std::vector<TFTPSectionInfo> &sections
+    ) = 0;
+
+    /**
+     * @brief Set admission limits. A request is admitted while fewer than
+     * maxSections sections are admitted and the admitted reads, the request
+     * included, have fewer than maxBytes left to send. A read larger than
+     * maxBytes is still admitted while no other read is. Only reads of
+     * known size count: virtual files, ranges and files the server opens
+     * itself are sized before admission, files from the open callback once
+     * open. Beyond that, up to queueLength requests wait, each for at most
+     * queueTimeout milliseconds, and are admitted as sections finish.
+     * Other requests, and queued ones that time out, are answered at once
+     * with the reject message, before any file is opened. A zero limit is
+     * ignored, by default there are none.
+     *
+     * While a limit is set, the section started callback is called once
+     * the request is admitted instead of when it arrives, so rejected
+     * requests run no callback.
+     *
+     * @param[in] maxSections the most sections admitted at once.
+     * @param[in] maxBytes the most bytes admitted reads may have left.
+     * @param[in] queueLength the most requests waiting for admission.
+     * @param[in] queueTimeout how long a request may wait, in milliseconds.
+     *
+     * @return TFTP_SERVER_OK if success.
+     * @return TFTP_SERVER_ERROR otherwise.
+     */
+    virtual TftpServerOperationResult setAdmissionLimits(
+            const int maxSections,
+            const uint64_t maxBytes,
+            const int queueLength,
+            const int queueTimeout
+    ) = 0;
+
+    /**
+     * @brief Set the error message rejected requests are answered with,
+     * such as the ARINC 615A "WAIT:<seconds>" telling the client when to
+     * retry. The default is "WAIT:1".
+     *
+     * @param[in] message the error message.
+     *
+     * @return TFTP_SERVER_OK if success.
+     * @return TFTP_SERVER_ERROR otherwise.
+     */
+    virtual TftpServerOperationResult setAdmissionRejectMessage(
+            const std::string &message
+    ) = 0;
+
+    /**
+     * @brief Get admission counters.
+     *
+     * @param[out] queued the number of requests that had to wait.
+     * @param[out] rejected the number of requests rejected.
+     *
+     * @return TFTP_SERVER_OK if success.
+     * @return TFTP_SERVER_ERROR otherwise.
+     */
+    virtual TftpServerOperationResult getAdmissionStats(
+            uint64_t *queued,
+            uint64_t *rejected
+    ) = 0;
+
+    /**
+     * @brief Register an in-memory file. Read requests for this file name
+     * are answered straight from a copy of the given bytes, without calling
+     * the open and close file callbacks. Write requests for the name are
+     * handled as usual.
+     *
+     * @param[in] filename the file name clients request.
+     * @param[in] data the file content. It is copied.
+     * @param[in] size the file size.
+     *
+     * @return TFTP_SERVER_OK if success.
+     * @return TFTP_SERVER_ERROR if the name is already registered.
+     */
+    virtual TftpServerOperationResult registerVirtualFile(
+            const char *filename,
+            const void *data,
+            const size_t size
+    ) = 0;
+
+    /**
+     * @brief Replace the content of a registered in-memory file. Transfers
+     * already in progress finish with the previous content, new requests
+     * get the new one.
+     *
+     * @param[in] filename the registered file name.
+     * @param[in] data the new file content. It is copied.
+     * @param[in] size the new file size.
+     *
+     * @return TFTP_SERVER_OK if success.
+     * @return TFTP_SERVER_ERROR if the name isn't registered.
+     */
+    virtual TftpServerOperationResult updateVirtualFile(
+            const char *filename,
+            const void *data,
+            const size_t size
+    ) = 0;
+
+    /**
+     * @brief Remove a registered in-memory file.
+     *
+     * @param[in] filename the registered file name.
+     *
+     * @return TFTP_SERVER_OK if success.
+     * @return TFTP_SERVER_ERROR if the name isn't registered.
+     */
+    virtual TftpServerOperationResult unregisterVirtualFile(
+            const char *filename
+    ) = 0;
+
     /**
      * @brief Register open file callback.
      *
+     * Callbacks can be registered while the server is listening. Sections
+     * started afterwards use the new callback, sections in progress keep
+     * all the callbacks they started with, so a file is always closed by
+     * the close callback paired with the one that opened it.
+     *
+     * File names starting with '?' are reserved for the requests clients
+     * of this library make, such as support probes. The server answers
+     * them itself, or rejects them when the feature is disabled, and never
+     * passes them to the callback.
+     *
      * @param[in] handler the pointer to the tftpd handler.
      * @param[in] callback the callback to register.
      * @param[in] context the user context.
@@ -169,6 +772,8 @@ public:
     /**
      * @brief Register close file callback.
      *
+     * Takes effect as for registerOpenFileCallback.
+     *
      * @param[in] callback the callback to register.
      * @param[in] context the user context.
      *
@@ -183,6 +788,8 @@ public:
     /**
      * @brief Register section start callback.
      *
+     * Takes effect as for registerOpenFileCallback.
+     *
      * @param[in] callback the callback to register.
      * @param[in] context the user context.
      *
@@ -197,6 +804,8 @@ public:
     /**
      * @brief Register section finished callback.
      *
+     * Takes effect as for registerOpenFileCallback.
+     *
      * @param[in] callback the callback to register.
      * @param[in] context the user context.
      *
@@ -212,9 +821,16 @@ public:
      * @brief Start the TFTP Server. This is a blocking function.
      * In order to stop be able to stop the server, call this function
      * from another thread and then use the stop_listening() function.
+     * While listening, clients in this process using the local transport
+     * are served too, without the UDP stack, each on a thread of its own
+     * and through the same callbacks.
      *
+     * Every port added with addPort() listens on a thread of its own. If
+     * an extra port fails to listen the server is asked to stop, as with
+     * stopListening(), and this function returns an error once the other
+     * ports have stopped.
      *
-     * @return TFTP_SERVER_OK if success.
+     * @return TFTP_SERVER_OK if every port listened until stopped.
      * @return TFTP_SERVER_ERROR otherwise.
      */
     virtual TftpServerOperationResult startListening() = 0;
@@ -226,6 +842,11 @@ public:
      * ready. When the server stops listening, the startListening()
      * function will return.
      *
+     * The listen loop is woken up immediately, so it doesn't have to
+     * reach its timeout before exiting. In-flight sections are drained
+     * as configured with setDrainTimeout(). After startListening()
+     * returns, it may be called again to restart the server.
+     *
      *
      * @return TFTP_SERVER_OK if success.
      * @return TFTP_SERVER_ERROR otherwise.
@@ -263,9 +884,23 @@ public:
             std::string &ip
     ) = 0;
 
+    /**
+     * @brief Get the server port the section request arrived on.
+     *
+     * @param[out] port the server port.
+     *
+     * @return TFTP_SERVER_OK if success.
+     * @return TFTP_SERVER_ERROR otherwise.
+     */
+    virtual TftpServerOperationResult getServerPort(
+            int *port
+    ) = 0;
+
     /**
      * @brief Get section status. Call this function from the section_finished
-     * callback to check if the section was successful.
+     * callback to check if the section was successful. An upload the client
+     * saw succeed reports TFTP_SERVER_SECTION_ERROR when the server couldn't
+     * rename it into place or sync its directory.
      *
      * @param[out] status the status of the section.
      *
@@ -0,0 +1,110 @@
+#ifndef TFTPCOMPRESSIONCACHE_H
+#define TFTPCOMPRESSIONCACHE_H
+
+#include <atomic>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/stat.h>
+#include <utility>
+#include <vector>
+
+typedef std::shared_ptr<const std::vector<char>> TFTPCompressedData;
+
+/**
+ * @brief Cache of the compressed form of files, so hot files are
+ * compressed once and not on every transfer.
+ *
+ * Entries are keyed by device and inode, so files opened by the open file
+ * callback are cached too, and checked against the file modification time
+ * and size, a changed file is compressed again. Only FILEs backed by a
+ * regular file can be cached. The least recently used
+ * entries are dropped when the cache goes over its capacity. Transfers in
+ * progress keep their data alive after it is dropped.
+ */
+class TFTPCompressionCache {
+public:
+    TFTPCompressionCache();
+    ~TFTPCompressionCache() = default;
+
+    TFTPCompressionCache(const TFTPCompressionCache &) = delete;
+    TFTPCompressionCache &operator=(const TFTPCompressionCache &) = delete;
+
+    /**
+     * @brief Set the capacity. 0 disables the cache.
+     *
+     * @param[in] capacity the capacity, in compressed bytes.
+     */
+    void setCapacity(
+            const size_t capacity
+    );
+
+    /**
+     * @brief Get the capacity.
+     *
+     * @return the capacity, in compressed bytes.
+     */
+    size_t getCapacity();
+
+    /**
+     * @brief Get the compressed form of a file, compressing it if it isn't
+     * cached or changed since it was.
+     *
+     * @param[in] file the file, its position is left untouched.
+     * @param[out] plainSize the file size.
+     *
+     * @return the compressed data, or nullptr if the file can't be cached.
+     */
+    TFTPCompressedData get(
+            FILE *file,
+            size_t *plainSize
+    );
+
+    /**
+     * @brief Get the cache statistics.
+     *
+     * @param[out] hits requests served from the cache.
+     * @param[out] misses requests that compressed the file.
+     */
+    void getStats(
+            uint64_t *hits,
+            uint64_t *misses
+    );
+
+private:
+    typedef std::pair<dev_t, ino_t> TFTPCacheKey;
+
+    struct TFTPCacheEntry {
+        TFTPCacheKey key;
+        struct timespec modified;
+        off_t size;
+        TFTPCompressedData data;
+    };
+
+    typedef std::list<TFTPCacheEntry> TFTPCacheList;
+
+    static TFTPCompressedData compressFile(
+            const int fd,
+            const off_t size
+    );
+
+    void remove(
+            std::map<TFTPCacheKey, TFTPCacheList::iterator>::iterator it
+    );
+
+    void evict();
+
+    std::mutex mutex;
+    size_t capacity;
+    size_t used;
+    // Most recently used first.
+    TFTPCacheList entries;
+    std::map<TFTPCacheKey, TFTPCacheList::iterator> index;
+    std::atomic<uint64_t> hits;
+    std::atomic<uint64_t> misses;
+};
+
+#endif //TFTPCOMPRESSIONCACHE_H
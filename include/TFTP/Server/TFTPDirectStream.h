@@ -0,0 +1,188 @@
+#ifndef TFTPDIRECTSTREAM_H
+#define TFTPDIRECTSTREAM_H
+
+#include <atomic>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/types.h>
+#include <vector>
+
+/**
+ * @brief Size of the buffer a large file is moved in, one huge page.
+ */
+#define TFTP_DIRECT_BUFFER_SIZE (2 * 1024 * 1024)
+
+/**
+ * @brief Alignment O_DIRECT offsets and lengths are kept to.
+ */
+#define TFTP_DIRECT_ALIGNMENT 4096
+
+/**
+ * @brief Large-file statistics shared by the streams of one server.
+ */
+struct TFTPDirectStats {
+    std::atomic<uint64_t> files;
+    std::atomic<uint64_t> bytes;
+    std::atomic<uint64_t> buffered;
+};
+
+/**
+ * @brief Page-aligned buffer, mapped from huge pages when asked and the
+ * system has some reserved, else from normal pages the kernel is advised
+ * to back with transparent huge pages.
+ */
+class TFTPAlignedBuffer {
+public:
+    TFTPAlignedBuffer();
+    ~TFTPAlignedBuffer();
+
+    TFTPAlignedBuffer(const TFTPAlignedBuffer &) = delete;
+    TFTPAlignedBuffer &operator=(const TFTPAlignedBuffer &) = delete;
+
+    /**
+     * @brief Allocate the buffer. An existing buffer of the same size and
+     * kind is kept.
+     *
+     * @param[in] size the buffer size, a multiple of the page size.
+     * @param[in] hugePages whether to back the buffer with huge pages.
+     *
+     * @return true if success.
+     */
+    bool allocate(
+            const size_t size,
+            const bool hugePages
+    );
+
+    /**
+     * @brief Get the buffer.
+     *
+     * @return the buffer, or nullptr if not allocated.
+     */
+    char *getData();
+
+private:
+    void release();
+
+    char *data;
+    size_t size;
+    bool hugePages;
+};
+
+/**
+ * @brief Stream that moves a large file through an aligned buffer with
+ * O_DIRECT, bypassing the page cache and the stdio buffer of the source
+ * FILE.
+ *
+ * Reads are only wrapped when the file is at least the threshold, writes
+ * switch to O_DIRECT once that much was written. The file is read and
+ * written a whole buffer at a time, at aligned offsets, the unaligned tail
+ * of a written file is written without O_DIRECT when the stream is closed.
+ * Filesystems that refuse O_DIRECT get buffered I/O instead, with the
+ * moved pages dropped from the page cache behind the stream.
+ *
+ * The source is not closed by the stream, it is left positioned after the
+ * bytes moved. Streams are meant to be pooled, they keep their buffer
+ * across uses.
+ */
+class TFTPDirectStream {
+public:
+    TFTPDirectStream();
+    ~TFTPDirectStream() = default;
+
+    TFTPDirectStream(const TFTPDirectStream &) = delete;
+    TFTPDirectStream &operator=(const TFTPDirectStream &) = delete;
+
+    /**
+     * @brief Open the stream.
+     *
+     * @param[in] source the regular FILE to move, freshly opened.
+     * @param[in] write true to write the file, false to read it.
+     * @param[in] threshold the size above which O_DIRECT is used.
+     * @param[in] hugePages whether to back the buffer with huge pages.
+     * @param[in] stats the statistics to update.
+     *
+     * @return the stream to hand to the engine, or NULL if the file is
+     * left alone.
+     */
+    FILE *open(
+            FILE *source,
+            const bool write,
+            const uint64_t threshold,
+            const bool hugePages,
+            TFTPDirectStats *stats
+    );
+
+    /**
+     * @brief Get the source FILE.
+     *
+     * @return the source FILE.
+     */
+    FILE *getSource();
+
+private:
+    bool enableDirect();
+
+    void disableDirect();
+
+    void dropCache(
+            const off64_t end
+    );
+
+    bool fill(
+            const off64_t offset
+    );
+
+    bool flush(
+            const bool last
+    );
+
+    static ssize_t streamRead(
+            void *cookie,
+            char *buffer,
+            size_t size
+    );
+
+    static ssize_t streamWrite(
+            void *cookie,
+            const char *buffer,
+            size_t size
+    );
+
+    static int streamSeek(
+            void *cookie,
+            off64_t *offset,
+            int whence
+    );
+
+    static int streamClose(
+            void *cookie
+    );
+
+    FILE *source;
+    FILE *stream;
+    int descriptor;
+    int flags;
+    bool write;
+    uint64_t threshold;
+    TFTPDirectStats *stats;
+
+    TFTPAlignedBuffer buffer;
+    std::vector<char> streamBuffer;
+    bool direct;
+    bool large;
+    bool failed;
+
+    // Reads: the buffer holds bufferLength bytes of the file from
+    // bufferOffset. Writes: the buffer holds the bytes after bufferOffset,
+    // bufferLength of them.
+    off64_t bufferOffset;
+    size_t bufferLength;
+    off64_t position;
+    off64_t start;
+    off64_t fileSize;
+    // Pages before it were dropped from the page cache, or never in it.
+    off64_t cachedEnd;
+};
+
+#endif //TFTPDIRECTSTREAM_H
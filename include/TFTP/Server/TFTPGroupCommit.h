@@ -0,0 +1,77 @@
+#ifndef TFTPGROUPCOMMIT_H
+#define TFTPGROUPCOMMIT_H
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <stdint.h>
+#include <thread>
+#include <vector>
+
+/**
+ * @brief Batches the syncs of files written by concurrent sections.
+ *
+ * A section commits its file and waits. Every interval, the files
+ * committed meanwhile are made durable with one syncfs() per filesystem
+ * they are on, and their sections are released. syncfs() writes back all
+ * the dirty data of the filesystem, not only the committed files, so a
+ * batch costs as much as everything written there since the last sync,
+ * by any process. A file whose filesystem can't be told is synced with
+ * fdatasync() instead. The syncing thread is started by the first commit.
+ */
+class TFTPGroupCommit {
+public:
+    TFTPGroupCommit();
+    ~TFTPGroupCommit();
+
+    TFTPGroupCommit(const TFTPGroupCommit &) = delete;
+    TFTPGroupCommit &operator=(const TFTPGroupCommit &) = delete;
+
+    /**
+     * @brief Set how long a batch collects files before it is synced.
+     *
+     * @param[in] interval the interval in milliseconds.
+     */
+    void setInterval(
+            const int interval
+    );
+
+    /**
+     * @brief Make a file durable, waiting for the batch it joins.
+     *
+     * @param[in] fd the file descriptor, written data must already be
+     * flushed to it.
+     *
+     * @return true if the file was synced.
+     */
+    bool commit(
+            const int fd
+    );
+
+    /**
+     * @brief Get the number of sync calls made.
+     *
+     * @return the number of sync calls.
+     */
+    uint64_t getSyncs();
+
+private:
+    struct TFTPCommitRequest {
+        int fd;
+        bool done;
+        bool synced;
+    };
+
+    void run();
+
+    std::mutex mutex;
+    std::condition_variable requested;
+    std::condition_variable committed;
+    std::thread worker;
+    bool stopping;
+    int interval;
+    std::vector<TFTPCommitRequest *> pending;
+    std::atomic<uint64_t> syncs;
+};
+
+#endif //TFTPGROUPCOMMIT_H
@@ -0,0 +1,157 @@
+#ifndef TFTPMETADATAINDEX_H
+#define TFTPMETADATAINDEX_H
+
+#include "TFTPDelta.h"
+
+#include <atomic>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <stdint.h>
+#include <string>
+#include <sys/stat.h>
+#include <thread>
+#include <utility>
+#include <vector>
+
+/**
+ * @brief Metadata of a served file, see ITFTPServer::getFileMetadata().
+ * The block hashes are the ones sent for delta transfers, their checksum
+ * is the CRC-32 of the whole file.
+ */
+struct TFTPFileMetadata {
+    uint64_t device;
+    uint64_t inode;
+    uint64_t size;
+    struct timespec modified;
+    TFTPBlockHashes hashes;
+    // The hashes serialized, ready to be served.
+    std::shared_ptr<const std::vector<char>> encodedHashes;
+};
+
+typedef std::shared_ptr<const TFTPFileMetadata> TFTPFileMetadataPtr;
+
+/**
+ * @brief Index of the metadata of the files of a directory.
+ *
+ * The index is built by a pool of threads, each file read once, and kept
+ * current by an inotify watch: files are indexed again when closed after
+ * a write or moved in, dropped when deleted or moved out. A file renamed
+ * within the directory keeps its entry. Only regular files directly in
+ * the directory are indexed, not hidden ones.
+ *
+ * Entries are found by the device and inode of a file and checked
+ * against its size and modification time, so a change the watch hasn't
+ * caught up with yet is a miss, never stale data.
+ */
+class TFTPMetadataIndex {
+public:
+    TFTPMetadataIndex();
+    ~TFTPMetadataIndex();
+
+    TFTPMetadataIndex(const TFTPMetadataIndex &) = delete;
+    TFTPMetadataIndex &operator=(const TFTPMetadataIndex &) = delete;
+
+    /**
+     * @brief Index a directory and start watching it, replacing the
+     * directory indexed before. Returns once the directory is indexed.
+     *
+     * @param[in] directory the directory.
+     * @param[in] threads the number of threads to build the index with.
+     *
+     * @return true if success.
+     */
+    bool start(
+            const std::string &directory,
+            const int threads
+    );
+
+    /**
+     * @brief Stop watching and drop the index.
+     */
+    void stop();
+
+    /**
+     * @brief Find the metadata of an open file.
+     *
+     * @param[in] descriptor the file descriptor.
+     *
+     * @return the metadata, or nullptr if the file isn't indexed as it is.
+     */
+    TFTPFileMetadataPtr find(
+            const int descriptor
+    );
+
+    /**
+     * @brief Find the metadata of a file by its path.
+     *
+     * @param[in] path the path.
+     *
+     * @return the metadata, or nullptr if the file isn't indexed as it is.
+     */
+    TFTPFileMetadataPtr find(
+            const std::string &path
+    );
+
+    /**
+     * @brief Get index counters.
+     *
+     * @param[out] files the number of files indexed.
+     * @param[out] hits the number of lookups that found the file.
+     * @param[out] misses the number of lookups that didn't.
+     */
+    void getStats(
+            uint64_t *files,
+            uint64_t *hits,
+            uint64_t *misses
+    );
+
+private:
+    typedef std::pair<uint64_t, uint64_t> TFTPFileKey;
+
+    TFTPFileMetadataPtr find(
+            const struct stat &info
+    );
+
+    static bool indexable(
+            const char *name
+    );
+
+    static TFTPFileMetadataPtr compute(
+            const std::string &path
+    );
+
+    void insert(
+            const std::string &name,
+            TFTPFileMetadataPtr metadata
+    );
+
+    TFTPFileMetadataPtr remove(
+            const std::string &name
+    );
+
+    void update(
+            const std::string &name
+    );
+
+    void build(
+            const int threads
+    );
+
+    void watch();
+
+    std::string directory;
+    int inotifyDescriptor;
+    int stopDescriptor;
+    std::thread watcher;
+    std::atomic<bool> running;
+
+    std::mutex mutex;
+    std::map<std::string, TFTPFileMetadataPtr> names;
+    std::map<TFTPFileKey, TFTPFileMetadataPtr> files;
+
+    std::atomic<uint64_t> hits;
+    std::atomic<uint64_t> misses;
+};
+
+#endif //TFTPMETADATAINDEX_H
@@ -0,0 +1,171 @@
+#ifndef TFTPREADAHEADSTREAM_H
+#define TFTPREADAHEADSTREAM_H
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/types.h>
+#include <thread>
+#include <vector>
+
+class TFTPPrefetcher;
+
+/**
+ * @brief Read-ahead statistics shared by the streams of one server.
+ */
+struct TFTPReadAheadStats {
+    std::atomic<uint64_t> hits;
+    std::atomic<uint64_t> misses;
+};
+
+/**
+ * @brief Read stream that has a TFTPPrefetcher read the next blocks of a
+ * source FILE in the background, so the engine's lockstep reads are served
+ * from memory instead of waiting on the disk.
+ *
+ * A read that finds its data already prefetched counts as a hit, a read
+ * that has to wait for the prefetcher counts as a miss. Seeking drops the
+ * prefetched blocks and restarts prefetching at the new position. A read
+ * error of the source fails the read that reaches it, instead of ending
+ * the stream early. The source is not closed by the stream.
+ *
+ * Streams are meant to be pooled: after the stream returned by open() is
+ * closed, the object can be opened again on another source, reusing its
+ * block buffers.
+ */
+class TFTPReadAheadStream {
+public:
+    friend TFTPPrefetcher;
+
+    TFTPReadAheadStream();
+    ~TFTPReadAheadStream() = default;
+
+    /**
+     * @brief Open the read stream and start prefetching.
+     *
+     * @param[in] source the FILE to read from.
+     * @param[in] blockSize the size of each prefetched block.
+     * @param[in] depth the number of blocks to prefetch.
+     * @param[in] stats the statistics to update.
+     * @param[in] prefetcher the prefetcher that reads the blocks.
+     *
+     * @return the stream to hand to the engine, or NULL on error.
+     */
+    FILE *open(
+            FILE *source,
+            const size_t blockSize,
+            const int depth,
+            TFTPReadAheadStats *stats,
+            TFTPPrefetcher *prefetcher
+    );
+
+    /**
+     * @brief Get the source FILE the stream reads from.
+     *
+     * @return the source FILE.
+     */
+    FILE *getSource();
+
+private:
+    void fill();
+
+    void resetRing();
+
+    static ssize_t streamRead(
+            void *cookie,
+            char *buffer,
+            size_t size
+    );
+
+    static int streamSeek(
+            void *cookie,
+            off64_t *offset,
+            int whence
+    );
+
+    static int streamClose(
+            void *cookie
+    );
+
+    FILE *source;
+    FILE *stream;
+    size_t blockSize;
+    int depth;
+    TFTPReadAheadStats *stats;
+    TFTPPrefetcher *prefetcher;
+
+    std::mutex mutex;
+    std::condition_variable changed;
+    bool endOfFile;
+    // Set when the source failed, endOfFile is set too.
+    bool failed;
+    bool detached;
+
+    // Ring of depth blocks. blockLength holds how many bytes of each block
+    // are valid, readOffset how many of the head block were consumed.
+    std::vector<char> blocks;
+    std::vector<size_t> blockLength;
+    std::vector<char> streamBuffer;
+    size_t head;
+    size_t count;
+    size_t readOffset;
+    off64_t position;
+
+    // Owned by the prefetcher, guarded by its mutex. A stream scheduled
+    // while a worker fills it is only marked for refill and queued again
+    // once that fill is done, so one worker at a time fills a ring.
+    TFTPReadAheadStream *prefetchNext;
+    bool queued;
+    bool filling;
+    bool refill;
+};
+
+/**
+ * @brief Background readers shared by every read-ahead stream of a server.
+ * Streams queue themselves when their ring has room, and a worker fills
+ * the ring. The workers are started on first use.
+ */
+class TFTPPrefetcher {
+public:
+    TFTPPrefetcher();
+    ~TFTPPrefetcher();
+
+    /**
+     * @brief Queue a stream to have its ring filled. A stream being filled
+     * is queued again once its fill is done.
+     *
+     * @param[in] stream the stream to fill.
+     */
+    void schedule(
+            TFTPReadAheadStream *stream
+    );
+
+    /**
+     * @brief Remove a stream from the queue and wait until no worker is
+     * filling it.
+     *
+     * @param[in] stream the stream to detach.
+     */
+    void detach(
+            TFTPReadAheadStream *stream
+    );
+
+private:
+    void run();
+
+    void enqueue(
+            TFTPReadAheadStream *stream
+    );
+
+    std::mutex mutex;
+    std::condition_variable changed;
+    std::vector<std::thread> workers;
+    bool stopping;
+
+    TFTPReadAheadStream *queueHead;
+    TFTPReadAheadStream *queueTail;
+};
+
+#endif //TFTPREADAHEADSTREAM_H
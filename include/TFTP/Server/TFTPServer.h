@@ -6,6 +6,28 @@
 #define TFTPSERVER_H
 
 #include "ITFTPServer.h"
+#include "TFTPCompressionCache.h"
+#include "TFTPCompressionStream.h"
+#include "TFTPCpuSet.h"
+#include "TFTPDelta.h"
+#include "TFTPDirectStream.h"
+#include "TFTPGroupCommit.h"
+#include "TFTPLatencyHistogram.h"
+#include "TFTPLocalTransport.h"
+#include "TFTPMemoryStream.h"
+#include "TFTPMetadataIndex.h"
+#include "TFTPObjectPool.h"
+#include "TFTPRangeStream.h"
+#include "TFTPReadAheadStream.h"
+#include "TFTPTimedStream.h"
+
+#include <arpa/inet.h>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <vector>
 
 /**
  * @brief TFTP server implementation.
@@ -19,10 +41,155 @@ public:
             const int port
     ) override;
 
+    TftpServerOperationResult addPort(
+            const int port
+    ) override;
+
+    TftpServerOperationResult setCpuAffinity(
+            const int port,
+            const std::vector<int> &cpus
+    ) override;
+
     TftpServerOperationResult setTimeout(
             const int timeout
     ) override;
 
+    TftpServerOperationResult setDrainTimeout(
+            const int timeout
+    ) override;
+
+    TftpServerOperationResult setReadAheadDepth(
+            const int depth
+    ) override;
+
+    TftpServerOperationResult getReadAheadStats(
+            uint64_t *hits,
+            uint64_t *misses
+    ) override;
+
+    TftpServerOperationResult getLatencyHistogram(
+            const TftpLatencyMetric metric,
+            TFTPLatencyHistogram &histogram
+    ) override;
+
+    TftpServerOperationResult getLatencySummary(
+            const TftpLatencyMetric metric,
+            TFTPLatencySummary *summary
+    ) override;
+
+    TftpServerOperationResult resetLatencyStats() override;
+
+    TftpServerOperationResult setDuplicateRequestWindow(
+            const int window
+    ) override;
+
+    TftpServerOperationResult getSuppressedDuplicates(
+            uint64_t *count
+    ) override;
+
+    TftpServerOperationResult setCompression(
+            const bool enabled
+    ) override;
+
+    TftpServerOperationResult setCompressionCacheSize(
+            const size_t size
+    ) override;
+
+    TftpServerOperationResult setDeltaTransfer(
+            const bool enabled
+    ) override;
+
+    TftpServerOperationResult setStripedTransfer(
+            const bool enabled
+    ) override;
+
+    TftpServerOperationResult setStripedFileLimit(
+            const uint64_t limit
+    ) override;
+
+    TftpServerOperationResult setDurabilityMode(
+            const TftpDurabilityMode mode
+    ) override;
+
+    TftpServerOperationResult setGroupCommitInterval(
+            const int interval
+    ) override;
+
+    TftpServerOperationResult getDurabilityStats(
+            uint64_t *files,
+            uint64_t *syncs,
+            uint64_t *failed
+    ) override;
+
+    TftpServerOperationResult setLargeFileMode(
+            const uint64_t threshold,
+            const bool hugePages
+    ) override;
+
+    TftpServerOperationResult getLargeFileStats(
+            uint64_t *files,
+            uint64_t *bytes,
+            uint64_t *buffered
+    ) override;
+
+    TftpServerOperationResult setMetadataIndex(
+            const std::string &directory,
+            const int threads
+    ) override;
+
+    TftpServerOperationResult getFileMetadata(
+            const std::string &filename,
+            TFTPFileMetadata &metadata
+    ) override;
+
+    TftpServerOperationResult getMetadataIndexStats(
+            uint64_t *files,
+            uint64_t *hits,
+            uint64_t *misses
+    ) override;
+
+    TftpServerOperationResult listSections(
+            std::vector<TFTPSectionInfo> &sections
+    ) override;
+
+    TftpServerOperationResult setAdmissionLimits(
+            const int maxSections,
+            const uint64_t maxBytes,
+            const int queueLength,
+            const int queueTimeout
+    ) override;
+
+    TftpServerOperationResult setAdmissionRejectMessage(
+            const std::string &message
+    ) override;
+
+    TftpServerOperationResult getAdmissionStats(
+            uint64_t *queued,
+            uint64_t *rejected
+    ) override;
+
+    TftpServerOperationResult getCompressionStats(
+            uint64_t *plainBytes,
+            uint64_t *compressedBytes,
+            uint64_t *cacheHits
+    ) override;
+
+    TftpServerOperationResult registerVirtualFile(
+            const char *filename,
+            const void *data,
+            const size_t size
+    ) override;
+
+    TftpServerOperationResult updateVirtualFile(
+            const char *filename,
+            const void *data,
+            const size_t size
+    ) override;
+
+    TftpServerOperationResult unregisterVirtualFile(
+            const char *filename
+    ) override;
+
     TftpServerOperationResult registerOpenFileCallback(
             openFileCallback callback,
             void *context
@@ -49,6 +216,420 @@ public:
 
 private:
 
+    struct TFTPEndpoint {
+        TFTPServer *server;
+        TftpdHandlerPtr handler;
+        int port;
+        TFTPCpuSet cpus;
+    };
+
+    typedef std::shared_ptr<const std::vector<char>> TFTPVirtualFileData;
+
+    struct TFTPVirtualFile {
+        std::string name;
+        TFTPVirtualFileData data;
+    };
+
+    // Sorted by name. Never modified once published, writers publish a
+    // new copy.
+    typedef std::vector<TFTPVirtualFile> TFTPVirtualFileTable;
+
+    // User callbacks. Never modified once published, registering a
+    // callback publishes a new copy.
+    struct TFTPCallbacks {
+        openFileCallback openFile;
+        void *openFileCtx;
+        closeFileCallback closeFile;
+        void *closeFileCtx;
+        sectionStartedCallback sectionStarted;
+        void *sectionStartedCtx;
+        sectionFinishedCallback sectionFinished;
+        void *sectionFinishedCtx;
+    };
+
+    // What listSections() reports of a section, published once its file is
+    // open. Only the byte count changes after that. Held by the section and
+    // by listings reading it, recycled through recordPool once both let go,
+    // so a listing reads it without the sections lock.
+    struct TFTPSectionRecord {
+        std::atomic<int> references;
+        TftpSectionId id;
+        char clientIp[INET6_ADDRSTRLEN];
+        int port;
+        bool upload;
+        bool ranged;
+        std::string filename;
+        std::chrono::steady_clock::time_point startTime;
+        std::atomic<uint64_t> bytes;
+    };
+
+    // Per-section control block, recycled through sectionPool.
+    struct TFTPSectionState {
+        TftpdSectionHandlerPtr handler;
+        // Callbacks current when the section started, used until it ends.
+        const TFTPCallbacks *callbacks;
+        TFTPReadAheadStream *readAhead;
+        FILE *readAheadStream;
+        TFTPDirectStream *directStream;
+        FILE *directFileStream;
+        TFTPVirtualFileData virtualFile;
+        TFTPMemoryStream *virtualStream;
+        FILE *virtualFileStream;
+        TFTPTimedStream *timedStream;
+        FILE *timedFileStream;
+        TFTPCompressionStream *compressionStream;
+        FILE *compressedFileStream;
+        FILE *memorySource;
+        TFTPDeltaStream *deltaStream;
+        FILE *deltaFileStream;
+        TFTPRangeStream *rangeStream;
+        FILE *rangeFileStream;
+        // Set while an uploaded file is open, when durability is on.
+        bool writeFile;
+        // Atomic rename: the file being written and the one it replaces
+        // once the section succeeded.
+        std::string tempPath;
+        std::string targetPath;
+        std::chrono::steady_clock::duration syncTime;
+        // Delta rebuilt into an unnamed file when the open file callback
+        // owns the files: the file it is copied into once it checks out.
+        std::string deltaPath;
+        std::string deltaMode;
+        // CPUs of the engine's thread before it was pinned for the section.
+        TFTPCpuSet threadCpus;
+
+        // Set under sectionsMutex once the file is open.
+        TFTPSectionRecord *record;
+        // File size of reads, 0 when unknown.
+        uint64_t size;
+        std::chrono::steady_clock::time_point startTime;
+        bool admitted;
+
+        // Request key for duplicate detection, valid once requestKnown.
+        uint64_t serial;
+        bool deferStart;
+        bool startNotified;
+        bool requestKnown;
+        char opcode;
+        char clientIp[INET6_ADDRSTRLEN];
+        std::string filename;
+        std::chrono::steady_clock::time_point requestTime;
+
+        TFTPSectionState *previous;
+        TFTPSectionState *next;
+    };
+
+    TFTPEndpoint *createEndpoint();
+
+    static void destroyEndpoint(TFTPEndpoint *endpoint);
+
+    void stopEndpoints();
+
+    static void wakeListener(const int port);
+
+    bool isSectionActive(
+            const uint64_t serial
+    );
+
+    bool admissionLimited();
+
+    bool admissionOverloaded(
+            const uint64_t size
+    );
+
+    uint64_t requestSize(
+            const TftpdSectionHandlerPtr sectionHandler,
+            const char *filename,
+            const char *mode
+    );
+
+    bool admitSection(
+            const TftpdSectionHandlerPtr sectionHandler,
+            const char *filename,
+            const char *mode
+    );
+
+    bool suppressDuplicate(
+            const TftpdSectionHandlerPtr sectionHandler,
+            const char *filename,
+            const char *mode
+    );
+
+    void notifyDeferredStart(
+            const TftpdSectionHandlerPtr sectionHandler,
+            const int port
+    );
+
+    TFTPSectionState *findSection(
+            const TftpdSectionHandlerPtr sectionHandler
+    );
+
+    TFTPSectionState *sectionState(
+            const TftpdSectionHandlerPtr sectionHandler
+    );
+
+    void releaseRecord(
+            TFTPSectionRecord *record
+    );
+
+    const TFTPCallbacks *sectionCallbacks(
+            const TftpdSectionHandlerPtr sectionHandler
+    );
+
+    void publishCallbacks(
+            TFTPCallbacks *next
+    );
+
+    void reclaimCallbacks();
+
+    void wrapReadStream(
+            const TftpdSectionHandlerPtr sectionHandler,
+            FILE **fd
+    );
+
+    bool wrapDirectStream(
+            const TftpdSectionHandlerPtr sectionHandler,
+            FILE **fd,
+            const bool write
+    );
+
+    FILE *unwrapDirectStream(
+            const TftpdSectionHandlerPtr sectionHandler,
+            FILE *fd,
+            bool *flushed
+    );
+
+    void wrapTimedStream(
+            const TftpdSectionHandlerPtr sectionHandler,
+            const int port,
+            FILE **fd,
+            const char *filename,
+            const bool write,
+            const uint64_t size
+    );
+
+    FILE *unwrapTimedStream(
+            const TftpdSectionHandlerPtr sectionHandler,
+            FILE *fd
+    );
+
+    void recordLatency(
+            const TftpLatencyMetric metric,
+            const std::chrono::steady_clock::time_point start
+    );
+
+    FILE *unwrapStream(
+            const TftpdSectionHandlerPtr sectionHandler,
+            FILE *fd
+    );
+
+    enum class TftpDeltaRequest {
+        TFTP_DELTA_NONE = 0,
+        TFTP_DELTA_HASHES,
+        TFTP_DELTA_CHECKSUM,
+        TFTP_DELTA_WRITE
+    };
+
+    static bool stripSuffix(
+            char *filename,
+            const char *suffix
+    );
+
+    bool stripCompressionSuffix(
+            char *filename
+    );
+
+    TftpDeltaRequest stripDeltaSuffix(
+            char *filename
+    );
+
+    bool stripRangeSuffix(
+            char *filename,
+            TFTPRange &range
+    );
+
+    bool stripSizeSuffix(
+            char *filename
+    );
+
+    bool openHashesFile(
+            const TftpdSectionHandlerPtr sectionHandler,
+            const int port,
+            FILE **fd,
+            char *filename,
+            char *mode,
+            size_t *bufferSize,
+            const bool checksumOnly
+    );
+
+    bool openSizeFile(
+            const TftpdSectionHandlerPtr sectionHandler,
+            const int port,
+            FILE **fd,
+            char *filename,
+            char *mode,
+            size_t *bufferSize
+    );
+
+    bool openAnswerFile(
+            const TftpdSectionHandlerPtr sectionHandler,
+            const int port,
+            FILE **fd,
+            FILE *file,
+            const TFTPVirtualFileData &answer,
+            size_t *bufferSize
+    );
+
+    bool openDeltaFile(
+            const TftpdSectionHandlerPtr sectionHandler,
+            const int port,
+            FILE **fd,
+            char *filename,
+            char *mode,
+            size_t *bufferSize
+    );
+
+    FILE *unwrapDeltaStream(
+            const TftpdSectionHandlerPtr sectionHandler,
+            const int port,
+            FILE *fd,
+            bool *rebuilt
+    );
+
+    bool copyFile(
+            FILE *source,
+            FILE *target
+    );
+
+    bool openRangeFile(
+            const TftpdSectionHandlerPtr sectionHandler,
+            const int port,
+            FILE **fd,
+            char *filename,
+            char *mode,
+            size_t *bufferSize,
+            const TFTPRange &range
+    );
+
+    FILE *unwrapRangeStream(
+            const TftpdSectionHandlerPtr sectionHandler,
+            FILE *fd,
+            bool *complete
+    );
+
+    TftpdOperationResult openUserFile(
+            const TftpdSectionHandlerPtr sectionHandler,
+            const int port,
+            FILE **fd,
+            char *filename,
+            char *mode,
+            size_t *bufferSize
+    );
+
+    TftpdOperationResult closeUserFile(
+            const TftpdSectionHandlerPtr sectionHandler,
+            const int port,
+            FILE *fd
+    );
+
+    FILE *openTempFile(
+            const TftpdSectionHandlerPtr sectionHandler,
+            const char *filename,
+            const char *mode
+    );
+
+    void markWriteFile(
+            const TftpdSectionHandlerPtr sectionHandler
+    );
+
+    bool takeWriteFile(
+            const TftpdSectionHandlerPtr sectionHandler
+    );
+
+    bool syncFile(
+            const TftpdSectionHandlerPtr sectionHandler,
+            FILE *fd
+    );
+
+    bool finishTempFile(
+            std::string &tempPath,
+            std::string &targetPath,
+            const std::chrono::steady_clock::duration syncTime,
+            const bool succeeded
+    );
+
+    void wrapCompressionStream(
+            const TftpdSectionHandlerPtr sectionHandler,
+            FILE **fd,
+            const bool write
+    );
+
+    FILE *unwrapCompressionStream(
+            const TftpdSectionHandlerPtr sectionHandler,
+            FILE *fd
+    );
+
+    bool openCompressedFile(
+            const TftpdSectionHandlerPtr sectionHandler,
+            FILE **fd,
+            size_t *bufferSize
+    );
+
+    FILE *closeMemorySource(
+            const TftpdSectionHandlerPtr sectionHandler,
+            FILE *fd
+    );
+
+    TftpServerOperationResult setVirtualFile(
+            const char *filename,
+            const void *data,
+            const size_t size,
+            const bool create
+    );
+
+    bool openVirtualFile(
+            const TftpdSectionHandlerPtr sectionHandler,
+            FILE **fd,
+            const char *filename,
+            size_t *bufferSize
+    );
+
+    bool openMemoryFile(
+            const TftpdSectionHandlerPtr sectionHandler,
+            FILE **fd,
+            const TFTPVirtualFileData &data,
+            size_t *bufferSize
+    );
+
+    bool closeVirtualFile(
+            const TftpdSectionHandlerPtr sectionHandler,
+            FILE *fd
+    );
+
+    void waitSectionsDrained(
+            const int timeout
+    );
+
+    static bool startLocalSectionCbk(
+            TFTPLocalSection *section,
+            void *context
+    );
+
+    void serveLocalSection(
+            TFTPEndpoint *endpoint,
+            TFTPLocalSection *section
+    );
+
+    static bool sendLocal(
+            TFTPLocalSection *section,
+            FILE *fd
+    );
+
+    static bool receiveLocal(
+            TFTPLocalSection *section,
+            FILE *fd
+    );
+
     static TftpdOperationResult sectionStartedCbk (
             const TftpdSectionHandlerPtr sectionHandler,
             void *context
@@ -75,18 +656,79 @@ private:
     );
 
     TftpdHandlerPtr serverHandler;
+    std::vector<TFTPEndpoint *> endpoints;
+
+    int serverTimeout;
+    int drainTimeout;
+    std::atomic<bool> listening;
+
+    std::atomic<int> readAheadDepth;
+    TFTPReadAheadStats readAheadStats;
+    std::atomic<int> duplicateWindow;
+    std::atomic<uint64_t> suppressedDuplicates;
+
+    // Limits are read without the lock, the counts kept under it.
+    std::atomic<int> maxAdmittedSections;
+    std::atomic<uint64_t> maxAdmittedBytes;
+    std::atomic<int> admissionQueueLength;
+    std::atomic<int> admissionQueueTimeout;
+    std::string admissionRejectMessage;
+    int admittedSections;
+    int queuedSections;
+    std::atomic<uint64_t> queuedRequests;
+    std::atomic<uint64_t> rejectedRequests;
+    TFTPObjectPool<TFTPReadAheadStream> readAheadPool;
+    TFTPPrefetcher prefetcher;
 
-    void *openFileCtx;
-    openFileCallback _openFileCallback;
+    std::atomic<uint64_t> largeFileThreshold;
+    std::atomic<bool> largeFileHugePages;
+    TFTPDirectStats directStats;
+    TFTPObjectPool<TFTPDirectStream> directStreamPool;
 
-    void *closeFileCtx;
-    closeFileCallback _closeFileCallback;
+    std::mutex virtualFilesMutex;
+    std::shared_ptr<const TFTPVirtualFileTable> virtualFiles;
+    TFTPObjectPool<TFTPMemoryStream> memoryStreamPool;
 
-    void *sectionStartedCtx;
-    sectionStartedCallback _sectionStartedCallback;
+    TFTPLatencyHistogram latency[(int) TftpLatencyMetric::TFTP_LATENCY_METRIC_COUNT];
+    TFTPObjectPool<TFTPTimedStream> timedStreamPool;
 
-    void *sectionFinishedCtx;
-    sectionFinishedCallback _sectionFinishedCallback;
+    std::atomic<bool> compressionEnabled;
+    TFTPCompressionStats compressionStats;
+    TFTPCompressionCache compressionCache;
+    // Empty file answering clients probing for a suffix.
+    TFTPVirtualFileData probeFile;
+    TFTPObjectPool<TFTPCompressionStream> compressionStreamPool;
+
+    std::atomic<bool> deltaEnabled;
+    TFTPObjectPool<TFTPDeltaStream> deltaStreamPool;
+    TFTPMetadataIndex metadataIndex;
+
+    std::atomic<bool> stripedEnabled;
+    std::atomic<uint64_t> stripedFileLimit;
+    TFTPObjectPool<TFTPRangeStream> rangeStreamPool;
+
+    std::atomic<TftpDurabilityMode> durabilityMode;
+    TFTPGroupCommit groupCommit;
+    std::atomic<uint64_t> durableFiles;
+    std::atomic<uint64_t> fileSyncs;
+    std::atomic<uint64_t> failedCommits;
+
+    TFTPObjectPool<TFTPSectionState> sectionPool;
+    TFTPObjectPool<TFTPSectionRecord> recordPool;
+    std::mutex sectionsMutex;
+    std::condition_variable sectionsDrained;
+    TFTPSectionState *activeSectionList;
+    // Section served by the calling thread, set when it starts.
+    static thread_local TFTPSectionState *threadSection;
+    int activeSections;
+    // Local transport sections, counted from before their thread starts.
+    int localSections;
+    uint64_t nextSectionSerial;
+
+    // Written under sectionsMutex, read without it. Replaced snapshots
+    // are retired until no active section uses them.
+    std::atomic<const TFTPCallbacks *> callbacks;
+    std::vector<const TFTPCallbacks *> retiredCallbacks;
 };
 
 /**
@@ -105,6 +747,10 @@ public:
             std::string &ip
     ) override;
 
+    TftpServerOperationResult getServerPort(
+            int *port
+    ) override;
+
     TftpServerOperationResult getSectionStatus(
             TftpServerSectionStatus *status
     ) override;
@@ -114,8 +760,11 @@ public:
     ) override;
 
 private:
-    TFTPSection(const TftpdSectionHandlerPtr sectionHandler);
+    TFTPSection(const TftpdSectionHandlerPtr sectionHandler,
+                const int serverPort);
     TftpdSectionHandlerPtr sectionHandler;
+    int serverPort;
+    bool commitFailed;
 };
 
 #endif //TFTPSERVER_H
@@ -0,0 +1,134 @@
+#ifndef TFTPTRACE_H
+#define TFTPTRACE_H
+
+#include <stdint.h>
+#include <string>
+
+/**
+ * @brief Enum with possible return from trace functions.
+ * Possible return values are:
+ * - TFTP_TRACE_OK:                     Operation was successful.
+ * - TFTP_TRACE_ERROR:                  Generic error.
+ */
+enum class TftpTraceOperationResult {
+    TFTP_TRACE_OK = 0,
+    TFTP_TRACE_ERROR
+};
+
+/**
+ * @brief Trace event phases, using the Chrome trace event letters.
+ */
+enum class TftpTracePhase : char {
+    TFTP_TRACE_PHASE_BEGIN = 'B',
+    TFTP_TRACE_PHASE_END = 'E',
+    TFTP_TRACE_PHASE_INSTANT = 'i'
+};
+
+/**
+ * @brief Per-thread event tracing for the client and server wrappers.
+ *
+ * Events are recorded into a fixed-size ring buffer owned by the calling
+ * thread, so recording never takes a lock. When a ring is full the oldest
+ * events are overwritten. Rings of finished threads are reused by new
+ * threads, keeping memory bounded when the engine spawns a thread per
+ * section.
+ *
+ * Trace points are compiled in only when the library is built with
+ * TFTP_TRACE defined (make trace). Otherwise the TFTP_TRACE_* macros expand
+ * to nothing. When compiled in, recording is still off until setEnabled()
+ * is called.
+ */
+class TFTPTrace {
+public:
+    /**
+     * @brief Enable or disable event recording at runtime.
+     *
+     * @param[in] enabled true to record events.
+     */
+    static void setEnabled(
+            const bool enabled
+    );
+
+    /**
+     * @brief Check if event recording is enabled.
+     *
+     * @return true if events are being recorded.
+     */
+    static bool isEnabled();
+
+    /**
+     * @brief Record an event in the calling thread's ring buffer.
+     *
+     * @param[in] category the event category. Must be a string literal.
+     * @param[in] name the event name. Must be a string literal.
+     * @param[in] phase the event phase.
+     * @param[in] value an event argument, such as a packet size.
+     */
+    static void record(
+            const char *category,
+            const char *name,
+            const TftpTracePhase phase,
+            const int64_t value
+    );
+
+    /**
+     * @brief Discard every recorded event. Safe while threads record, an
+     * event recorded meanwhile may be kept or discarded.
+     */
+    static void clear();
+
+    /**
+     * @brief Serialize recorded events in Chrome trace event JSON format,
+     * which can be loaded in chrome://tracing or Perfetto. Events recorded
+     * while dumping may be missing or partially written.
+     *
+     * @param[out] json the trace JSON.
+     *
+     * @return TFTP_TRACE_OK if success.
+     * @return TFTP_TRACE_ERROR otherwise.
+     */
+    static TftpTraceOperationResult dump(
+            std::string &json
+    );
+
+    /**
+     * @brief Write recorded events to a Chrome trace JSON file.
+     *
+     * @param[in] path the output file path.
+     *
+     * @return TFTP_TRACE_OK if success.
+     * @return TFTP_TRACE_ERROR otherwise.
+     */
+    static TftpTraceOperationResult dumpToFile(
+            const char *path
+    );
+};
+
+/**
+ * @brief Records a begin event on construction and the matching end event
+ * when it goes out of scope.
+ */
+class TFTPTraceScope {
+public:
+    TFTPTraceScope(const char *category, const char *name);
+    ~TFTPTraceScope();
+
+private:
+    const char *category;
+    const char *name;
+};
+
+#ifdef TFTP_TRACE
+#define TFTP_TRACE_CONCAT_(a, b) a##b
+#define TFTP_TRACE_CONCAT(a, b) TFTP_TRACE_CONCAT_(a, b)
+#define TFTP_TRACE_SCOPE(category, name) \
+    TFTPTraceScope TFTP_TRACE_CONCAT(tftpTraceScope, __LINE__)(category, name)
+#define TFTP_TRACE_INSTANT(category, name, value) \
+    TFTPTrace::record(category, name, \
+                      TftpTracePhase::TFTP_TRACE_PHASE_INSTANT, value)
+#else
+#define TFTP_TRACE_SCOPE(category, name) do {} while (0)
+#define TFTP_TRACE_INSTANT(category, name, value) do {} while (0)
+#endif
+
+#endif //TFTPTRACE_H
@@ -3,6 +3,34 @@
 //
 
 #include "TFTPClient.h"
+#include "TFTPMappedSink.h"
+#include "TFTPTrace.h"
+
+#include <algorithm>
+#include <deque>
+#include <new>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <system_error>
+#include <thread>
+#include <zlib.h>
+
+#define TFTP_MAX_STRIPES 64
+// Ranges start on block boundaries.
+#define TFTP_STRIPE_ALIGNMENT 512
+// An adaptive window moves ranges in about this many rounds at its
+// largest, ranges of at least TFTP_STRIPE_MIN_RANGE bytes.
+#define TFTP_STRIPE_ROUNDS 4
+#define TFTP_STRIPE_MIN_RANGE (64 * 1024)
+#define TFTP_STRIPE_RETRIES 3
+// Start of the message a busy server rejects a request with, and the pause
+// before the first retry, doubled for each one after. Busy rejections have
+// their own budget, about 2.5 s in all, a loaded server may take that long
+// to close the sections just moved.
+#define TFTP_BUSY_PREFIX "WAIT"
+#define TFTP_BUSY_PAUSE_MS 10
+#define TFTP_BUSY_RETRIES 8
 
 TFTPClient::TFTPClient() {
     if (create_tftp_handler(&clientHandler) != TFTP_OK) {
@@ -10,10 +38,38 @@ TFTPClient::TFTPClient() {
         throw "CLIENT HANDLER CREATION FAILED!";
     }
 
+    port = 0;
+    transport = TftpClientTransport::TFTP_CLIENT_TRANSPORT_UDP;
     tftpErrorCtx = nullptr;
     _tftpErrorCallback = nullptr;
     tftpFetchDataReceivedCtx = nullptr;
     _tftpFetchDataReceivedCallback = nullptr;
+    tftpProgressCtx = nullptr;
+    _tftpProgressCallback = nullptr;
+    progressBytes = TFTP_PROGRESS_DEFAULT_BYTES;
+    progressIntervalMs = 0;
+
+    compressionEnabled = false;
+    quietRequest = false;
+    serverBusy = false;
+    compressionSupport = TftpServerSupport::TFTP_SUPPORT_UNKNOWN;
+    compressionStats.plainBytes = 0;
+    compressionStats.compressedBytes = 0;
+
+    deltaEnabled = false;
+    deltaFileBytes = 0;
+    deltaSentBytes = 0;
+
+    stripeCount = 1;
+    stripeThreshold = 0;
+    stripingSupport = TftpServerSupport::TFTP_SUPPORT_UNKNOWN;
+    stripedFiles = 0;
+    stripedBytes = 0;
+    adaptiveStriping = false;
+    stripeWindow.reset(stripeCount, adaptiveStriping);
+    stripeLosses = 0;
+    stripeFailed = false;
+    stripeErrorCode = 0;
 
     register_tftp_error_callback(clientHandler, tftpErrorCbk, this);
     register_tftp_fetch_data_received_callback(clientHandler, tftpFetchDataReceivedCbk, this);
@@ -46,12 +102,28 @@ TftpClientOperationResult TFTPClient::setConnection(
     }
 
     result = config_tftp(clientHandler);
+    this->host = host != nullptr ? host : "";
+    this->port = port;
+    compressionSupport = TftpServerSupport::TFTP_SUPPORT_UNKNOWN;
+    stripingSupport = TftpServerSupport::TFTP_SUPPORT_UNKNOWN;
+    stripeWindow.reset(stripeCount, adaptiveStriping);
 
     return result == TFTP_OK ?
            TftpClientOperationResult::TFTP_CLIENT_OK :
            TftpClientOperationResult::TFTP_CLIENT_ERROR;
 }
 
+TftpClientOperationResult TFTPClient::setTransport(
+        const TftpClientTransport transport)
+{
+    if (transport != TftpClientTransport::TFTP_CLIENT_TRANSPORT_UDP &&
+        transport != TftpClientTransport::TFTP_CLIENT_TRANSPORT_LOCAL) {
+        return TftpClientOperationResult::TFTP_CLIENT_ERROR;
+    }
+    this->transport = transport;
+    return TftpClientOperationResult::TFTP_CLIENT_OK;
+}
+
 TftpClientOperationResult TFTPClient::registerTftpErrorCallback(
         tftpErrorCallback callback,
         void *context)
@@ -70,6 +142,27 @@ TftpClientOperationResult TFTPClient::registerTftpFetchDataReceivedCallback(
     return TftpClientOperationResult::TFTP_CLIENT_OK;
 }
 
+TftpClientOperationResult TFTPClient::registerTftpProgressCallback(
+        tftpProgressCallback callback,
+        void *context)
+{
+    _tftpProgressCallback = callback;
+    tftpProgressCtx = context;
+    return TftpClientOperationResult::TFTP_CLIENT_OK;
+}
+
+TftpClientOperationResult TFTPClient::setProgressThreshold(
+        const uint64_t thresholdBytes,
+        const int intervalMs)
+{
+    if (intervalMs < 0) {
+        return TftpClientOperationResult::TFTP_CLIENT_ERROR;
+    }
+    progressBytes = thresholdBytes;
+    progressIntervalMs = intervalMs;
+    return TftpClientOperationResult::TFTP_CLIENT_OK;
+}
+
 TftpClientOperationResult TFTPClient::sendFile(
         const char *filename,
         FILE *fp
@@ -77,7 +170,37 @@ TftpClientOperationResult TFTPClient::sendFile(
     if (clientHandler == nullptr) {
         return TftpClientOperationResult::TFTP_CLIENT_ERROR;
     }
-    return send_file(clientHandler, filename, fp) == TFTP_OK ?
+    TFTP_TRACE_SCOPE("client", "sendFile");
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    std::string name(filename != nullptr ? filename : "");
+    TftpOperationResult result;
+    // What is left of a regular file, other streams have no known size.
+    int64_t total = -1;
+    struct stat info;
+    int fd = fp != NULL ? fileno(fp) : -1;
+    off_t position = fd >= 0 ? ftello(fp) : -1;
+    if (position >= 0 && fstat(fd, &info) == 0 && S_ISREG(info.st_mode) &&
+        info.st_size >= position) {
+        total = info.st_size - position;
+    }
+    if (deltaEnabled && total >= 0) {
+        result = sendFileWithDelta(name, fp, position, total, start);
+    } else if (deltaEnabled && fp != NULL) {
+        // No file to read where needed, the stream is read whole.
+        std::vector<char> content;
+        result = TFTPDelta::readAll(fp, content) ?
+                 sendWithDelta(name, content.data(), content.size(), start) : TFTP_ERROR;
+    } else if (total > 0 && (uint64_t) total >= stripeThreshold && useStriping()) {
+        // Ranges are read where they are, the FILE is left past them.
+        result = transferStriped(name, fd, nullptr, position, total, false, nullptr);
+        if (result == TFTP_OK) {
+            fseeko(fp, position + total, SEEK_SET);
+        }
+    } else {
+        result = sendWithProgress(name, fp, total, start);
+    }
+    recordLatency(TftpLatencyMetric::TFTP_LATENCY_SECTION_DURATION, start);
+    return result == TFTP_OK ?
            TftpClientOperationResult::TFTP_CLIENT_OK :
            TftpClientOperationResult::TFTP_CLIENT_ERROR;
 }
@@ -89,18 +212,876 @@ TftpClientOperationResult TFTPClient::fetchFile(
     if (clientHandler == nullptr) {
         return TftpClientOperationResult::TFTP_CLIENT_ERROR;
     }
-    return fetch_file(clientHandler, filename, fp) == TFTP_OK ?
+    TFTP_TRACE_SCOPE("client", "fetchFile");
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    std::string name(filename != nullptr ? filename : "");
+    TftpOperationResult result;
+    TFTPBlockHashes expected;
+    struct stat info;
+    int fd = fp != NULL ? fileno(fp) : -1;
+    off_t position = fd >= 0 && fflush(fp) == 0 ? ftello(fp) : -1;
+    if (position >= 0 && fstat(fd, &info) == 0 && S_ISREG(info.st_mode) && useStriping() &&
+        fetchStripedChecksum(name, expected)) {
+        // Ranges are written where they go, the FILE is left past them.
+        result = transferStriped(name, fd, nullptr, position, expected.size, true, &expected);
+        if (result == TFTP_OK) {
+            fseeko(fp, position + expected.size, SEEK_SET);
+        }
+    } else {
+        result = fetchWithProgress(name, fp, start);
+    }
+    recordLatency(TftpLatencyMetric::TFTP_LATENCY_SECTION_DURATION, start);
+    return result == TFTP_OK ?
            TftpClientOperationResult::TFTP_CLIENT_OK :
            TftpClientOperationResult::TFTP_CLIENT_ERROR;
 }
 
+TftpClientOperationResult TFTPClient::fetchFile(
+        const char *filename,
+        TFTPMappedSink &sink
+) {
+    FILE *stream = sink.getStream();
+    if (stream == NULL) {
+        return TftpClientOperationResult::TFTP_CLIENT_ERROR;
+    }
+    return fetchFile(filename, stream);
+}
+
+TftpClientOperationResult TFTPClient::sendBuffer(
+        const char *filename,
+        const void *data,
+        const size_t size
+) {
+    if (clientHandler == nullptr || (data == nullptr && size > 0)) {
+        return TftpClientOperationResult::TFTP_CLIENT_ERROR;
+    }
+    TFTP_TRACE_SCOPE("client", "sendBuffer");
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    std::string name(filename != nullptr ? filename : "");
+    TftpOperationResult result = TFTP_ERROR;
+    if (deltaEnabled) {
+        result = sendWithDelta(name, (const char *) data, size, start);
+    } else if (size > 0 && size >= stripeThreshold && useStriping()) {
+        result = transferStriped(name, -1, (char *) data, 0, size, false, nullptr);
+    } else {
+        FILE *stream = memoryStream.open(data, size);
+        if (stream != NULL) {
+            result = sendWithProgress(name, stream, size, start);
+            fclose(stream);
+        }
+    }
+    recordLatency(TftpLatencyMetric::TFTP_LATENCY_SECTION_DURATION, start);
+    return result == TFTP_OK ?
+           TftpClientOperationResult::TFTP_CLIENT_OK :
+           TftpClientOperationResult::TFTP_CLIENT_ERROR;
+}
+
+TftpClientOperationResult TFTPClient::fetchToBuffer(
+        const char *filename,
+        std::vector<uint8_t> &buffer
+) {
+    buffer.clear();
+    if (clientHandler == nullptr) {
+        return TftpClientOperationResult::TFTP_CLIENT_ERROR;
+    }
+
+    std::string name(filename != nullptr ? filename : "");
+    TFTPBlockHashes expected;
+    if (useStriping() && fetchStripedChecksum(name, expected)) {
+        TFTP_TRACE_SCOPE("client", "fetchToBuffer");
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        // Sized up front, each range is written in its place.
+        TftpOperationResult result = TFTP_ERROR;
+        try {
+            buffer.resize(expected.size);
+            result = transferStriped(name, -1, (char *) buffer.data(), 0, expected.size,
+                                     true, &expected);
+        } catch (const std::exception &) {
+        }
+        recordLatency(TftpLatencyMetric::TFTP_LATENCY_SECTION_DURATION, start);
+        if (result != TFTP_OK) {
+            buffer.clear();
+            return TftpClientOperationResult::TFTP_CLIENT_ERROR;
+        }
+        return TftpClientOperationResult::TFTP_CLIENT_OK;
+    }
+
+    cookie_io_functions_t functions;
+    memset(&functions, 0, sizeof(functions));
+    functions.write = bufferWrite;
+    FILE *stream = fopencookie(&buffer, "w", functions);
+    if (stream == NULL) {
+        return TftpClientOperationResult::TFTP_CLIENT_ERROR;
+    }
+    // Unbuffered, each block is copied once, from the engine into the vector.
+    setvbuf(stream, NULL, _IONBF, 0);
+
+    TFTP_TRACE_SCOPE("client", "fetchToBuffer");
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    TftpOperationResult result = fetchWithProgress(name, stream, start);
+    fclose(stream);
+    recordLatency(TftpLatencyMetric::TFTP_LATENCY_SECTION_DURATION, start);
+    if (result != TFTP_OK) {
+        buffer.clear();
+        return TftpClientOperationResult::TFTP_CLIENT_ERROR;
+    }
+    return TftpClientOperationResult::TFTP_CLIENT_OK;
+}
+
+TftpClientOperationResult TFTPClient::getLatencyHistogram(
+        const TftpLatencyMetric metric,
+        TFTPLatencyHistogram &histogram)
+{
+    if (metric >= TftpLatencyMetric::TFTP_LATENCY_METRIC_COUNT) {
+        return TftpClientOperationResult::TFTP_CLIENT_ERROR;
+    }
+
+    histogram.merge(latency[(int) metric]);
+    return TftpClientOperationResult::TFTP_CLIENT_OK;
+}
+
+TftpClientOperationResult TFTPClient::getLatencySummary(
+        const TftpLatencyMetric metric,
+        TFTPLatencySummary *summary)
+{
+    if (metric >= TftpLatencyMetric::TFTP_LATENCY_METRIC_COUNT || summary == nullptr) {
+        return TftpClientOperationResult::TFTP_CLIENT_ERROR;
+    }
+
+    latency[(int) metric].getSummary(summary);
+    return TftpClientOperationResult::TFTP_CLIENT_OK;
+}
+
+TftpClientOperationResult TFTPClient::resetLatencyStats()
+{
+    for (TFTPLatencyHistogram &histogram : latency) {
+        histogram.reset();
+    }
+    return TftpClientOperationResult::TFTP_CLIENT_OK;
+}
+
+TftpClientOperationResult TFTPClient::setCompression(
+        const bool enabled)
+{
+    compressionEnabled = enabled;
+    return TftpClientOperationResult::TFTP_CLIENT_OK;
+}
+
+TftpClientOperationResult TFTPClient::getCompressionStats(
+        uint64_t *plainBytes,
+        uint64_t *compressedBytes)
+{
+    if (plainBytes != nullptr) {
+        *plainBytes = compressionStats.plainBytes.load(std::memory_order_relaxed);
+    }
+    if (compressedBytes != nullptr) {
+        *compressedBytes = compressionStats.compressedBytes.load(std::memory_order_relaxed);
+    }
+    return TftpClientOperationResult::TFTP_CLIENT_OK;
+}
+
+TftpClientOperationResult TFTPClient::setDeltaTransfer(
+        const bool enabled)
+{
+    deltaEnabled = enabled;
+    return TftpClientOperationResult::TFTP_CLIENT_OK;
+}
+
+TftpClientOperationResult TFTPClient::getDeltaStats(
+        uint64_t *fileBytes,
+        uint64_t *sentBytes)
+{
+    if (fileBytes != nullptr) {
+        *fileBytes = deltaFileBytes;
+    }
+    if (sentBytes != nullptr) {
+        *sentBytes = deltaSentBytes;
+    }
+    return TftpClientOperationResult::TFTP_CLIENT_OK;
+}
+
+TftpClientOperationResult TFTPClient::setStriping(
+        const int stripes,
+        const uint64_t threshold)
+{
+    if (stripes < 1 || stripes > TFTP_MAX_STRIPES) {
+        return TftpClientOperationResult::TFTP_CLIENT_ERROR;
+    }
+    stripeCount = stripes;
+    stripeThreshold = threshold;
+    stripeWindow.reset(stripeCount, adaptiveStriping);
+    return TftpClientOperationResult::TFTP_CLIENT_OK;
+}
+
+TftpClientOperationResult TFTPClient::setAdaptiveStriping(
+        const bool enabled)
+{
+    adaptiveStriping = enabled;
+    stripeWindow.reset(stripeCount, adaptiveStriping);
+    return TftpClientOperationResult::TFTP_CLIENT_OK;
+}
+
+TftpClientOperationResult TFTPClient::getStripingStats(
+        uint64_t *files,
+        uint64_t *bytes,
+        int *window,
+        uint64_t *losses)
+{
+    if (files != nullptr) {
+        *files = stripedFiles;
+    }
+    if (bytes != nullptr) {
+        *bytes = stripedBytes;
+    }
+    if (window != nullptr) {
+        *window = stripeWindow.getWindow();
+    }
+    if (losses != nullptr) {
+        std::lock_guard<std::mutex> lock(stripeMutex);
+        *losses = stripeLosses;
+    }
+    return TftpClientOperationResult::TFTP_CLIENT_OK;
+}
+
+TftpOperationResult TFTPClient::sendStream(
+        std::string name,
+        FILE *fp,
+        const std::chrono::steady_clock::time_point start)
+{
+    FILE *source = useCompression() ? openCompressionStream(fp, false) : fp;
+    if (source != fp) {
+        name += TFTP_COMPRESSION_SUFFIX;
+    }
+    FILE *stream = openTimedStream(source, false, start);
+    TftpOperationResult result = transferFile(name.c_str(), stream, false);
+    if (stream != source) {
+        fclose(stream);
+    }
+    if (source != fp) {
+        fclose(source);
+    }
+    return result;
+}
+
+TftpOperationResult TFTPClient::fetchStream(
+        std::string name,
+        FILE *fp,
+        const std::chrono::steady_clock::time_point start)
+{
+    FILE *source = useCompression() ? openCompressionStream(fp, true) : fp;
+    if (source != fp) {
+        name += TFTP_COMPRESSION_SUFFIX;
+    }
+    FILE *stream = openTimedStream(source, true, start);
+    TftpOperationResult result = transferFile(name.c_str(), stream, true);
+    if (stream != source) {
+        fclose(stream);
+    }
+    // Closing fails if the compressed stream was cut short.
+    if (source != fp && fclose(source) != 0) {
+        result = TFTP_ERROR;
+    }
+    return result;
+}
+
+TftpOperationResult TFTPClient::transferFile(
+        const char *name,
+        FILE *fp,
+        const bool fetch)
+{
+    if (transport == TftpClientTransport::TFTP_CLIENT_TRANSPORT_LOCAL && fp != NULL &&
+        TFTPLocalTransport::isLoopback(host.c_str())) {
+        TFTPLocalSection section(name, !fetch);
+        if (TFTPLocalTransport::startSection(port, &section)) {
+            return transferLocal(section, fp);
+        }
+    }
+    return fetch ? fetch_file(clientHandler, name, fp) : send_file(clientHandler, name, fp);
+}
+
+TftpOperationResult TFTPClient::transferLocal(
+        TFTPLocalSection &section,
+        FILE *fp)
+{
+    TFTP_TRACE_SCOPE("client", "localTransfer");
+    char block[TFTPBlockRing::BLOCK_SIZE];
+    bool moved = false;
+    bool aborted = false;
+    while (!moved && !aborted) {
+        ssize_t length;
+        if (section.write) {
+            length = fread(block, 1, sizeof(block), fp);
+            aborted = (size_t) length < sizeof(block) && ferror(fp);
+            if (!aborted && !section.ring.push(block, length)) {
+                break;
+            }
+        } else {
+            length = section.ring.pop(block);
+            if (length < 0) {
+                break;
+            }
+            aborted = length > 0 && fwrite(block, 1, length, fp) != (size_t) length;
+            if (!aborted) {
+                tftpFetchDataReceivedCbk((int) length, this);
+            }
+        }
+        moved = !aborted && (size_t) length < sizeof(block);
+    }
+    if (aborted) {
+        // Our side failed, the server side gives up too.
+        section.ring.abort();
+    }
+
+    section.join();
+    if (!aborted && section.failed) {
+        tftpErrorCbk(section.errorCode, section.errorMessage.c_str(), this);
+    }
+    return moved && section.succeeded ? TFTP_OK : TFTP_ERROR;
+}
+
+TftpOperationResult TFTPClient::sendWithProgress(
+        const std::string &name,
+        FILE *fp,
+        const int64_t totalBytes,
+        const std::chrono::steady_clock::time_point start)
+{
+    // Counted against the caller's data, under any compression.
+    FILE *stream = _tftpProgressCallback == nullptr || fp == NULL ? NULL :
+                   progressStream.open(fp, TftpClientTransferDirection::TFTP_CLIENT_TRANSFER_SEND,
+                                       totalBytes, _tftpProgressCallback, tftpProgressCtx,
+                                       progressBytes, progressIntervalMs);
+    if (stream == NULL) {
+        return sendStream(name, fp, start);
+    }
+    TftpOperationResult result = sendStream(name, stream, start);
+    fclose(stream);
+    return result;
+}
+
+TftpOperationResult TFTPClient::fetchWithProgress(
+        const std::string &name,
+        FILE *fp,
+        const std::chrono::steady_clock::time_point start)
+{
+    FILE *stream = _tftpProgressCallback == nullptr || fp == NULL ? NULL :
+                   progressStream.open(fp, TftpClientTransferDirection::TFTP_CLIENT_TRANSFER_FETCH,
+                                       -1, _tftpProgressCallback, tftpProgressCtx,
+                                       progressBytes, progressIntervalMs);
+    if (stream == NULL) {
+        return fetchStream(name, fp, start);
+    }
+    TftpOperationResult result = fetchStream(name, stream, start);
+    fclose(stream);
+    return result;
+}
+
+TftpOperationResult TFTPClient::sendWithDelta(
+        const std::string &name,
+        const char *data,
+        const size_t size,
+        const std::chrono::steady_clock::time_point start)
+{
+    // Any failure before the delta is accepted, including a server that
+    // doesn't know the suffixes, ends in a plain transfer.
+    TFTPBlockHashes hashes;
+    if (fetchHashes(name, hashes, start)) {
+        std::vector<char> delta;
+        TFTPDelta::encodeDelta(data, size, hashes, delta);
+        FILE *stream = memoryStream.open(delta.data(), delta.size());
+        if (stream != NULL) {
+            bool sent = sendDelta(name, stream, delta.size(), size, start);
+            fclose(stream);
+            if (sent) {
+                return TFTP_OK;
+            }
+        }
+    }
+
+    FILE *stream = memoryStream.open(data, size);
+    if (stream == NULL) {
+        return TFTP_ERROR;
+    }
+    TftpOperationResult result = sendWithProgress(name, stream, size, start);
+    fclose(stream);
+    if (result == TFTP_OK) {
+        deltaFileBytes += size;
+        deltaSentBytes += size;
+    }
+    return result;
+}
+
+TftpOperationResult TFTPClient::sendFileWithDelta(
+        const std::string &name,
+        FILE *fp,
+        const off_t position,
+        const uint64_t size,
+        const std::chrono::steady_clock::time_point start)
+{
+    // The delta is built from the file into a temporary file, neither is
+    // held in memory. Failures end in a plain transfer, as for buffers.
+    TFTPBlockHashes hashes;
+    if (fflush(fp) == 0 && fetchHashes(name, hashes, start)) {
+        FILE *delta = tmpfile();
+        bool sent = false;
+        if (delta != NULL && TFTPDelta::encodeDeltaFile(fileno(fp), position, size, hashes, delta)) {
+            off_t deltaSize = ftello(delta);
+            sent = deltaSize >= 0 && fseeko(delta, 0, SEEK_SET) == 0 &&
+                   sendDelta(name, delta, deltaSize, size, start);
+        }
+        if (delta != NULL) {
+            fclose(delta);
+        }
+        if (sent) {
+            fseeko(fp, position + size, SEEK_SET);
+            return TFTP_OK;
+        }
+    }
+
+    if (fseeko(fp, position, SEEK_SET) != 0) {
+        return TFTP_ERROR;
+    }
+    TftpOperationResult result = sendWithProgress(name, fp, size, start);
+    if (result == TFTP_OK) {
+        deltaFileBytes += size;
+        deltaSentBytes += size;
+    }
+    return result;
+}
+
+bool TFTPClient::sendDelta(
+        const std::string &name,
+        FILE *delta,
+        const uint64_t deltaSize,
+        const uint64_t fileSize,
+        const std::chrono::steady_clock::time_point start)
+{
+    // Not worth it when most of the file changed.
+    if (deltaSize >= fileSize) {
+        return false;
+    }
+
+    quietRequest = true;
+    TftpOperationResult result = sendWithProgress(
+            name + TFTP_DELTA_SUFFIX, delta, deltaSize, start);
+    quietRequest = false;
+    if (result != TFTP_OK) {
+        return false;
+    }
+    deltaFileBytes += fileSize;
+    deltaSentBytes += deltaSize;
+    return true;
+}
+
+bool TFTPClient::fetchHashes(
+        const std::string &name,
+        TFTPBlockHashes &hashes,
+        const std::chrono::steady_clock::time_point start)
+{
+    char *buffer = NULL;
+    size_t length = 0;
+    FILE *sink = open_memstream(&buffer, &length);
+    if (sink == NULL) {
+        return false;
+    }
+
+    quietRequest = true;
+    TftpOperationResult result = fetchStream(name + TFTP_HASHES_SUFFIX, sink, start);
+    quietRequest = false;
+    fclose(sink);
+
+    bool ok = result == TFTP_OK && TFTPDelta::decodeHashes(buffer, length, hashes);
+    free(buffer);
+    return ok;
+}
+
+bool TFTPClient::useCompression()
+{
+    if (!compressionEnabled) {
+        return false;
+    }
+
+    return probeSupport(TFTP_COMPRESSION_SUFFIX, compressionSupport);
+}
+
+bool TFTPClient::useStriping()
+{
+    // Compressed transfers move other bytes than the file's.
+    if (stripeCount < 2 || compressionEnabled) {
+        return false;
+    }
+    return probeSupport(TFTP_RANGE_SUFFIX, stripingSupport);
+}
+
+bool TFTPClient::probeSupport(
+        const char *suffix,
+        TftpServerSupport &support)
+{
+    if (support == TftpServerSupport::TFTP_SUPPORT_UNKNOWN) {
+        // A server that doesn't know the suffix answers the bare suffix with
+        // an error, as for any missing file. Keep that error from the user.
+        TFTP_TRACE_SCOPE("client", "probeSupport");
+        FILE *sink = fopen("/dev/null", "w");
+        if (sink == NULL) {
+            return false;
+        }
+        bool quiet = quietRequest;
+        quietRequest = true;
+        TftpOperationResult result = transferFile(suffix, sink, true);
+        quietRequest = quiet;
+        fclose(sink);
+        support = result == TFTP_OK ? TftpServerSupport::TFTP_SUPPORTED :
+                  TftpServerSupport::TFTP_UNSUPPORTED;
+    }
+    return support == TftpServerSupport::TFTP_SUPPORTED;
+}
+
+bool TFTPClient::fetchAnswer(
+        const std::string &request,
+        std::string &answer)
+{
+    char *buffer = NULL;
+    size_t length = 0;
+    FILE *sink = open_memstream(&buffer, &length);
+    if (sink == NULL) {
+        return false;
+    }
+
+    // The server may still be closing the ranges just moved, and reject
+    // the request as busy.
+    bool quiet = quietRequest;
+    quietRequest = true;
+    TftpOperationResult result = TFTP_ERROR;
+    for (int attempt = 0; attempt <= TFTP_BUSY_RETRIES; attempt++) {
+        if (attempt > 0) {
+            std::this_thread::sleep_for(
+                    std::chrono::milliseconds(TFTP_BUSY_PAUSE_MS << (attempt - 1)));
+            rewind(sink);
+        }
+        serverBusy = false;
+        result = transferFile(request.c_str(), sink, true);
+        if (result == TFTP_OK || !serverBusy) {
+            break;
+        }
+    }
+    quietRequest = quiet;
+    fclose(sink);
+
+    if (result == TFTP_OK) {
+        answer.assign(buffer, length);
+    }
+    free(buffer);
+    return result == TFTP_OK;
+}
+
+bool TFTPClient::fetchChecksum(
+        const std::string &name,
+        TFTPBlockHashes &checksum)
+{
+    std::string answer;
+    return fetchAnswer(name + TFTP_CHECKSUM_SUFFIX, answer) &&
+           TFTPDelta::decodeChecksum(answer.data(), answer.size(), checksum);
+}
+
+bool TFTPClient::fetchStripedChecksum(
+        const std::string &name,
+        TFTPBlockHashes &checksum)
+{
+    // The server reads the whole file for a checksum, only the size is
+    // asked first when small files aren't striped.
+    std::string answer;
+    uint64_t size = 0;
+    if (stripeThreshold > 0 &&
+        (!fetchAnswer(name + TFTP_SIZE_SUFFIX, answer) ||
+         !TFTPRangeStream::decodeSize(answer.data(), answer.size(), &size) ||
+         size < stripeThreshold)) {
+        return false;
+    }
+    return fetchChecksum(name, checksum) && checksum.size > 0 &&
+           checksum.size >= stripeThreshold;
+}
+
+bool TFTPClient::truncateStriped(
+        const std::string &name,
+        const uint64_t size)
+{
+    // Ranges never shrink the server's file, a longer one is emptied with
+    // a plain write first.
+    std::string answer;
+    uint64_t current = 0;
+    if (!fetchAnswer(name + TFTP_SIZE_SUFFIX, answer) ||
+        !TFTPRangeStream::decodeSize(answer.data(), answer.size(), &current) ||
+        current <= size) {
+        return true;
+    }
+
+    static const char empty = 0;
+    FILE *stream = memoryStream.open(&empty, 0);
+    if (stream == NULL) {
+        return false;
+    }
+    TftpOperationResult result = transferFile(name.c_str(), stream, false);
+    fclose(stream);
+    return result == TFTP_OK;
+}
+
+TftpOperationResult TFTPClient::transferStriped(
+        const std::string &name,
+        const int descriptor,
+        char *memory,
+        const uint64_t base,
+        const uint64_t size,
+        const bool fetch,
+        const TFTPBlockHashes *expected)
+{
+    TFTP_TRACE_SCOPE("client", "stripedTransfer");
+    uint64_t rangeSize = (size + stripeCount - 1) / stripeCount;
+    if (adaptiveStriping) {
+        // More ranges than sessions, so the window has rounds to adapt in.
+        rangeSize = std::max<uint64_t>(TFTP_STRIPE_MIN_RANGE,
+                                       size / ((uint64_t) stripeCount * TFTP_STRIPE_ROUNDS));
+    }
+    rangeSize = (rangeSize + TFTP_STRIPE_ALIGNMENT - 1) / TFTP_STRIPE_ALIGNMENT *
+                TFTP_STRIPE_ALIGNMENT;
+    size_t count = (size_t) ((size + rangeSize - 1) / rangeSize);
+    size_t sessions = std::min<size_t>(count, stripeCount);
+    if (!fetch && !truncateStriped(name, size)) {
+        return TFTP_ERROR;
+    }
+    try {
+        while (stripeSessions.size() < sessions) {
+            std::unique_ptr<StripeSession> session(new StripeSession());
+            session->client.reset(new TFTPClient());
+            session->client->registerTftpErrorCallback(stripeErrorCbk, session.get());
+            stripeSessions.push_back(std::move(session));
+        }
+    } catch (...) {
+        return TFTP_ERROR;
+    }
+    for (size_t i = 0; i < sessions; i++) {
+        if (stripeSessions[i]->client->setConnection(host.c_str(), port) !=
+            TftpClientOperationResult::TFTP_CLIENT_OK) {
+            return TFTP_ERROR;
+        }
+        stripeSessions[i]->client->setTransport(transport);
+    }
+
+    // Ranges are taken from the queue by the sessions as the window lets
+    // them, a lost one goes back to it.
+    std::deque<size_t> pending;
+    std::vector<int> attempts(count, 0);
+    std::vector<int> busyAttempts(count, 0);
+    std::vector<uint32_t> checksums(count, 0);
+    size_t moved = 0;
+    bool aborted = false;
+    {
+        std::lock_guard<std::mutex> lock(stripeMutex);
+        stripeFailed = false;
+        for (size_t i = 0; i < count; i++) {
+            pending.push_back(i);
+        }
+    }
+
+    // Each session runs on its own thread, the first one on this thread.
+    auto run = [&](size_t s) {
+        StripeSession &session = *stripeSessions[s];
+        while (true) {
+            uint64_t epoch = stripeWindow.acquire();
+            size_t i;
+            {
+                std::lock_guard<std::mutex> lock(stripeMutex);
+                if (aborted || pending.empty()) {
+                    i = count;
+                } else {
+                    i = pending.front();
+                    pending.pop_front();
+                }
+            }
+            if (i == count) {
+                stripeWindow.release(epoch, false, false);
+                return;
+            }
+
+            TFTPRange range;
+            range.offset = i * rangeSize;
+            range.length = std::min(rangeSize, size - range.offset);
+            // The server checks the file size against its limit.
+            range.total = fetch ? 0 : size;
+            FILE *stream = memory != nullptr ?
+                           session.stream.open(memory + range.offset, range.length, fetch) :
+                           session.stream.open(descriptor, base + range.offset, range.length,
+                                               fetch);
+            bool done = false;
+            bool lost = false;
+            bool busy = false;
+            bool retry = false;
+            if (stream != NULL) {
+                std::string rangeName = name + TFTP_RANGE_SUFFIX +
+                                        TFTPRangeStream::encodeRange(range);
+                session.failed = false;
+                TftpClientOperationResult result = fetch ?
+                        session.client->fetchFile(rangeName.c_str(), stream) :
+                        session.client->sendFile(rangeName.c_str(), stream);
+                // Closing fails if the range wasn't moved whole.
+                bool complete = fclose(stream) == 0;
+                done = result == TftpClientOperationResult::TFTP_CLIENT_OK && complete;
+                // Without an error from the server the engine timed out.
+                busy = result != TftpClientOperationResult::TFTP_CLIENT_OK && session.failed &&
+                       session.errorMessage.compare(0, strlen(TFTP_BUSY_PREFIX),
+                                                    TFTP_BUSY_PREFIX) == 0;
+                retry = result != TftpClientOperationResult::TFTP_CLIENT_OK &&
+                        (!session.failed || busy);
+                lost = retry || session.stream.getStalls() > 0;
+            }
+            stripeWindow.release(epoch, lost, done);
+
+            int pause = 0;
+            {
+                std::lock_guard<std::mutex> lock(stripeMutex);
+                stripeLosses += lost ? 1 : 0;
+                if (done) {
+                    checksums[i] = session.stream.getChecksum();
+                    moved++;
+                } else if (busy && ++busyAttempts[i] <= TFTP_BUSY_RETRIES) {
+                    pending.push_back(i);
+                    pause = TFTP_BUSY_PAUSE_MS << (busyAttempts[i] - 1);
+                } else if (retry && !busy && ++attempts[i] <= TFTP_STRIPE_RETRIES) {
+                    pending.push_back(i);
+                } else {
+                    aborted = true;
+                    if (!stripeFailed && session.failed) {
+                        stripeFailed = true;
+                        stripeErrorCode = session.errorCode;
+                        stripeErrorMessage = session.errorMessage;
+                    }
+                }
+            }
+            if (pause > 0) {
+                // Other sessions move the other ranges meanwhile.
+                std::this_thread::sleep_for(std::chrono::milliseconds(pause));
+            }
+        }
+    };
+
+    std::vector<std::thread> workers;
+    for (size_t i = 1; i < sessions; i++) {
+        try {
+            workers.push_back(std::thread(run, i));
+        } catch (const std::system_error &) {
+            // One session less, the others move its ranges.
+            break;
+        }
+    }
+    run(0);
+    for (std::thread &worker : workers) {
+        worker.join();
+    }
+
+    if (moved < count) {
+        std::lock_guard<std::mutex> lock(stripeMutex);
+        if (stripeFailed) {
+            tftpErrorCbk(stripeErrorCode, stripeErrorMessage.c_str(), this);
+        }
+        return TFTP_ERROR;
+    }
+
+    // The checksum of the whole file, from those of the ranges.
+    uLong checksum = crc32(0L, Z_NULL, 0);
+    for (size_t i = 0; i < count; i++) {
+        uint64_t offset = i * rangeSize;
+        checksum = crc32_combine(checksum, checksums[i],
+                                 (z_off_t) std::min(rangeSize, size - offset));
+    }
+
+    // Sent ranges are checked against what the server assembled.
+    TFTPBlockHashes assembled;
+    if (expected == nullptr) {
+        if (!fetchChecksum(name, assembled)) {
+            tftpErrorCbk(0, "Striped transfer not checked", this);
+            return TFTP_ERROR;
+        }
+        expected = &assembled;
+    }
+    if (expected->size != size || expected->checksum != (uint32_t) checksum) {
+        tftpErrorCbk(0, "Striped transfer checksum mismatch", this);
+        return TFTP_ERROR;
+    }
+
+    stripedFiles++;
+    stripedBytes += size;
+    if (_tftpProgressCallback != nullptr) {
+        _tftpProgressCallback(fetch ? TftpClientTransferDirection::TFTP_CLIENT_TRANSFER_FETCH :
+                              TftpClientTransferDirection::TFTP_CLIENT_TRANSFER_SEND,
+                              size, size, tftpProgressCtx);
+    }
+    return TFTP_OK;
+}
+
+FILE *TFTPClient::openCompressionStream(
+        FILE *fp,
+        const bool write)
+{
+    if (fp == NULL) {
+        return fp;
+    }
+
+    FILE *stream = compressionStream.open(fp, write, &compressionStats);
+    return stream != NULL ? stream : fp;
+}
+
+FILE *TFTPClient::openTimedStream(
+        FILE *fp,
+        const bool write,
+        const std::chrono::steady_clock::time_point start)
+{
+    if (fp == NULL) {
+        return fp;
+    }
+
+    // A client runs one transfer at a time, so one stream object is enough.
+    FILE *stream = timedStream.open(
+            fp, write, start,
+            &latency[(int) TftpLatencyMetric::TFTP_LATENCY_FIRST_BLOCK],
+            &latency[(int) TftpLatencyMetric::TFTP_LATENCY_BLOCK_ROUND_TRIP]);
+    return stream != NULL ? stream : fp;
+}
+
+void TFTPClient::recordLatency(
+        const TftpLatencyMetric metric,
+        const std::chrono::steady_clock::time_point start)
+{
+    std::chrono::steady_clock::duration elapsed = std::chrono::steady_clock::now() - start;
+    latency[(int) metric].record(
+            std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count());
+}
+
+ssize_t TFTPClient::bufferWrite(
+        void *cookie,
+        const char *buffer,
+        size_t size)
+{
+    std::vector<uint8_t> *vector = (std::vector<uint8_t> *) cookie;
+    try {
+        vector->insert(vector->end(), buffer, buffer + size);
+    } catch (const std::bad_alloc &) {
+        return -1;
+    }
+    return (ssize_t) size;
+}
+
 TftpOperationResult TFTPClient::tftpErrorCbk (
         short error_code,
         const char *error_message,
         void *context)
 {
+    TFTP_TRACE_INSTANT("client", "error", error_code);
     if (context != NULL) {
         TFTPClient *client = (TFTPClient *) context;
+        client->serverBusy = error_message != NULL &&
+                             strncmp(error_message, TFTP_BUSY_PREFIX,
+                                     strlen(TFTP_BUSY_PREFIX)) == 0;
+        if (client->quietRequest) {
+            return TFTP_OK;
+        }
         if (client->_tftpErrorCallback != nullptr) {
             std::string errorMessage(error_message);
             client->_tftpErrorCallback(error_code, errorMessage,
@@ -111,13 +1092,31 @@ TftpOperationResult TFTPClient::tftpErrorCbk (
     return TFTP_ERROR;
 }
 
+TftpClientOperationResult TFTPClient::stripeErrorCbk (
+        short error_code,
+        std::string &error_message,
+        void *context)
+{
+    // Runs on the session's thread, read there once the range is done.
+    StripeSession *session = (StripeSession *) context;
+    session->failed = true;
+    session->errorCode = error_code;
+    session->errorMessage = error_message;
+    return TftpClientOperationResult::TFTP_CLIENT_OK;
+}
+
 TftpOperationResult TFTPClient::tftpFetchDataReceivedCbk (
         int data_size,
         void *context)
 {
+    TFTP_TRACE_INSTANT("client", "dataReceived", data_size);
     if (context != NULL) {
         TFTPClient *client = (TFTPClient *) context;
+        if (client->quietRequest) {
+            return TFTP_OK;
+        }
         if (client->_tftpFetchDataReceivedCallback != nullptr) {
+            TFTP_TRACE_SCOPE("client", "fetchDataReceivedCallback");
             client->_tftpFetchDataReceivedCallback(data_size, 
                                                    client->tftpFetchDataReceivedCtx);
             return TFTP_OK;
@@ -0,0 +1,228 @@
+#include "TFTPMappedSink.h"
+
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+TFTPMappedSink::TFTPMappedSink() {
+    stream = NULL;
+    fd = -1;
+    mapping = nullptr;
+    mappedSize = 0;
+    size = 0;
+    position = 0;
+}
+
+TFTPMappedSink::~TFTPMappedSink() {
+    close();
+}
+
+TftpClientOperationResult TFTPMappedSink::openAnonymous(
+        const size_t sizeHint)
+{
+    if (stream != NULL) {
+        return TftpClientOperationResult::TFTP_CLIENT_ERROR;
+    }
+    return openMapping(sizeHint);
+}
+
+TftpClientOperationResult TFTPMappedSink::openFile(
+        const char *path,
+        const size_t sizeHint)
+{
+    if (stream != NULL || path == nullptr) {
+        return TftpClientOperationResult::TFTP_CLIENT_ERROR;
+    }
+
+    fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        return TftpClientOperationResult::TFTP_CLIENT_ERROR;
+    }
+
+    if (openMapping(sizeHint) != TftpClientOperationResult::TFTP_CLIENT_OK) {
+        ::close(fd);
+        fd = -1;
+        return TftpClientOperationResult::TFTP_CLIENT_ERROR;
+    }
+    return TftpClientOperationResult::TFTP_CLIENT_OK;
+}
+
+TftpClientOperationResult TFTPMappedSink::openMapping(
+        const size_t sizeHint)
+{
+    size = 0;
+    position = 0;
+    if (!reserve(sizeHint > 0 ? sizeHint : 1)) {
+        return TftpClientOperationResult::TFTP_CLIENT_ERROR;
+    }
+
+    cookie_io_functions_t functions;
+    memset(&functions, 0, sizeof(functions));
+    functions.write = streamWrite;
+    functions.seek = streamSeek;
+
+    stream = fopencookie(this, "w", functions);
+    if (stream == NULL) {
+        munmap(mapping, mappedSize);
+        mapping = nullptr;
+        mappedSize = 0;
+        return TftpClientOperationResult::TFTP_CLIENT_ERROR;
+    }
+
+    // Blocks go straight from the engine into the mapping.
+    setvbuf(stream, NULL, _IONBF, 0);
+    return TftpClientOperationResult::TFTP_CLIENT_OK;
+}
+
+bool TFTPMappedSink::reserve(
+        const size_t capacity)
+{
+    if (capacity <= mappedSize) {
+        return true;
+    }
+
+    size_t pageSize = (size_t) sysconf(_SC_PAGESIZE);
+    size_t newSize = mappedSize > 0 ? mappedSize : pageSize;
+    while (newSize < capacity) {
+        newSize *= 2;
+    }
+    newSize = (newSize + pageSize - 1) / pageSize * pageSize;
+
+    if (fd >= 0 && ftruncate(fd, (off_t) newSize) != 0) {
+        return false;
+    }
+
+    void *newMapping;
+    if (mapping == nullptr) {
+        newMapping = fd >= 0 ?
+                     mmap(NULL, newSize, PROT_READ | PROT_WRITE, MAP_SHARED,
+                          fd, 0) :
+                     mmap(NULL, newSize, PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    } else {
+        newMapping = mremap(mapping, mappedSize, newSize, MREMAP_MAYMOVE);
+    }
+
+    if (newMapping == MAP_FAILED) {
+        return false;
+    }
+
+    mapping = (uint8_t *) newMapping;
+    mappedSize = newSize;
+    return true;
+}
+
+FILE *TFTPMappedSink::getStream()
+{
+    return stream;
+}
+
+const uint8_t *TFTPMappedSink::getData() const
+{
+    return mapping;
+}
+
+size_t TFTPMappedSink::getSize() const
+{
+    return size;
+}
+
+TftpClientOperationResult TFTPMappedSink::release(
+        void **data,
+        size_t *size,
+        size_t *mappedSize)
+{
+    if (stream == NULL || fd >= 0 || data == nullptr || size == nullptr ||
+        mappedSize == nullptr) {
+        return TftpClientOperationResult::TFTP_CLIENT_ERROR;
+    }
+
+    fclose(stream);
+    stream = NULL;
+
+    *data = mapping;
+    *size = this->size;
+    *mappedSize = this->mappedSize;
+
+    mapping = nullptr;
+    this->mappedSize = 0;
+    this->size = 0;
+    position = 0;
+    return TftpClientOperationResult::TFTP_CLIENT_OK;
+}
+
+TftpClientOperationResult TFTPMappedSink::close()
+{
+    bool ok = true;
+
+    if (stream != NULL) {
+        ok = fclose(stream) == 0;
+        stream = NULL;
+    }
+
+    if (mapping != nullptr) {
+        ok = munmap(mapping, mappedSize) == 0 && ok;
+        mapping = nullptr;
+        mappedSize = 0;
+    }
+
+    if (fd >= 0) {
+        ok = ftruncate(fd, (off_t) size) == 0 && ok;
+        ok = ::close(fd) == 0 && ok;
+        fd = -1;
+    }
+
+    size = 0;
+    position = 0;
+    return ok ? TftpClientOperationResult::TFTP_CLIENT_OK :
+           TftpClientOperationResult::TFTP_CLIENT_ERROR;
+}
+
+ssize_t TFTPMappedSink::streamWrite(
+        void *cookie,
+        const char *buffer,
+        size_t size)
+{
+    TFTPMappedSink *sink = (TFTPMappedSink *) cookie;
+    if (!sink->reserve(sink->position + size)) {
+        return -1;
+    }
+
+    memcpy(sink->mapping + sink->position, buffer, size);
+    sink->position += size;
+    if (sink->position > sink->size) {
+        sink->size = sink->position;
+    }
+    return (ssize_t) size;
+}
+
+int TFTPMappedSink::streamSeek(
+        void *cookie,
+        off64_t *offset,
+        int whence)
+{
+    TFTPMappedSink *sink = (TFTPMappedSink *) cookie;
+    off64_t base;
+    switch (whence) {
+        case SEEK_SET:
+            base = 0;
+            break;
+        case SEEK_CUR:
+            base = (off64_t) sink->position;
+            break;
+        case SEEK_END:
+            base = (off64_t) sink->size;
+            break;
+        default:
+            return -1;
+    }
+
+    if (base + *offset < 0) {
+        return -1;
+    }
+
+    sink->position = (size_t) (base + *offset);
+    *offset = (off64_t) sink->position;
+    return 0;
+}
@@ -0,0 +1,155 @@
+#include "TFTPProgressStream.h"
+
+#include <string.h>
+
+TFTPProgressStream::TFTPProgressStream() {
+    source = NULL;
+    stream = NULL;
+    direction = TftpClientTransferDirection::TFTP_CLIENT_TRANSFER_SEND;
+    totalBytes = -1;
+    callback = nullptr;
+    context = nullptr;
+    thresholdBytes = 0;
+    interval = std::chrono::steady_clock::duration::zero();
+    bytes = 0;
+    reportedBytes = 0;
+    reported = false;
+}
+
+FILE *TFTPProgressStream::open(
+        FILE *source,
+        const TftpClientTransferDirection direction,
+        const int64_t totalBytes,
+        tftpProgressCallback callback,
+        void *context,
+        const uint64_t thresholdBytes,
+        const int intervalMs)
+{
+    if (source == NULL || callback == nullptr || stream != NULL) {
+        return NULL;
+    }
+
+    bool write = direction == TftpClientTransferDirection::TFTP_CLIENT_TRANSFER_FETCH;
+    this->source = source;
+    this->direction = direction;
+    this->totalBytes = totalBytes;
+    this->callback = callback;
+    this->context = context;
+    this->thresholdBytes = thresholdBytes;
+    interval = std::chrono::milliseconds(intervalMs > 0 ? intervalMs : 0);
+    bytes = 0;
+    reportedBytes = 0;
+    reported = false;
+    reportedAt = std::chrono::steady_clock::now();
+
+    cookie_io_functions_t functions;
+    memset(&functions, 0, sizeof(functions));
+    if (write) {
+        functions.write = streamWrite;
+    } else {
+        functions.read = streamRead;
+    }
+    functions.seek = streamSeek;
+    functions.close = streamClose;
+
+    stream = fopencookie(this, write ? "w" : "r", functions);
+    if (stream == NULL) {
+        return NULL;
+    }
+
+    if (write) {
+        setvbuf(stream, NULL, _IONBF, 0);
+    } else {
+        // glibc hands reads of an unbuffered cookie stream over one byte at
+        // a time, a block-sized buffer gets whole blocks passed in one call.
+        setvbuf(stream, streamBuffer, _IOFBF, sizeof(streamBuffer));
+    }
+    return stream;
+}
+
+void TFTPProgressStream::account(
+        const size_t length)
+{
+    bytes += length;
+    bool due;
+    if (thresholdBytes == 0 && interval == std::chrono::steady_clock::duration::zero()) {
+        due = true;
+    } else {
+        due = thresholdBytes > 0 && bytes - reportedBytes >= thresholdBytes;
+        if (!due && interval > std::chrono::steady_clock::duration::zero()) {
+            due = std::chrono::steady_clock::now() - reportedAt >= interval;
+        }
+    }
+    if (due) {
+        report();
+    }
+}
+
+void TFTPProgressStream::report()
+{
+    callback(direction, bytes, totalBytes, context);
+    reportedBytes = bytes;
+    reported = true;
+    if (interval > std::chrono::steady_clock::duration::zero()) {
+        reportedAt = std::chrono::steady_clock::now();
+    }
+}
+
+ssize_t TFTPProgressStream::streamRead(
+        void *cookie,
+        char *buffer,
+        size_t size)
+{
+    TFTPProgressStream *self = (TFTPProgressStream *) cookie;
+    size_t length = fread(buffer, 1, size, self->source);
+    if (length > 0) {
+        self->account(length);
+    }
+    return ferror(self->source) && length == 0 ? -1 : (ssize_t) length;
+}
+
+ssize_t TFTPProgressStream::streamWrite(
+        void *cookie,
+        const char *buffer,
+        size_t size)
+{
+    TFTPProgressStream *self = (TFTPProgressStream *) cookie;
+    size_t length = fwrite(buffer, 1, size, self->source);
+    if (length > 0) {
+        self->account(length);
+    }
+    return length == 0 && size > 0 ? -1 : (ssize_t) length;
+}
+
+int TFTPProgressStream::streamSeek(
+        void *cookie,
+        off64_t *offset,
+        int whence)
+{
+    TFTPProgressStream *self = (TFTPProgressStream *) cookie;
+    if (fseeko(self->source, *offset, whence) != 0) {
+        return -1;
+    }
+
+    off64_t position = ftello(self->source);
+    if (position < 0) {
+        return -1;
+    }
+    *offset = position;
+    return 0;
+}
+
+int TFTPProgressStream::streamClose(
+        void *cookie)
+{
+    TFTPProgressStream *self = (TFTPProgressStream *) cookie;
+    fflush(self->source);
+    // The last block is always reported, so a finished transfer ends on
+    // its full size, even an empty one.
+    if (!self->reported || self->bytes != self->reportedBytes) {
+        self->report();
+    }
+    self->stream = NULL;
+    self->source = NULL;
+    return 0;
+}
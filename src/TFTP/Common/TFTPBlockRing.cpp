@@ -0,0 +1,80 @@
+#include "TFTPBlockRing.h"
+
+#include <string.h>
+
+TFTPBlockRing::TFTPBlockRing() {
+    head = 0;
+    tail = 0;
+    aborted = false;
+    waiters = 0;
+}
+
+bool TFTPBlockRing::push(
+        const char *data,
+        const size_t size)
+{
+    if (size > BLOCK_SIZE) {
+        return false;
+    }
+
+    uint64_t position = tail.load(std::memory_order_relaxed);
+    if (position - head.load(std::memory_order_acquire) == SLOT_COUNT) {
+        std::unique_lock<std::mutex> lock(mutex);
+        waiters++;
+        changed.wait(lock, [this, position] {
+            return aborted || position - head.load(std::memory_order_acquire) < SLOT_COUNT;
+        });
+        waiters--;
+    }
+    if (aborted) {
+        return false;
+    }
+
+    Slot &slot = slots[position % SLOT_COUNT];
+    memcpy(slot.data, data, size);
+    slot.length = size;
+    tail.store(position + 1, std::memory_order_seq_cst);
+    wake();
+    return true;
+}
+
+ssize_t TFTPBlockRing::pop(
+        char *buffer)
+{
+    uint64_t position = head.load(std::memory_order_relaxed);
+    if (tail.load(std::memory_order_acquire) == position) {
+        std::unique_lock<std::mutex> lock(mutex);
+        waiters++;
+        changed.wait(lock, [this, position] {
+            return aborted || tail.load(std::memory_order_acquire) != position;
+        });
+        waiters--;
+    }
+    if (aborted) {
+        return -1;
+    }
+
+    Slot &slot = slots[position % SLOT_COUNT];
+    size_t length = slot.length;
+    memcpy(buffer, slot.data, length);
+    head.store(position + 1, std::memory_order_seq_cst);
+    wake();
+    return (ssize_t) length;
+}
+
+void TFTPBlockRing::abort()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    aborted = true;
+    changed.notify_all();
+}
+
+void TFTPBlockRing::wake()
+{
+    // Pairs with the waiter counting itself before it checks the ring
+    // again under the lock, so a wakeup can't slip in between.
+    if (waiters.load(std::memory_order_seq_cst) > 0) {
+        std::lock_guard<std::mutex> lock(mutex);
+        changed.notify_all();
+    }
+}
@@ -0,0 +1,229 @@
+#include "TFTPCompressionStream.h"
+
+#include <string.h>
+
+TFTPCompressionStream::TFTPCompressionStream() {
+    source = NULL;
+    stream = NULL;
+    write = false;
+    deflateReady = false;
+    inflateReady = false;
+    sourceEnd = false;
+    finished = false;
+    position = 0;
+    stats = nullptr;
+    memset(&deflater, 0, sizeof(deflater));
+    memset(&inflater, 0, sizeof(inflater));
+}
+
+TFTPCompressionStream::~TFTPCompressionStream() {
+    if (deflateReady) {
+        deflateEnd(&deflater);
+    }
+    if (inflateReady) {
+        inflateEnd(&inflater);
+    }
+}
+
+FILE *TFTPCompressionStream::open(
+        FILE *source,
+        const bool write,
+        TFTPCompressionStats *stats)
+{
+    if (source == NULL || stream != NULL) {
+        return NULL;
+    }
+
+    // zlib state is kept across uses of a pooled object, only reset.
+    if (write) {
+        if (!inflateReady) {
+            if (inflateInit(&inflater) != Z_OK) {
+                return NULL;
+            }
+            inflateReady = true;
+        } else if (inflateReset(&inflater) != Z_OK) {
+            return NULL;
+        }
+    } else {
+        if (!deflateReady) {
+            if (deflateInit(&deflater, Z_DEFAULT_COMPRESSION) != Z_OK) {
+                return NULL;
+            }
+            deflateReady = true;
+        } else if (deflateReset(&deflater) != Z_OK) {
+            return NULL;
+        }
+        deflater.avail_in = 0;
+    }
+
+    this->source = source;
+    this->write = write;
+    this->stats = stats;
+    sourceEnd = false;
+    finished = false;
+    position = 0;
+    chunk.resize(CHUNK_SIZE);
+
+    cookie_io_functions_t functions;
+    memset(&functions, 0, sizeof(functions));
+    if (write) {
+        functions.write = streamWrite;
+    } else {
+        functions.read = streamRead;
+    }
+    functions.seek = streamSeek;
+    functions.close = streamClose;
+
+    stream = fopencookie(this, write ? "w" : "r", functions);
+    if (stream == NULL) {
+        return NULL;
+    }
+
+    if (write) {
+        setvbuf(stream, NULL, _IONBF, 0);
+    } else {
+        // glibc hands reads of an unbuffered cookie stream over one byte at
+        // a time, a block-sized buffer gets whole blocks passed in one call.
+        setvbuf(stream, streamBuffer, _IOFBF, sizeof(streamBuffer));
+    }
+    return stream;
+}
+
+FILE *TFTPCompressionStream::getSource()
+{
+    return source;
+}
+
+bool TFTPCompressionStream::compress(
+        const void *data,
+        const size_t size,
+        std::vector<char> &compressed)
+{
+    uLongf length = compressBound(size);
+    compressed.resize(length);
+    if (::compress((Bytef *) &compressed[0], &length, (const Bytef *) data, size) != Z_OK) {
+        compressed.clear();
+        return false;
+    }
+    compressed.resize(length);
+    return true;
+}
+
+ssize_t TFTPCompressionStream::streamRead(
+        void *cookie,
+        char *buffer,
+        size_t size)
+{
+    TFTPCompressionStream *self = (TFTPCompressionStream *) cookie;
+    z_stream &z = self->deflater;
+    z.next_out = (Bytef *) buffer;
+    z.avail_out = size;
+
+    // Fill the whole request: the engine takes a short block for the end.
+    while (z.avail_out > 0 && !self->finished) {
+        if (z.avail_in == 0 && !self->sourceEnd) {
+            size_t length = fread(&self->chunk[0], 1, self->chunk.size(), self->source);
+            if (length < self->chunk.size()) {
+                if (ferror(self->source)) {
+                    return -1;
+                }
+                self->sourceEnd = true;
+            }
+            z.next_in = (Bytef *) &self->chunk[0];
+            z.avail_in = length;
+            if (self->stats != nullptr) {
+                self->stats->plainBytes.fetch_add(length, std::memory_order_relaxed);
+            }
+        }
+
+        int result = deflate(&z, self->sourceEnd ? Z_FINISH : Z_NO_FLUSH);
+        if (result == Z_STREAM_END) {
+            self->finished = true;
+        } else if (result != Z_OK && result != Z_BUF_ERROR) {
+            return -1;
+        }
+    }
+
+    size_t produced = size - z.avail_out;
+    self->position += produced;
+    if (self->stats != nullptr) {
+        self->stats->compressedBytes.fetch_add(produced, std::memory_order_relaxed);
+    }
+    return (ssize_t) produced;
+}
+
+ssize_t TFTPCompressionStream::streamWrite(
+        void *cookie,
+        const char *buffer,
+        size_t size)
+{
+    TFTPCompressionStream *self = (TFTPCompressionStream *) cookie;
+    z_stream &z = self->inflater;
+    if (self->finished) {
+        // Nothing is expected after the end of the compressed stream.
+        return size > 0 ? -1 : 0;
+    }
+
+    z.next_in = (Bytef *) buffer;
+    z.avail_in = size;
+    do {
+        z.next_out = (Bytef *) &self->chunk[0];
+        z.avail_out = self->chunk.size();
+        int result = inflate(&z, Z_NO_FLUSH);
+        if (result != Z_OK && result != Z_STREAM_END && result != Z_BUF_ERROR) {
+            return -1;
+        }
+
+        size_t produced = self->chunk.size() - z.avail_out;
+        if (produced > 0 &&
+            fwrite(&self->chunk[0], 1, produced, self->source) != produced) {
+            return -1;
+        }
+        if (self->stats != nullptr) {
+            self->stats->plainBytes.fetch_add(produced, std::memory_order_relaxed);
+        }
+
+        if (result == Z_STREAM_END) {
+            // A flush of our stream doesn't reach the source, hand the
+            // data on now that the transfer is complete.
+            self->finished = true;
+            fflush(self->source);
+            break;
+        }
+    } while (z.avail_in > 0 || z.avail_out == 0);
+
+    self->position += size;
+    if (self->stats != nullptr) {
+        self->stats->compressedBytes.fetch_add(size, std::memory_order_relaxed);
+    }
+    return (ssize_t) size;
+}
+
+int TFTPCompressionStream::streamSeek(
+        void *cookie,
+        off64_t *offset,
+        int whence)
+{
+    TFTPCompressionStream *self = (TFTPCompressionStream *) cookie;
+    // The compressed stream can only be told, not moved.
+    off64_t target = whence == SEEK_CUR ? self->position + *offset :
+                     (whence == SEEK_SET ? *offset : -1);
+    if (target != self->position) {
+        return -1;
+    }
+    *offset = self->position;
+    return 0;
+}
+
+int TFTPCompressionStream::streamClose(
+        void *cookie)
+{
+    TFTPCompressionStream *self = (TFTPCompressionStream *) cookie;
+    if (self->write) {
+        fflush(self->source);
+    }
+    self->stream = NULL;
+    self->source = NULL;
+    self->stats = nullptr;
+    return self->write && !self->finished ? -1 : 0;
+}
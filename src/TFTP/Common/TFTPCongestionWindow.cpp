@@ -0,0 +1,77 @@
+#include "TFTPCongestionWindow.h"
+
+#include <algorithm>
+
+TFTPCongestionWindow::TFTPCongestionWindow() {
+    adaptive = false;
+    maxWindow = 1;
+    window = 1;
+    threshold = 1;
+    inFlight = 0;
+    acknowledged = 0;
+    epoch = 0;
+    losses = 0;
+}
+
+void TFTPCongestionWindow::reset(
+        const int maxWindow,
+        const bool adaptive)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    this->adaptive = adaptive;
+    this->maxWindow = std::max(1, maxWindow);
+    window = adaptive ? 1 : this->maxWindow;
+    threshold = this->maxWindow;
+    acknowledged = 0;
+    epoch++;
+    losses = 0;
+}
+
+uint64_t TFTPCongestionWindow::acquire()
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    released.wait(lock, [this]() { return inFlight < window; });
+    inFlight++;
+    return epoch;
+}
+
+void TFTPCongestionWindow::release(
+        const uint64_t epoch,
+        const bool lost,
+        const bool moved)
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        inFlight--;
+        if (lost) {
+            losses++;
+        }
+
+        if (adaptive && lost && epoch == this->epoch) {
+            threshold = std::max(1, window / 2);
+            window = threshold;
+            acknowledged = 0;
+            this->epoch++;
+        } else if (adaptive && moved && !lost) {
+            if (window < threshold) {
+                window++;
+            } else if (++acknowledged >= window) {
+                window = std::min(window + 1, maxWindow);
+                acknowledged = 0;
+            }
+        }
+    }
+    released.notify_all();
+}
+
+int TFTPCongestionWindow::getWindow()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return window;
+}
+
+uint64_t TFTPCongestionWindow::getLosses()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return losses;
+}
@@ -0,0 +1,44 @@
+#include "TFTPCpuSet.h"
+
+#include <pthread.h>
+
+TFTPCpuSet::TFTPCpuSet() {
+    CPU_ZERO(&cpus);
+    set = false;
+}
+
+bool TFTPCpuSet::assign(
+        const std::vector<int> &cpus)
+{
+    cpu_set_t next;
+    CPU_ZERO(&next);
+    for (int cpu : cpus) {
+        if (cpu < 0 || cpu >= CPU_SETSIZE) {
+            return false;
+        }
+        CPU_SET(cpu, &next);
+    }
+
+    this->cpus = next;
+    set = !cpus.empty();
+    return true;
+}
+
+bool TFTPCpuSet::isSet() const
+{
+    return set;
+}
+
+bool TFTPCpuSet::pinCurrentThread(
+        TFTPCpuSet *previous) const
+{
+    if (!set) {
+        return true;
+    }
+
+    pthread_t self = pthread_self();
+    if (previous != nullptr) {
+        previous->set = pthread_getaffinity_np(self, sizeof(cpu_set_t), &previous->cpus) == 0;
+    }
+    return pthread_setaffinity_np(self, sizeof(cpu_set_t), &cpus) == 0;
+}
@@ -0,0 +1,578 @@
+#include "TFTPDelta.h"
+
+#include <algorithm>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#define TFTP_HASHES_MAGIC "TFTPHSH1"
+#define TFTP_DELTA_MAGIC "TFTPDLT1"
+#define TFTP_CHECKSUM_MAGIC "TFTPSUM1"
+#define TFTP_MAGIC_SIZE 8
+
+// Fields are little-endian, whatever the host.
+static void put32(
+        std::vector<char> &out,
+        const uint32_t value)
+{
+    for (int i = 0; i < 4; i++) {
+        out.push_back((char) (value >> (8 * i)));
+    }
+}
+
+static void put64(
+        std::vector<char> &out,
+        const uint64_t value)
+{
+    for (int i = 0; i < 8; i++) {
+        out.push_back((char) (value >> (8 * i)));
+    }
+}
+
+static uint32_t get32(
+        const char *in)
+{
+    uint32_t value = 0;
+    for (int i = 0; i < 4; i++) {
+        value |= (uint32_t) (unsigned char) in[i] << (8 * i);
+    }
+    return value;
+}
+
+static uint64_t get64(
+        const char *in)
+{
+    uint64_t value = 0;
+    for (int i = 0; i < 8; i++) {
+        value |= (uint64_t) (unsigned char) in[i] << (8 * i);
+    }
+    return value;
+}
+
+// FNV-1a, the whole-file checksum catches what a collision lets through.
+static uint64_t hashBlock(
+        const char *data,
+        const size_t size)
+{
+    uint64_t hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < size; i++) {
+        hash ^= (unsigned char) data[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+static uint32_t checksum(
+        const char *data,
+        const size_t size)
+{
+    uLong crc = crc32(0L, Z_NULL, 0);
+    size_t done = 0;
+    while (done < size) {
+        uInt length = (uInt) std::min<size_t>(size - done, 1 << 30);
+        crc = crc32(crc, (const Bytef *) data + done, length);
+        done += length;
+    }
+    return (uint32_t) crc;
+}
+
+static uint64_t blockLength(
+        const uint64_t size,
+        const uint32_t blockSize,
+        const uint64_t block)
+{
+    uint64_t start = block * blockSize;
+    return start >= size ? 0 : std::min<uint64_t>(blockSize, size - start);
+}
+
+static bool readAt(
+        const int descriptor,
+        char *buffer,
+        const size_t size,
+        const off_t offset)
+{
+    size_t done = 0;
+    while (done < size) {
+        ssize_t length = pread(descriptor, buffer + done, size - done, offset + done);
+        if (length < 0 && errno == EINTR) {
+            continue;
+        }
+        if (length <= 0) {
+            return false;
+        }
+        done += length;
+    }
+    return true;
+}
+
+// Consecutive blocks that differ from the base, as (first block, count).
+static void addChangedBlock(
+        std::vector<std::pair<uint32_t, uint32_t>> &records,
+        const uint64_t block)
+{
+    if (!records.empty() &&
+        records.back().first + records.back().second == block) {
+        records.back().second++;
+    } else {
+        records.push_back(std::make_pair((uint32_t) block, 1u));
+    }
+}
+
+static void putDeltaHeader(
+        std::vector<char> &delta,
+        const TFTPBlockHashes &base,
+        const uint64_t size,
+        const uint32_t newChecksum,
+        const uint32_t records)
+{
+    delta.insert(delta.end(), TFTP_DELTA_MAGIC, TFTP_DELTA_MAGIC + TFTP_MAGIC_SIZE);
+    put64(delta, base.size);
+    put64(delta, size);
+    put32(delta, TFTP_DELTA_BLOCK_SIZE);
+    put32(delta, base.checksum);
+    put32(delta, newChecksum);
+    put32(delta, records);
+}
+
+static bool sameBlock(
+        const TFTPBlockHashes &base,
+        const uint64_t block,
+        const uint64_t length,
+        const uint64_t hash)
+{
+    return base.blockSize == TFTP_DELTA_BLOCK_SIZE && block < base.hashes.size() &&
+           blockLength(base.size, TFTP_DELTA_BLOCK_SIZE, block) == length &&
+           base.hashes[block] == hash;
+}
+
+void TFTPDelta::hash(
+        const char *data,
+        const size_t size,
+        TFTPBlockHashes &hashes)
+{
+    hashes.size = size;
+    hashes.blockSize = TFTP_DELTA_BLOCK_SIZE;
+    hashes.checksum = checksum(data, size);
+    hashes.hashes.clear();
+    for (size_t offset = 0; offset < size; offset += TFTP_DELTA_BLOCK_SIZE) {
+        hashes.hashes.push_back(
+                hashBlock(data + offset, std::min<size_t>(TFTP_DELTA_BLOCK_SIZE, size - offset)));
+    }
+}
+
+static bool readHashes(
+        FILE *file,
+        TFTPBlockHashes &hashes,
+        const bool blocks)
+{
+    hashes.size = 0;
+    hashes.blockSize = TFTP_DELTA_BLOCK_SIZE;
+    hashes.checksum = (uint32_t) crc32(0L, Z_NULL, 0);
+    hashes.hashes.clear();
+    if (file == NULL) {
+        return false;
+    }
+
+    char buffer[TFTP_DELTA_BLOCK_SIZE];
+    size_t length;
+    while ((length = fread(buffer, 1, sizeof(buffer), file)) > 0) {
+        if (blocks) {
+            hashes.hashes.push_back(hashBlock(buffer, length));
+        }
+        hashes.checksum = (uint32_t) crc32(hashes.checksum, (const Bytef *) buffer,
+                                           (uInt) length);
+        hashes.size += length;
+    }
+    return ferror(file) == 0;
+}
+
+bool TFTPDelta::hashFile(
+        FILE *file,
+        TFTPBlockHashes &hashes)
+{
+    return readHashes(file, hashes, true);
+}
+
+bool TFTPDelta::checksumFile(
+        FILE *file,
+        TFTPBlockHashes &hashes)
+{
+    return readHashes(file, hashes, false);
+}
+
+void TFTPDelta::encodeHashes(
+        const TFTPBlockHashes &hashes,
+        std::vector<char> &encoded)
+{
+    encoded.clear();
+    encoded.reserve(HASHES_HEADER_SIZE + hashes.hashes.size() * 8);
+    encoded.insert(encoded.end(), TFTP_HASHES_MAGIC, TFTP_HASHES_MAGIC + TFTP_MAGIC_SIZE);
+    put64(encoded, hashes.size);
+    put32(encoded, hashes.blockSize);
+    put32(encoded, hashes.checksum);
+    put32(encoded, (uint32_t) hashes.hashes.size());
+    for (uint64_t hash : hashes.hashes) {
+        put64(encoded, hash);
+    }
+}
+
+bool TFTPDelta::decodeHashes(
+        const char *data,
+        const size_t size,
+        TFTPBlockHashes &hashes)
+{
+    if (data == nullptr || size < HASHES_HEADER_SIZE ||
+        memcmp(data, TFTP_HASHES_MAGIC, TFTP_MAGIC_SIZE) != 0) {
+        return false;
+    }
+
+    hashes.size = get64(data + 8);
+    hashes.blockSize = get32(data + 16);
+    hashes.checksum = get32(data + 20);
+    uint32_t count = get32(data + 24);
+    if (hashes.blockSize == 0 || size != HASHES_HEADER_SIZE + (size_t) count * 8 ||
+        count != (hashes.size + hashes.blockSize - 1) / hashes.blockSize) {
+        return false;
+    }
+
+    hashes.hashes.resize(count);
+    for (uint32_t i = 0; i < count; i++) {
+        hashes.hashes[i] = get64(data + HASHES_HEADER_SIZE + (size_t) i * 8);
+    }
+    return true;
+}
+
+void TFTPDelta::encodeChecksum(
+        const TFTPBlockHashes &hashes,
+        std::vector<char> &encoded)
+{
+    encoded.clear();
+    encoded.reserve(CHECKSUM_SIZE);
+    encoded.insert(encoded.end(), TFTP_CHECKSUM_MAGIC, TFTP_CHECKSUM_MAGIC + TFTP_MAGIC_SIZE);
+    put64(encoded, hashes.size);
+    put32(encoded, hashes.checksum);
+}
+
+bool TFTPDelta::decodeChecksum(
+        const char *data,
+        const size_t size,
+        TFTPBlockHashes &hashes)
+{
+    if (data == nullptr || size != CHECKSUM_SIZE ||
+        memcmp(data, TFTP_CHECKSUM_MAGIC, TFTP_MAGIC_SIZE) != 0) {
+        return false;
+    }
+
+    hashes.size = get64(data + 8);
+    hashes.blockSize = TFTP_DELTA_BLOCK_SIZE;
+    hashes.checksum = get32(data + 16);
+    hashes.hashes.clear();
+    return true;
+}
+
+void TFTPDelta::encodeDelta(
+        const char *data,
+        const size_t size,
+        const TFTPBlockHashes &base,
+        std::vector<char> &delta)
+{
+    const uint32_t blockSize = TFTP_DELTA_BLOCK_SIZE;
+    uint64_t blocks = (size + blockSize - 1) / blockSize;
+
+    std::vector<std::pair<uint32_t, uint32_t>> records;
+    for (uint64_t block = 0; block < blocks; block++) {
+        uint64_t length = blockLength(size, blockSize, block);
+        if (!sameBlock(base, block, length, hashBlock(data + block * blockSize, length))) {
+            addChangedBlock(records, block);
+        }
+    }
+
+    delta.clear();
+    putDeltaHeader(delta, base, size, checksum(data, size), (uint32_t) records.size());
+    for (const std::pair<uint32_t, uint32_t> &record : records) {
+        put32(delta, record.first);
+        put32(delta, record.second);
+        uint64_t start = (uint64_t) record.first * blockSize;
+        uint64_t end = std::min<uint64_t>(size, start + (uint64_t) record.second * blockSize);
+        delta.insert(delta.end(), data + start, data + end);
+    }
+}
+
+bool TFTPDelta::encodeDeltaFile(
+        const int descriptor,
+        const off_t offset,
+        const uint64_t size,
+        const TFTPBlockHashes &base,
+        FILE *delta)
+{
+    if (descriptor < 0 || delta == NULL) {
+        return false;
+    }
+
+    // First pass finds the changed blocks and the checksum, the second
+    // copies the changed blocks. Only one block is held at a time.
+    const uint32_t blockSize = TFTP_DELTA_BLOCK_SIZE;
+    uint64_t blocks = (size + blockSize - 1) / blockSize;
+    char buffer[TFTP_DELTA_BLOCK_SIZE];
+    uint32_t newChecksum = (uint32_t) crc32(0L, Z_NULL, 0);
+    std::vector<std::pair<uint32_t, uint32_t>> records;
+    for (uint64_t block = 0; block < blocks; block++) {
+        uint64_t length = blockLength(size, blockSize, block);
+        if (!readAt(descriptor, buffer, length, offset + block * blockSize)) {
+            return false;
+        }
+        newChecksum = (uint32_t) crc32(newChecksum, (const Bytef *) buffer, (uInt) length);
+        if (!sameBlock(base, block, length, hashBlock(buffer, length))) {
+            addChangedBlock(records, block);
+        }
+    }
+
+    std::vector<char> header;
+    putDeltaHeader(header, base, size, newChecksum, (uint32_t) records.size());
+    if (fwrite(header.data(), 1, header.size(), delta) != header.size()) {
+        return false;
+    }
+    for (const std::pair<uint32_t, uint32_t> &record : records) {
+        header.clear();
+        put32(header, record.first);
+        put32(header, record.second);
+        if (fwrite(header.data(), 1, header.size(), delta) != header.size()) {
+            return false;
+        }
+        for (uint64_t block = record.first; block < (uint64_t) record.first + record.second;
+             block++) {
+            uint64_t length = blockLength(size, blockSize, block);
+            if (!readAt(descriptor, buffer, length, offset + block * blockSize) ||
+                fwrite(buffer, 1, length, delta) != length) {
+                return false;
+            }
+        }
+    }
+    return fflush(delta) == 0;
+}
+
+bool TFTPDelta::readAll(
+        FILE *file,
+        std::vector<char> &content)
+{
+    content.clear();
+    if (file == NULL) {
+        return false;
+    }
+
+    char buffer[TFTP_DELTA_BLOCK_SIZE];
+    size_t length;
+    while ((length = fread(buffer, 1, sizeof(buffer), file)) > 0) {
+        content.insert(content.end(), buffer, buffer + length);
+    }
+    return ferror(file) == 0;
+}
+
+TFTPDeltaStream::TFTPDeltaStream() {
+    target = NULL;
+    stream = NULL;
+    base = NULL;
+    baseSize = 0;
+    baseChecksum = 0;
+    headerLength = 0;
+    headerDone = false;
+    recordLength = 0;
+    inRecord = false;
+    finished = false;
+    failed = false;
+    newSize = 0;
+    newChecksum = 0;
+    recordsLeft = 0;
+    recordLeft = 0;
+    written = 0;
+    checksum = 0;
+}
+
+FILE *TFTPDeltaStream::open(
+        FILE *target,
+        FILE *base,
+        const TFTPBlockHashes &baseSum)
+{
+    if (target == NULL || base == NULL || target == base || stream != NULL) {
+        return NULL;
+    }
+
+    this->target = target;
+    this->base = base;
+    baseSize = baseSum.size;
+    baseChecksum = baseSum.checksum;
+    // A pooled stream keeps its buffer.
+    copyBuffer.resize(COPY_BUFFER_SIZE);
+    headerLength = 0;
+    headerDone = false;
+    recordLength = 0;
+    inRecord = false;
+    finished = false;
+    failed = false;
+    written = 0;
+    checksum = (uint32_t) crc32(0L, Z_NULL, 0);
+
+    cookie_io_functions_t functions;
+    memset(&functions, 0, sizeof(functions));
+    functions.write = streamWrite;
+    functions.close = streamClose;
+
+    stream = fopencookie(this, "w", functions);
+    if (stream == NULL) {
+        this->base = NULL;
+        return NULL;
+    }
+    setvbuf(stream, NULL, _IONBF, 0);
+    return stream;
+}
+
+FILE *TFTPDeltaStream::getTarget()
+{
+    return target;
+}
+
+FILE *TFTPDeltaStream::getBase()
+{
+    return base;
+}
+
+ssize_t TFTPDeltaStream::streamWrite(
+        void *cookie,
+        const char *buffer,
+        size_t size)
+{
+    TFTPDeltaStream *self = (TFTPDeltaStream *) cookie;
+    size_t position = 0;
+    while (position < size && !self->failed) {
+        size_t available = size - position;
+        if (self->finished) {
+            // Nothing is expected after the last record.
+            self->failed = true;
+        } else if (!self->headerDone) {
+            size_t length = std::min(available, sizeof(self->header) - self->headerLength);
+            memcpy(self->header + self->headerLength, buffer + position, length);
+            self->headerLength += length;
+            position += length;
+            if (self->headerLength == sizeof(self->header)) {
+                self->headerDone = true;
+                self->failed = !self->parseHeader() ||
+                               (self->recordsLeft == 0 && !self->finish());
+            }
+        } else if (!self->inRecord) {
+            size_t length = std::min(available, sizeof(self->record) - self->recordLength);
+            memcpy(self->record + self->recordLength, buffer + position, length);
+            self->recordLength += length;
+            position += length;
+            if (self->recordLength == sizeof(self->record)) {
+                uint64_t start = (uint64_t) get32(self->record) * TFTP_DELTA_BLOCK_SIZE;
+                uint64_t end = std::min<uint64_t>(
+                        self->newSize, start + (uint64_t) get32(self->record + 4) * TFTP_DELTA_BLOCK_SIZE);
+                if (start < self->written || start >= end || !self->copyBase(start)) {
+                    self->failed = true;
+                    break;
+                }
+                self->recordLeft = end - start;
+                self->recordLength = 0;
+                self->inRecord = true;
+            }
+        } else {
+            size_t length = (size_t) std::min<uint64_t>(available, self->recordLeft);
+            if (!self->output(buffer + position, length)) {
+                self->failed = true;
+                break;
+            }
+            position += length;
+            self->recordLeft -= length;
+            if (self->recordLeft == 0) {
+                self->inRecord = false;
+                if (--self->recordsLeft == 0 && !self->finish()) {
+                    self->failed = true;
+                }
+            }
+        }
+    }
+    return self->failed ? -1 : (ssize_t) size;
+}
+
+int TFTPDeltaStream::streamClose(
+        void *cookie)
+{
+    TFTPDeltaStream *self = (TFTPDeltaStream *) cookie;
+    bool complete = self->finished && !self->failed;
+    self->stream = NULL;
+    return complete ? 0 : -1;
+}
+
+bool TFTPDeltaStream::parseHeader()
+{
+    if (memcmp(header, TFTP_DELTA_MAGIC, TFTP_MAGIC_SIZE) != 0) {
+        return false;
+    }
+
+    uint64_t baseSize = get64(header + 8);
+    newSize = get64(header + 16);
+    uint32_t blockSize = get32(header + 24);
+    uint32_t baseChecksum = get32(header + 28);
+    newChecksum = get32(header + 32);
+    recordsLeft = get32(header + 36);
+
+    // The delta is only good for the content it was computed against.
+    return blockSize == TFTP_DELTA_BLOCK_SIZE && baseSize == this->baseSize &&
+           baseChecksum == this->baseChecksum;
+}
+
+bool TFTPDeltaStream::copyBase(
+        const uint64_t end)
+{
+    if (end == written) {
+        return true;
+    }
+    if (end > baseSize || end < written) {
+        return false;
+    }
+
+    // Unchanged blocks are at the same offset in both versions.
+    int descriptor = fileno(base);
+    if (descriptor < 0 && fseeko(base, written, SEEK_SET) != 0) {
+        return false;
+    }
+    while (written < end) {
+        size_t length = (size_t) std::min<uint64_t>(end - written, copyBuffer.size());
+        bool read = descriptor >= 0 ?
+                    readAt(descriptor, &copyBuffer[0], length, written) :
+                    fread(&copyBuffer[0], 1, length, base) == length;
+        if (!read || !output(&copyBuffer[0], length)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool TFTPDeltaStream::output(
+        const char *data,
+        const size_t size)
+{
+    if (size == 0) {
+        return true;
+    }
+    if (fwrite(data, 1, size, target) != size) {
+        return false;
+    }
+    checksum = (uint32_t) crc32(checksum, (const Bytef *) data, (uInt) size);
+    written += size;
+    return true;
+}
+
+bool TFTPDeltaStream::finish()
+{
+    if (!copyBase(newSize) || written != newSize || checksum != newChecksum) {
+        return false;
+    }
+
+    // A flush of our stream doesn't reach the target, hand the file on
+    // now that it is complete.
+    fflush(target);
+    finished = true;
+    return true;
+}
@@ -0,0 +1,142 @@
+#include "TFTPLatencyHistogram.h"
+
+#include <math.h>
+
+TFTPLatencyHistogram::TFTPLatencyHistogram() {
+    reset();
+}
+
+size_t TFTPLatencyHistogram::bucketIndex(
+        const uint64_t value)
+{
+    if (value < SUB_BUCKETS) {
+        return (size_t) value;
+    }
+
+    uint64_t clamped = value < (1ULL << MAX_VALUE_BITS) ?
+                       value : (1ULL << MAX_VALUE_BITS) - 1;
+    int highestBit = 63 - __builtin_clzll(clamped);
+    int shift = highestBit - (SUB_BUCKET_BITS - 1);
+    size_t subBucket = (size_t) (clamped >> shift) - SUB_BUCKETS / 2;
+    return SUB_BUCKETS + (shift - 1) * (SUB_BUCKETS / 2) + subBucket;
+}
+
+uint64_t TFTPLatencyHistogram::bucketValue(
+        const size_t index)
+{
+    if (index < SUB_BUCKETS) {
+        return index;
+    }
+
+    // Highest value that lands in the bucket.
+    size_t offset = index - SUB_BUCKETS;
+    int shift = (int) (offset / (SUB_BUCKETS / 2)) + 1;
+    uint64_t subBucket = SUB_BUCKETS / 2 + offset % (SUB_BUCKETS / 2);
+    return ((subBucket + 1) << shift) - 1;
+}
+
+void TFTPLatencyHistogram::record(
+        const uint64_t value)
+{
+    counts[bucketIndex(value)].fetch_add(1, std::memory_order_relaxed);
+    count.fetch_add(1, std::memory_order_relaxed);
+    sum.fetch_add(value, std::memory_order_relaxed);
+
+    uint64_t current = min.load(std::memory_order_relaxed);
+    while (value < current &&
+           !min.compare_exchange_weak(current, value, std::memory_order_relaxed)) {
+    }
+    current = max.load(std::memory_order_relaxed);
+    while (value > current &&
+           !max.compare_exchange_weak(current, value, std::memory_order_relaxed)) {
+    }
+}
+
+void TFTPLatencyHistogram::merge(
+        const TFTPLatencyHistogram &other)
+{
+    uint64_t otherCount = other.count.load(std::memory_order_relaxed);
+    if (otherCount == 0) {
+        return;
+    }
+
+    for (size_t i = 0; i < BUCKET_COUNT; ++i) {
+        uint64_t bucket = other.counts[i].load(std::memory_order_relaxed);
+        if (bucket > 0) {
+            counts[i].fetch_add(bucket, std::memory_order_relaxed);
+        }
+    }
+    count.fetch_add(otherCount, std::memory_order_relaxed);
+    sum.fetch_add(other.sum.load(std::memory_order_relaxed), std::memory_order_relaxed);
+
+    uint64_t value = other.min.load(std::memory_order_relaxed);
+    uint64_t current = min.load(std::memory_order_relaxed);
+    while (value < current &&
+           !min.compare_exchange_weak(current, value, std::memory_order_relaxed)) {
+    }
+    value = other.max.load(std::memory_order_relaxed);
+    current = max.load(std::memory_order_relaxed);
+    while (value > current &&
+           !max.compare_exchange_weak(current, value, std::memory_order_relaxed)) {
+    }
+}
+
+void TFTPLatencyHistogram::reset()
+{
+    for (size_t i = 0; i < BUCKET_COUNT; ++i) {
+        counts[i].store(0, std::memory_order_relaxed);
+    }
+    count.store(0, std::memory_order_relaxed);
+    sum.store(0, std::memory_order_relaxed);
+    min.store(UINT64_MAX, std::memory_order_relaxed);
+    max.store(0, std::memory_order_relaxed);
+}
+
+uint64_t TFTPLatencyHistogram::getCount() const
+{
+    return count.load(std::memory_order_relaxed);
+}
+
+uint64_t TFTPLatencyHistogram::getValueAtPercentile(
+        const double percentile) const
+{
+    uint64_t total = count.load(std::memory_order_relaxed);
+    if (total == 0) {
+        return 0;
+    }
+
+    double fraction = percentile < 0 ? 0 : (percentile > 100 ? 1 : percentile / 100);
+    uint64_t target = (uint64_t) ceil(fraction * total);
+    if (target == 0) {
+        target = 1;
+    }
+
+    uint64_t highest = max.load(std::memory_order_relaxed);
+    uint64_t seen = 0;
+    for (size_t i = 0; i < BUCKET_COUNT; ++i) {
+        seen += counts[i].load(std::memory_order_relaxed);
+        if (seen >= target) {
+            uint64_t value = bucketValue(i);
+            return value < highest ? value : highest;
+        }
+    }
+    return highest;
+}
+
+void TFTPLatencyHistogram::getSummary(
+        TFTPLatencySummary *summary) const
+{
+    if (summary == nullptr) {
+        return;
+    }
+
+    summary->count = count.load(std::memory_order_relaxed);
+    summary->min = summary->count > 0 ? min.load(std::memory_order_relaxed) : 0;
+    summary->max = max.load(std::memory_order_relaxed);
+    summary->mean = summary->count > 0 ?
+                    (double) sum.load(std::memory_order_relaxed) / summary->count : 0;
+    summary->p50 = getValueAtPercentile(50);
+    summary->p90 = getValueAtPercentile(90);
+    summary->p99 = getValueAtPercentile(99);
+    summary->p999 = getValueAtPercentile(99.9);
+}
@@ -0,0 +1,121 @@
+#include "TFTPLocalTransport.h"
+
+#include <arpa/inet.h>
+#include <atomic>
+#include <map>
+#include <mutex>
+#include <string.h>
+
+// Kept apart from the engine's section ids.
+#define TFTP_LOCAL_SECTION_ID_BASE (1ULL << 62)
+
+struct TFTPLocalPort {
+    tftpLocalSectionStarter starter;
+    void *context;
+};
+
+static std::mutex registryMutex;
+static std::map<int, TFTPLocalPort> registry;
+static std::atomic<uint64_t> nextSectionId(TFTP_LOCAL_SECTION_ID_BASE);
+static thread_local TFTPLocalSection *currentSection = nullptr;
+
+TFTPLocalSection::TFTPLocalSection(
+        const std::string &filename,
+        const bool write)
+{
+    this->filename = filename;
+    this->write = write;
+    id = nextSectionId.fetch_add(1, std::memory_order_relaxed);
+    succeeded = false;
+    failed = false;
+    errorCode = 0;
+}
+
+TFTPLocalSection *TFTPLocalSection::current()
+{
+    return currentSection;
+}
+
+void TFTPLocalSection::setCurrent(
+        TFTPLocalSection *section)
+{
+    currentSection = section;
+}
+
+void TFTPLocalSection::fail(
+        const short code,
+        const char *message)
+{
+    if (!failed) {
+        failed = true;
+        errorCode = serverMessage.empty() ? code : 0;
+        errorMessage = serverMessage.empty() ? message : serverMessage;
+    }
+    ring.abort();
+}
+
+void TFTPLocalSection::join()
+{
+    if (serverThread.joinable()) {
+        serverThread.join();
+    }
+}
+
+void TFTPLocalTransport::registerPort(
+        const int port,
+        tftpLocalSectionStarter starter,
+        void *context)
+{
+    std::lock_guard<std::mutex> lock(registryMutex);
+    TFTPLocalPort entry;
+    entry.starter = starter;
+    entry.context = context;
+    registry[port] = entry;
+}
+
+void TFTPLocalTransport::unregisterPort(
+        const int port,
+        void *context)
+{
+    std::lock_guard<std::mutex> lock(registryMutex);
+    std::map<int, TFTPLocalPort>::iterator it = registry.find(port);
+    if (it != registry.end() && it->second.context == context) {
+        registry.erase(it);
+    }
+}
+
+bool TFTPLocalTransport::startSection(
+        const int port,
+        TFTPLocalSection *section)
+{
+    // Started under the lock, so the server can't go away in between.
+    std::lock_guard<std::mutex> lock(registryMutex);
+    std::map<int, TFTPLocalPort>::iterator it = registry.find(port);
+    return it != registry.end() && it->second.starter(section, it->second.context);
+}
+
+bool TFTPLocalTransport::isServed(
+        const int port)
+{
+    std::lock_guard<std::mutex> lock(registryMutex);
+    return registry.find(port) != registry.end();
+}
+
+bool TFTPLocalTransport::isLoopback(
+        const char *host)
+{
+    if (host == nullptr) {
+        return false;
+    }
+    if (strcmp(host, "localhost") == 0) {
+        return true;
+    }
+
+    struct in_addr address4;
+    if (inet_pton(AF_INET, host, &address4) == 1) {
+        return (ntohl(address4.s_addr) >> 24) == 127;
+    }
+    struct in6_addr address6;
+    return inet_pton(AF_INET6, host, &address6) == 1 &&
+           memcmp(&address6, &in6addr_loopback, sizeof(address6)) == 0;
+}
@@ -0,0 +1,97 @@
+#include "TFTPMemoryStream.h"
+
+#include <string.h>
+
+TFTPMemoryStream::TFTPMemoryStream() {
+    data = nullptr;
+    size = 0;
+    position = 0;
+    stream = NULL;
+}
+
+FILE *TFTPMemoryStream::open(
+        const void *data,
+        const size_t size)
+{
+    if ((data == nullptr && size > 0) || stream != NULL) {
+        return NULL;
+    }
+
+    this->data = (const char *) data;
+    this->size = size;
+    position = 0;
+
+    cookie_io_functions_t functions;
+    memset(&functions, 0, sizeof(functions));
+    functions.read = streamRead;
+    functions.seek = streamSeek;
+    functions.close = streamClose;
+
+    stream = fopencookie(this, "r", functions);
+    if (stream == NULL) {
+        return NULL;
+    }
+
+    // glibc hands reads of an unbuffered cookie stream over one byte at a
+    // time, a block-sized buffer gets whole blocks passed in one call.
+    setvbuf(stream, streamBuffer, _IOFBF, sizeof(streamBuffer));
+    return stream;
+}
+
+ssize_t TFTPMemoryStream::streamRead(
+        void *cookie,
+        char *buffer,
+        size_t size)
+{
+    TFTPMemoryStream *self = (TFTPMemoryStream *) cookie;
+    size_t available = self->size - self->position;
+    size_t chunk = size < available ? size : available;
+
+    if (chunk > 0) {
+        memcpy(buffer, self->data + self->position, chunk);
+        self->position += chunk;
+    }
+    return (ssize_t) chunk;
+}
+
+int TFTPMemoryStream::streamSeek(
+        void *cookie,
+        off64_t *offset,
+        int whence)
+{
+    TFTPMemoryStream *self = (TFTPMemoryStream *) cookie;
+    off64_t base;
+    switch (whence) {
+        case SEEK_SET:
+            base = 0;
+            break;
+        case SEEK_CUR:
+            base = (off64_t) self->position;
+            break;
+        case SEEK_END:
+            base = (off64_t) self->size;
+            break;
+        default:
+            return -1;
+    }
+
+    off64_t target = base + *offset;
+    if (target < 0 || target > (off64_t) self->size) {
+        return -1;
+    }
+
+    self->position = (size_t) target;
+    *offset = target;
+    return 0;
+}
+
+int TFTPMemoryStream::streamClose(
+        void *cookie)
+{
+    TFTPMemoryStream *self = (TFTPMemoryStream *) cookie;
+    self->stream = NULL;
+    self->data = nullptr;
+    self->size = 0;
+    self->position = 0;
+    return 0;
+}
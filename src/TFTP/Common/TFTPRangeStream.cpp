@@ -0,0 +1,298 @@
+#include "TFTPRangeStream.h"
+
+#include <algorithm>
+#include <errno.h>
+#include <math.h>
+#include <string.h>
+#include <unistd.h>
+#include <zlib.h>
+
+// Digits only, no sign or spaces strtoull() would let through.
+static const char *parseNumber(
+        const char *text,
+        uint64_t *value)
+{
+    if (*text < '0' || *text > '9') {
+        return nullptr;
+    }
+
+    *value = 0;
+    for (; *text >= '0' && *text <= '9'; text++) {
+        uint64_t digit = *text - '0';
+        if (*value > (UINT64_MAX - digit) / 10) {
+            return nullptr;
+        }
+        *value = *value * 10 + digit;
+    }
+    return text;
+}
+
+TFTPRangeStream::TFTPRangeStream() {
+    source = NULL;
+    descriptor = -1;
+    memory = nullptr;
+    stream = NULL;
+    write = false;
+    failed = false;
+    offset = 0;
+    length = 0;
+    position = 0;
+    checksum = 0;
+    gap = 0;
+    gapDeviation = 0;
+    stalls = 0;
+}
+
+FILE *TFTPRangeStream::open(
+        FILE *source,
+        const uint64_t offset,
+        const uint64_t length,
+        const bool write)
+{
+    if (source == NULL || stream != NULL || fseeko(source, offset, SEEK_SET) != 0) {
+        return NULL;
+    }
+
+    this->source = source;
+    descriptor = -1;
+    memory = nullptr;
+    this->offset = offset;
+    this->length = length;
+    return open(write);
+}
+
+FILE *TFTPRangeStream::open(
+        const int descriptor,
+        const uint64_t offset,
+        const uint64_t length,
+        const bool write)
+{
+    if (descriptor < 0 || stream != NULL) {
+        return NULL;
+    }
+
+    source = NULL;
+    this->descriptor = descriptor;
+    memory = nullptr;
+    this->offset = offset;
+    this->length = length;
+    return open(write);
+}
+
+FILE *TFTPRangeStream::open(
+        char *memory,
+        const uint64_t length,
+        const bool write)
+{
+    if ((memory == nullptr && length > 0) || stream != NULL) {
+        return NULL;
+    }
+
+    source = NULL;
+    descriptor = -1;
+    this->memory = memory;
+    offset = 0;
+    this->length = length;
+    return open(write);
+}
+
+FILE *TFTPRangeStream::open(
+        const bool write)
+{
+    this->write = write;
+    failed = false;
+    position = 0;
+    checksum = (uint32_t) crc32(0L, Z_NULL, 0);
+    lastBlock = std::chrono::steady_clock::now();
+    gap = 0;
+    gapDeviation = 0;
+    stalls = 0;
+
+    cookie_io_functions_t functions;
+    memset(&functions, 0, sizeof(functions));
+    if (write) {
+        functions.write = streamWrite;
+    } else {
+        functions.read = streamRead;
+    }
+    functions.close = streamClose;
+
+    stream = fopencookie(this, write ? "w" : "r", functions);
+    if (stream == NULL) {
+        return NULL;
+    }
+
+    if (write) {
+        setvbuf(stream, NULL, _IONBF, 0);
+    } else {
+        // An unbuffered cookie stream is read a byte at a time, see
+        // TFTPMemoryStream.
+        setvbuf(stream, streamBuffer, _IOFBF, sizeof(streamBuffer));
+    }
+    return stream;
+}
+
+FILE *TFTPRangeStream::getSource()
+{
+    return source;
+}
+
+uint32_t TFTPRangeStream::getChecksum()
+{
+    return checksum;
+}
+
+uint64_t TFTPRangeStream::getStalls()
+{
+    return stalls;
+}
+
+void TFTPRangeStream::countBlock()
+{
+    // The gap is tracked the way TCP tracks its round trip time, a gap
+    // past four deviations of the mean waited for a retransmission.
+    std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+    double elapsed = std::chrono::duration<double, std::milli>(now - lastBlock).count();
+    lastBlock = now;
+    if (elapsed >= STALL_MIN_MS && elapsed > gap + 4 * gapDeviation) {
+        stalls++;
+        return;
+    }
+    gapDeviation += (fabs(elapsed - gap) - gapDeviation) / 4;
+    gap += (elapsed - gap) / 8;
+}
+
+std::string TFTPRangeStream::encodeRange(
+        const TFTPRange &range)
+{
+    std::string text = std::to_string(range.offset) + ":" + std::to_string(range.length);
+    if (range.total > 0) {
+        text += ":" + std::to_string(range.total);
+    }
+    return text;
+}
+
+bool TFTPRangeStream::decodeRange(
+        const char *text,
+        TFTPRange &range)
+{
+    range.total = 0;
+    text = parseNumber(text, &range.offset);
+    if (text == nullptr || *text++ != ':') {
+        return false;
+    }
+    text = parseNumber(text, &range.length);
+    if (text != nullptr && *text == ':') {
+        text = parseNumber(text + 1, &range.total);
+    }
+    if (text == nullptr || *text != '\0' || range.offset > UINT64_MAX - range.length) {
+        return false;
+    }
+    return range.total == 0 || range.offset + range.length <= range.total;
+}
+
+std::string TFTPRangeStream::encodeSize(
+        const uint64_t size)
+{
+    return std::to_string(size);
+}
+
+bool TFTPRangeStream::decodeSize(
+        const char *text,
+        const size_t length,
+        uint64_t *size)
+{
+    // Short, a number is at most 20 digits.
+    char terminated[24];
+    if (text == nullptr || length == 0 || length >= sizeof(terminated)) {
+        return false;
+    }
+    memcpy(terminated, text, length);
+    terminated[length] = '\0';
+    const char *end = parseNumber(terminated, size);
+    return end != nullptr && *end == '\0';
+}
+
+ssize_t TFTPRangeStream::streamRead(
+        void *cookie,
+        char *buffer,
+        size_t size)
+{
+    TFTPRangeStream *self = (TFTPRangeStream *) cookie;
+    size_t chunk = (size_t) std::min<uint64_t>(size, self->length - self->position);
+    ssize_t read = 0;
+    if (chunk == 0) {
+        return 0;
+    } else if (self->memory != nullptr) {
+        memcpy(buffer, self->memory + self->position, chunk);
+        read = (ssize_t) chunk;
+    } else if (self->source != NULL) {
+        read = (ssize_t) fread(buffer, 1, chunk, self->source);
+        if (read == 0 && ferror(self->source)) {
+            read = -1;
+        }
+    } else {
+        while ((read = pread(self->descriptor, buffer, chunk,
+                             self->offset + self->position)) < 0 && errno == EINTR) {
+        }
+    }
+
+    if (read < 0) {
+        self->failed = true;
+        return -1;
+    }
+    self->checksum = (uint32_t) crc32(self->checksum, (const Bytef *) buffer, (uInt) read);
+    self->position += read;
+    self->countBlock();
+    return read;
+}
+
+ssize_t TFTPRangeStream::streamWrite(
+        void *cookie,
+        const char *buffer,
+        size_t size)
+{
+    TFTPRangeStream *self = (TFTPRangeStream *) cookie;
+    if (self->failed || size > self->length - self->position) {
+        // Past the range, another range's bytes.
+        self->failed = true;
+        return -1;
+    }
+
+    if (self->memory != nullptr) {
+        memcpy(self->memory + self->position, buffer, size);
+    } else if (self->source != NULL) {
+        // Flushed with the last byte of the range, the other ranges may be
+        // done already and the file read back.
+        self->failed = fwrite(buffer, 1, size, self->source) != size ||
+                       (self->position + size == self->length && fflush(self->source) != 0);
+    } else {
+        size_t written = 0;
+        while (written < size && !self->failed) {
+            ssize_t length = pwrite(self->descriptor, buffer + written, size - written,
+                                    self->offset + self->position + written);
+            if (length > 0) {
+                written += length;
+            } else if (length == 0 || errno != EINTR) {
+                self->failed = true;
+            }
+        }
+    }
+
+    if (self->failed) {
+        return -1;
+    }
+    self->checksum = (uint32_t) crc32(self->checksum, (const Bytef *) buffer, (uInt) size);
+    self->position += size;
+    self->countBlock();
+    return (ssize_t) size;
+}
+
+int TFTPRangeStream::streamClose(
+        void *cookie)
+{
+    TFTPRangeStream *self = (TFTPRangeStream *) cookie;
+    bool complete = !self->failed && self->position == self->length;
+    self->stream = NULL;
+    return complete ? 0 : -1;
+}
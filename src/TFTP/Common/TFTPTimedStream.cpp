@@ -0,0 +1,145 @@
+#include "TFTPTimedStream.h"
+
+#include <string.h>
+
+TFTPTimedStream::TFTPTimedStream() {
+    source = NULL;
+    stream = NULL;
+    firstCall = true;
+    largestWrite = 0;
+    firstBlock = nullptr;
+    roundTrip = nullptr;
+    bytes = nullptr;
+}
+
+FILE *TFTPTimedStream::open(
+        FILE *source,
+        const bool write,
+        const std::chrono::steady_clock::time_point start,
+        TFTPLatencyHistogram *firstBlock,
+        TFTPLatencyHistogram *roundTrip,
+        std::atomic<uint64_t> *bytes)
+{
+    if (source == NULL || firstBlock == nullptr || roundTrip == nullptr ||
+        stream != NULL) {
+        return NULL;
+    }
+
+    this->source = source;
+    this->firstBlock = firstBlock;
+    this->roundTrip = roundTrip;
+    this->bytes = bytes;
+    firstCall = true;
+    largestWrite = 0;
+    last = start;
+
+    cookie_io_functions_t functions;
+    memset(&functions, 0, sizeof(functions));
+    if (write) {
+        functions.write = streamWrite;
+    } else {
+        functions.read = streamRead;
+    }
+    functions.seek = streamSeek;
+    functions.close = streamClose;
+
+    stream = fopencookie(this, write ? "w" : "r", functions);
+    if (stream == NULL) {
+        return NULL;
+    }
+
+    if (write) {
+        setvbuf(stream, NULL, _IONBF, 0);
+    } else {
+        // glibc hands reads of an unbuffered cookie stream over one byte at
+        // a time, a block-sized buffer gets whole blocks passed in one call.
+        setvbuf(stream, streamBuffer, _IOFBF, sizeof(streamBuffer));
+    }
+    return stream;
+}
+
+FILE *TFTPTimedStream::getSource()
+{
+    return source;
+}
+
+void TFTPTimedStream::recordBlock()
+{
+    std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+    uint64_t elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(
+            now - last).count();
+    (firstCall ? firstBlock : roundTrip)->record(elapsed);
+    firstCall = false;
+    last = now;
+}
+
+ssize_t TFTPTimedStream::streamRead(
+        void *cookie,
+        char *buffer,
+        size_t size)
+{
+    TFTPTimedStream *self = (TFTPTimedStream *) cookie;
+    size_t length = fread(buffer, 1, size, self->source);
+    // stdio asks again after a short block, only count calls that move data.
+    if (length > 0) {
+        self->recordBlock();
+        if (self->bytes != nullptr) {
+            self->bytes->fetch_add(length, std::memory_order_relaxed);
+        }
+    }
+    return ferror(self->source) && length == 0 ? -1 : (ssize_t) length;
+}
+
+ssize_t TFTPTimedStream::streamWrite(
+        void *cookie,
+        const char *buffer,
+        size_t size)
+{
+    TFTPTimedStream *self = (TFTPTimedStream *) cookie;
+    self->recordBlock();
+    size_t length = fwrite(buffer, 1, size, self->source);
+    if (self->bytes != nullptr) {
+        self->bytes->fetch_add(length, std::memory_order_relaxed);
+    }
+
+    // A flush of our stream doesn't reach the source. A block shorter than
+    // the ones before ends the transfer, so hand the data on right away
+    // like the engine meant to.
+    if (size < self->largestWrite || self->largestWrite == 0) {
+        fflush(self->source);
+    }
+    if (size > self->largestWrite) {
+        self->largestWrite = size;
+    }
+    return length == 0 && size > 0 ? -1 : (ssize_t) length;
+}
+
+int TFTPTimedStream::streamSeek(
+        void *cookie,
+        off64_t *offset,
+        int whence)
+{
+    TFTPTimedStream *self = (TFTPTimedStream *) cookie;
+    if (fseeko(self->source, *offset, whence) != 0) {
+        return -1;
+    }
+
+    off64_t position = ftello(self->source);
+    if (position < 0) {
+        return -1;
+    }
+    *offset = position;
+    return 0;
+}
+
+int TFTPTimedStream::streamClose(
+        void *cookie)
+{
+    TFTPTimedStream *self = (TFTPTimedStream *) cookie;
+    // The engine may have written through us, hand the data on before the
+    // source is closed by its owner.
+    fflush(self->source);
+    self->stream = NULL;
+    self->source = NULL;
+    return 0;
+}
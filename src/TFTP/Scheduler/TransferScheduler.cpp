@@ -0,0 +1,425 @@
+#include "TransferScheduler.h"
+#include "TFTPClient.h"
+
+#include <algorithm>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <system_error>
+
+#define DEFAULT_MAX_CONCURRENT_TRANSFERS 4
+#define DEFAULT_MAX_TRANSFERS_PER_HOST 1
+#define DEFAULT_RETRY_DELAY_MS 1000
+#define WAIT_MESSAGE_PREFIX "WAIT:"
+#define MAX_WAIT_SECONDS 3600
+
+namespace {
+
+// The delay a WAIT message asks for, clamped. Without a positive number of
+// seconds, the configured delay.
+int waitDelay(
+        const std::string &message,
+        const int fallback)
+{
+    const char *text = message.c_str() + strlen(WAIT_MESSAGE_PREFIX);
+    char *end = nullptr;
+    errno = 0;
+    long seconds = strtol(text, &end, 10);
+    if (end == text || errno != 0 || seconds <= 0) {
+        return fallback;
+    }
+    return (int) std::min<long>(seconds, MAX_WAIT_SECONDS) * 1000;
+}
+
+struct AttemptContext {
+    bool errorReceived;
+    short errorCode;
+    std::string errorMessage;
+    std::atomic<uint64_t> *bytesFetched;
+};
+
+TftpClientOperationResult attemptErrorCbk(
+        short error_code,
+        std::string &error_message,
+        void *context)
+{
+    AttemptContext *attempt = (AttemptContext *) context;
+    attempt->errorReceived = true;
+    attempt->errorCode = error_code;
+    attempt->errorMessage = error_message;
+    return TftpClientOperationResult::TFTP_CLIENT_OK;
+}
+
+TftpClientOperationResult attemptDataReceivedCbk(
+        int dataSize,
+        void *context)
+{
+    AttemptContext *attempt = (AttemptContext *) context;
+    if (dataSize > 0) {
+        attempt->bytesFetched->fetch_add(dataSize, std::memory_order_relaxed);
+    }
+    return TftpClientOperationResult::TFTP_CLIENT_OK;
+}
+
+} // namespace
+
+TransferScheduler::TransferScheduler() {
+    running = false;
+    nextJobId = 1;
+    memset(&progress, 0, sizeof(progress));
+    bytesFetched = 0;
+
+    maxConcurrentTransfers = DEFAULT_MAX_CONCURRENT_TRANSFERS;
+    maxTransfersPerHost = DEFAULT_MAX_TRANSFERS_PER_HOST;
+    retryDelay = DEFAULT_RETRY_DELAY_MS;
+
+    jobFinishedCtx = nullptr;
+    _jobFinishedCallback = nullptr;
+    progressCtx = nullptr;
+    _progressCallback = nullptr;
+}
+
+TransferScheduler::~TransferScheduler() {
+    stop();
+}
+
+TransferSchedulerOperationResult TransferScheduler::setMaxConcurrentTransfers(
+        const int maxTransfers)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    if (maxTransfers <= 0 || running) {
+        return TransferSchedulerOperationResult::TRANSFER_SCHEDULER_ERROR;
+    }
+
+    maxConcurrentTransfers = maxTransfers;
+    return TransferSchedulerOperationResult::TRANSFER_SCHEDULER_OK;
+}
+
+TransferSchedulerOperationResult TransferScheduler::setMaxTransfersPerHost(
+        const int maxTransfers)
+{
+    if (maxTransfers <= 0) {
+        return TransferSchedulerOperationResult::TRANSFER_SCHEDULER_ERROR;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        maxTransfersPerHost = maxTransfers;
+    }
+    jobsChanged.notify_all();
+    return TransferSchedulerOperationResult::TRANSFER_SCHEDULER_OK;
+}
+
+TransferSchedulerOperationResult TransferScheduler::setRetryDelay(
+        const int delay)
+{
+    if (delay < 0) {
+        return TransferSchedulerOperationResult::TRANSFER_SCHEDULER_ERROR;
+    }
+
+    std::lock_guard<std::mutex> lock(mutex);
+    retryDelay = delay;
+    return TransferSchedulerOperationResult::TRANSFER_SCHEDULER_OK;
+}
+
+TransferSchedulerOperationResult TransferScheduler::setCpuAffinity(
+        const std::vector<int> &cpus)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    if (running || !workerCpus.assign(cpus)) {
+        return TransferSchedulerOperationResult::TRANSFER_SCHEDULER_ERROR;
+    }
+    return TransferSchedulerOperationResult::TRANSFER_SCHEDULER_OK;
+}
+
+TransferSchedulerOperationResult TransferScheduler::registerJobFinishedCallback(
+        transferJobFinishedCallback callback,
+        void *context)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    _jobFinishedCallback = callback;
+    jobFinishedCtx = context;
+    return TransferSchedulerOperationResult::TRANSFER_SCHEDULER_OK;
+}
+
+TransferSchedulerOperationResult TransferScheduler::registerProgressCallback(
+        transferProgressCallback callback,
+        void *context)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    _progressCallback = callback;
+    progressCtx = context;
+    return TransferSchedulerOperationResult::TRANSFER_SCHEDULER_OK;
+}
+
+TransferSchedulerOperationResult TransferScheduler::submitJob(
+        const TransferJob &job,
+        TransferJobId *id)
+{
+    if (job.fp == NULL || job.host.empty() || job.filename.empty() ||
+        job.maxRetries < 0) {
+        return TransferSchedulerOperationResult::TRANSFER_SCHEDULER_ERROR;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        QueuedJob queued;
+        queued.id = nextJobId++;
+        queued.job = job;
+        queued.attempts = 0;
+        queued.notBefore = Clock::now();
+        queued.startOffset = ftello(job.fp);
+        queue.push_back(queued);
+
+        progress.submittedJobs++;
+        progress.pendingJobs++;
+
+        if (id != nullptr) {
+            *id = queued.id;
+        }
+    }
+    jobsChanged.notify_one();
+    return TransferSchedulerOperationResult::TRANSFER_SCHEDULER_OK;
+}
+
+TransferSchedulerOperationResult TransferScheduler::start()
+{
+    std::vector<std::thread> started;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (running) {
+            return TransferSchedulerOperationResult::TRANSFER_SCHEDULER_ERROR;
+        }
+
+        running = true;
+        try {
+            for (int i = 0; i < maxConcurrentTransfers; ++i) {
+                workers.push_back(std::thread(&TransferScheduler::workerLoop, this));
+            }
+            return TransferSchedulerOperationResult::TRANSFER_SCHEDULER_OK;
+        } catch (const std::system_error &) {
+            // Out of threads. The workers already created exit as soon as
+            // they get the lock.
+            running = false;
+            started.swap(workers);
+        }
+    }
+    jobsChanged.notify_all();
+
+    for (std::thread &worker : started) {
+        worker.join();
+    }
+    return TransferSchedulerOperationResult::TRANSFER_SCHEDULER_ERROR;
+}
+
+TransferSchedulerOperationResult TransferScheduler::waitIdle()
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    while (progress.pendingJobs > 0 || progress.runningJobs > 0) {
+        if (!running) {
+            return TransferSchedulerOperationResult::TRANSFER_SCHEDULER_ERROR;
+        }
+        jobsChanged.wait(lock);
+    }
+    return TransferSchedulerOperationResult::TRANSFER_SCHEDULER_OK;
+}
+
+TransferSchedulerOperationResult TransferScheduler::stop()
+{
+    std::vector<std::thread> stopping;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        running = false;
+        stopping.swap(workers);
+    }
+    jobsChanged.notify_all();
+
+    for (std::thread &worker : stopping) {
+        worker.join();
+    }
+    return TransferSchedulerOperationResult::TRANSFER_SCHEDULER_OK;
+}
+
+TransferSchedulerOperationResult TransferScheduler::getProgress(
+        TransferProgress &progress)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    progress = this->progress;
+    progress.bytesFetched = bytesFetched.load(std::memory_order_relaxed);
+    return TransferSchedulerOperationResult::TRANSFER_SCHEDULER_OK;
+}
+
+std::string TransferScheduler::hostKey(
+        const TransferJob &job)
+{
+    // Several servers may share a host on different ports.
+    return job.host + ":" + std::to_string(job.port);
+}
+
+bool TransferScheduler::pickJob(
+        QueuedJob &job,
+        Clock::time_point &wakeUp)
+{
+    Clock::time_point now = Clock::now();
+    wakeUp = Clock::time_point::max();
+
+    // Highest priority first, then lowest id, which is submission order.
+    std::vector<QueuedJob>::iterator best = queue.end();
+    for (std::vector<QueuedJob>::iterator it = queue.begin();
+         it != queue.end(); ++it) {
+        std::map<std::string, int>::const_iterator running =
+                runningPerHost.find(hostKey(it->job));
+        if (running != runningPerHost.end() && running->second >= maxTransfersPerHost) {
+            continue;
+        }
+        if (it->notBefore > now) {
+            if (it->notBefore < wakeUp) {
+                wakeUp = it->notBefore;
+            }
+            continue;
+        }
+        if (best == queue.end() ||
+            it->job.priority > best->job.priority ||
+            (it->job.priority == best->job.priority && it->id < best->id)) {
+            best = it;
+        }
+    }
+
+    if (best == queue.end()) {
+        return false;
+    }
+
+    job = *best;
+    queue.erase(best);
+    return true;
+}
+
+void TransferScheduler::notifyProgress()
+{
+    transferProgressCallback callback;
+    void *context;
+    TransferProgress snapshot;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        callback = _progressCallback;
+        context = progressCtx;
+        snapshot = progress;
+    }
+    snapshot.bytesFetched = bytesFetched.load(std::memory_order_relaxed);
+
+    if (callback != nullptr) {
+        callback(snapshot, context);
+    }
+}
+
+void TransferScheduler::workerLoop()
+{
+    // Set before start(), read-only while workers run.
+    workerCpus.pinCurrentThread();
+
+    ITFTPClient *client;
+    try {
+        client = new TFTPClient();
+    } catch (...) {
+        return;
+    }
+
+    AttemptContext attempt;
+    attempt.bytesFetched = &bytesFetched;
+    client->registerTftpErrorCallback(attemptErrorCbk, &attempt);
+    client->registerTftpFetchDataReceivedCallback(attemptDataReceivedCbk,
+                                                  &attempt);
+
+    for (;;) {
+        QueuedJob queued;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            for (;;) {
+                if (!running) {
+                    delete client;
+                    return;
+                }
+                Clock::time_point wakeUp;
+                if (pickJob(queued, wakeUp)) {
+                    break;
+                }
+                if (wakeUp == Clock::time_point::max()) {
+                    jobsChanged.wait(lock);
+                } else {
+                    jobsChanged.wait_until(lock, wakeUp);
+                }
+            }
+            progress.pendingJobs--;
+            progress.runningJobs++;
+            runningPerHost[hostKey(queued.job)]++;
+        }
+        notifyProgress();
+
+        TransferJob &job = queued.job;
+        attempt.errorReceived = false;
+        attempt.errorCode = 0;
+        attempt.errorMessage.clear();
+
+        // A retry starts where the first attempt did.
+        bool rewound = queued.attempts == 0 ||
+                       fseeko(job.fp, queued.startOffset, SEEK_SET) == 0;
+
+        TftpClientOperationResult result = rewound ?
+                client->setConnection(job.host.c_str(), job.port) :
+                TftpClientOperationResult::TFTP_CLIENT_ERROR;
+        if (result == TftpClientOperationResult::TFTP_CLIENT_OK) {
+            result = job.direction == TransferDirection::TRANSFER_SEND ?
+                     client->sendFile(job.filename.c_str(), job.fp) :
+                     client->fetchFile(job.filename.c_str(), job.fp);
+        }
+
+        // A target that answered with an error packet refused the transfer
+        // for good, unless it is an ARINC 615A WAIT message. Anything else,
+        // such as a timeout, is worth retrying.
+        bool isWait = attempt.errorReceived &&
+                      attempt.errorMessage.compare(0, strlen(WAIT_MESSAGE_PREFIX),
+                                                   WAIT_MESSAGE_PREFIX) == 0;
+        bool transient = (!attempt.errorReceived || isWait) &&
+                         queued.startOffset >= 0;
+
+        bool finished = true;
+        TransferJobStatus status = TransferJobStatus::TRANSFER_JOB_OK;
+        transferJobFinishedCallback callback;
+        void *context;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            // Only hosts with running transfers are kept.
+            std::map<std::string, int>::iterator running =
+                    runningPerHost.find(hostKey(job));
+            if (running != runningPerHost.end() && --running->second <= 0) {
+                runningPerHost.erase(running);
+            }
+            progress.runningJobs--;
+
+            if (result == TftpClientOperationResult::TFTP_CLIENT_OK) {
+                progress.completedJobs++;
+            } else if (transient && queued.attempts < job.maxRetries) {
+                int delay = isWait ? waitDelay(attempt.errorMessage, retryDelay) : retryDelay;
+                queued.attempts++;
+                queued.notBefore = Clock::now() +
+                                   std::chrono::milliseconds(delay);
+                queue.push_back(queued);
+                progress.pendingJobs++;
+                progress.retries++;
+                finished = false;
+            } else {
+                progress.failedJobs++;
+                status = TransferJobStatus::TRANSFER_JOB_ERROR;
+            }
+
+            callback = _jobFinishedCallback;
+            context = jobFinishedCtx;
+        }
+        jobsChanged.notify_all();
+
+        if (finished && callback != nullptr) {
+            callback(queued.id, status, attempt.errorMessage, context);
+        }
+        notifyProgress();
+    }
+}
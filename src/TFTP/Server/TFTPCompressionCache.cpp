@@ -0,0 +1,138 @@
+#include "TFTPCompressionCache.h"
+#include "TFTPCompressionStream.h"
+
+#include <unistd.h>
+
+TFTPCompressionCache::TFTPCompressionCache() {
+    capacity = 0;
+    used = 0;
+    hits = 0;
+    misses = 0;
+}
+
+void TFTPCompressionCache::setCapacity(
+        const size_t capacity)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    this->capacity = capacity;
+    evict();
+}
+
+size_t TFTPCompressionCache::getCapacity()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return capacity;
+}
+
+TFTPCompressedData TFTPCompressionCache::get(
+        FILE *file,
+        size_t *plainSize)
+{
+    int fd = file != NULL ? fileno(file) : -1;
+    struct stat info;
+    if (fd < 0 || fstat(fd, &info) != 0 || !S_ISREG(info.st_mode)) {
+        return nullptr;
+    }
+    if (plainSize != nullptr) {
+        *plainSize = info.st_size;
+    }
+
+    TFTPCacheKey key(info.st_dev, info.st_ino);
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (capacity == 0 || (size_t) info.st_size > capacity) {
+            return nullptr;
+        }
+
+        std::map<TFTPCacheKey, TFTPCacheList::iterator>::iterator it = index.find(key);
+        if (it != index.end()) {
+            TFTPCacheEntry &entry = *it->second;
+            if (entry.modified.tv_sec == info.st_mtim.tv_sec &&
+                entry.modified.tv_nsec == info.st_mtim.tv_nsec &&
+                entry.size == info.st_size) {
+                entries.splice(entries.begin(), entries, it->second);
+                hits.fetch_add(1, std::memory_order_relaxed);
+                return entry.data;
+            }
+            remove(it);
+        }
+    }
+
+    // Compressed outside the lock, two sections missing on the same file
+    // both compress it and the last one in replaces the other.
+    misses.fetch_add(1, std::memory_order_relaxed);
+    TFTPCompressedData data = compressFile(fd, info.st_size);
+    if (data == nullptr) {
+        return nullptr;
+    }
+
+    std::lock_guard<std::mutex> lock(mutex);
+    if (data->size() > capacity) {
+        return data;
+    }
+
+    std::map<TFTPCacheKey, TFTPCacheList::iterator>::iterator it = index.find(key);
+    if (it != index.end()) {
+        remove(it);
+    }
+
+    TFTPCacheEntry entry;
+    entry.key = key;
+    entry.modified = info.st_mtim;
+    entry.size = info.st_size;
+    entry.data = data;
+    entries.push_front(entry);
+    index[key] = entries.begin();
+    used += data->size();
+    evict();
+    return data;
+}
+
+void TFTPCompressionCache::getStats(
+        uint64_t *hits,
+        uint64_t *misses)
+{
+    if (hits != nullptr) {
+        *hits = this->hits.load(std::memory_order_relaxed);
+    }
+    if (misses != nullptr) {
+        *misses = this->misses.load(std::memory_order_relaxed);
+    }
+}
+
+TFTPCompressedData TFTPCompressionCache::compressFile(
+        const int fd,
+        const off_t size)
+{
+    // pread leaves the FILE position alone, the FILE may still be read.
+    std::vector<char> plain(size);
+    size_t length = 0;
+    while (length < plain.size()) {
+        ssize_t result = pread(fd, &plain[length], plain.size() - length, length);
+        if (result <= 0) {
+            return nullptr;
+        }
+        length += result;
+    }
+
+    std::shared_ptr<std::vector<char>> compressed = std::make_shared<std::vector<char>>();
+    if (!TFTPCompressionStream::compress(plain.data(), plain.size(), *compressed)) {
+        return nullptr;
+    }
+    return compressed;
+}
+
+void TFTPCompressionCache::remove(
+        std::map<TFTPCacheKey, TFTPCacheList::iterator>::iterator it)
+{
+    used -= it->second->data->size();
+    entries.erase(it->second);
+    index.erase(it);
+}
+
+void TFTPCompressionCache::evict()
+{
+    while (used > capacity && !entries.empty()) {
+        remove(index.find(entries.back().key));
+    }
+}
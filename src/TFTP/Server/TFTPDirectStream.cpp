@@ -0,0 +1,365 @@
+#include "TFTPDirectStream.h"
+
+#include <algorithm>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+TFTPAlignedBuffer::TFTPAlignedBuffer() {
+    data = nullptr;
+    size = 0;
+    hugePages = false;
+}
+
+TFTPAlignedBuffer::~TFTPAlignedBuffer() {
+    release();
+}
+
+bool TFTPAlignedBuffer::allocate(
+        const size_t size,
+        const bool hugePages)
+{
+    if (data != nullptr && this->size == size && this->hugePages == hugePages) {
+        return true;
+    }
+    release();
+
+    void *mapped = MAP_FAILED;
+    if (hugePages) {
+        mapped = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    }
+    if (mapped == MAP_FAILED) {
+        // No huge pages reserved, transparent ones may still do.
+        mapped = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (mapped == MAP_FAILED) {
+            return false;
+        }
+        if (hugePages) {
+            madvise(mapped, size, MADV_HUGEPAGE);
+        }
+    }
+
+    data = (char *) mapped;
+    this->size = size;
+    this->hugePages = hugePages;
+    return true;
+}
+
+char *TFTPAlignedBuffer::getData()
+{
+    return data;
+}
+
+void TFTPAlignedBuffer::release()
+{
+    if (data != nullptr) {
+        munmap(data, size);
+        data = nullptr;
+        size = 0;
+    }
+}
+
+TFTPDirectStream::TFTPDirectStream() {
+    source = NULL;
+    stream = NULL;
+    descriptor = -1;
+    flags = 0;
+    write = false;
+    threshold = 0;
+    stats = nullptr;
+    direct = false;
+    large = false;
+    failed = false;
+    bufferOffset = 0;
+    bufferLength = 0;
+    position = 0;
+    start = 0;
+    fileSize = 0;
+    cachedEnd = 0;
+}
+
+FILE *TFTPDirectStream::open(
+        FILE *source,
+        const bool write,
+        const uint64_t threshold,
+        const bool hugePages,
+        TFTPDirectStats *stats)
+{
+    if (source == NULL || threshold == 0 || stats == nullptr || stream != NULL) {
+        return NULL;
+    }
+
+    struct stat info;
+    int descriptor = fileno(source);
+    if (descriptor < 0 || fstat(descriptor, &info) != 0 || !S_ISREG(info.st_mode) ||
+        (!write && (uint64_t) info.st_size < threshold)) {
+        return NULL;
+    }
+
+    // O_DIRECT offsets must stay aligned from where the FILE stands.
+    fflush(source);
+    off64_t start = ftello(source);
+    int flags = fcntl(descriptor, F_GETFL);
+    if (start < 0 || start % TFTP_DIRECT_ALIGNMENT != 0 || flags < 0 ||
+        !buffer.allocate(TFTP_DIRECT_BUFFER_SIZE, hugePages)) {
+        return NULL;
+    }
+
+    this->source = source;
+    this->descriptor = descriptor;
+    this->flags = flags;
+    this->write = write;
+    this->threshold = threshold;
+    this->stats = stats;
+    direct = false;
+    large = false;
+    failed = false;
+    bufferOffset = start;
+    bufferLength = 0;
+    position = start;
+    this->start = start;
+    fileSize = info.st_size;
+    cachedEnd = start;
+
+    cookie_io_functions_t functions;
+    memset(&functions, 0, sizeof(functions));
+    if (write) {
+        functions.write = streamWrite;
+    } else {
+        functions.read = streamRead;
+    }
+    functions.seek = streamSeek;
+    functions.close = streamClose;
+
+    stream = fopencookie(this, write ? "w" : "r", functions);
+    if (stream == NULL) {
+        return NULL;
+    }
+
+    if (write) {
+        setvbuf(stream, NULL, _IONBF, 0);
+    } else {
+        // An unbuffered cookie stream is read a byte at a time, see
+        // TFTPReadAheadStream.
+        streamBuffer.resize(TFTP_DIRECT_ALIGNMENT);
+        setvbuf(stream, &streamBuffer[0], _IOFBF, streamBuffer.size());
+        large = true;
+        stats->files.fetch_add(1, std::memory_order_relaxed);
+        enableDirect();
+    }
+    return stream;
+}
+
+FILE *TFTPDirectStream::getSource()
+{
+    return source;
+}
+
+bool TFTPDirectStream::enableDirect()
+{
+    direct = fcntl(descriptor, F_SETFL, flags | O_DIRECT) == 0;
+    if (!direct) {
+        stats->buffered.fetch_add(1, std::memory_order_relaxed);
+    }
+    return direct;
+}
+
+void TFTPDirectStream::disableDirect()
+{
+    if (direct) {
+        fcntl(descriptor, F_SETFL, flags);
+        direct = false;
+    }
+}
+
+void TFTPDirectStream::dropCache(
+        const off64_t end)
+{
+    if (end <= cachedEnd) {
+        return;
+    }
+
+    // Dirty pages can't be dropped, they are written back first.
+    if (write) {
+        sync_file_range(descriptor, cachedEnd, end - cachedEnd,
+                        SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE |
+                        SYNC_FILE_RANGE_WAIT_AFTER);
+    }
+    posix_fadvise(descriptor, cachedEnd, end - cachedEnd, POSIX_FADV_DONTNEED);
+    cachedEnd = end;
+}
+
+bool TFTPDirectStream::fill(
+        const off64_t offset)
+{
+    ssize_t length;
+    while ((length = pread(descriptor, buffer.getData(), TFTP_DIRECT_BUFFER_SIZE, offset)) < 0) {
+        if (direct && errno == EINVAL) {
+            // The filesystem took the flag but not our alignment.
+            disableDirect();
+            stats->buffered.fetch_add(1, std::memory_order_relaxed);
+        } else if (errno != EINTR) {
+            return false;
+        }
+    }
+
+    bufferOffset = offset;
+    bufferLength = length;
+    if (!direct) {
+        // Copied out already, the pages only crowd the cache.
+        cachedEnd = offset;
+        dropCache(offset + length);
+    }
+    return true;
+}
+
+bool TFTPDirectStream::flush(
+        const bool last)
+{
+    if (bufferLength == 0) {
+        return true;
+    }
+
+    if (!large && (uint64_t) (bufferOffset + bufferLength - start) >= threshold) {
+        // What was written before the file turned out large is in the
+        // cache, the rest never gets there.
+        large = true;
+        stats->files.fetch_add(1, std::memory_order_relaxed);
+        dropCache(bufferOffset);
+        enableDirect();
+    }
+    if (last && direct && bufferLength % TFTP_DIRECT_ALIGNMENT != 0) {
+        disableDirect();
+    }
+
+    size_t written = 0;
+    while (written < bufferLength) {
+        ssize_t length = pwrite(descriptor, buffer.getData() + written,
+                                bufferLength - written, bufferOffset + written);
+        if (length > 0) {
+            written += length;
+        } else if (length < 0 && errno == EINTR) {
+            continue;
+        } else if (length < 0 && direct && errno == EINVAL) {
+            disableDirect();
+            stats->buffered.fetch_add(1, std::memory_order_relaxed);
+        } else {
+            return false;
+        }
+    }
+
+    if (direct) {
+        cachedEnd = bufferOffset + bufferLength;
+    } else if (large) {
+        // Start writing this buffer back, and drop the ones before it,
+        // whose write back was started by the previous flush.
+        sync_file_range(descriptor, bufferOffset, bufferLength, SYNC_FILE_RANGE_WRITE);
+        dropCache(bufferOffset);
+    }
+    bufferOffset += bufferLength;
+    bufferLength = 0;
+    return true;
+}
+
+ssize_t TFTPDirectStream::streamRead(
+        void *cookie,
+        char *buffer,
+        size_t size)
+{
+    TFTPDirectStream *self = (TFTPDirectStream *) cookie;
+    if (self->failed) {
+        return -1;
+    }
+
+    off64_t end = self->bufferOffset + (off64_t) self->bufferLength;
+    if (self->position < self->bufferOffset || self->position >= end) {
+        if (!self->fill(self->position - self->position % TFTP_DIRECT_ALIGNMENT)) {
+            self->failed = true;
+            return -1;
+        }
+        end = self->bufferOffset + (off64_t) self->bufferLength;
+        if (self->position >= end) {
+            return 0;
+        }
+    }
+
+    size_t length = std::min<size_t>(size, end - self->position);
+    memcpy(buffer, self->buffer.getData() + (self->position - self->bufferOffset), length);
+    self->position += length;
+    return (ssize_t) length;
+}
+
+ssize_t TFTPDirectStream::streamWrite(
+        void *cookie,
+        const char *buffer,
+        size_t size)
+{
+    TFTPDirectStream *self = (TFTPDirectStream *) cookie;
+    size_t done = 0;
+    while (done < size && !self->failed) {
+        size_t length = std::min(size - done, TFTP_DIRECT_BUFFER_SIZE - self->bufferLength);
+        memcpy(self->buffer.getData() + self->bufferLength, buffer + done, length);
+        self->bufferLength += length;
+        done += length;
+        if (self->bufferLength == TFTP_DIRECT_BUFFER_SIZE && !self->flush(false)) {
+            self->failed = true;
+        }
+    }
+    if (self->failed) {
+        return -1;
+    }
+    self->position += size;
+    return (ssize_t) size;
+}
+
+int TFTPDirectStream::streamSeek(
+        void *cookie,
+        off64_t *offset,
+        int whence)
+{
+    TFTPDirectStream *self = (TFTPDirectStream *) cookie;
+    off64_t target;
+    if (whence == SEEK_SET) {
+        target = *offset;
+    } else if (whence == SEEK_CUR) {
+        target = self->position + *offset;
+    } else if (whence == SEEK_END && !self->write) {
+        target = self->fileSize + *offset;
+    } else {
+        return -1;
+    }
+
+    // Writes are sequential, only telling the position is allowed.
+    if (target < self->start || (self->write && target != self->position)) {
+        return -1;
+    }
+    self->position = target;
+    *offset = target;
+    return 0;
+}
+
+int TFTPDirectStream::streamClose(
+        void *cookie)
+{
+    TFTPDirectStream *self = (TFTPDirectStream *) cookie;
+    bool succeeded = !self->failed && (!self->write || self->flush(true));
+    if (self->large) {
+        if (self->write && succeeded) {
+            self->dropCache(self->position);
+        }
+        self->stats->bytes.fetch_add(self->position - self->start,
+                                     std::memory_order_relaxed);
+    }
+    self->disableDirect();
+
+    // The source FILE never saw the bytes, put it where they end.
+    fseeko(self->source, self->position, SEEK_SET);
+    self->stream = NULL;
+    self->stats = nullptr;
+    return succeeded ? 0 : -1;
+}
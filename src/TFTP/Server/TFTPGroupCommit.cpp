@@ -0,0 +1,100 @@
+#include "TFTPGroupCommit.h"
+
+#include <chrono>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define TFTP_GROUP_COMMIT_INTERVAL_MS 10
+
+TFTPGroupCommit::TFTPGroupCommit() {
+    stopping = false;
+    interval = TFTP_GROUP_COMMIT_INTERVAL_MS;
+    syncs = 0;
+}
+
+TFTPGroupCommit::~TFTPGroupCommit() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    requested.notify_all();
+    if (worker.joinable()) {
+        worker.join();
+    }
+}
+
+void TFTPGroupCommit::setInterval(
+        const int interval)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    this->interval = interval;
+}
+
+bool TFTPGroupCommit::commit(
+        const int fd)
+{
+    TFTPCommitRequest request;
+    request.fd = fd;
+    request.done = false;
+    request.synced = false;
+
+    std::unique_lock<std::mutex> lock(mutex);
+    if (!worker.joinable()) {
+        worker = std::thread(&TFTPGroupCommit::run, this);
+    }
+    pending.push_back(&request);
+    requested.notify_one();
+    committed.wait(lock, [&request] { return request.done; });
+    return request.synced;
+}
+
+uint64_t TFTPGroupCommit::getSyncs()
+{
+    return syncs.load(std::memory_order_relaxed);
+}
+
+void TFTPGroupCommit::run()
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    while (true) {
+        requested.wait(lock, [this] { return stopping || !pending.empty(); });
+        if (pending.empty()) {
+            return;
+        }
+
+        // Let the batch fill, unless the server is going away.
+        requested.wait_for(lock, std::chrono::milliseconds(interval),
+                           [this] { return stopping; });
+        std::vector<TFTPCommitRequest *> batch;
+        batch.swap(pending);
+        lock.unlock();
+
+        std::vector<dev_t> devices;
+        std::vector<bool> results;
+        for (TFTPCommitRequest *request : batch) {
+            struct stat info;
+            if (fstat(request->fd, &info) != 0) {
+                // Filesystem unknown, the file is synced on its own.
+                request->synced = fdatasync(request->fd) == 0;
+                syncs.fetch_add(1, std::memory_order_relaxed);
+                continue;
+            }
+            size_t i = 0;
+            while (i < devices.size() && devices[i] != info.st_dev) {
+                i++;
+            }
+            if (i == devices.size()) {
+                devices.push_back(info.st_dev);
+                results.push_back(syncfs(request->fd) == 0);
+                syncs.fetch_add(1, std::memory_order_relaxed);
+            }
+            request->synced = results[i];
+        }
+
+        lock.lock();
+        for (TFTPCommitRequest *request : batch) {
+            request->done = true;
+        }
+        committed.notify_all();
+    }
+}
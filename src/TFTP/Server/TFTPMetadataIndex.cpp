@@ -0,0 +1,336 @@
+#include "TFTPMetadataIndex.h"
+
+#include <algorithm>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <system_error>
+#include <unistd.h>
+
+#define TFTP_INDEX_EVENTS (IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_DELETE)
+
+TFTPMetadataIndex::TFTPMetadataIndex() {
+    inotifyDescriptor = -1;
+    stopDescriptor = -1;
+    running = false;
+    hits = 0;
+    misses = 0;
+}
+
+TFTPMetadataIndex::~TFTPMetadataIndex() {
+    stop();
+}
+
+bool TFTPMetadataIndex::start(
+        const std::string &directory,
+        const int threads)
+{
+    stop();
+
+    // Watched before the directory is read, so nothing changed meanwhile
+    // is missed.
+    inotifyDescriptor = inotify_init1(IN_CLOEXEC);
+    stopDescriptor = eventfd(0, EFD_CLOEXEC);
+    if (inotifyDescriptor < 0 || stopDescriptor < 0 ||
+        inotify_add_watch(inotifyDescriptor, directory.c_str(), TFTP_INDEX_EVENTS) < 0) {
+        stop();
+        return false;
+    }
+
+    this->directory = directory;
+    build(threads);
+    try {
+        watcher = std::thread(&TFTPMetadataIndex::watch, this);
+    } catch (const std::system_error &) {
+        stop();
+        return false;
+    }
+    running = true;
+    return true;
+}
+
+void TFTPMetadataIndex::stop()
+{
+    running = false;
+    if (watcher.joinable()) {
+        uint64_t value = 1;
+        if (write(stopDescriptor, &value, sizeof(value)) == sizeof(value)) {
+            watcher.join();
+        } else {
+            watcher.detach();
+        }
+    }
+    if (inotifyDescriptor >= 0) {
+        close(inotifyDescriptor);
+        inotifyDescriptor = -1;
+    }
+    if (stopDescriptor >= 0) {
+        close(stopDescriptor);
+        stopDescriptor = -1;
+    }
+
+    std::lock_guard<std::mutex> lock(mutex);
+    names.clear();
+    files.clear();
+    directory.clear();
+}
+
+TFTPFileMetadataPtr TFTPMetadataIndex::find(
+        const int descriptor)
+{
+    struct stat info;
+    if (!running || descriptor < 0 || fstat(descriptor, &info) != 0) {
+        return nullptr;
+    }
+    return find(info);
+}
+
+TFTPFileMetadataPtr TFTPMetadataIndex::find(
+        const std::string &path)
+{
+    struct stat info;
+    if (!running || stat(path.c_str(), &info) != 0) {
+        return nullptr;
+    }
+    return find(info);
+}
+
+TFTPFileMetadataPtr TFTPMetadataIndex::find(
+        const struct stat &info)
+{
+    TFTPFileMetadataPtr metadata;
+    if (S_ISREG(info.st_mode)) {
+        std::lock_guard<std::mutex> lock(mutex);
+        std::map<TFTPFileKey, TFTPFileMetadataPtr>::iterator it =
+                files.find(TFTPFileKey(info.st_dev, info.st_ino));
+        if (it != files.end() && it->second->size == (uint64_t) info.st_size &&
+            it->second->modified.tv_sec == info.st_mtim.tv_sec &&
+            it->second->modified.tv_nsec == info.st_mtim.tv_nsec) {
+            metadata = it->second;
+        }
+    }
+
+    if (metadata != nullptr) {
+        hits.fetch_add(1, std::memory_order_relaxed);
+    } else {
+        misses.fetch_add(1, std::memory_order_relaxed);
+    }
+    return metadata;
+}
+
+void TFTPMetadataIndex::getStats(
+        uint64_t *files,
+        uint64_t *hits,
+        uint64_t *misses)
+{
+    if (files != nullptr) {
+        std::lock_guard<std::mutex> lock(mutex);
+        *files = names.size();
+    }
+    if (hits != nullptr) {
+        *hits = this->hits.load(std::memory_order_relaxed);
+    }
+    if (misses != nullptr) {
+        *misses = this->misses.load(std::memory_order_relaxed);
+    }
+}
+
+bool TFTPMetadataIndex::indexable(
+        const char *name)
+{
+    return name[0] != '\0' && name[0] != '.';
+}
+
+TFTPFileMetadataPtr TFTPMetadataIndex::compute(
+        const std::string &path)
+{
+    FILE *file = fopen(path.c_str(), "r");
+    if (file == NULL) {
+        return nullptr;
+    }
+
+    std::shared_ptr<TFTPFileMetadata> metadata = std::make_shared<TFTPFileMetadata>();
+    struct stat before, after;
+    int descriptor = fileno(file);
+    bool ok = fstat(descriptor, &before) == 0 && S_ISREG(before.st_mode);
+    if (ok) {
+        posix_fadvise(descriptor, 0, 0, POSIX_FADV_SEQUENTIAL);
+        ok = TFTPDelta::hashFile(file, metadata->hashes);
+    }
+    // A file written while it was read is indexed when that write ends.
+    ok = ok && fstat(descriptor, &after) == 0 && after.st_size == before.st_size &&
+         after.st_mtim.tv_sec == before.st_mtim.tv_sec &&
+         after.st_mtim.tv_nsec == before.st_mtim.tv_nsec &&
+         metadata->hashes.size == (uint64_t) before.st_size;
+    fclose(file);
+    if (!ok) {
+        return nullptr;
+    }
+
+    metadata->device = before.st_dev;
+    metadata->inode = before.st_ino;
+    metadata->size = before.st_size;
+    metadata->modified = before.st_mtim;
+    std::shared_ptr<std::vector<char>> encoded = std::make_shared<std::vector<char>>();
+    TFTPDelta::encodeHashes(metadata->hashes, *encoded);
+    metadata->encodedHashes = encoded;
+    return metadata;
+}
+
+void TFTPMetadataIndex::insert(
+        const std::string &name,
+        TFTPFileMetadataPtr metadata)
+{
+    remove(name);
+    std::lock_guard<std::mutex> lock(mutex);
+    names[name] = metadata;
+    files[TFTPFileKey(metadata->device, metadata->inode)] = metadata;
+}
+
+TFTPFileMetadataPtr TFTPMetadataIndex::remove(
+        const std::string &name)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    std::map<std::string, TFTPFileMetadataPtr>::iterator it = names.find(name);
+    if (it == names.end()) {
+        return nullptr;
+    }
+
+    TFTPFileMetadataPtr metadata = it->second;
+    names.erase(it);
+    std::map<TFTPFileKey, TFTPFileMetadataPtr>::iterator file =
+            files.find(TFTPFileKey(metadata->device, metadata->inode));
+    if (file != files.end() && file->second == metadata) {
+        files.erase(file);
+    }
+    return metadata;
+}
+
+void TFTPMetadataIndex::update(
+        const std::string &name)
+{
+    TFTPFileMetadataPtr metadata = compute(directory + "/" + name);
+    if (metadata != nullptr) {
+        insert(name, metadata);
+    } else {
+        remove(name);
+    }
+}
+
+void TFTPMetadataIndex::build(
+        const int threads)
+{
+    std::vector<std::string> entries;
+    DIR *handle = opendir(directory.c_str());
+    struct dirent *entry;
+    while (handle != NULL && (entry = readdir(handle)) != NULL) {
+        if (indexable(entry->d_name)) {
+            entries.push_back(entry->d_name);
+        }
+    }
+    if (handle != NULL) {
+        closedir(handle);
+    }
+
+    // Files are handed out one at a time, a few large ones don't leave
+    // the other threads idle.
+    std::atomic<size_t> next(0);
+    auto run = [this, &entries, &next]() {
+        size_t i;
+        while ((i = next.fetch_add(1)) < entries.size()) {
+            update(entries[i]);
+        }
+    };
+
+    size_t count = threads > 0 ? threads : std::thread::hardware_concurrency();
+    count = std::max<size_t>(1, std::min(count, entries.size()));
+    std::vector<std::thread> workers;
+    for (size_t i = 1; i < count; i++) {
+        try {
+            workers.push_back(std::thread(run));
+        } catch (const std::system_error &) {
+            break;
+        }
+    }
+    run();
+    for (std::thread &worker : workers) {
+        worker.join();
+    }
+}
+
+void TFTPMetadataIndex::watch()
+{
+    alignas(struct inotify_event) char buffer[64 * 1024];
+    // A rename comes as a move out and a move in, the entry is kept for
+    // the move in.
+    uint32_t movedCookie = 0;
+    TFTPFileMetadataPtr moved;
+
+    struct pollfd descriptors[2];
+    descriptors[0].fd = inotifyDescriptor;
+    descriptors[0].events = POLLIN;
+    descriptors[1].fd = stopDescriptor;
+    descriptors[1].events = POLLIN;
+    while (true) {
+        if (poll(descriptors, 2, -1) < 0 && errno != EINTR) {
+            return;
+        }
+        if (descriptors[1].revents != 0) {
+            return;
+        }
+        if (descriptors[0].revents == 0) {
+            continue;
+        }
+
+        ssize_t length = read(inotifyDescriptor, buffer, sizeof(buffer));
+        for (ssize_t offset = 0; offset < length;) {
+            const struct inotify_event *event =
+                    (const struct inotify_event *) (buffer + offset);
+            offset += sizeof(struct inotify_event) + event->len;
+
+            if (event->mask & IN_Q_OVERFLOW) {
+                // Events were lost, start over.
+                {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    names.clear();
+                    files.clear();
+                }
+                build(0);
+                continue;
+            }
+            if (event->len == 0 || !indexable(event->name)) {
+                continue;
+            }
+
+            std::string name(event->name);
+            if (event->mask & IN_MOVED_FROM) {
+                movedCookie = event->cookie;
+                moved = remove(name);
+                continue;
+            }
+
+            TFTPFileMetadataPtr renamed;
+            if (event->mask & IN_MOVED_TO && moved != nullptr &&
+                event->cookie == movedCookie) {
+                renamed = moved;
+            }
+            moved.reset();
+
+            struct stat info;
+            if (renamed != nullptr && stat((directory + "/" + name).c_str(), &info) == 0 &&
+                renamed->inode == (uint64_t) info.st_ino &&
+                renamed->size == (uint64_t) info.st_size &&
+                renamed->modified.tv_sec == info.st_mtim.tv_sec &&
+                renamed->modified.tv_nsec == info.st_mtim.tv_nsec) {
+                insert(name, renamed);
+            } else if (event->mask & (IN_CLOSE_WRITE | IN_MOVED_TO)) {
+                update(name);
+            } else if (event->mask & IN_DELETE) {
+                remove(name);
+            }
+        }
+    }
+}
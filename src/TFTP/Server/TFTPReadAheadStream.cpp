@@ -0,0 +1,330 @@
+#include "TFTPReadAheadStream.h"
+
+#include <fcntl.h>
+#include <string.h>
+
+#define PREFETCH_WORKERS 2
+
+TFTPReadAheadStream::TFTPReadAheadStream() {
+    source = NULL;
+    stream = NULL;
+    blockSize = 0;
+    depth = 0;
+    stats = nullptr;
+    prefetcher = nullptr;
+    endOfFile = false;
+    failed = false;
+    detached = true;
+    head = 0;
+    count = 0;
+    readOffset = 0;
+    position = 0;
+    prefetchNext = nullptr;
+    queued = false;
+    filling = false;
+    refill = false;
+}
+
+FILE *TFTPReadAheadStream::open(
+        FILE *source,
+        const size_t blockSize,
+        const int depth,
+        TFTPReadAheadStats *stats,
+        TFTPPrefetcher *prefetcher)
+{
+    if (source == NULL || blockSize == 0 || depth <= 0 || stats == nullptr ||
+        prefetcher == nullptr || stream != NULL) {
+        return NULL;
+    }
+
+    this->source = source;
+    this->blockSize = blockSize;
+    this->depth = depth;
+    this->stats = stats;
+    this->prefetcher = prefetcher;
+
+    // A pooled stream keeps its buffers, so this only allocates the first
+    // time or when the depth grows.
+    blocks.resize(blockSize * depth);
+    blockLength.resize(depth);
+    streamBuffer.resize(blockSize);
+    position = ftello(source);
+    if (position < 0) {
+        position = 0;
+    }
+
+    int fd = fileno(source);
+    if (fd >= 0) {
+        posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    }
+
+    cookie_io_functions_t functions;
+    memset(&functions, 0, sizeof(functions));
+    functions.read = streamRead;
+    functions.seek = streamSeek;
+    functions.close = streamClose;
+
+    stream = fopencookie(this, "r", functions);
+    if (stream == NULL) {
+        return NULL;
+    }
+
+    // glibc hands reads of an unbuffered cookie stream over one byte at a
+    // time. With a block-sized buffer, whole-block reads are passed to us in
+    // one call and land straight in the engine's buffer.
+    setvbuf(stream, &streamBuffer[0], _IOFBF, blockSize);
+    resetRing();
+    prefetcher->schedule(this);
+    return stream;
+}
+
+FILE *TFTPReadAheadStream::getSource()
+{
+    return source;
+}
+
+void TFTPReadAheadStream::resetRing()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    endOfFile = false;
+    failed = false;
+    detached = false;
+    head = 0;
+    count = 0;
+    readOffset = 0;
+}
+
+void TFTPReadAheadStream::fill()
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    while (!detached && !endOfFile && count < (size_t) depth) {
+        // Only the prefetcher touches the tail slot, so the read itself
+        // doesn't need the lock.
+        size_t tail = (head + count) % depth;
+        lock.unlock();
+        size_t length = fread(&blocks[tail * blockSize], 1, blockSize, source);
+        lock.lock();
+
+        blockLength[tail] = length;
+        if (length > 0) {
+            count++;
+        }
+        if (length < blockSize) {
+            // A read error ends the prefetching too, it is reported once
+            // the blocks read before it are consumed.
+            failed = ferror(source) != 0;
+            endOfFile = true;
+        }
+        changed.notify_all();
+    }
+}
+
+ssize_t TFTPReadAheadStream::streamRead(
+        void *cookie,
+        char *buffer,
+        size_t size)
+{
+    TFTPReadAheadStream *self = (TFTPReadAheadStream *) cookie;
+    std::unique_lock<std::mutex> lock(self->mutex);
+
+    if (self->count == 0 && !self->endOfFile) {
+        self->stats->misses.fetch_add(1, std::memory_order_relaxed);
+        self->changed.wait(lock, [self] {
+            return self->count > 0 || self->endOfFile;
+        });
+    } else if (self->count > 0) {
+        self->stats->hits.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    size_t copied = 0;
+    while (copied < size && self->count > 0) {
+        size_t available = self->blockLength[self->head] - self->readOffset;
+        size_t chunk = available < size - copied ? available : size - copied;
+        memcpy(buffer + copied,
+               &self->blocks[self->head * self->blockSize + self->readOffset],
+               chunk);
+        copied += chunk;
+        self->readOffset += chunk;
+
+        if (self->readOffset == self->blockLength[self->head]) {
+            self->head = (self->head + 1) % self->depth;
+            self->count--;
+            self->readOffset = 0;
+        }
+    }
+
+    self->position += copied;
+    bool refill = !self->endOfFile;
+    bool failed = copied == 0 && self->failed;
+    lock.unlock();
+
+    if (refill) {
+        self->prefetcher->schedule(self);
+    }
+    return failed ? -1 : (ssize_t) copied;
+}
+
+int TFTPReadAheadStream::streamSeek(
+        void *cookie,
+        off64_t *offset,
+        int whence)
+{
+    TFTPReadAheadStream *self = (TFTPReadAheadStream *) cookie;
+    {
+        std::lock_guard<std::mutex> lock(self->mutex);
+        self->detached = true;
+    }
+    self->prefetcher->detach(self);
+
+    // Reading again after a seek may succeed.
+    clearerr(self->source);
+    int result = 0;
+    if (whence == SEEK_CUR) {
+        result = fseeko(self->source, self->position + *offset, SEEK_SET);
+    } else {
+        result = fseeko(self->source, *offset, whence);
+    }
+
+    off64_t newPosition = ftello(self->source);
+    if (result != 0 || newPosition < 0) {
+        fseeko(self->source, self->position, SEEK_SET);
+        newPosition = -1;
+    } else {
+        self->position = newPosition;
+        *offset = newPosition;
+    }
+
+    self->resetRing();
+    self->prefetcher->schedule(self);
+    return newPosition < 0 ? -1 : 0;
+}
+
+int TFTPReadAheadStream::streamClose(
+        void *cookie)
+{
+    TFTPReadAheadStream *self = (TFTPReadAheadStream *) cookie;
+    {
+        std::lock_guard<std::mutex> lock(self->mutex);
+        self->detached = true;
+    }
+    self->prefetcher->detach(self);
+    self->stream = NULL;
+    return 0;
+}
+
+TFTPPrefetcher::TFTPPrefetcher() {
+    stopping = false;
+    queueHead = nullptr;
+    queueTail = nullptr;
+}
+
+TFTPPrefetcher::~TFTPPrefetcher() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    changed.notify_all();
+    for (std::thread &worker : workers) {
+        worker.join();
+    }
+}
+
+void TFTPPrefetcher::schedule(
+        TFTPReadAheadStream *stream)
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (stream->queued || stopping) {
+            return;
+        }
+        if (stream->filling) {
+            stream->refill = true;
+            return;
+        }
+
+        if (workers.empty()) {
+            for (int i = 0; i < PREFETCH_WORKERS; ++i) {
+                workers.push_back(std::thread(&TFTPPrefetcher::run, this));
+            }
+        }
+
+        enqueue(stream);
+    }
+    changed.notify_all();
+}
+
+void TFTPPrefetcher::enqueue(
+        TFTPReadAheadStream *stream)
+{
+    stream->queued = true;
+    stream->prefetchNext = nullptr;
+    if (queueTail != nullptr) {
+        queueTail->prefetchNext = stream;
+    } else {
+        queueHead = stream;
+    }
+    queueTail = stream;
+}
+
+void TFTPPrefetcher::detach(
+        TFTPReadAheadStream *stream)
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    if (stream->queued) {
+        TFTPReadAheadStream *previous = nullptr;
+        TFTPReadAheadStream *current = queueHead;
+        while (current != nullptr && current != stream) {
+            previous = current;
+            current = current->prefetchNext;
+        }
+        if (current != nullptr) {
+            if (previous != nullptr) {
+                previous->prefetchNext = current->prefetchNext;
+            } else {
+                queueHead = current->prefetchNext;
+            }
+            if (queueTail == current) {
+                queueTail = previous;
+            }
+        }
+        stream->queued = false;
+        stream->prefetchNext = nullptr;
+    }
+
+    stream->refill = false;
+    changed.wait(lock, [stream] { return !stream->filling; });
+}
+
+void TFTPPrefetcher::run()
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    for (;;) {
+        changed.wait(lock, [this] {
+            return stopping || queueHead != nullptr;
+        });
+        if (stopping) {
+            return;
+        }
+
+        TFTPReadAheadStream *stream = queueHead;
+        queueHead = stream->prefetchNext;
+        if (queueHead == nullptr) {
+            queueTail = nullptr;
+        }
+        stream->prefetchNext = nullptr;
+        stream->queued = false;
+        stream->filling = true;
+        lock.unlock();
+
+        stream->fill();
+
+        lock.lock();
+        stream->filling = false;
+        if (stream->refill && !stopping) {
+            // Read from while we filled it, the ring may have room again.
+            stream->refill = false;
+            enqueue(stream);
+        }
+        changed.notify_all();
+    }
+}
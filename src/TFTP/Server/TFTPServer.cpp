@@ -3,94 +3,1828 @@
 //
 
 #include "TFTPServer.h"
+#include "TFTPTrace.h"
 #include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <chrono>
+#include <map>
+#include <string.h>
+#include <thread>
+
+#define TFTP_DEFAULT_PORT 69
+#define TFTP_SEGMENT_SIZE 512
+#define TFTP_COMPRESSION_CACHE_SIZE (32 * 1024 * 1024)
+#define TFTP_STRIPED_FILE_LIMIT (4ULL * 1024 * 1024 * 1024)
+#define TFTP_ADMISSION_REJECT_MESSAGE "WAIT:1"
+#define TFTP_LOCAL_CLIENT_IP "127.0.0.1"
+// File names starting with it are requests of the library, not files.
+#define TFTP_RESERVED_NAME_PREFIX '?'
+// Least time the destructor waits for sections without a drain timeout.
+#define TFTP_DESTROY_DRAIN_TIMEOUT 5000
+
+// Sections of the local transport aren't the engine's. Each is served on
+// a thread of its own, which knows it, and answers for the engine.
+static TFTPLocalSection *localSection(
+        const TftpdSectionHandlerPtr sectionHandler)
+{
+    TFTPLocalSection *section = TFTPLocalSection::current();
+    return section != nullptr && (TftpdSectionHandlerPtr) section == sectionHandler ?
+           section : nullptr;
+}
+
+static TftpdOperationResult sectionGetId(
+        const TftpdSectionHandlerPtr sectionHandler,
+        SectionId *id)
+{
+    TFTPLocalSection *section = localSection(sectionHandler);
+    if (section == nullptr) {
+        return get_section_id(sectionHandler, id);
+    }
+    *id = section->id;
+    return TFTPD_OK;
+}
+
+static TftpdOperationResult sectionGetClientIp(
+        const TftpdSectionHandlerPtr sectionHandler,
+        char *ip)
+{
+    TFTPLocalSection *section = localSection(sectionHandler);
+    if (section == nullptr) {
+        return get_client_ip(sectionHandler, ip);
+    }
+    strcpy(ip, TFTP_LOCAL_CLIENT_IP);
+    return TFTPD_OK;
+}
+
+static TftpdOperationResult sectionGetStatus(
+        const TftpdSectionHandlerPtr sectionHandler,
+        TftpdSectionStatus *status)
+{
+    TFTPLocalSection *section = localSection(sectionHandler);
+    if (section == nullptr) {
+        return get_section_status(sectionHandler, status);
+    }
+    *status = section->succeeded ? TFTPD_SECTION_OK :
+              section->failed ? TFTPD_SECTION_ERROR : TFTPD_SECTION_UNDEFINED;
+    return TFTPD_OK;
+}
+
+static TftpdOperationResult sectionSetErrorMessage(
+        const TftpdSectionHandlerPtr sectionHandler,
+        const char *message)
+{
+    TFTPLocalSection *section = localSection(sectionHandler);
+    if (section == nullptr) {
+        return set_error_msg(sectionHandler, message);
+    }
+    section->serverMessage = message;
+    return TFTPD_OK;
+}
+
+thread_local TFTPServer::TFTPSectionState *TFTPServer::threadSection = nullptr;
 
 TFTPServer::TFTPServer() {
-    if (create_tftpd_handler(&serverHandler) != TFTPD_OK) {
+    TFTPEndpoint *endpoint = createEndpoint();
+    if (endpoint == nullptr) {
         serverHandler = nullptr;
         throw "SERVER HANDLER CREATION FAILED!";
     }
-    
-    register_section_started_callback(serverHandler, sectionStartedCbk, this);
-    register_open_file_callback(serverHandler, openFileCbk, this);
-    register_close_file_callback(serverHandler, closeFileCbk, this);
-    register_section_finished_callback(serverHandler, sectionFinishedCbk, this);
+    endpoints.push_back(endpoint);
+    serverHandler = endpoint->handler;
+
+    serverTimeout = -1;
+    drainTimeout = 0;
+    readAheadDepth = 0;
+    readAheadStats.hits = 0;
+    readAheadStats.misses = 0;
+    largeFileThreshold = 0;
+    largeFileHugePages = false;
+    directStats.files = 0;
+    directStats.bytes = 0;
+    directStats.buffered = 0;
+    duplicateWindow = 0;
+    suppressedDuplicates = 0;
+    maxAdmittedSections = 0;
+    maxAdmittedBytes = 0;
+    admissionQueueLength = 0;
+    admissionQueueTimeout = 0;
+    admissionRejectMessage = TFTP_ADMISSION_REJECT_MESSAGE;
+    admittedSections = 0;
+    queuedSections = 0;
+    queuedRequests = 0;
+    rejectedRequests = 0;
+    compressionEnabled = false;
+    deltaEnabled = false;
+    stripedEnabled = false;
+    stripedFileLimit = TFTP_STRIPED_FILE_LIMIT;
+    durabilityMode = TftpDurabilityMode::TFTP_DURABILITY_NONE;
+    durableFiles = 0;
+    fileSyncs = 0;
+    failedCommits = 0;
+    compressionStats.plainBytes = 0;
+    compressionStats.compressedBytes = 0;
+    compressionCache.setCapacity(TFTP_COMPRESSION_CACHE_SIZE);
+    probeFile = std::make_shared<const std::vector<char>>();
+    listening = false;
+    activeSectionList = nullptr;
+    activeSections = 0;
+    localSections = 0;
+    nextSectionSerial = 0;
+    virtualFiles = std::make_shared<const TFTPVirtualFileTable>();
+
+    TFTPCallbacks *initial = new TFTPCallbacks;
+    initial->openFile = nullptr;
+    initial->openFileCtx = nullptr;
+    initial->closeFile = nullptr;
+    initial->closeFileCtx = nullptr;
+    initial->sectionStarted = nullptr;
+    initial->sectionStartedCtx = nullptr;
+    initial->sectionFinished = nullptr;
+    initial->sectionFinishedCtx = nullptr;
+    callbacks = initial;
+}
+
+TFTPServer::~TFTPServer() {
+    // Engine threads still finishing a section call back into us. One
+    // stuck past the bound is abandoned instead of hanging the destructor,
+    // the callbacks are unregistered below.
+    waitSectionsDrained(std::max(drainTimeout, TFTP_DESTROY_DRAIN_TIMEOUT));
+
+    for (TFTPEndpoint *endpoint : endpoints) {
+        destroyEndpoint(endpoint);
+    }
+    endpoints.clear();
+    serverHandler = nullptr;
+
+    for (const TFTPCallbacks *retired : retiredCallbacks) {
+        delete retired;
+    }
+    delete callbacks.load();
+}
+
+TFTPServer::TFTPEndpoint *TFTPServer::createEndpoint()
+{
+    TFTPEndpoint *endpoint = new TFTPEndpoint;
+    if (create_tftpd_handler(&endpoint->handler) != TFTPD_OK) {
+        delete endpoint;
+        return nullptr;
+    }
+    endpoint->server = this;
+    endpoint->port = TFTP_DEFAULT_PORT;
+
+    register_section_started_callback(endpoint->handler, sectionStartedCbk, endpoint);
+    register_open_file_callback(endpoint->handler, openFileCbk, endpoint);
+    register_close_file_callback(endpoint->handler, closeFileCbk, endpoint);
+    register_section_finished_callback(endpoint->handler, sectionFinishedCbk, endpoint);
+
+    return endpoint;
+}
+
+void TFTPServer::destroyEndpoint(TFTPEndpoint *endpoint)
+{
+    if (endpoint->handler != nullptr) {
+
+        register_section_started_callback(endpoint->handler, NULL, NULL);
+        register_open_file_callback(endpoint->handler, NULL, NULL);
+        register_close_file_callback(endpoint->handler, NULL, NULL);
+        register_section_finished_callback(endpoint->handler, NULL, NULL);
+
+        if (destroy_tftpd_handler(&endpoint->handler) != TFTPD_OK) {
+            //TODO: inform error
+        }
+    }
+    delete endpoint;
+}
+
+TftpServerOperationResult TFTPServer::setPort(
+        const int port)
+{
+    if (serverHandler == nullptr) {
+        return TftpServerOperationResult::TFTP_SERVER_ERROR;
+    }
+
+    if (set_port(serverHandler, port) != TFTPD_OK) {
+        return TftpServerOperationResult::TFTP_SERVER_ERROR;
+    }
+
+    endpoints[0]->port = port;
+    return TftpServerOperationResult::TFTP_SERVER_OK;
+}
+
+TftpServerOperationResult TFTPServer::addPort(
+        const int port)
+{
+    if (serverHandler == nullptr || listening) {
+        return TftpServerOperationResult::TFTP_SERVER_ERROR;
+    }
+
+    for (TFTPEndpoint *endpoint : endpoints) {
+        if (endpoint->port == port) {
+            return TftpServerOperationResult::TFTP_SERVER_ERROR;
+        }
+    }
+
+    TFTPEndpoint *endpoint = createEndpoint();
+    if (endpoint == nullptr) {
+        return TftpServerOperationResult::TFTP_SERVER_ERROR;
+    }
+
+    if (set_port(endpoint->handler, port) != TFTPD_OK ||
+        (serverTimeout >= 0 &&
+         set_server_timeout(endpoint->handler, serverTimeout) != TFTPD_OK)) {
+        destroyEndpoint(endpoint);
+        return TftpServerOperationResult::TFTP_SERVER_ERROR;
+    }
+
+    endpoint->port = port;
+    endpoints.push_back(endpoint);
+    return TftpServerOperationResult::TFTP_SERVER_OK;
+}
+
+TftpServerOperationResult TFTPServer::setCpuAffinity(
+        const int port,
+        const std::vector<int> &cpus)
+{
+    if (serverHandler == nullptr || listening) {
+        return TftpServerOperationResult::TFTP_SERVER_ERROR;
+    }
+
+    for (TFTPEndpoint *endpoint : endpoints) {
+        if (endpoint->port == port) {
+            return endpoint->cpus.assign(cpus) ?
+                   TftpServerOperationResult::TFTP_SERVER_OK :
+                   TftpServerOperationResult::TFTP_SERVER_ERROR;
+        }
+    }
+    return TftpServerOperationResult::TFTP_SERVER_ERROR;
+}
+
+TftpServerOperationResult TFTPServer::setTimeout(
+        const int timeout)
+{
+    if (serverHandler == nullptr) {
+        return TftpServerOperationResult::TFTP_SERVER_ERROR;
+    }
+
+    for (TFTPEndpoint *endpoint : endpoints) {
+        if (set_server_timeout(endpoint->handler, timeout) != TFTPD_OK) {
+            return TftpServerOperationResult::TFTP_SERVER_ERROR;
+        }
+    }
+
+    serverTimeout = timeout;
+    return TftpServerOperationResult::TFTP_SERVER_OK;
+}
+
+TftpServerOperationResult TFTPServer::setDrainTimeout(
+        const int timeout)
+{
+    if (timeout < 0) {
+        return TftpServerOperationResult::TFTP_SERVER_ERROR;
+    }
+
+    drainTimeout = timeout;
+    return TftpServerOperationResult::TFTP_SERVER_OK;
+}
+
+TftpServerOperationResult TFTPServer::startListening() {
+    if (serverHandler == nullptr) {
+        return TftpServerOperationResult::TFTP_SERVER_ERROR;
+    }
+
+    listening = true;
+    for (TFTPEndpoint *endpoint : endpoints) {
+        TFTPLocalTransport::registerPort(endpoint->port, startLocalSectionCbk, endpoint);
+    }
+
+    // Extra ports get a listener thread each, the primary port keeps
+    // listening on the calling thread. A port that fails to listen stops
+    // the others, so the failure is reported without waiting for a stop.
+    std::vector<TftpdOperationResult> results(endpoints.size(), TFTPD_OK);
+    std::vector<std::thread> listeners;
+    for (size_t i = 1; i < endpoints.size(); ++i) {
+        TFTPEndpoint *endpoint = endpoints[i];
+        TftpdOperationResult *result = &results[i];
+        listeners.push_back(std::thread([this, endpoint, result]() {
+            endpoint->cpus.pinCurrentThread();
+            *result = start_listening(endpoint->handler);
+            if (*result != TFTPD_OK) {
+                stopListening();
+            }
+        }));
+    }
+
+    // The calling thread gets its CPUs back once the server stops.
+    TFTPCpuSet callerCpus;
+    endpoints[0]->cpus.pinCurrentThread(&callerCpus);
+    results[0] = start_listening(serverHandler);
+    if (results[0] != TFTPD_OK) {
+        stopEndpoints();
+    }
+    callerCpus.pinCurrentThread();
+
+    for (std::thread &listener : listeners) {
+        listener.join();
+    }
+    bool failed = false;
+    for (TftpdOperationResult result : results) {
+        failed = failed || result != TFTPD_OK;
+    }
+    for (TFTPEndpoint *endpoint : endpoints) {
+        TFTPLocalTransport::unregisterPort(endpoint->port, endpoint);
+    }
+    listening = false;
+
+    waitSectionsDrained(drainTimeout);
+
+    return failed ?
+           TftpServerOperationResult::TFTP_SERVER_ERROR :
+           TftpServerOperationResult::TFTP_SERVER_OK;
+}
+
+TftpServerOperationResult TFTPServer::stopListening() {
+    if (serverHandler == nullptr) {
+        return TftpServerOperationResult::TFTP_SERVER_ERROR;
+    }
+
+    TFTP_TRACE_INSTANT("server", "stopListening", 0);
+    if (stop_listening(serverHandler) != TFTPD_OK) {
+        return TftpServerOperationResult::TFTP_SERVER_ERROR;
+    }
+
+    stopEndpoints();
+    return TftpServerOperationResult::TFTP_SERVER_OK;
+}
+
+void TFTPServer::stopEndpoints()
+{
+    for (TFTPEndpoint *endpoint : endpoints) {
+        if (endpoint->handler != serverHandler) {
+            stop_listening(endpoint->handler);
+        }
+        if (listening) {
+            wakeListener(endpoint->port);
+        }
+    }
+}
+
+void TFTPServer::wakeListener(const int port)
+{
+    // The listen loop only checks the stop request after its socket wait
+    // returns, so an empty datagram to our own port ends the wait now
+    // instead of after the listen timeout. The engine has no bind address,
+    // it listens on the wildcard address of either family, which loopback
+    // reaches.
+    int sock = socket(AF_INET, SOCK_DGRAM, 0);
+    if (sock >= 0) {
+        struct sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(port);
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        sendto(sock, NULL, 0, 0, (struct sockaddr *) &addr, sizeof(addr));
+        close(sock);
+    }
+
+    sock = socket(AF_INET6, SOCK_DGRAM, 0);
+    if (sock >= 0) {
+        struct sockaddr_in6 addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin6_family = AF_INET6;
+        addr.sin6_port = htons(port);
+        addr.sin6_addr = in6addr_loopback;
+        sendto(sock, NULL, 0, 0, (struct sockaddr *) &addr, sizeof(addr));
+        close(sock);
+    }
+}
+
+void TFTPServer::waitSectionsDrained(
+        const int timeout)
+{
+    if (timeout <= 0) {
+        return;
+    }
+
+    std::unique_lock<std::mutex> lock(sectionsMutex);
+    sectionsDrained.wait_for(lock, std::chrono::milliseconds(timeout),
+                             [this] { return activeSections == 0 && localSections == 0; });
+}
+
+TftpServerOperationResult TFTPServer::setReadAheadDepth(
+        const int depth)
+{
+    if (depth < 0) {
+        return TftpServerOperationResult::TFTP_SERVER_ERROR;
+    }
+
+    readAheadDepth = depth;
+    return TftpServerOperationResult::TFTP_SERVER_OK;
+}
+
+TftpServerOperationResult TFTPServer::getReadAheadStats(
+        uint64_t *hits,
+        uint64_t *misses)
+{
+    if (hits == nullptr || misses == nullptr) {
+        return TftpServerOperationResult::TFTP_SERVER_ERROR;
+    }
+
+    *hits = readAheadStats.hits.load(std::memory_order_relaxed);
+    *misses = readAheadStats.misses.load(std::memory_order_relaxed);
+    return TftpServerOperationResult::TFTP_SERVER_OK;
+}
+
+TftpServerOperationResult TFTPServer::getLatencyHistogram(
+        const TftpLatencyMetric metric,
+        TFTPLatencyHistogram &histogram)
+{
+    if (metric >= TftpLatencyMetric::TFTP_LATENCY_METRIC_COUNT) {
+        return TftpServerOperationResult::TFTP_SERVER_ERROR;
+    }
+
+    histogram.merge(latency[(int) metric]);
+    return TftpServerOperationResult::TFTP_SERVER_OK;
+}
+
+TftpServerOperationResult TFTPServer::getLatencySummary(
+        const TftpLatencyMetric metric,
+        TFTPLatencySummary *summary)
+{
+    if (metric >= TftpLatencyMetric::TFTP_LATENCY_METRIC_COUNT || summary == nullptr) {
+        return TftpServerOperationResult::TFTP_SERVER_ERROR;
+    }
+
+    latency[(int) metric].getSummary(summary);
+    return TftpServerOperationResult::TFTP_SERVER_OK;
+}
+
+TftpServerOperationResult TFTPServer::resetLatencyStats()
+{
+    for (TFTPLatencyHistogram &histogram : latency) {
+        histogram.reset();
+    }
+    return TftpServerOperationResult::TFTP_SERVER_OK;
+}
+
+void TFTPServer::recordLatency(
+        const TftpLatencyMetric metric,
+        const std::chrono::steady_clock::time_point start)
+{
+    std::chrono::steady_clock::duration elapsed = std::chrono::steady_clock::now() - start;
+    latency[(int) metric].record(
+            std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count());
+}
+
+TftpServerOperationResult TFTPServer::setDuplicateRequestWindow(
+        const int window)
+{
+    if (window < 0) {
+        return TftpServerOperationResult::TFTP_SERVER_ERROR;
+    }
+
+    duplicateWindow = window;
+    return TftpServerOperationResult::TFTP_SERVER_OK;
+}
+
+TftpServerOperationResult TFTPServer::getSuppressedDuplicates(
+        uint64_t *count)
+{
+    if (count == nullptr) {
+        return TftpServerOperationResult::TFTP_SERVER_ERROR;
+    }
+
+    *count = suppressedDuplicates.load(std::memory_order_relaxed);
+    return TftpServerOperationResult::TFTP_SERVER_OK;
+}
+
+TftpServerOperationResult TFTPServer::setCompression(
+        const bool enabled)
+{
+    compressionEnabled = enabled;
+    return TftpServerOperationResult::TFTP_SERVER_OK;
+}
+
+TftpServerOperationResult TFTPServer::setDeltaTransfer(
+        const bool enabled)
+{
+    deltaEnabled = enabled;
+    return TftpServerOperationResult::TFTP_SERVER_OK;
+}
+
+TftpServerOperationResult TFTPServer::setStripedTransfer(
+        const bool enabled)
+{
+    stripedEnabled = enabled;
+    return TftpServerOperationResult::TFTP_SERVER_OK;
+}
+
+TftpServerOperationResult TFTPServer::setStripedFileLimit(
+        const uint64_t limit)
+{
+    stripedFileLimit = limit;
+    return TftpServerOperationResult::TFTP_SERVER_OK;
+}
+
+TftpServerOperationResult TFTPServer::setDurabilityMode(
+        const TftpDurabilityMode mode)
+{
+    durabilityMode = mode;
+    return TftpServerOperationResult::TFTP_SERVER_OK;
+}
+
+TftpServerOperationResult TFTPServer::setGroupCommitInterval(
+        const int interval)
+{
+    if (interval < 0) {
+        return TftpServerOperationResult::TFTP_SERVER_ERROR;
+    }
+
+    groupCommit.setInterval(interval);
+    return TftpServerOperationResult::TFTP_SERVER_OK;
+}
+
+TftpServerOperationResult TFTPServer::getDurabilityStats(
+        uint64_t *files,
+        uint64_t *syncs,
+        uint64_t *failed)
+{
+    if (files != nullptr) {
+        *files = durableFiles.load(std::memory_order_relaxed);
+    }
+    if (syncs != nullptr) {
+        *syncs = fileSyncs.load(std::memory_order_relaxed) + groupCommit.getSyncs();
+    }
+    if (failed != nullptr) {
+        *failed = failedCommits.load(std::memory_order_relaxed);
+    }
+    return TftpServerOperationResult::TFTP_SERVER_OK;
+}
+
+TftpServerOperationResult TFTPServer::setLargeFileMode(
+        const uint64_t threshold,
+        const bool hugePages)
+{
+    largeFileThreshold = threshold;
+    largeFileHugePages = hugePages;
+    return TftpServerOperationResult::TFTP_SERVER_OK;
+}
+
+TftpServerOperationResult TFTPServer::getLargeFileStats(
+        uint64_t *files,
+        uint64_t *bytes,
+        uint64_t *buffered)
+{
+    if (files != nullptr) {
+        *files = directStats.files.load(std::memory_order_relaxed);
+    }
+    if (bytes != nullptr) {
+        *bytes = directStats.bytes.load(std::memory_order_relaxed);
+    }
+    if (buffered != nullptr) {
+        *buffered = directStats.buffered.load(std::memory_order_relaxed);
+    }
+    return TftpServerOperationResult::TFTP_SERVER_OK;
+}
+
+TftpServerOperationResult TFTPServer::setMetadataIndex(
+        const std::string &directory,
+        const int threads)
+{
+    if (directory.empty()) {
+        metadataIndex.stop();
+        return TftpServerOperationResult::TFTP_SERVER_OK;
+    }
+    if (threads < 0 || !metadataIndex.start(directory, threads)) {
+        return TftpServerOperationResult::TFTP_SERVER_ERROR;
+    }
+    return TftpServerOperationResult::TFTP_SERVER_OK;
+}
+
+TftpServerOperationResult TFTPServer::getFileMetadata(
+        const std::string &filename,
+        TFTPFileMetadata &metadata)
+{
+    TFTPFileMetadataPtr found = metadataIndex.find(filename);
+    if (found == nullptr) {
+        return TftpServerOperationResult::TFTP_SERVER_ERROR;
+    }
+
+    metadata = *found;
+    return TftpServerOperationResult::TFTP_SERVER_OK;
+}
+
+TftpServerOperationResult TFTPServer::getMetadataIndexStats(
+        uint64_t *files,
+        uint64_t *hits,
+        uint64_t *misses)
+{
+    metadataIndex.getStats(files, hits, misses);
+    return TftpServerOperationResult::TFTP_SERVER_OK;
+}
+
+TftpServerOperationResult TFTPServer::setCompressionCacheSize(
+        const size_t size)
+{
+    compressionCache.setCapacity(size);
+    return TftpServerOperationResult::TFTP_SERVER_OK;
+}
+
+TftpServerOperationResult TFTPServer::getCompressionStats(
+        uint64_t *plainBytes,
+        uint64_t *compressedBytes,
+        uint64_t *cacheHits)
+{
+    if (plainBytes != nullptr) {
+        *plainBytes = compressionStats.plainBytes.load(std::memory_order_relaxed);
+    }
+    if (compressedBytes != nullptr) {
+        *compressedBytes = compressionStats.compressedBytes.load(std::memory_order_relaxed);
+    }
+    if (cacheHits != nullptr) {
+        compressionCache.getStats(cacheHits, nullptr);
+    }
+    return TftpServerOperationResult::TFTP_SERVER_OK;
+}
+
+TftpServerOperationResult TFTPServer::setAdmissionLimits(
+        const int maxSections,
+        const uint64_t maxBytes,
+        const int queueLength,
+        const int queueTimeout)
+{
+    if (maxSections < 0 || queueLength < 0 || queueTimeout < 0) {
+        return TftpServerOperationResult::TFTP_SERVER_ERROR;
+    }
+
+    std::lock_guard<std::mutex> lock(sectionsMutex);
+    maxAdmittedSections = maxSections;
+    maxAdmittedBytes = maxBytes;
+    admissionQueueLength = queueLength;
+    admissionQueueTimeout = queueTimeout;
+    // Raised limits let queued requests in now.
+    sectionsDrained.notify_all();
+    return TftpServerOperationResult::TFTP_SERVER_OK;
+}
+
+TftpServerOperationResult TFTPServer::setAdmissionRejectMessage(
+        const std::string &message)
+{
+    std::lock_guard<std::mutex> lock(sectionsMutex);
+    admissionRejectMessage = message;
+    return TftpServerOperationResult::TFTP_SERVER_OK;
+}
+
+TftpServerOperationResult TFTPServer::getAdmissionStats(
+        uint64_t *queued,
+        uint64_t *rejected)
+{
+    if (queued != nullptr) {
+        *queued = queuedRequests.load(std::memory_order_relaxed);
+    }
+    if (rejected != nullptr) {
+        *rejected = rejectedRequests.load(std::memory_order_relaxed);
+    }
+    return TftpServerOperationResult::TFTP_SERVER_OK;
+}
+
+bool TFTPServer::admissionLimited()
+{
+    return maxAdmittedSections > 0 || maxAdmittedBytes > 0;
+}
+
+bool TFTPServer::admissionOverloaded(
+        const uint64_t size)
+{
+    int maxSections = maxAdmittedSections;
+    if (maxSections > 0 && admittedSections >= maxSections) {
+        return true;
+    }
+
+    uint64_t maxBytes = maxAdmittedBytes;
+    if (maxBytes == 0) {
+        return false;
+    }
+    uint64_t left = 0;
+    for (TFTPSectionState *state = activeSectionList; state != nullptr;
+         state = state->next) {
+        if (state->admitted) {
+            uint64_t moved = state->record != nullptr ?
+                             state->record->bytes.load(std::memory_order_relaxed) : 0;
+            left += state->size > moved ? state->size - moved : 0;
+        }
+    }
+    // The request counts too, but a read larger than the limit still gets
+    // in on its own.
+    return left >= maxBytes || (left > 0 && left + size > maxBytes);
+}
+
+uint64_t TFTPServer::requestSize(
+        const TftpdSectionHandlerPtr sectionHandler,
+        const char *filename,
+        const char *mode)
+{
+    // Uploads don't tell their size. Compressed reads, sizes, hashes and
+    // checksums are left unsized, like once they are open.
+    if (filename == nullptr || mode == nullptr || mode[0] != 'r') {
+        return 0;
+    }
+    std::string name = filename;
+    TFTPRange range;
+    if (stripCompressionSuffix(&name[0])) {
+        return 0;
+    }
+    if (stripRangeSuffix(&name[0], range)) {
+        return range.length;
+    }
+    if (stripSizeSuffix(&name[0]) ||
+        stripDeltaSuffix(&name[0]) != TftpDeltaRequest::TFTP_DELTA_NONE) {
+        return 0;
+    }
+    name.resize(strlen(name.c_str()));
+
+    std::shared_ptr<const TFTPVirtualFileTable> table = std::atomic_load(&virtualFiles);
+    TFTPVirtualFileTable::const_iterator it = std::lower_bound(
+            table->begin(), table->end(), name.c_str(),
+            [](const TFTPVirtualFile &file, const char *name) {
+                return strcmp(file.name.c_str(), name) < 0;
+            });
+    if (it != table->end() && it->name == name) {
+        return it->data->size();
+    }
+
+    // Files opened by the callback are only sized once open.
+    struct stat info;
+    if (sectionCallbacks(sectionHandler)->openFile == nullptr &&
+        stat(name.c_str(), &info) == 0 && S_ISREG(info.st_mode)) {
+        return info.st_size;
+    }
+    return 0;
+}
+
+bool TFTPServer::admitSection(
+        const TftpdSectionHandlerPtr sectionHandler,
+        const char *filename,
+        const char *mode)
+{
+    if (!admissionLimited()) {
+        return true;
+    }
+
+    TFTPSectionState *state = sectionState(sectionHandler);
+    if (state == nullptr) {
+        return true;
+    }
+
+    // Sized before it is admitted, so it counts against the byte limit.
+    uint64_t size = maxAdmittedBytes > 0 ? requestSize(sectionHandler, filename, mode) : 0;
+
+    std::string message;
+    {
+        std::unique_lock<std::mutex> lock(sectionsMutex);
+
+        bool admitted = !admissionOverloaded(size);
+        if (!admitted && queuedSections < admissionQueueLength) {
+            queuedSections++;
+            queuedRequests.fetch_add(1, std::memory_order_relaxed);
+            TFTP_TRACE_INSTANT("server", "admissionQueued", state->serial);
+            // Woken as sections finish, which is when room is made.
+            admitted = sectionsDrained.wait_for(
+                    lock, std::chrono::milliseconds(admissionQueueTimeout),
+                    [this, size] { return !admissionOverloaded(size); });
+            queuedSections--;
+        }
+        if (admitted) {
+            state->admitted = true;
+            state->size = size;
+            admittedSections++;
+            return true;
+        }
+        message = admissionRejectMessage;
+    }
+
+    // Answered before the file is opened, a rejected client costs us one
+    // ERROR packet.
+    rejectedRequests.fetch_add(1, std::memory_order_relaxed);
+    TFTP_TRACE_INSTANT("server", "admissionRejected", 0);
+    sectionSetErrorMessage(sectionHandler, message.c_str());
+    return false;
+}
+
+bool TFTPServer::isSectionActive(
+        const uint64_t serial)
+{
+    for (TFTPSectionState *state = activeSectionList; state != nullptr;
+         state = state->next) {
+        if (state->serial == serial) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool TFTPServer::suppressDuplicate(
+        const TftpdSectionHandlerPtr sectionHandler,
+        const char *filename,
+        const char *mode)
+{
+    // Local sections don't retransmit their request.
+    int window = duplicateWindow;
+    if (window <= 0 || filename == nullptr || mode == nullptr ||
+        localSection(sectionHandler) != nullptr) {
+        return false;
+    }
+
+    char clientIp[INET6_ADDRSTRLEN];
+    if (sectionGetClientIp(sectionHandler, clientIp) != TFTPD_OK) {
+        return false;
+    }
+
+    TFTPSectionState *state = sectionState(sectionHandler);
+    if (state == nullptr) {
+        return false;
+    }
+
+    std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+    std::unique_lock<std::mutex> lock(sectionsMutex);
+
+    // A client only repeats its request until it hears from the original:
+    // its first ACK of a read, its first DATA of a write.
+    TFTPSectionState *original = activeSectionList;
+    for (; original != nullptr; original = original->next) {
+        uint64_t heard = original->opcode == 'r' ? TFTP_SEGMENT_SIZE : 0;
+        TFTPSectionRecord *record = original->record;
+        if (original != state && original->requestKnown &&
+            original->opcode == mode[0] &&
+            now - original->requestTime <= std::chrono::milliseconds(window) &&
+            (record == nullptr || record->bytes.load(std::memory_order_relaxed) <= heard) &&
+            strcmp(original->clientIp, clientIp) == 0 &&
+            original->filename == filename) {
+            break;
+        }
+    }
+
+    if (original == nullptr) {
+        state->requestKnown = true;
+        state->opcode = mode[0];
+        strcpy(state->clientIp, clientIp);
+        state->filename = filename;
+        state->requestTime = now;
+        return false;
+    }
+
+    suppressedDuplicates.fetch_add(1, std::memory_order_relaxed);
+    TFTP_TRACE_INSTANT("server", "duplicateRequest", state->serial);
+
+    // The engine answers a failed open with an ERROR packet. Sent now, it
+    // could reach the client before the original's first packet, sent
+    // once the original is done, the client has already moved on. The
+    // engine thread is held at most until the original's window ends.
+    uint64_t serial = original->serial;
+    sectionsDrained.wait_until(
+            lock, original->requestTime + std::chrono::milliseconds(window),
+            [this, serial] { return !isSectionActive(serial); });
+    return true;
+}
+
+void TFTPServer::notifyDeferredStart(
+        const TftpdSectionHandlerPtr sectionHandler,
+        const int port)
+{
+    TFTPSectionState *state = sectionState(sectionHandler);
+    if (state == nullptr || state->startNotified) {
+        return;
+    }
+    state->startNotified = true;
+
+    const TFTPCallbacks *current = state->callbacks;
+    if (current->sectionStarted != nullptr) {
+        TFTP_TRACE_SCOPE("server", "sectionStartedCallback");
+        TFTPSection section(sectionHandler, port);
+        current->sectionStarted(&section, current->sectionStartedCtx);
+    }
+}
+
+TFTPServer::TFTPSectionState *TFTPServer::findSection(
+        const TftpdSectionHandlerPtr sectionHandler)
+{
+    for (TFTPSectionState *state = activeSectionList; state != nullptr;
+         state = state->next) {
+        if (state->handler == sectionHandler) {
+            return state;
+        }
+    }
+    return nullptr;
+}
+
+TFTPServer::TFTPSectionState *TFTPServer::sectionState(
+        const TftpdSectionHandlerPtr sectionHandler)
+{
+    // The engine calls back on the thread that started the section, which
+    // knows its state. Its fields besides the ones listSections() reads are
+    // only used by that thread, so they need no lock.
+    TFTPSectionState *state = threadSection;
+    if (state != nullptr && state->handler == sectionHandler) {
+        return state;
+    }
+
+    std::lock_guard<std::mutex> lock(sectionsMutex);
+    return findSection(sectionHandler);
+}
+
+const TFTPServer::TFTPCallbacks *TFTPServer::sectionCallbacks(
+        const TftpdSectionHandlerPtr sectionHandler)
+{
+    TFTPSectionState *state = sectionState(sectionHandler);
+    return state != nullptr ? state->callbacks : callbacks.load(std::memory_order_acquire);
+}
+
+void TFTPServer::publishCallbacks(
+        TFTPCallbacks *next)
+{
+    // Called with sectionsMutex held: no section can pick up the old
+    // snapshot once it is retired.
+    retiredCallbacks.push_back(callbacks.exchange(next, std::memory_order_acq_rel));
+    reclaimCallbacks();
+}
+
+void TFTPServer::reclaimCallbacks()
+{
+    std::vector<const TFTPCallbacks *>::iterator it = retiredCallbacks.begin();
+    while (it != retiredCallbacks.end()) {
+        bool used = false;
+        for (TFTPSectionState *state = activeSectionList; state != nullptr && !used;
+             state = state->next) {
+            used = state->callbacks == *it;
+        }
+        if (used) {
+            ++it;
+        } else {
+            delete *it;
+            it = retiredCallbacks.erase(it);
+        }
+    }
+}
+
+void TFTPServer::wrapReadStream(
+        const TftpdSectionHandlerPtr sectionHandler,
+        FILE **fd)
+{
+    int depth = readAheadDepth;
+    if (depth <= 0) {
+        return;
+    }
+
+    TFTPReadAheadStream *readAhead = readAheadPool.acquire();
+    FILE *stream = readAhead->open(*fd, TFTP_SEGMENT_SIZE, depth,
+                                   &readAheadStats, &prefetcher);
+    if (stream == NULL) {
+        readAheadPool.release(readAhead);
+        return;
+    }
+
+    TFTPSectionState *state = sectionState(sectionHandler);
+    if (state == nullptr || state->readAhead != nullptr) {
+        fclose(stream);
+        readAheadPool.release(readAhead);
+        return;
+    }
+
+    state->readAhead = readAhead;
+    state->readAheadStream = stream;
+    *fd = stream;
+}
+
+bool TFTPServer::wrapDirectStream(
+        const TftpdSectionHandlerPtr sectionHandler,
+        FILE **fd,
+        const bool write)
+{
+    // Only files we open ourselves, callback FILEs may be anything.
+    uint64_t threshold = largeFileThreshold;
+    if (threshold == 0 || sectionCallbacks(sectionHandler)->openFile != nullptr) {
+        return false;
+    }
+
+    TFTPDirectStream *directStream = directStreamPool.acquire();
+    FILE *stream = directStream->open(*fd, write, threshold, largeFileHugePages,
+                                      &directStats);
+    if (stream == NULL) {
+        directStreamPool.release(directStream);
+        return false;
+    }
+
+    TFTPSectionState *state = sectionState(sectionHandler);
+    if (state == nullptr || state->directStream != nullptr) {
+        fclose(stream);
+        directStreamPool.release(directStream);
+        return false;
+    }
+
+    state->directStream = directStream;
+    state->directFileStream = stream;
+    *fd = stream;
+    return true;
+}
+
+FILE *TFTPServer::unwrapDirectStream(
+        const TftpdSectionHandlerPtr sectionHandler,
+        FILE *fd,
+        bool *flushed)
+{
+    TFTPSectionState *state = sectionState(sectionHandler);
+    if (state == nullptr || fd == NULL || state->directFileStream != fd) {
+        return fd;
+    }
+    TFTPDirectStream *directStream = state->directStream;
+    state->directStream = nullptr;
+    state->directFileStream = NULL;
+
+    // The tail of a written file only reaches it on close.
+    FILE *source = directStream->getSource();
+    *flushed = fclose(fd) == 0;
+    directStreamPool.release(directStream);
+    return source;
+}
+
+void TFTPServer::wrapTimedStream(
+        const TftpdSectionHandlerPtr sectionHandler,
+        const int port,
+        FILE **fd,
+        const char *filename,
+        const bool write,
+        const uint64_t size)
+{
+    TftpSectionId id = 0;
+    char clientIp[INET6_ADDRSTRLEN];
+    sectionGetId(sectionHandler, &id);
+    if (sectionGetClientIp(sectionHandler, clientIp) != TFTPD_OK) {
+        clientIp[0] = '\0';
+    }
+
+    TFTPTimedStream *timedStream = timedStreamPool.acquire();
+    TFTPSectionState *state = sectionState(sectionHandler);
+    TFTPSectionRecord *record = nullptr;
+    FILE *stream = NULL;
+    if (state != nullptr && state->timedStream == nullptr) {
+        record = recordPool.acquire();
+        record->references = 1;
+        record->id = id;
+        strcpy(record->clientIp, clientIp);
+        record->port = port;
+        record->upload = write;
+        record->ranged = state->rangeStream != nullptr;
+        record->filename = filename;
+        record->startTime = state->startTime;
+        record->bytes = 0;
+        // The timed stream sees every block, it keeps the byte count.
+        stream = timedStream->open(
+                *fd, write, state->startTime,
+                &latency[(int) TftpLatencyMetric::TFTP_LATENCY_FIRST_BLOCK],
+                &latency[(int) TftpLatencyMetric::TFTP_LATENCY_BLOCK_ROUND_TRIP],
+                &record->bytes);
+    }
+    if (stream == NULL) {
+        timedStreamPool.release(timedStream);
+        recordPool.release(record);
+        return;
+    }
+
+    state->timedStream = timedStream;
+    state->timedFileStream = stream;
+    {
+        std::lock_guard<std::mutex> lock(sectionsMutex);
+        state->record = record;
+        state->size = size;
+    }
+    *fd = stream;
+}
+
+void TFTPServer::releaseRecord(
+        TFTPSectionRecord *record)
+{
+    if (record->references.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+        recordPool.release(record);
+    }
+}
+
+FILE *TFTPServer::unwrapTimedStream(
+        const TftpdSectionHandlerPtr sectionHandler,
+        FILE *fd)
+{
+    TFTPSectionState *state = sectionState(sectionHandler);
+    if (state == nullptr || fd == NULL || state->timedFileStream != fd) {
+        return fd;
+    }
+    TFTPTimedStream *timedStream = state->timedStream;
+    state->timedStream = nullptr;
+    state->timedFileStream = NULL;
+
+    FILE *source = timedStream->getSource();
+    fclose(fd);
+    timedStreamPool.release(timedStream);
+    return source;
+}
+
+FILE *TFTPServer::unwrapStream(
+        const TftpdSectionHandlerPtr sectionHandler,
+        FILE *fd)
+{
+    TFTPSectionState *state = sectionState(sectionHandler);
+    if (state == nullptr || state->readAheadStream != fd) {
+        return fd;
+    }
+    TFTPReadAheadStream *readAhead = state->readAhead;
+    state->readAhead = nullptr;
+    state->readAheadStream = NULL;
+
+    FILE *source = readAhead->getSource();
+    fclose(fd);
+    readAheadPool.release(readAhead);
+    return source;
+}
+
+bool TFTPServer::stripSuffix(
+        char *filename,
+        const char *suffix)
+{
+    if (filename == nullptr) {
+        return false;
+    }
+
+    size_t length = strlen(filename);
+    size_t suffixLength = strlen(suffix);
+    if (length < suffixLength || strcmp(filename + length - suffixLength, suffix) != 0) {
+        return false;
+    }
+
+    filename[length - suffixLength] = '\0';
+    return true;
+}
+
+bool TFTPServer::stripCompressionSuffix(
+        char *filename)
+{
+    return compressionEnabled && stripSuffix(filename, TFTP_COMPRESSION_SUFFIX);
+}
+
+TFTPServer::TftpDeltaRequest TFTPServer::stripDeltaSuffix(
+        char *filename)
+{
+    // Striped transfers are checked against the checksum.
+    if ((deltaEnabled || stripedEnabled) && stripSuffix(filename, TFTP_CHECKSUM_SUFFIX)) {
+        return TftpDeltaRequest::TFTP_DELTA_CHECKSUM;
+    }
+    if (!deltaEnabled) {
+        return TftpDeltaRequest::TFTP_DELTA_NONE;
+    }
+    if (stripSuffix(filename, TFTP_HASHES_SUFFIX)) {
+        return TftpDeltaRequest::TFTP_DELTA_HASHES;
+    }
+    if (stripSuffix(filename, TFTP_DELTA_SUFFIX)) {
+        return TftpDeltaRequest::TFTP_DELTA_WRITE;
+    }
+    return TftpDeltaRequest::TFTP_DELTA_NONE;
+}
+
+bool TFTPServer::stripRangeSuffix(
+        char *filename,
+        TFTPRange &range)
+{
+    // The range is last, a name may hold the suffix text before it.
+    char *suffix = nullptr;
+    if (filename != nullptr && stripedEnabled) {
+        const char *value = strrchr(filename, TFTP_RANGE_SUFFIX[0]);
+        if (value != nullptr &&
+            strncmp(value, TFTP_RANGE_SUFFIX, strlen(TFTP_RANGE_SUFFIX)) == 0) {
+            suffix = filename + (value - filename);
+        }
+    }
+    if (suffix == nullptr) {
+        return false;
+    }
+
+    // The bare suffix is a probe, it names no file.
+    const char *value = suffix + strlen(TFTP_RANGE_SUFFIX);
+    if (value[0] == '\0' && suffix == filename) {
+        memset(&range, 0, sizeof(range));
+    } else if (!TFTPRangeStream::decodeRange(value, range)) {
+        return false;
+    }
+    *suffix = '\0';
+    return true;
+}
+
+bool TFTPServer::stripSizeSuffix(
+        char *filename)
+{
+    return stripedEnabled && stripSuffix(filename, TFTP_SIZE_SUFFIX);
+}
+
+bool TFTPServer::openHashesFile(
+        const TftpdSectionHandlerPtr sectionHandler,
+        const int port,
+        FILE **fd,
+        char *filename,
+        char *mode,
+        size_t *bufferSize,
+        const bool checksumOnly)
+{
+    FILE *file = NULL;
+    openUserFile(sectionHandler, port, &file, filename, mode, bufferSize);
+    if (file == NULL) {
+        return false;
+    }
+
+    // Indexed files aren't read at all.
+    bool ok = true;
+    TFTPVirtualFileData encoded;
+    TFTPFileMetadataPtr metadata = metadataIndex.find(fileno(file));
+    if (metadata != nullptr && !checksumOnly) {
+        encoded = metadata->encodedHashes;
+    } else {
+        TFTPBlockHashes hashes;
+        std::shared_ptr<std::vector<char>> computed = std::make_shared<std::vector<char>>();
+        if (metadata != nullptr) {
+            TFTPDelta::encodeChecksum(metadata->hashes, *computed);
+        } else if (checksumOnly) {
+            ok = TFTPDelta::checksumFile(file, hashes);
+            TFTPDelta::encodeChecksum(hashes, *computed);
+        } else {
+            ok = TFTPDelta::hashFile(file, hashes);
+            TFTPDelta::encodeHashes(hashes, *computed);
+        }
+        encoded = computed;
+    }
+
+    if (!ok) {
+        closeUserFile(sectionHandler, port, file);
+        return false;
+    }
+    return openAnswerFile(sectionHandler, port, fd, file, encoded, bufferSize);
+}
+
+bool TFTPServer::openSizeFile(
+        const TftpdSectionHandlerPtr sectionHandler,
+        const int port,
+        FILE **fd,
+        char *filename,
+        char *mode,
+        size_t *bufferSize)
+{
+    FILE *file = NULL;
+    openUserFile(sectionHandler, port, &file, filename, mode, nullptr);
+    if (file == NULL) {
+        return false;
+    }
+
+    // Never read, FILEs without a descriptor are only seeked.
+    off_t size = -1;
+    struct stat info;
+    int descriptor = fileno(file);
+    if (descriptor >= 0 && fstat(descriptor, &info) == 0 && S_ISREG(info.st_mode)) {
+        size = info.st_size;
+    } else if (fseeko(file, 0, SEEK_END) == 0) {
+        size = ftello(file);
+    }
+    if (size < 0) {
+        closeUserFile(sectionHandler, port, file);
+        return false;
+    }
+    std::string text = TFTPRangeStream::encodeSize(size);
+    TFTPVirtualFileData encoded = std::make_shared<std::vector<char>>(text.begin(), text.end());
+    return openAnswerFile(sectionHandler, port, fd, file, encoded, bufferSize);
+}
+
+bool TFTPServer::openAnswerFile(
+        const TftpdSectionHandlerPtr sectionHandler,
+        const int port,
+        FILE **fd,
+        FILE *file,
+        const TFTPVirtualFileData &answer,
+        size_t *bufferSize)
+{
+    FILE *stream = NULL;
+    if (!openMemoryFile(sectionHandler, &stream, answer, bufferSize)) {
+        closeUserFile(sectionHandler, port, file);
+        return false;
+    }
+
+    // The opened file is closed along with the answer.
+    TFTPSectionState *state = sectionState(sectionHandler);
+    if (state != nullptr) {
+        state->memorySource = file;
+    }
+    *fd = stream;
+    return true;
+}
+
+bool TFTPServer::openDeltaFile(
+        const TftpdSectionHandlerPtr sectionHandler,
+        const int port,
+        FILE **fd,
+        char *filename,
+        char *mode,
+        size_t *bufferSize)
+{
+    // The target is left alone until the rebuilt file checks out, so a
+    // stale base, a bad delta or an aborted client can't damage it. The
+    // base is read block by block where the delta needs it.
+    char readMode[] = "r";
+    size_t baseSize = 0;
+    FILE *base = NULL;
+    openUserFile(sectionHandler, port, &base, filename, readMode, &baseSize);
+    if (base == NULL) {
+        return false;
+    }
+
+    TFTPBlockHashes baseSum;
+    bool ok = true;
+    TFTPFileMetadataPtr metadata = metadataIndex.find(fileno(base));
+    if (metadata != nullptr) {
+        baseSum.size = metadata->hashes.size;
+        baseSum.checksum = metadata->hashes.checksum;
+    } else {
+        ok = TFTPDelta::checksumFile(base, baseSum);
+    }
+
+    // Files the server opens itself are rebuilt beside the target and
+    // renamed over it once the section succeeded. The open file callback
+    // is only asked for the target once the rebuilt file checked out.
+    TFTPSectionState *state = sectionState(sectionHandler);
+    bool named = sectionCallbacks(sectionHandler)->openFile == nullptr;
+    FILE *target = NULL;
+    if (ok && state != nullptr && state->deltaStream == nullptr) {
+        target = named ? openTempFile(sectionHandler, filename, mode) : tmpfile();
+    }
+
+    TFTPDeltaStream *deltaStream = deltaStreamPool.acquire();
+    FILE *stream = target != NULL ? deltaStream->open(target, base, baseSum) : NULL;
+    if (stream != NULL) {
+        state->deltaStream = deltaStream;
+        state->deltaFileStream = stream;
+        if (!named) {
+            state->deltaPath = filename;
+            state->deltaMode = mode;
+        }
+        *fd = stream;
+        return true;
+    }
+
+    deltaStreamPool.release(deltaStream);
+    if (target != NULL) {
+        fclose(target);
+        if (named) {
+            unlink(state->tempPath.c_str());
+            state->tempPath.clear();
+        }
+    }
+    closeUserFile(sectionHandler, port, base);
+    return false;
+}
+
+FILE *TFTPServer::unwrapDeltaStream(
+        const TftpdSectionHandlerPtr sectionHandler,
+        const int port,
+        FILE *fd,
+        bool *rebuilt)
+{
+    TFTPSectionState *state = sectionState(sectionHandler);
+    if (state == nullptr || fd == NULL || state->deltaFileStream != fd) {
+        return fd;
+    }
+    TFTPDeltaStream *deltaStream = state->deltaStream;
+    state->deltaStream = nullptr;
+    state->deltaFileStream = NULL;
+
+    FILE *target = deltaStream->getTarget();
+    FILE *base = deltaStream->getBase();
+    *rebuilt = fclose(fd) == 0;
+    deltaStreamPool.release(deltaStream);
+    // Closed first, so a sync of the upload applies to the target.
+    closeUserFile(sectionHandler, port, base);
 
-    _openFileCallback = nullptr;
-    _closeFileCallback = nullptr;
-    _sectionStartedCallback = nullptr;
-    _sectionFinishedCallback = nullptr;
+    std::string path, mode;
+    path.swap(state->deltaPath);
+    mode.swap(state->deltaMode);
+    if (path.empty()) {
+        // Renamed over the target when the section finishes.
+        if (!*rebuilt) {
+            unlink(state->tempPath.c_str());
+            state->tempPath.clear();
+        } else if (durabilityMode != TftpDurabilityMode::TFTP_DURABILITY_NONE) {
+            markWriteFile(sectionHandler);
+        }
+        return target;
+    }
 
-    openFileCtx = nullptr;
-    closeFileCtx = nullptr;
-    sectionStartedCtx = nullptr;
-    sectionFinishedCtx = nullptr;
+    FILE *file = NULL;
+    if (*rebuilt) {
+        openUserFile(sectionHandler, port, &file, &path[0], &mode[0], nullptr);
+        *rebuilt = file != NULL && copyFile(target, file);
+    }
+    fclose(target);
+    return file;
 }
 
-TFTPServer::~TFTPServer() {
-    if (serverHandler != nullptr) {
-
-        register_section_started_callback(serverHandler, NULL, NULL);
-        register_open_file_callback(serverHandler, NULL, NULL);
-        register_close_file_callback(serverHandler, NULL, NULL);
-        register_section_finished_callback(serverHandler, NULL, NULL);        
-        
-        if (destroy_tftpd_handler(&serverHandler) != TFTPD_OK) {
-            //TODO: inform error
+bool TFTPServer::copyFile(
+        FILE *source,
+        FILE *target)
+{
+    if (fseeko(source, 0, SEEK_SET) != 0) {
+        return false;
+    }
+    char buffer[TFTP_DELTA_BLOCK_SIZE];
+    size_t length;
+    while ((length = fread(buffer, 1, sizeof(buffer), source)) > 0) {
+        if (fwrite(buffer, 1, length, target) != length) {
+            return false;
         }
     }
+    return ferror(source) == 0;
 }
 
-TftpServerOperationResult TFTPServer::setPort(
-        const int port)
+bool TFTPServer::openRangeFile(
+        const TftpdSectionHandlerPtr sectionHandler,
+        const int port,
+        FILE **fd,
+        char *filename,
+        char *mode,
+        size_t *bufferSize,
+        const TFTPRange &range)
 {
-    if (serverHandler == nullptr) {
-        return TftpServerOperationResult::TFTP_SERVER_ERROR;
+    // Other ranges of the file are written at the same time, it is opened
+    // without truncating it. Writing a range grows the file to its end,
+    // never shrinks it, and only up to the limit.
+    bool write = mode[0] == 'w';
+    uint64_t limit = stripedFileLimit;
+    if (write && (range.total > limit || range.length > limit ||
+                  range.offset > limit - range.length)) {
+        return false;
+    }
+    char rangeMode[] = "r+";
+    openUserFile(sectionHandler, port, fd, filename, write ? rangeMode : mode, bufferSize);
+    if (*fd == NULL) {
+        return false;
+    }
+
+    TFTPRangeStream *rangeStream = rangeStreamPool.acquire();
+    FILE *stream = rangeStream->open(*fd, range.offset, range.length, write);
+    TFTPSectionState *state = sectionState(sectionHandler);
+    if (stream != NULL && state != nullptr && state->rangeStream == nullptr) {
+        state->rangeStream = rangeStream;
+        state->rangeFileStream = stream;
+        *fd = stream;
+        if (bufferSize != nullptr) {
+            *bufferSize = 0;
+        }
+        return true;
     }
 
-    return set_port(serverHandler, port) == TFTPD_OK ?
-           TftpServerOperationResult::TFTP_SERVER_OK :
-           TftpServerOperationResult::TFTP_SERVER_ERROR;
+    if (stream != NULL) {
+        fclose(stream);
+    }
+    rangeStreamPool.release(rangeStream);
+    closeUserFile(sectionHandler, port, *fd);
+    *fd = NULL;
+    return false;
 }
 
-TftpServerOperationResult TFTPServer::setTimeout(
-        const int timeout)
+FILE *TFTPServer::unwrapRangeStream(
+        const TftpdSectionHandlerPtr sectionHandler,
+        FILE *fd,
+        bool *complete)
 {
-    if (serverHandler == nullptr) {
-        return TftpServerOperationResult::TFTP_SERVER_ERROR;
+    TFTPSectionState *state = sectionState(sectionHandler);
+    if (state == nullptr || fd == NULL || state->rangeFileStream != fd) {
+        return fd;
     }
+    TFTPRangeStream *rangeStream = state->rangeStream;
+    state->rangeStream = nullptr;
+    state->rangeFileStream = NULL;
 
-    return set_server_timeout(serverHandler, timeout) == TFTPD_OK ?
-           TftpServerOperationResult::TFTP_SERVER_OK :
-           TftpServerOperationResult::TFTP_SERVER_ERROR;
+    // A written range must be whole, the rest of the file is left to the
+    // other ranges.
+    FILE *source = rangeStream->getSource();
+    *complete = fclose(fd) == 0;
+    rangeStreamPool.release(rangeStream);
+    return source;
 }
 
-TftpServerOperationResult TFTPServer::startListening() {
-    if (serverHandler == nullptr) {
+void TFTPServer::wrapCompressionStream(
+        const TftpdSectionHandlerPtr sectionHandler,
+        FILE **fd,
+        const bool write)
+{
+    TFTPCompressionStream *compressionStream = compressionStreamPool.acquire();
+    FILE *stream = compressionStream->open(*fd, write, &compressionStats);
+    if (stream == NULL) {
+        compressionStreamPool.release(compressionStream);
+        return;
+    }
+
+    TFTPSectionState *state = sectionState(sectionHandler);
+    if (state == nullptr || state->compressionStream != nullptr) {
+        fclose(stream);
+        compressionStreamPool.release(compressionStream);
+        return;
+    }
+
+    state->compressionStream = compressionStream;
+    state->compressedFileStream = stream;
+    *fd = stream;
+}
+
+FILE *TFTPServer::unwrapCompressionStream(
+        const TftpdSectionHandlerPtr sectionHandler,
+        FILE *fd)
+{
+    TFTPSectionState *state = sectionState(sectionHandler);
+    if (state == nullptr || fd == NULL || state->compressedFileStream != fd) {
+        return fd;
+    }
+    TFTPCompressionStream *compressionStream = state->compressionStream;
+    state->compressionStream = nullptr;
+    state->compressedFileStream = NULL;
+
+    FILE *source = compressionStream->getSource();
+    fclose(fd);
+    compressionStreamPool.release(compressionStream);
+    return source;
+}
+
+bool TFTPServer::openCompressedFile(
+        const TftpdSectionHandlerPtr sectionHandler,
+        FILE **fd,
+        size_t *bufferSize)
+{
+    size_t plainSize = 0;
+    FILE *stream = NULL;
+    TFTPCompressedData data = compressionCache.get(*fd, &plainSize);
+    if (data == nullptr || !openMemoryFile(sectionHandler, &stream, data, bufferSize)) {
+        return false;
+    }
+
+    // The opened file is closed along with the cached copy.
+    TFTPSectionState *state = sectionState(sectionHandler);
+    if (state != nullptr) {
+        state->memorySource = *fd;
+    }
+    *fd = stream;
+
+    // Served as is, no stream counts these bytes.
+    compressionStats.plainBytes.fetch_add(plainSize, std::memory_order_relaxed);
+    compressionStats.compressedBytes.fetch_add(data->size(), std::memory_order_relaxed);
+    return true;
+}
+
+FILE *TFTPServer::closeMemorySource(
+        const TftpdSectionHandlerPtr sectionHandler,
+        FILE *fd)
+{
+    TFTPSectionState *state = sectionState(sectionHandler);
+    if (state == nullptr || fd == NULL || state->memorySource == NULL ||
+        state->virtualFileStream != fd) {
+        return fd;
+    }
+    FILE *source = state->memorySource;
+    state->memorySource = NULL;
+
+    closeVirtualFile(sectionHandler, fd);
+    return source;
+}
+
+TftpServerOperationResult TFTPServer::registerVirtualFile(
+        const char *filename,
+        const void *data,
+        const size_t size)
+{
+    return setVirtualFile(filename, data, size, true);
+}
+
+TftpServerOperationResult TFTPServer::updateVirtualFile(
+        const char *filename,
+        const void *data,
+        const size_t size)
+{
+    return setVirtualFile(filename, data, size, false);
+}
+
+TftpServerOperationResult TFTPServer::unregisterVirtualFile(
+        const char *filename)
+{
+    if (filename == nullptr) {
+        return TftpServerOperationResult::TFTP_SERVER_ERROR;
+    }
+
+    std::lock_guard<std::mutex> lock(virtualFilesMutex);
+    std::shared_ptr<const TFTPVirtualFileTable> current = std::atomic_load(&virtualFiles);
+    std::shared_ptr<TFTPVirtualFileTable> table =
+            std::make_shared<TFTPVirtualFileTable>(*current);
+
+    TFTPVirtualFileTable::iterator it = std::lower_bound(
+            table->begin(), table->end(), filename,
+            [](const TFTPVirtualFile &file, const char *name) {
+                return strcmp(file.name.c_str(), name) < 0;
+            });
+    if (it == table->end() || it->name != filename) {
         return TftpServerOperationResult::TFTP_SERVER_ERROR;
     }
 
-    return start_listening(serverHandler) == TFTPD_OK ?
-           TftpServerOperationResult::TFTP_SERVER_OK :
-           TftpServerOperationResult::TFTP_SERVER_ERROR;
+    table->erase(it);
+    std::atomic_store(&virtualFiles, std::shared_ptr<const TFTPVirtualFileTable>(table));
+    return TftpServerOperationResult::TFTP_SERVER_OK;
 }
 
-TftpServerOperationResult TFTPServer::stopListening() {
-    if (serverHandler == nullptr) {
+TftpServerOperationResult TFTPServer::setVirtualFile(
+        const char *filename,
+        const void *data,
+        const size_t size,
+        const bool create)
+{
+    if (filename == nullptr || (data == nullptr && size > 0)) {
+        return TftpServerOperationResult::TFTP_SERVER_ERROR;
+    }
+
+    // Built outside the lock, readers never see a partially copied file.
+    const char *bytes = (const char *) data;
+    TFTPVirtualFileData content =
+            std::make_shared<const std::vector<char>>(bytes, bytes + size);
+
+    std::lock_guard<std::mutex> lock(virtualFilesMutex);
+    std::shared_ptr<const TFTPVirtualFileTable> current = std::atomic_load(&virtualFiles);
+    std::shared_ptr<TFTPVirtualFileTable> table =
+            std::make_shared<TFTPVirtualFileTable>(*current);
+
+    TFTPVirtualFileTable::iterator it = std::lower_bound(
+            table->begin(), table->end(), filename,
+            [](const TFTPVirtualFile &file, const char *name) {
+                return strcmp(file.name.c_str(), name) < 0;
+            });
+    bool found = it != table->end() && it->name == filename;
+    if (found == create) {
         return TftpServerOperationResult::TFTP_SERVER_ERROR;
     }
 
-    return stop_listening(serverHandler) == TFTPD_OK ?
-           TftpServerOperationResult::TFTP_SERVER_OK :
-           TftpServerOperationResult::TFTP_SERVER_ERROR;
+    if (found) {
+        it->data = content;
+    } else {
+        TFTPVirtualFile file;
+        file.name = filename;
+        file.data = content;
+        table->insert(it, file);
+    }
+
+    std::atomic_store(&virtualFiles, std::shared_ptr<const TFTPVirtualFileTable>(table));
+    return TftpServerOperationResult::TFTP_SERVER_OK;
+}
+
+bool TFTPServer::openVirtualFile(
+        const TftpdSectionHandlerPtr sectionHandler,
+        FILE **fd,
+        const char *filename,
+        size_t *bufferSize)
+{
+    std::shared_ptr<const TFTPVirtualFileTable> table = std::atomic_load(&virtualFiles);
+    if (table->empty() || filename == nullptr) {
+        return false;
+    }
+
+    TFTPVirtualFileTable::const_iterator it = std::lower_bound(
+            table->begin(), table->end(), filename,
+            [](const TFTPVirtualFile &file, const char *name) {
+                return strcmp(file.name.c_str(), name) < 0;
+            });
+    if (it == table->end() || it->name != filename) {
+        return false;
+    }
+    return openMemoryFile(sectionHandler, fd, it->data, bufferSize);
+}
+
+bool TFTPServer::openMemoryFile(
+        const TftpdSectionHandlerPtr sectionHandler,
+        FILE **fd,
+        const TFTPVirtualFileData &data,
+        size_t *bufferSize)
+{
+    TFTPMemoryStream *memoryStream = memoryStreamPool.acquire();
+    FILE *stream = memoryStream->open(data->data(), data->size());
+    if (stream == NULL) {
+        memoryStreamPool.release(memoryStream);
+        return false;
+    }
+
+    TFTPSectionState *state = sectionState(sectionHandler);
+    if (state != nullptr && state->virtualStream == nullptr) {
+        // The section keeps its version of the file alive, an update
+        // during the transfer doesn't pull the bytes from under it.
+        state->virtualFile = data;
+        state->virtualStream = memoryStream;
+        state->virtualFileStream = stream;
+        memoryStream = nullptr;
+    }
+
+    if (memoryStream != nullptr) {
+        fclose(stream);
+        memoryStreamPool.release(memoryStream);
+        return false;
+    }
+
+    *fd = stream;
+    if (bufferSize != nullptr) {
+        *bufferSize = data->size();
+    }
+    return true;
+}
+
+bool TFTPServer::closeVirtualFile(
+        const TftpdSectionHandlerPtr sectionHandler,
+        FILE *fd)
+{
+    TFTPSectionState *state = sectionState(sectionHandler);
+    if (state == nullptr || fd == NULL || state->virtualFileStream != fd) {
+        return false;
+    }
+    TFTPMemoryStream *memoryStream = state->virtualStream;
+    TFTPVirtualFileData data;
+    data.swap(state->virtualFile);
+    state->virtualStream = nullptr;
+    state->virtualFileStream = NULL;
+
+    fclose(fd);
+    memoryStreamPool.release(memoryStream);
+    return true;
+}
+
+TftpServerOperationResult TFTPServer::listSections(
+        std::vector<TFTPSectionInfo> &sections)
+{
+    sections.clear();
+
+    // Only the records are taken under the lock, sections starting and
+    // finishing meanwhile don't wait for them to be read.
+    std::vector<TFTPSectionRecord *> records;
+    {
+        std::lock_guard<std::mutex> lock(sectionsMutex);
+        for (TFTPSectionState *state = activeSectionList; state != nullptr;
+             state = state->next) {
+            if (state->record != nullptr) {
+                state->record->references.fetch_add(1, std::memory_order_relaxed);
+                records.push_back(state->record);
+            }
+        }
+    }
+
+    std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+    for (TFTPSectionRecord *record : records) {
+        TFTPSectionInfo info;
+        info.id = record->id;
+        info.clientIp = record->clientIp;
+        info.serverPort = record->port;
+        info.filename = record->filename;
+        info.direction = record->upload ? TftpTransferDirection::TFTP_TRANSFER_WRITE
+                                        : TftpTransferDirection::TFTP_TRANSFER_READ;
+        info.bytes = record->bytes.load(std::memory_order_relaxed);
+        std::chrono::duration<double> age = now - record->startTime;
+        info.ageMs = (uint64_t) (age.count() * 1000);
+        info.bytesPerSecond = age.count() > 0 ? info.bytes / age.count() : 0;
+        // Ranges are counted below.
+        info.window = record->ranged ? 0 : 1;
+        sections.push_back(info);
+        releaseRecord(record);
+    }
+
+    // The ranges a client has in flight on a file are its window.
+    auto key = [](const TFTPSectionInfo &info) {
+        return info.clientIp + '/' + (char) info.direction + info.filename;
+    };
+    std::map<std::string, int> windows;
+    for (const TFTPSectionInfo &info : sections) {
+        if (info.window == 0) {
+            windows[key(info)]++;
+        }
+    }
+    for (TFTPSectionInfo &info : sections) {
+        if (info.window == 0) {
+            info.window = windows[key(info)];
+        }
+    }
+    return TftpServerOperationResult::TFTP_SERVER_OK;
 }
 
 TftpServerOperationResult TFTPServer::registerOpenFileCallback(
         openFileCallback callback,
         void *context)
 {
-    _openFileCallback = callback;
-    openFileCtx = context;
+    std::lock_guard<std::mutex> lock(sectionsMutex);
+    TFTPCallbacks *next = new TFTPCallbacks(*callbacks.load(std::memory_order_relaxed));
+    next->openFile = callback;
+    next->openFileCtx = context;
+    publishCallbacks(next);
     return TftpServerOperationResult::TFTP_SERVER_OK;
 }
 
@@ -98,8 +1832,11 @@ TftpServerOperationResult TFTPServer::registerCloseFileCallback(
         closeFileCallback callback,
         void *context)
 {
-    _closeFileCallback = callback;
-    closeFileCtx = context;
+    std::lock_guard<std::mutex> lock(sectionsMutex);
+    TFTPCallbacks *next = new TFTPCallbacks(*callbacks.load(std::memory_order_relaxed));
+    next->closeFile = callback;
+    next->closeFileCtx = context;
+    publishCallbacks(next);
     return TftpServerOperationResult::TFTP_SERVER_OK;
 }
 
@@ -107,8 +1844,11 @@ TftpServerOperationResult TFTPServer::registerSectionStartedCallback(
         sectionStartedCallback callback,
         void *context)
 {
-    _sectionStartedCallback = callback;
-    sectionStartedCtx = context;
+    std::lock_guard<std::mutex> lock(sectionsMutex);
+    TFTPCallbacks *next = new TFTPCallbacks(*callbacks.load(std::memory_order_relaxed));
+    next->sectionStarted = callback;
+    next->sectionStartedCtx = context;
+    publishCallbacks(next);
     return TftpServerOperationResult::TFTP_SERVER_OK;
 }
 
@@ -116,8 +1856,11 @@ TftpServerOperationResult TFTPServer::registerSectionFinishedCallback(
         sectionFinishedCallback callback,
         void *context)
 {
-    _sectionFinishedCallback = callback;
-    sectionFinishedCtx = context;
+    std::lock_guard<std::mutex> lock(sectionsMutex);
+    TFTPCallbacks *next = new TFTPCallbacks(*callbacks.load(std::memory_order_relaxed));
+    next->sectionFinished = callback;
+    next->sectionFinishedCtx = context;
+    publishCallbacks(next);
     return TftpServerOperationResult::TFTP_SERVER_OK;
 }
 
@@ -125,11 +1868,68 @@ TftpdOperationResult TFTPServer::sectionStartedCbk(
         const TftpdSectionHandlerPtr section_handler,
         void *context)
 {
+    TFTP_TRACE_SCOPE("server", "sectionStartedCbk");
     if (context != NULL) {
-        TFTPServer *server = (TFTPServer *) context;
-        if (server->_sectionStartedCallback != nullptr) {
-            TFTPSection section(section_handler);
-            server->_sectionStartedCallback(&section, server->sectionStartedCtx);
+        TFTPEndpoint *endpoint = (TFTPEndpoint *) context;
+        TFTPServer *server = endpoint->server;
+        // The engine's thread is pinned to the port's CPUs for the
+        // section and gets its previous CPUs back when the section ends.
+        // Buffers newly allocated for the section are first touched on the
+        // port's NUMA node, pooled objects stay where they were first
+        // touched.
+        TFTPSectionState *state = server->sectionPool.acquire();
+        state->threadCpus = TFTPCpuSet();
+        endpoint->cpus.pinCurrentThread(&state->threadCpus);
+        state->handler = section_handler;
+        state->callbacks = nullptr;
+        state->readAhead = nullptr;
+        state->readAheadStream = NULL;
+        state->directStream = nullptr;
+        state->directFileStream = NULL;
+        state->virtualStream = nullptr;
+        state->virtualFileStream = NULL;
+        state->timedStream = nullptr;
+        state->timedFileStream = NULL;
+        state->compressionStream = nullptr;
+        state->compressedFileStream = NULL;
+        state->memorySource = NULL;
+        state->deltaStream = nullptr;
+        state->deltaFileStream = NULL;
+        state->deltaPath.clear();
+        state->deltaMode.clear();
+        state->rangeStream = nullptr;
+        state->rangeFileStream = NULL;
+        state->writeFile = false;
+        state->record = nullptr;
+        state->size = 0;
+        state->admitted = false;
+        state->startTime = std::chrono::steady_clock::now();
+        state->deferStart = server->duplicateWindow > 0 || server->admissionLimited();
+        state->startNotified = !state->deferStart;
+        state->requestKnown = false;
+        state->previous = nullptr;
+        {
+            std::lock_guard<std::mutex> lock(server->sectionsMutex);
+            state->callbacks = server->callbacks.load(std::memory_order_acquire);
+            state->serial = server->nextSectionSerial++;
+            state->next = server->activeSectionList;
+            if (state->next != nullptr) {
+                state->next->previous = state;
+            }
+            server->activeSectionList = state;
+            server->activeSections++;
+        }
+        threadSection = state;
+        if (state->deferStart) {
+            // Called from openFileCbk, once we know it isn't a duplicate and
+            // it is admitted.
+            return TFTPD_OK;
+        }
+        const TFTPCallbacks *current = state->callbacks;
+        if (current->sectionStarted != nullptr) {
+            TFTP_TRACE_SCOPE("server", "sectionStartedCallback");
+            TFTPSection section(section_handler, endpoint->port);
+            current->sectionStarted(&section, current->sectionStartedCtx);
             return TFTPD_OK;
         }
     }
@@ -140,13 +1940,82 @@ TftpdOperationResult TFTPServer::sectionFinishedCbk(
         const TftpdSectionHandlerPtr section_handler,
         void *context)
 {
+    TFTP_TRACE_SCOPE("server", "sectionFinishedCbk");
     if (context != NULL) {
-        TFTPServer *server = (TFTPServer *) context;
-        if (server->_sectionFinishedCallback != nullptr) {
-            TFTPSection section(section_handler);
-            server->_sectionFinishedCallback(&section, server->sectionFinishedCtx);
-            return TFTPD_OK;
+        TFTPEndpoint *endpoint = (TFTPEndpoint *) context;
+        TFTPServer *server = endpoint->server;
+        TFTPSectionState *state = server->sectionState(section_handler);
+        bool notify = state == nullptr || state->startNotified;
+        const TFTPCallbacks *current = state != nullptr ? state->callbacks :
+                                       server->callbacks.load(std::memory_order_acquire);
+        if (state != nullptr && state->startNotified) {
+            server->recordLatency(TftpLatencyMetric::TFTP_LATENCY_SECTION_DURATION,
+                                  state->startTime);
+        }
+        std::string tempPath, targetPath;
+        std::chrono::steady_clock::duration syncTime;
+        if (state != nullptr && !state->tempPath.empty()) {
+            tempPath.swap(state->tempPath);
+            targetPath.swap(state->targetPath);
+            syncTime = state->syncTime;
+        }
+
+        bool committed = true;
+        if (!tempPath.empty()) {
+            // Renamed before the user hears the section finished, so the
+            // file is in place by then.
+            TftpdSectionStatus status;
+            bool succeeded = sectionGetStatus(section_handler, &status) == TFTPD_OK &&
+                             status == TFTPD_SECTION_OK;
+            committed = server->finishTempFile(tempPath, targetPath, syncTime, succeeded) ||
+                        !succeeded;
+        }
+
+        TftpdOperationResult result = TFTPD_ERROR;
+        if (notify && current->sectionFinished != nullptr) {
+            TFTP_TRACE_SCOPE("server", "sectionFinishedCallback");
+            TFTPSection section(section_handler, endpoint->port);
+            // The client was answered already, the file never got in place.
+            section.commitFailed = !committed;
+            current->sectionFinished(&section, current->sectionFinishedCtx);
+            result = TFTPD_OK;
+        }
+        if (state != nullptr) {
+            // Empty unless sectionStartedCbk pinned the thread.
+            state->threadCpus.pinCurrentThread();
         }
+        {
+            // Everything is done under the lock: once the count drops, the
+            // server may be destroyed.
+            std::lock_guard<std::mutex> lock(server->sectionsMutex);
+            if (threadSection == state) {
+                threadSection = nullptr;
+            }
+            if (state != nullptr) {
+                if (state->previous != nullptr) {
+                    state->previous->next = state->next;
+                } else {
+                    server->activeSectionList = state->next;
+                }
+                if (state->next != nullptr) {
+                    state->next->previous = state->previous;
+                }
+                state->virtualFile.reset();
+                if (state->record != nullptr) {
+                    server->releaseRecord(state->record);
+                }
+                if (state->admitted) {
+                    server->admittedSections--;
+                }
+                server->sectionPool.release(state);
+                server->activeSections--;
+                if (!server->retiredCallbacks.empty()) {
+                    server->reclaimCallbacks();
+                }
+            }
+            server->sectionsDrained.notify_all();
+        }
+        return result;
     }
     return TFTPD_ERROR;
 }
@@ -159,17 +2028,126 @@ TftpdOperationResult TFTPServer::openFileCbk(
         size_t *bufferSize,
         void *context)
 {
+    TFTP_TRACE_SCOPE("server", "openFileCbk");
     if (context != NULL) {
-        TFTPServer *server = (TFTPServer *) context;
-        if (server->_openFileCallback != nullptr) {
-            TFTPSection section(section_handler);
-            server->_openFileCallback(&section, fd, filename, mode, bufferSize,
-                                      server->openFileCtx);
+        TFTPEndpoint *endpoint = (TFTPEndpoint *) context;
+        TFTPServer *server = endpoint->server;
+        if (server->suppressDuplicate(section_handler, filename, mode) ||
+            !server->admitSection(section_handler, filename, mode)) {
+            return TFTPD_ERROR;
+        }
+        server->notifyDeferredStart(section_handler, endpoint->port);
+
+        bool read = mode != NULL && mode[0] == 'r';
+        bool compressed = server->stripCompressionSuffix(filename);
+        if (compressed && filename[0] == '\0') {
+            // Bare suffix, the client is probing for compression support.
+            return read && server->openMemoryFile(section_handler, fd,
+                                                  server->probeFile,
+                                                  bufferSize) ? TFTPD_OK : TFTPD_ERROR;
+        }
+
+        TFTPRange range;
+        if (server->stripRangeSuffix(filename, range)) {
+            // Ranges are moved as they are, never compressed.
+            if (compressed || (filename[0] == '\0' && !read)) {
+                return TFTPD_ERROR;
+            }
+            if (filename[0] == '\0') {
+                // Bare suffix, the client is probing for range support.
+                return server->openMemoryFile(section_handler, fd, server->probeFile,
+                                              bufferSize) ? TFTPD_OK : TFTPD_ERROR;
+            }
+            if (!server->openRangeFile(section_handler, endpoint->port, fd, filename, mode,
+                                       bufferSize, range)) {
+                return TFTPD_ERROR;
+            }
+            server->wrapTimedStream(section_handler, endpoint->port, fd, filename, !read,
+                                    read ? range.length : 0);
+            return TFTPD_OK;
+        }
+
+        if (server->stripSizeSuffix(filename)) {
+            if (compressed || !read || filename[0] == '\0' ||
+                !server->openSizeFile(section_handler, endpoint->port, fd, filename, mode,
+                                      bufferSize)) {
+                return TFTPD_ERROR;
+            }
+            server->wrapTimedStream(section_handler, endpoint->port, fd, filename, false, 0);
+            return TFTPD_OK;
+        }
+
+        if (filename[0] == TFTP_RESERVED_NAME_PREFIX) {
+            // A request of a disabled feature, such as a probe. Never the
+            // user's file.
+            return TFTPD_ERROR;
+        }
+
+        TftpDeltaRequest delta = server->stripDeltaSuffix(filename);
+        if (delta != TftpDeltaRequest::TFTP_DELTA_NONE) {
+            // Only ever what the request names: hashes and checksums are
+            // read, deltas written.
+            bool opened = read == (delta != TftpDeltaRequest::TFTP_DELTA_WRITE) &&
+                          (read ? server->openHashesFile(
+                                          section_handler, endpoint->port, fd, filename, mode,
+                                          bufferSize,
+                                          delta == TftpDeltaRequest::TFTP_DELTA_CHECKSUM)
+                                : server->openDeltaFile(section_handler, endpoint->port, fd,
+                                                        filename, mode, bufferSize));
+            if (!opened) {
+                return TFTPD_ERROR;
+            }
+            if (compressed) {
+                server->wrapCompressionStream(section_handler, fd, !read);
+            }
+            server->wrapTimedStream(section_handler, endpoint->port, fd, filename, !read, 0);
+            return TFTPD_OK;
+        }
+
+        if (read && server->openVirtualFile(section_handler, fd, filename, bufferSize)) {
+            uint64_t size = bufferSize != nullptr ? *bufferSize : 0;
+            if (compressed) {
+                server->wrapCompressionStream(section_handler, fd, false);
+                if (bufferSize != nullptr) {
+                    *bufferSize = 0;
+                }
+                size = 0;
+            }
+            server->wrapTimedStream(section_handler, endpoint->port, fd, filename, false, size);
             return TFTPD_OK;
-        } else {
-            *fd = fopen(filename, mode);
-            return *fd != NULL ? TFTPD_OK : TFTPD_ERROR;
         }
+
+        TftpdOperationResult result = server->openUserFile(
+                section_handler, endpoint->port, fd, filename, mode, bufferSize);
+        if (*fd != NULL) {
+            if (compressed && read &&
+                server->openCompressedFile(section_handler, fd, bufferSize)) {
+                server->wrapTimedStream(section_handler, endpoint->port, fd, filename, false, 0);
+                return result;
+            }
+
+            // Sized before any wrapping hides the descriptor. The timed
+            // stream counts compressed bytes, those reads stay unsized.
+            uint64_t size = 0;
+            struct stat info;
+            int descriptor = read && !compressed ? fileno(*fd) : -1;
+            if (descriptor >= 0 && fstat(descriptor, &info) == 0 && S_ISREG(info.st_mode)) {
+                size = info.st_size;
+            }
+            bool large = server->wrapDirectStream(section_handler, fd, !read);
+            if (read && !large) {
+                server->wrapReadStream(section_handler, fd);
+            }
+            if (compressed) {
+                // Not cacheable, compressed on the fly.
+                server->wrapCompressionStream(section_handler, fd, !read);
+                if (bufferSize != nullptr) {
+                    *bufferSize = 0;
+                }
+            }
+            server->wrapTimedStream(section_handler, endpoint->port, fd, filename, !read, size);
+        }
+        return result;
     }
     return TFTPD_ERROR;
 }
@@ -179,25 +2157,361 @@ TftpdOperationResult TFTPServer::closeFileCbk(
         FILE *fd,
         void *context)
 {
+    TFTP_TRACE_SCOPE("server", "closeFileCbk");
     if (context != NULL) {
-        TFTPServer *server = (TFTPServer *) context;
-        if (server->_closeFileCallback != nullptr) {
-            TFTPSection section(section_handler);
-            server->_closeFileCallback(&section, fd, server->closeFileCtx);
-            return TFTPD_OK;
-        } else if (fd != NULL) {
-            return fclose(fd) == 0 ? TFTPD_OK : TFTPD_ERROR;
-        } else {
+        TFTPEndpoint *endpoint = (TFTPEndpoint *) context;
+        TFTPServer *server = endpoint->server;
+        fd = server->unwrapTimedStream(section_handler, fd);
+        fd = server->unwrapCompressionStream(section_handler, fd);
+        bool flushed = true;
+        FILE *wrapped = fd;
+        fd = server->unwrapDeltaStream(section_handler, endpoint->port, fd, &flushed);
+        if (wrapped != NULL && fd == NULL) {
+            // A delta that didn't check out, the target was never opened.
             return TFTPD_ERROR;
         }
+        fd = server->closeMemorySource(section_handler, fd);
+        if (server->closeVirtualFile(section_handler, fd)) {
+            return TFTPD_OK;
+        }
+
+        fd = server->unwrapStream(section_handler, fd);
+        fd = server->unwrapDirectStream(section_handler, fd, &flushed);
+        fd = server->unwrapRangeStream(section_handler, fd, &flushed);
+        TftpdOperationResult result = server->closeUserFile(section_handler, endpoint->port, fd);
+        return flushed ? result : TFTPD_ERROR;
     }
     return TFTPD_ERROR;
 }
 
+bool TFTPServer::startLocalSectionCbk(
+        TFTPLocalSection *section,
+        void *context)
+{
+    TFTPEndpoint *endpoint = (TFTPEndpoint *) context;
+    TFTPServer *server = endpoint->server;
+    {
+        // Counted before the thread runs, the server waits for it.
+        std::lock_guard<std::mutex> lock(server->sectionsMutex);
+        server->localSections++;
+    }
+    try {
+        section->serverThread = std::thread([server, endpoint, section]() {
+            server->serveLocalSection(endpoint, section);
+        });
+    } catch (const std::system_error &) {
+        std::lock_guard<std::mutex> lock(server->sectionsMutex);
+        server->localSections--;
+        server->sectionsDrained.notify_all();
+        return false;
+    }
+    return true;
+}
+
+void TFTPServer::serveLocalSection(
+        TFTPEndpoint *endpoint,
+        TFTPLocalSection *section)
+{
+    TFTP_TRACE_SCOPE("server", "localSection");
+    // Run through the same callbacks the engine calls, so the section
+    // gets everything an engine one does.
+    TFTPLocalSection::setCurrent(section);
+    TftpdSectionHandlerPtr handler = (TftpdSectionHandlerPtr) section;
+    sectionStartedCbk(handler, endpoint);
+
+    std::vector<char> filename(section->filename.begin(), section->filename.end());
+    filename.push_back('\0');
+    char mode[2] = {section->write ? 'w' : 'r', '\0'};
+    FILE *fd = NULL;
+    size_t fileSize = 0;
+    if (openFileCbk(handler, &fd, filename.data(), mode, &fileSize, endpoint) != TFTPD_OK ||
+        fd == NULL) {
+        if (fd != NULL) {
+            closeFileCbk(handler, fd, endpoint);
+        }
+        section->fail(TFTP_LOCAL_ERROR_NOT_FOUND, "File not found");
+    } else {
+        bool moved = section->write ? receiveLocal(section, fd) : sendLocal(section, fd);
+        // An upload is only done once its file is closed, and synced
+        // when durability is on.
+        bool closed = closeFileCbk(handler, fd, endpoint) == TFTPD_OK;
+        if (moved && section->write && !closed) {
+            section->fail(TFTP_LOCAL_ERROR_DISK_FULL, "Disk full or allocation exceeded");
+        }
+        section->succeeded = moved && !section->failed;
+    }
+
+    sectionFinishedCbk(handler, endpoint);
+    TFTPLocalSection::setCurrent(nullptr);
+
+    std::lock_guard<std::mutex> lock(sectionsMutex);
+    localSections--;
+    sectionsDrained.notify_all();
+}
+
+bool TFTPServer::sendLocal(
+        TFTPLocalSection *section,
+        FILE *fd)
+{
+    char block[TFTPBlockRing::BLOCK_SIZE];
+    for (;;) {
+        size_t length = fread(block, 1, sizeof(block), fd);
+        if (length < sizeof(block) && ferror(fd)) {
+            section->fail(TFTP_LOCAL_ERROR_UNDEFINED, "Read error");
+            return false;
+        }
+        if (!section->ring.push(block, length)) {
+            section->fail(TFTP_LOCAL_ERROR_UNDEFINED, "Transfer aborted");
+            return false;
+        }
+        if (length < sizeof(block)) {
+            return true;
+        }
+    }
+}
+
+bool TFTPServer::receiveLocal(
+        TFTPLocalSection *section,
+        FILE *fd)
+{
+    char block[TFTPBlockRing::BLOCK_SIZE];
+    for (;;) {
+        ssize_t length = section->ring.pop(block);
+        if (length < 0) {
+            section->fail(TFTP_LOCAL_ERROR_UNDEFINED, "Transfer aborted");
+            return false;
+        }
+        if (length > 0 && fwrite(block, 1, length, fd) != (size_t) length) {
+            section->fail(TFTP_LOCAL_ERROR_DISK_FULL, "Disk full or allocation exceeded");
+            return false;
+        }
+        if ((size_t) length < sizeof(block)) {
+            return true;
+        }
+    }
+}
+
+TftpdOperationResult TFTPServer::openUserFile(
+        const TftpdSectionHandlerPtr sectionHandler,
+        const int port,
+        FILE **fd,
+        char *filename,
+        char *mode,
+        size_t *bufferSize)
+{
+    TftpdOperationResult result;
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    const TFTPCallbacks *current = sectionCallbacks(sectionHandler);
+    if (current->openFile != nullptr) {
+        TFTP_TRACE_SCOPE("server", "openFileCallback");
+        TFTPSection section(sectionHandler, port);
+        current->openFile(&section, fd, filename, mode, bufferSize, current->openFileCtx);
+        result = TFTPD_OK;
+    } else {
+        TFTP_TRACE_SCOPE("io", "fopen");
+        if (mode[0] == 'w' &&
+            durabilityMode == TftpDurabilityMode::TFTP_DURABILITY_ATOMIC_RENAME) {
+            *fd = openTempFile(sectionHandler, filename, mode);
+        } else if (mode[0] == 'r' && mode[1] == '+') {
+            // A range, written in place. fopen() won't create the file.
+            int descriptor = open(filename, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+            *fd = descriptor >= 0 ? fdopen(descriptor, mode) : NULL;
+            if (descriptor >= 0 && *fd == NULL) {
+                close(descriptor);
+            }
+        } else {
+            *fd = fopen(filename, mode);
+        }
+        result = *fd != NULL ? TFTPD_OK : TFTPD_ERROR;
+    }
+    if (*fd != NULL && (mode[0] == 'w' || (mode[0] == 'r' && mode[1] == '+')) &&
+        durabilityMode != TftpDurabilityMode::TFTP_DURABILITY_NONE) {
+        markWriteFile(sectionHandler);
+    }
+    recordLatency(TftpLatencyMetric::TFTP_LATENCY_OPEN_FILE, start);
+    return result;
+}
+
+TftpdOperationResult TFTPServer::closeUserFile(
+        const TftpdSectionHandlerPtr sectionHandler,
+        const int port,
+        FILE *fd)
+{
+    bool synced = true;
+    if (fd != NULL && durabilityMode != TftpDurabilityMode::TFTP_DURABILITY_NONE) {
+        synced = syncFile(sectionHandler, fd);
+    }
+
+    TftpdOperationResult result;
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    const TFTPCallbacks *current = sectionCallbacks(sectionHandler);
+    if (current->closeFile != nullptr) {
+        TFTP_TRACE_SCOPE("server", "closeFileCallback");
+        TFTPSection section(sectionHandler, port);
+        current->closeFile(&section, fd, current->closeFileCtx);
+        result = TFTPD_OK;
+    } else if (fd != NULL) {
+        TFTP_TRACE_SCOPE("io", "fclose");
+        result = fclose(fd) == 0 ? TFTPD_OK : TFTPD_ERROR;
+    } else {
+        return TFTPD_ERROR;
+    }
+    recordLatency(TftpLatencyMetric::TFTP_LATENCY_CLOSE_FILE, start);
+    return synced ? result : TFTPD_ERROR;
+}
+
+FILE *TFTPServer::openTempFile(
+        const TftpdSectionHandlerPtr sectionHandler,
+        const char *filename,
+        const char *mode)
+{
+    // Next to the target, rename() doesn't cross filesystems.
+    std::string tempPath = std::string(filename) + ".tftp-XXXXXX";
+    int descriptor = mkstemp(&tempPath[0]);
+    if (descriptor < 0) {
+        return NULL;
+    }
+
+    struct stat info;
+    fchmod(descriptor, stat(filename, &info) == 0 ? (info.st_mode & 07777) : 0644);
+    FILE *file = fdopen(descriptor, mode);
+    if (file == NULL) {
+        close(descriptor);
+        unlink(tempPath.c_str());
+        return NULL;
+    }
+
+    TFTPSectionState *state = sectionState(sectionHandler);
+    if (state == nullptr || !state->tempPath.empty()) {
+        fclose(file);
+        unlink(tempPath.c_str());
+        return NULL;
+    }
+    state->tempPath.swap(tempPath);
+    state->targetPath = filename;
+    state->syncTime = std::chrono::steady_clock::duration::zero();
+    return file;
+}
+
+void TFTPServer::markWriteFile(
+        const TftpdSectionHandlerPtr sectionHandler)
+{
+    TFTPSectionState *state = sectionState(sectionHandler);
+    if (state != nullptr) {
+        state->writeFile = true;
+    }
+}
+
+bool TFTPServer::takeWriteFile(
+        const TftpdSectionHandlerPtr sectionHandler)
+{
+    TFTPSectionState *state = sectionState(sectionHandler);
+    if (state == nullptr || !state->writeFile) {
+        return false;
+    }
+    state->writeFile = false;
+    return true;
+}
+
+bool TFTPServer::syncFile(
+        const TftpdSectionHandlerPtr sectionHandler,
+        FILE *fd)
+{
+    if (!takeWriteFile(sectionHandler)) {
+        return true;
+    }
+
+    TFTP_TRACE_SCOPE("io", "sync");
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    if (fflush(fd) != 0) {
+        return false;
+    }
+    int descriptor = fileno(fd);
+    if (descriptor < 0) {
+        // Not backed by a file, nothing to make durable.
+        return true;
+    }
+
+    bool synced;
+    TftpDurabilityMode mode = durabilityMode;
+    if (mode == TftpDurabilityMode::TFTP_DURABILITY_GROUP_COMMIT) {
+        synced = groupCommit.commit(descriptor);
+    } else {
+        synced = fdatasync(descriptor) == 0;
+        fileSyncs.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    // A temporary file is only durable once renamed, the time is recorded
+    // then.
+    TFTPSectionState *state = sectionState(sectionHandler);
+    if (state != nullptr && !state->tempPath.empty()) {
+        state->syncTime = std::chrono::steady_clock::now() - start;
+        if (!synced) {
+            unlink(state->tempPath.c_str());
+            state->tempPath.clear();
+        }
+        return synced;
+    }
+
+    if (synced) {
+        durableFiles.fetch_add(1, std::memory_order_relaxed);
+        recordLatency(TftpLatencyMetric::TFTP_LATENCY_DURABILITY, start);
+    }
+    return synced;
+}
+
+bool TFTPServer::finishTempFile(
+        std::string &tempPath,
+        std::string &targetPath,
+        const std::chrono::steady_clock::duration syncTime,
+        const bool succeeded)
+{
+    if (!succeeded) {
+        // The target is left as it was.
+        unlink(tempPath.c_str());
+        return false;
+    }
+
+    TFTP_TRACE_SCOPE("io", "rename");
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    if (rename(tempPath.c_str(), targetPath.c_str()) != 0) {
+        unlink(tempPath.c_str());
+        failedCommits.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+    if (durabilityMode == TftpDurabilityMode::TFTP_DURABILITY_NONE) {
+        // A rebuilt delta, nothing asked for durability.
+        return true;
+    }
+
+    // The rename is only durable once the directory is synced.
+    size_t slash = targetPath.rfind('/');
+    std::string directory = slash == std::string::npos ? "." :
+                            slash == 0 ? "/" : targetPath.substr(0, slash);
+    int descriptor = open(directory.c_str(), O_RDONLY | O_DIRECTORY);
+    bool synced = descriptor >= 0 && fsync(descriptor) == 0;
+    if (descriptor >= 0) {
+        fileSyncs.fetch_add(1, std::memory_order_relaxed);
+        close(descriptor);
+    }
+    if (!synced) {
+        // In place, but it may not survive a crash.
+        failedCommits.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+
+    durableFiles.fetch_add(1, std::memory_order_relaxed);
+    recordLatency(TftpLatencyMetric::TFTP_LATENCY_DURABILITY, start - syncTime);
+    return true;
+}
+
 TFTPSection::TFTPSection(
-        const TftpdSectionHandlerPtr section_handler)
+        const TftpdSectionHandlerPtr section_handler,
+        const int server_port)
 {
     sectionHandler = section_handler;
+    serverPort = server_port;
+    commitFailed = false;
 }
 
 TftpServerOperationResult TFTPSection::getSectionId(
@@ -208,7 +2522,7 @@ TftpServerOperationResult TFTPSection::getSectionId(
     }
 
     SectionId sectionId;
-    if (get_section_id(sectionHandler, &sectionId) != TFTPD_OK) {
+    if (sectionGetId(sectionHandler, &sectionId) != TFTPD_OK) {
         return TftpServerOperationResult::TFTP_SERVER_ERROR;
     }
 
@@ -224,7 +2538,7 @@ TftpServerOperationResult TFTPSection::getClientIp(
     }
 
     char clientIp[INET6_ADDRSTRLEN];
-    if (get_client_ip(sectionHandler, clientIp) != TFTPD_OK) {
+    if (sectionGetClientIp(sectionHandler, clientIp) != TFTPD_OK) {
         return TftpServerOperationResult::TFTP_SERVER_ERROR;
     }
 
@@ -232,6 +2546,17 @@ TftpServerOperationResult TFTPSection::getClientIp(
     return TftpServerOperationResult::TFTP_SERVER_OK;
 }
 
+TftpServerOperationResult TFTPSection::getServerPort(
+        int *port)
+{
+    if (sectionHandler == nullptr || port == nullptr) {
+        return TftpServerOperationResult::TFTP_SERVER_ERROR;
+    }
+
+    *port = serverPort;
+    return TftpServerOperationResult::TFTP_SERVER_OK;
+}
+
 TftpServerOperationResult TFTPSection::getSectionStatus(
         TftpServerSectionStatus *status)
 {
@@ -239,9 +2564,14 @@ TftpServerOperationResult TFTPSection::getSectionStatus(
         return TftpServerOperationResult::TFTP_SERVER_ERROR;
     }
 
+    if (commitFailed) {
+        *status = TftpServerSectionStatus::TFTP_SERVER_SECTION_ERROR;
+        return TftpServerOperationResult::TFTP_SERVER_OK;
+    }
+
     TftpdSectionStatus sectionStatus;
 
-    if (get_section_status(sectionHandler, &sectionStatus) != TFTPD_OK) {
+    if (sectionGetStatus(sectionHandler, &sectionStatus) != TFTPD_OK) {
         return TftpServerOperationResult::TFTP_SERVER_ERROR;
     }
 
@@ -265,7 +2595,7 @@ TftpServerOperationResult TFTPSection::setErrorMessage(std::string &message)
         return TftpServerOperationResult::TFTP_SERVER_ERROR;
     }
 
-    if (set_error_msg(sectionHandler, message.c_str()) != TFTPD_OK) {
+    if (sectionSetErrorMessage(sectionHandler, message.c_str()) != TFTPD_OK) {
         return TftpServerOperationResult::TFTP_SERVER_ERROR;
     }
 
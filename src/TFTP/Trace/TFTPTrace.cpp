@@ -0,0 +1,216 @@
+#include "TFTPTrace.h"
+
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <vector>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#define TFTP_TRACE_RING_SIZE 4096
+
+namespace {
+
+struct TraceEvent {
+    uint64_t timestamp;
+    const char *category;
+    const char *name;
+    int64_t value;
+    uint32_t threadId;
+    TftpTracePhase phase;
+};
+
+// Only the owner thread moves head. Clearing moves cleared up to it
+// instead, events before it are left out of dumps.
+struct TraceRing {
+    TraceEvent events[TFTP_TRACE_RING_SIZE];
+    std::atomic<uint64_t> head;
+    std::atomic<uint64_t> cleared;
+    std::atomic<bool> inUse;
+};
+
+std::atomic<bool> traceEnabled(false);
+
+// Rings are only created, never destroyed, so readers can walk the list
+// without racing against thread exit. The mutex guards the list itself,
+// which only changes the first time a thread records an event.
+std::mutex ringsMutex;
+std::vector<TraceRing *> rings;
+
+struct ThreadRing {
+    TraceRing *ring;
+    uint32_t threadId;
+
+    ThreadRing() : ring(nullptr), threadId(0) {}
+
+    ~ThreadRing() {
+        if (ring != nullptr) {
+            ring->inUse.store(false, std::memory_order_release);
+        }
+    }
+};
+
+thread_local ThreadRing threadRing;
+
+TraceRing *acquireRing()
+{
+    std::lock_guard<std::mutex> lock(ringsMutex);
+    for (TraceRing *ring : rings) {
+        bool expected = false;
+        if (ring->inUse.compare_exchange_strong(expected, true)) {
+            return ring;
+        }
+    }
+
+    TraceRing *ring = new TraceRing;
+    ring->head.store(0, std::memory_order_relaxed);
+    ring->cleared.store(0, std::memory_order_relaxed);
+    ring->inUse.store(true, std::memory_order_relaxed);
+    rings.push_back(ring);
+    return ring;
+}
+
+uint64_t now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + (uint64_t) ts.tv_nsec;
+}
+
+void appendEscaped(std::string &json, const char *text)
+{
+    for (const char *c = text; *c != '\0'; ++c) {
+        if (*c == '"' || *c == '\\') {
+            json += '\\';
+        }
+        json += *c;
+    }
+}
+
+} // namespace
+
+void TFTPTrace::setEnabled(
+        const bool enabled)
+{
+    traceEnabled.store(enabled, std::memory_order_relaxed);
+}
+
+bool TFTPTrace::isEnabled()
+{
+    return traceEnabled.load(std::memory_order_relaxed);
+}
+
+void TFTPTrace::record(
+        const char *category,
+        const char *name,
+        const TftpTracePhase phase,
+        const int64_t value)
+{
+    if (!traceEnabled.load(std::memory_order_relaxed)) {
+        return;
+    }
+
+    ThreadRing &local = threadRing;
+    if (local.ring == nullptr) {
+        local.ring = acquireRing();
+        local.threadId = (uint32_t) syscall(SYS_gettid);
+    }
+
+    TraceRing *ring = local.ring;
+    uint64_t index = ring->head.load(std::memory_order_relaxed);
+    TraceEvent &event = ring->events[index % TFTP_TRACE_RING_SIZE];
+    event.timestamp = now();
+    event.category = category;
+    event.name = name;
+    event.value = value;
+    event.threadId = local.threadId;
+    event.phase = phase;
+    ring->head.store(index + 1, std::memory_order_release);
+}
+
+void TFTPTrace::clear()
+{
+    std::lock_guard<std::mutex> lock(ringsMutex);
+    for (TraceRing *ring : rings) {
+        ring->cleared.store(ring->head.load(std::memory_order_acquire),
+                            std::memory_order_release);
+    }
+}
+
+TftpTraceOperationResult TFTPTrace::dump(
+        std::string &json)
+{
+    json = "{\"traceEvents\":[";
+    bool first = true;
+    int pid = (int) getpid();
+    char line[128];
+
+    std::lock_guard<std::mutex> lock(ringsMutex);
+    for (TraceRing *ring : rings) {
+        uint64_t head = ring->head.load(std::memory_order_acquire);
+        uint64_t start = head > TFTP_TRACE_RING_SIZE ?
+                         head - TFTP_TRACE_RING_SIZE : 0;
+        start = std::max(start, ring->cleared.load(std::memory_order_acquire));
+        for (uint64_t i = start; i < head; ++i) {
+            const TraceEvent &event = ring->events[i % TFTP_TRACE_RING_SIZE];
+            json += first ? "{\"name\":\"" : ",{\"name\":\"";
+            first = false;
+            appendEscaped(json, event.name);
+            json += "\",\"cat\":\"";
+            appendEscaped(json, event.category);
+            snprintf(line, sizeof(line),
+                     "\",\"ph\":\"%c\",\"ts\":%llu.%03llu,\"pid\":%d,"
+                     "\"tid\":%u,\"s\":\"t\",\"args\":{\"value\":%lld}}",
+                     (char) event.phase,
+                     (unsigned long long) (event.timestamp / 1000),
+                     (unsigned long long) (event.timestamp % 1000),
+                     pid, event.threadId, (long long) event.value);
+            json += line;
+        }
+    }
+    json += "],\"displayTimeUnit\":\"ns\"}";
+
+    return TftpTraceOperationResult::TFTP_TRACE_OK;
+}
+
+TftpTraceOperationResult TFTPTrace::dumpToFile(
+        const char *path)
+{
+    if (path == nullptr) {
+        return TftpTraceOperationResult::TFTP_TRACE_ERROR;
+    }
+
+    std::string json;
+    if (dump(json) != TftpTraceOperationResult::TFTP_TRACE_OK) {
+        return TftpTraceOperationResult::TFTP_TRACE_ERROR;
+    }
+
+    FILE *fp = fopen(path, "w");
+    if (fp == NULL) {
+        return TftpTraceOperationResult::TFTP_TRACE_ERROR;
+    }
+
+    bool written = fwrite(json.data(), 1, json.size(), fp) == json.size();
+    if (fclose(fp) != 0 || !written) {
+        return TftpTraceOperationResult::TFTP_TRACE_ERROR;
+    }
+    return TftpTraceOperationResult::TFTP_TRACE_OK;
+}
+
+TFTPTraceScope::TFTPTraceScope(
+        const char *category,
+        const char *name)
+{
+    this->category = category;
+    this->name = name;
+    TFTPTrace::record(category, name,
+                      TftpTracePhase::TFTP_TRACE_PHASE_BEGIN, 0);
+}
+
+TFTPTraceScope::~TFTPTraceScope()
+{
+    TFTPTrace::record(category, name,
+                      TftpTracePhase::TFTP_TRACE_PHASE_END, 0);
+}
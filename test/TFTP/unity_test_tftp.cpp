@@ -1,8 +1,24 @@
 #include <gtest/gtest.h>
 
 #include "TFTPClient.h"
+#include "TFTPCongestionWindow.h"
+#include "TFTPDelta.h"
+#include "TFTPLatencyHistogram.h"
+#include "TFTPMappedSink.h"
+#include "TFTPObjectPool.h"
+#include "TFTPReadAheadStream.h"
 #include "TFTPServer.h"
-
+#include "TFTPTrace.h"
+#include "TransferScheduler.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <map>
+#include <vector>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <dirent.h>
 #include <thread>
 #include <arpa/inet.h>
 #define SOCKADDR_PRINT_ADDR_LEN INET6_ADDRSTRLEN
@@ -24,6 +40,41 @@
 #define ABORT_TFTP_MSG "ABORT:1003"
 #define WAIT_TFTP_MSG "WAIT:1"
 
+// Heap allocations made through operator new by the calling thread, only
+// counted while an allocation test holds an AllocationCounting.
+static std::atomic<bool> countAllocations(false);
+static thread_local uint64_t threadAllocations = 0;
+
+struct AllocationCounting
+{
+    AllocationCounting() { countAllocations = true; }
+    ~AllocationCounting() { countAllocations = false; }
+};
+
+void *operator new(size_t size)
+{
+    if (countAllocations.load(std::memory_order_relaxed))
+    {
+        threadAllocations++;
+    }
+    void *ptr = malloc(size > 0 ? size : 1);
+    if (ptr == nullptr)
+    {
+        throw std::bad_alloc();
+    }
+    return ptr;
+}
+
+void operator delete(void *ptr) noexcept
+{
+    free(ptr);
+}
+
+void operator delete(void *ptr, size_t) noexcept
+{
+    free(ptr);
+}
+
 typedef struct
 {
     SectionId sectionId;
@@ -33,6 +84,7 @@ typedef struct
     char buffer[BUFSIZE];
     std::string tftpErrorMsg;
     short tftpErrorCode;
+    int serverPort;
 } ClientServerContext;
 
 /*
@@ -583,4 +635,2642 @@ TEST(TFTPExtra, TwoServers)
         FAIL() << "pthread_timedjoin_np() failed";
     }
     SUCCEED();
-}
\ No newline at end of file
+}
+
+TEST(TFTPExtra, StopListeningWakesServer)
+{
+    ITFTPServer *server = new TFTPServer();
+    server->setPort(PORT);
+    server->setTimeout(TIMEOUT);
+    std::thread serverThread([&]()
+                             { server->startListening(); });
+    sleep(1);
+
+    auto start = std::chrono::steady_clock::now();
+    server->stopListening();
+    serverThread.join();
+    auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now() - start);
+
+    delete server;
+
+    ASSERT_LT(elapsed.count(), 500);
+}
+
+TEST(TFTPExtra, RestartServer)
+{
+    ITFTPServer *server = new TFTPServer();
+    ITFTPClient *client = new TFTPClient();
+    ClientServerContext context;
+    memset(context.buffer, 0, BUFSIZE);
+
+    server->setPort(PORT);
+    server->setTimeout(TIMEOUT);
+    server->setDrainTimeout(TIMEOUT * 1000);
+    server->registerSectionStartedCallback(
+        ClientServerContext_sectionStartedCbk, &context);
+    server->registerOpenFileCallback(
+        ClientMemoryServerMemoryCommunication_openFileCbk, &context);
+    server->registerCloseFileCallback(
+        ClientMemoryServerMemoryCommunication_closeFileCbk, &context);
+
+    std::thread firstRun([&]()
+                         { server->startListening(); });
+    sleep(1);
+    server->stopListening();
+    firstRun.join();
+
+    std::thread secondRun([&]()
+                          { server->startListening(); });
+
+    client->setConnection(LOCALHOST, PORT);
+
+    char *sendBuffer = new char[BUFSIZE];
+    memset(sendBuffer, 0, BUFSIZE);
+    strcpy(sendBuffer, MEM_MEM_MSG);
+    FILE *sendFd = fmemopen(sendBuffer, BUFSIZE, "r");
+    TftpClientOperationResult result =
+        client->sendFile(FILENAME_MEM_MEM, sendFd);
+
+    server->stopListening();
+    secondRun.join();
+
+    fclose(sendFd);
+
+    delete server;
+    delete client;
+
+    ASSERT_EQ(result, TftpClientOperationResult::TFTP_CLIENT_OK);
+    ASSERT_STREQ(sendBuffer, context.buffer);
+}
+
+TftpServerOperationResult ServerMultiplePorts_sectionStartedCbk(
+    ITFTPSection *sectionHandler,
+    void *context)
+{
+    if (context != nullptr)
+    {
+        ClientServerContext *ctx = (ClientServerContext *)context;
+        sectionHandler->getSectionId(&ctx->sectionId);
+        sectionHandler->getServerPort(&ctx->serverPort);
+        return TftpServerOperationResult::TFTP_SERVER_OK;
+    }
+    return TftpServerOperationResult::TFTP_SERVER_ERROR;
+}
+
+TEST(TFTPExtra, ServerMultiplePorts)
+{
+    ITFTPServer *server = new TFTPServer();
+    ITFTPClient *client = new TFTPClient();
+    ClientServerContext context;
+    memset(context.buffer, 0, BUFSIZE);
+    context.serverPort = 0;
+
+    server->setPort(PORT);
+    ASSERT_EQ(server->addPort(PORT + 1),
+              TftpServerOperationResult::TFTP_SERVER_OK);
+    ASSERT_EQ(server->addPort(PORT + 1),
+              TftpServerOperationResult::TFTP_SERVER_ERROR);
+    server->setTimeout(TIMEOUT);
+    server->registerSectionStartedCallback(
+        ServerMultiplePorts_sectionStartedCbk, &context);
+    server->registerOpenFileCallback(
+        ClientMemoryServerMemoryCommunication_openFileCbk, &context);
+    server->registerCloseFileCallback(
+        ClientMemoryServerMemoryCommunication_closeFileCbk, &context);
+
+    std::thread serverThread([&]()
+                             { server->startListening(); });
+
+    client->setConnection(LOCALHOST, PORT + 1);
+
+    char *sendBuffer = new char[BUFSIZE];
+    memset(sendBuffer, 0, BUFSIZE);
+    strcpy(sendBuffer, MEM_MEM_MSG);
+    FILE *sendFd = fmemopen(sendBuffer, BUFSIZE, "r");
+    TftpClientOperationResult result =
+        client->sendFile(FILENAME_MEM_MEM, sendFd);
+
+    auto start = std::chrono::steady_clock::now();
+    server->stopListening();
+    serverThread.join();
+    auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now() - start);
+
+    fclose(sendFd);
+
+    delete server;
+    delete client;
+
+    ASSERT_EQ(result, TftpClientOperationResult::TFTP_CLIENT_OK);
+    ASSERT_EQ(context.serverPort, PORT + 1);
+    ASSERT_STREQ(sendBuffer, context.buffer);
+    ASSERT_LT(elapsed.count(), 500);
+}
+
+TEST(TFTPExtra, ServerReportsExtraPortFailure)
+{
+    // Hold the extra port so the server can't listen on it.
+    int sock = socket(AF_INET, SOCK_DGRAM, 0);
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(PORT + 1);
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    ASSERT_EQ(bind(sock, (struct sockaddr *)&addr, sizeof(addr)), 0);
+
+    ITFTPServer *server = new TFTPServer();
+    server->setPort(PORT);
+    server->addPort(PORT + 1);
+    server->setTimeout(TIMEOUT);
+
+    TftpServerOperationResult result =
+        TftpServerOperationResult::TFTP_SERVER_OK;
+    std::thread serverThread([&]()
+                             { result = server->startListening(); });
+    sleep(1);
+    server->stopListening();
+    serverThread.join();
+
+    delete server;
+    close(sock);
+
+    ASSERT_EQ(result, TftpServerOperationResult::TFTP_SERVER_ERROR);
+}
+
+typedef struct
+{
+    int cpu;
+    int sectionCpus;
+    bool sectionOnCpu;
+} CpuAffinityContext;
+
+TftpServerOperationResult ServerCpuAffinity_sectionStartedCbk(
+    ITFTPSection *sectionHandler,
+    void *context)
+{
+    CpuAffinityContext *ctx = (CpuAffinityContext *)context;
+    cpu_set_t cpus;
+    pthread_getaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+    ctx->sectionCpus = CPU_COUNT(&cpus);
+    ctx->sectionOnCpu = CPU_ISSET(ctx->cpu, &cpus);
+    return TftpServerOperationResult::TFTP_SERVER_OK;
+}
+
+TEST(TFTPExtra, ServerCpuAffinity)
+{
+    ITFTPServer *server = new TFTPServer();
+    ITFTPClient *client = new TFTPClient();
+    CpuAffinityContext context;
+    memset(&context, 0, sizeof(context));
+
+    cpu_set_t allowed;
+    ASSERT_EQ(pthread_getaffinity_np(pthread_self(), sizeof(allowed), &allowed), 0);
+    while (!CPU_ISSET(context.cpu, &allowed))
+    {
+        context.cpu++;
+    }
+
+    server->setPort(PORT);
+    server->setTimeout(TIMEOUT);
+    ASSERT_EQ(server->setCpuAffinity(PORT + 1, {context.cpu}),
+              TftpServerOperationResult::TFTP_SERVER_ERROR);
+    ASSERT_EQ(server->setCpuAffinity(PORT, {-1}),
+              TftpServerOperationResult::TFTP_SERVER_ERROR);
+    ASSERT_EQ(server->setCpuAffinity(PORT, {context.cpu}),
+              TftpServerOperationResult::TFTP_SERVER_OK);
+    server->registerSectionStartedCallback(
+        ServerCpuAffinity_sectionStartedCbk, &context);
+
+    std::thread serverThread([&]()
+                             {
+                                 server->startListening();
+                                 cpu_set_t cpus;
+                                 pthread_getaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+                                 // The caller's CPUs are given back.
+                                 EXPECT_TRUE(CPU_EQUAL(&cpus, &allowed));
+                             });
+
+    client->setConnection(LOCALHOST, PORT);
+
+    char buffer[BUFSIZE];
+    memset(buffer, 0, BUFSIZE);
+    strcpy(buffer, MEM_MEM_MSG);
+    FILE *fp = fmemopen(buffer, BUFSIZE, "r");
+    client->sendFile(FILENAME_DISK_DISK_SEND, fp);
+    fclose(fp);
+
+    server->stopListening();
+    serverThread.join();
+    delete server;
+    delete client;
+
+    ASSERT_EQ(context.sectionCpus, 1);
+    ASSERT_TRUE(context.sectionOnCpu);
+}
+
+/*
+ *******************************************************************************
+ *                                    TRACE                                    *
+ *******************************************************************************
+ */
+
+TEST(TFTPTrace, RecordAndDump)
+{
+    TFTPTrace::clear();
+    TFTPTrace::record("test", "disabled",
+                      TftpTracePhase::TFTP_TRACE_PHASE_INSTANT, 0);
+
+    TFTPTrace::setEnabled(true);
+    {
+        TFTPTraceScope scope("test", "scope");
+        TFTPTrace::record("test", "packet",
+                          TftpTracePhase::TFTP_TRACE_PHASE_INSTANT, 512);
+    }
+    TFTPTrace::setEnabled(false);
+
+    std::string json;
+    ASSERT_EQ(TFTPTrace::dump(json), TftpTraceOperationResult::TFTP_TRACE_OK);
+    TFTPTrace::clear();
+    std::string cleared;
+    TFTPTrace::dump(cleared);
+
+    ASSERT_EQ(json.find("\"disabled\""), std::string::npos);
+    ASSERT_NE(json.find("\"name\":\"scope\",\"cat\":\"test\",\"ph\":\"B\""),
+              std::string::npos);
+    ASSERT_NE(json.find("\"name\":\"scope\",\"cat\":\"test\",\"ph\":\"E\""),
+              std::string::npos);
+    ASSERT_NE(json.find("\"value\":512"), std::string::npos);
+    ASSERT_EQ(json.find("{\"traceEvents\":["), 0u);
+    ASSERT_EQ(cleared.find("\"packet\""), std::string::npos);
+}
+
+/*
+ *******************************************************************************
+ *                                  SCHEDULER                                  *
+ *******************************************************************************
+ */
+
+TransferSchedulerOperationResult TransferScheduler_jobFinishedCbk(
+    TransferJobId id,
+    TransferJobStatus status,
+    std::string &errorMessage,
+    void *context)
+{
+    if (context != nullptr)
+    {
+        std::map<TransferJobId, TransferJobStatus> *results =
+            (std::map<TransferJobId, TransferJobStatus> *)context;
+        (*results)[id] = status;
+        return TransferSchedulerOperationResult::TRANSFER_SCHEDULER_OK;
+    }
+    return TransferSchedulerOperationResult::TRANSFER_SCHEDULER_ERROR;
+}
+
+TEST(TransferScheduler, FetchFromTwoServers)
+{
+    ITFTPServer *server1 = new TFTPServer();
+    ITFTPServer *server2 = new TFTPServer();
+    ITransferScheduler *scheduler = new TransferScheduler();
+    std::map<TransferJobId, TransferJobStatus> results;
+
+    FILE *fp = fopen(FILENAME_DISK_DISK_SEND, "w");
+    fprintf(fp, DISK_DISK_MSG);
+    fclose(fp);
+
+    server1->setPort(PORT);
+    server1->setTimeout(TIMEOUT);
+    server2->setPort(PORT + 1);
+    server2->setTimeout(TIMEOUT);
+    std::thread serverThread1([&]()
+                              { server1->startListening(); });
+    std::thread serverThread2([&]()
+                              { server2->startListening(); });
+
+    scheduler->setMaxConcurrentTransfers(2);
+    scheduler->setRetryDelay(0);
+    scheduler->registerJobFinishedCallback(
+        TransferScheduler_jobFinishedCbk, &results);
+
+    char buffers[3][BUFSIZE];
+    FILE *sinks[3];
+    TransferJobId ids[3];
+    for (int i = 0; i < 3; i++)
+    {
+        memset(buffers[i], 0, BUFSIZE);
+        sinks[i] = fmemopen(buffers[i], BUFSIZE, "w");
+        TransferJob job;
+        job.host = LOCALHOST;
+        job.port = PORT + (i % 2);
+        job.direction = TransferDirection::TRANSFER_FETCH;
+        job.filename = i < 2 ? FILENAME_DISK_DISK_SEND : "missing_file.txt";
+        job.fp = sinks[i];
+        job.priority = i;
+        job.maxRetries = 2;
+        ASSERT_EQ(scheduler->submitJob(job, &ids[i]),
+                  TransferSchedulerOperationResult::TRANSFER_SCHEDULER_OK);
+    }
+
+    scheduler->start();
+    ASSERT_EQ(scheduler->waitIdle(),
+              TransferSchedulerOperationResult::TRANSFER_SCHEDULER_OK);
+    TransferProgress progress;
+    scheduler->getProgress(progress);
+    scheduler->stop();
+
+    server1->stopListening();
+    server2->stopListening();
+    serverThread1.join();
+    serverThread2.join();
+
+    for (int i = 0; i < 3; i++)
+    {
+        fclose(sinks[i]);
+    }
+
+    delete scheduler;
+    delete server1;
+    delete server2;
+
+    ASSERT_EQ(progress.submittedJobs, 3u);
+    ASSERT_EQ(progress.completedJobs, 2u);
+    ASSERT_EQ(progress.failedJobs, 1u);
+    ASSERT_EQ(progress.retries, 0u);
+    ASSERT_EQ(progress.bytesFetched, 2 * strlen(DISK_DISK_MSG));
+    ASSERT_EQ(results[ids[0]], TransferJobStatus::TRANSFER_JOB_OK);
+    ASSERT_EQ(results[ids[1]], TransferJobStatus::TRANSFER_JOB_OK);
+    ASSERT_EQ(results[ids[2]], TransferJobStatus::TRANSFER_JOB_ERROR);
+    ASSERT_STREQ(buffers[0], DISK_DISK_MSG);
+    ASSERT_STREQ(buffers[1], DISK_DISK_MSG);
+}
+
+typedef struct
+{
+    int attempts;
+    char buffer[BUFSIZE];
+} RetryContext;
+
+TftpServerOperationResult RetriesFromSubmitOffset_openFileCbk(
+    ITFTPSection *sectionHandler,
+    FILE **fd,
+    char *filename,
+    char *mode,
+    size_t *fileSize,
+    void *context)
+{
+    RetryContext *ctx = (RetryContext *)context;
+    if (ctx->attempts++ == 0)
+    {
+        (*fd) = NULL;
+        std::string errorMsg("WAIT:0");
+        sectionHandler->setErrorMessage(errorMsg);
+        return TftpServerOperationResult::TFTP_SERVER_ERROR;
+    }
+    *fd = fmemopen(ctx->buffer, BUFSIZE, mode);
+    return TftpServerOperationResult::TFTP_SERVER_OK;
+}
+
+TEST(TransferScheduler, RetriesFromSubmitOffset)
+{
+    ITFTPServer *server = new TFTPServer();
+    ITransferScheduler *scheduler = new TransferScheduler();
+    RetryContext context;
+    context.attempts = 0;
+    memset(context.buffer, 0, BUFSIZE);
+
+    server->setPort(PORT);
+    server->setTimeout(TIMEOUT);
+    server->registerOpenFileCallback(
+        RetriesFromSubmitOffset_openFileCbk, &context);
+    server->registerCloseFileCallback(
+        ClientMemoryServerMemoryCommunication_closeFileCbk, &context);
+    std::thread serverThread([&]()
+                             { server->startListening(); });
+
+    // Only the part after the header is sent, on every attempt.
+    char sendBuffer[] = "header:" MEM_MEM_MSG;
+    FILE *source = fmemopen(sendBuffer, strlen(sendBuffer), "r");
+    fseek(source, strlen("header:"), SEEK_SET);
+
+    TransferJob job;
+    job.host = LOCALHOST;
+    job.port = PORT;
+    job.direction = TransferDirection::TRANSFER_SEND;
+    job.filename = FILENAME_MEM_MEM;
+    job.fp = source;
+    job.priority = 0;
+    job.maxRetries = 1;
+    scheduler->submitJob(job, nullptr);
+
+    // WAIT:0 asks for no time, the retry delay applies.
+    scheduler->setRetryDelay(200);
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    scheduler->start();
+    scheduler->waitIdle();
+    std::chrono::steady_clock::duration elapsed = std::chrono::steady_clock::now() - start;
+    TransferProgress progress;
+    scheduler->getProgress(progress);
+    scheduler->stop();
+
+    server->stopListening();
+    serverThread.join();
+
+    fclose(source);
+    delete scheduler;
+    delete server;
+
+    ASSERT_EQ(progress.completedJobs, 1u);
+    ASSERT_EQ(progress.retries, 1u);
+    ASSERT_GE(elapsed, std::chrono::milliseconds(200));
+    ASSERT_STREQ(context.buffer, MEM_MEM_MSG);
+}
+
+/*
+ *******************************************************************************
+ *                                 MAPPED SINK                                 *
+ *******************************************************************************
+ */
+
+TEST(TFTPMappedSink, GrowsPastSizeHint)
+{
+    TFTPMappedSink sink;
+    ASSERT_EQ(sink.openAnonymous(16), TftpClientOperationResult::TFTP_CLIENT_OK);
+
+    std::vector<char> block(512, 'A');
+    for (int i = 0; i < 64; i++)
+    {
+        block[0] = (char)i;
+        ASSERT_EQ(fwrite(block.data(), 1, block.size(), sink.getStream()),
+                  block.size());
+    }
+    ASSERT_EQ(sink.getSize(), 64u * 512u);
+    ASSERT_EQ(sink.getData()[63 * 512], 63);
+
+    void *data;
+    size_t size, mappedSize;
+    ASSERT_EQ(sink.release(&data, &size, &mappedSize),
+              TftpClientOperationResult::TFTP_CLIENT_OK);
+    ASSERT_EQ(size, 64u * 512u);
+    ASSERT_GE(mappedSize, size);
+    ASSERT_EQ(((char *)data)[513], 'A');
+    munmap(data, mappedSize);
+}
+
+TEST(TFTPClientServer, ClientMappedFileServerDiskCommunication)
+{
+    ITFTPServer *server = new TFTPServer();
+    ITFTPClient *client = new TFTPClient();
+
+    std::vector<char> content(3 * 512 + 100);
+    for (size_t i = 0; i < content.size(); i++)
+    {
+        content[i] = (char)('a' + i % 26);
+    }
+    FILE *fp = fopen(FILENAME_DISK_DISK_SEND, "w");
+    fwrite(content.data(), 1, content.size(), fp);
+    fclose(fp);
+
+    server->setPort(PORT);
+    server->setTimeout(TIMEOUT);
+    std::thread serverThread([&]()
+                             { server->startListening(); });
+
+    client->setConnection(LOCALHOST, PORT);
+
+    TFTPMappedSink sink;
+    ASSERT_EQ(sink.openFile(FILENAME_DISK_DISK_RECEIVE, 0),
+              TftpClientOperationResult::TFTP_CLIENT_OK);
+    TftpClientOperationResult result =
+        client->fetchFile(FILENAME_DISK_DISK_SEND, sink);
+    size_t received = sink.getSize();
+    sink.close();
+
+    server->stopListening();
+    serverThread.join();
+
+    delete server;
+    delete client;
+
+    ASSERT_EQ(result, TftpClientOperationResult::TFTP_CLIENT_OK);
+    ASSERT_EQ(received, content.size());
+
+    std::vector<char> stored(content.size() + 1);
+    fp = fopen(FILENAME_DISK_DISK_RECEIVE, "r");
+    size_t stored_size = fread(stored.data(), 1, stored.size(), fp);
+    fclose(fp);
+    ASSERT_EQ(stored_size, content.size());
+    ASSERT_EQ(memcmp(stored.data(), content.data(), content.size()), 0);
+}
+
+/*
+ *******************************************************************************
+ *                                 READ-AHEAD                                  *
+ *******************************************************************************
+ */
+
+TEST(TFTPClientServer, ServerReadAhead)
+{
+    ITFTPServer *server = new TFTPServer();
+    ITFTPClient *client = new TFTPClient();
+
+    std::vector<char> content(20 * 512 + 7);
+    for (size_t i = 0; i < content.size(); i++)
+    {
+        content[i] = (char)(i * 31);
+    }
+    FILE *fp = fopen(FILENAME_DISK_DISK_SEND, "w");
+    fwrite(content.data(), 1, content.size(), fp);
+    fclose(fp);
+
+    server->setPort(PORT);
+    server->setTimeout(TIMEOUT);
+    ASSERT_EQ(server->setReadAheadDepth(4),
+              TftpServerOperationResult::TFTP_SERVER_OK);
+    std::thread serverThread([&]()
+                             { server->startListening(); });
+
+    client->setConnection(LOCALHOST, PORT);
+
+    TFTPMappedSink sink;
+    sink.openAnonymous(content.size());
+    TftpClientOperationResult result =
+        client->fetchFile(FILENAME_DISK_DISK_SEND, sink);
+
+    server->stopListening();
+    serverThread.join();
+
+    uint64_t hits = 0, misses = 0;
+    server->getReadAheadStats(&hits, &misses);
+
+    delete server;
+    delete client;
+
+    ASSERT_EQ(result, TftpClientOperationResult::TFTP_CLIENT_OK);
+    ASSERT_EQ(sink.getSize(), content.size());
+    ASSERT_EQ(memcmp(sink.getData(), content.data(), content.size()), 0);
+    ASSERT_GT(hits + misses, 0u);
+}
+
+ssize_t FailingSource_read(
+    void *cookie,
+    char *buffer,
+    size_t size)
+{
+    // One block of data, then a read error.
+    size_t *served = (size_t *)cookie;
+    if (*served >= 512)
+    {
+        errno = EIO;
+        return -1;
+    }
+    size_t length = std::min(size, 512 - *served);
+    memset(buffer, 'x', length);
+    *served += length;
+    return (ssize_t)length;
+}
+
+TEST(TFTPReadAheadStream, ReportsSourceErrors)
+{
+    size_t served = 0;
+    cookie_io_functions_t functions;
+    memset(&functions, 0, sizeof(functions));
+    functions.read = FailingSource_read;
+    FILE *source = fopencookie(&served, "r", functions);
+    ASSERT_NE(source, nullptr);
+
+    TFTPPrefetcher prefetcher;
+    TFTPReadAheadStats stats;
+    stats.hits = 0;
+    stats.misses = 0;
+    TFTPReadAheadStream readAhead;
+    FILE *stream = readAhead.open(source, 512, 4, &stats, &prefetcher);
+    ASSERT_NE(stream, nullptr);
+
+    char buffer[2048];
+    size_t length = fread(buffer, 1, sizeof(buffer), stream);
+    bool failed = ferror(stream) != 0;
+    fclose(stream);
+    fclose(source);
+
+    ASSERT_EQ(length, 512u);
+    ASSERT_TRUE(failed);
+}
+
+TEST(TFTPReadAheadStream, KeepsBlocksInOrder)
+{
+    // Many rings' worth of blocks, each tagged with its index, read through
+    // the shared prefetcher.
+    const int blockCount = 20000;
+    FILE *source = tmpfile();
+    ASSERT_NE(source, nullptr);
+    char block[512];
+    for (int i = 0; i < blockCount; i++)
+    {
+        memset(block, i & 0xff, sizeof(block));
+        memcpy(block, &i, sizeof(i));
+        fwrite(block, 1, sizeof(block), source);
+    }
+    rewind(source);
+
+    TFTPPrefetcher prefetcher;
+    TFTPReadAheadStats stats;
+    stats.hits = 0;
+    stats.misses = 0;
+    TFTPReadAheadStream readAhead;
+    FILE *stream = readAhead.open(source, 512, 8, &stats, &prefetcher);
+    ASSERT_NE(stream, nullptr);
+
+    int wrongBlocks = 0;
+    int blocks = 0;
+    while (fread(block, 1, sizeof(block), stream) == sizeof(block))
+    {
+        int index;
+        memcpy(&index, block, sizeof(index));
+        if (index != blocks || block[sizeof(block) - 1] != (char)(blocks & 0xff))
+        {
+            wrongBlocks++;
+        }
+        blocks++;
+    }
+    fclose(stream);
+    fclose(source);
+
+    ASSERT_EQ(blocks, blockCount);
+    ASSERT_EQ(wrongBlocks, 0);
+}
+
+TftpServerOperationResult VirtualFile_openFileCbk(
+    ITFTPSection *sectionHandler,
+    FILE **fd,
+    char *filename,
+    char *mode,
+    size_t *bufferSize,
+    void *context)
+{
+    int *opened = (int *)context;
+    (*opened)++;
+    *fd = fopen(filename, mode);
+    return TftpServerOperationResult::TFTP_SERVER_OK;
+}
+
+TEST(TFTPClientServer, ServerVirtualFile)
+{
+    ITFTPServer *server = new TFTPServer();
+    ITFTPClient *client = new TFTPClient();
+    int opened = 0;
+
+    std::string first(3 * 512, 'a');
+    std::string second = "updated content";
+
+    server->setPort(PORT);
+    server->setTimeout(TIMEOUT);
+    server->registerOpenFileCallback(VirtualFile_openFileCbk, &opened);
+    ASSERT_EQ(server->registerVirtualFile("virtual.bin", first.data(), first.size()),
+              TftpServerOperationResult::TFTP_SERVER_OK);
+    ASSERT_EQ(server->registerVirtualFile("virtual.bin", first.data(), first.size()),
+              TftpServerOperationResult::TFTP_SERVER_ERROR);
+    ASSERT_EQ(server->updateVirtualFile("missing.bin", first.data(), first.size()),
+              TftpServerOperationResult::TFTP_SERVER_ERROR);
+    std::thread serverThread([&]()
+                             { server->startListening(); });
+
+    client->setConnection(LOCALHOST, PORT);
+
+    TFTPMappedSink firstSink;
+    firstSink.openAnonymous(0);
+    TftpClientOperationResult firstResult =
+        client->fetchFile("virtual.bin", firstSink);
+
+    TftpServerOperationResult updateResult =
+        server->updateVirtualFile("virtual.bin", second.data(), second.size());
+
+    TFTPMappedSink secondSink;
+    secondSink.openAnonymous(0);
+    TftpClientOperationResult secondResult =
+        client->fetchFile("virtual.bin", secondSink);
+
+    server->stopListening();
+    serverThread.join();
+
+    delete server;
+    delete client;
+
+    ASSERT_EQ(firstResult, TftpClientOperationResult::TFTP_CLIENT_OK);
+    ASSERT_EQ(updateResult, TftpServerOperationResult::TFTP_SERVER_OK);
+    ASSERT_EQ(secondResult, TftpClientOperationResult::TFTP_CLIENT_OK);
+    ASSERT_EQ(std::string((const char *)firstSink.getData(), firstSink.getSize()), first);
+    ASSERT_EQ(std::string((const char *)secondSink.getData(), secondSink.getSize()), second);
+    ASSERT_EQ(opened, 0);
+}
+
+typedef struct
+{
+    std::atomic<int> opened;
+    std::atomic<int> started;
+    std::atomic<int> finished;
+} DuplicateContext;
+
+TftpServerOperationResult Duplicate_sectionStartedCbk(
+    ITFTPSection *sectionHandler,
+    void *context)
+{
+    ((DuplicateContext *)context)->started++;
+    return TftpServerOperationResult::TFTP_SERVER_OK;
+}
+
+TftpServerOperationResult Duplicate_sectionFinishedCbk(
+    ITFTPSection *sectionHandler,
+    void *context)
+{
+    ((DuplicateContext *)context)->finished++;
+    return TftpServerOperationResult::TFTP_SERVER_OK;
+}
+
+TftpServerOperationResult Duplicate_openFileCbk(
+    ITFTPSection *sectionHandler,
+    FILE **fd,
+    char *filename,
+    char *mode,
+    size_t *bufferSize,
+    void *context)
+{
+    // Slow enough for the client to retransmit its request.
+    ((DuplicateContext *)context)->opened++;
+    std::this_thread::sleep_for(std::chrono::milliseconds(1500));
+    *fd = fopen(filename, mode);
+    return TftpServerOperationResult::TFTP_SERVER_OK;
+}
+
+TftpServerOperationResult Duplicate_closeFileCbk(
+    ITFTPSection *sectionHandler,
+    FILE *fd,
+    void *context)
+{
+    fclose(fd);
+    return TftpServerOperationResult::TFTP_SERVER_OK;
+}
+
+TEST(TFTPClientServer, ServerSuppressesDuplicateRequests)
+{
+    ITFTPServer *server = new TFTPServer();
+    ITFTPClient *client = new TFTPClient();
+    DuplicateContext context;
+    context.opened = 0;
+    context.started = 0;
+    context.finished = 0;
+
+    FILE *fp = fopen(FILENAME_DISK_DISK_SEND, "w");
+    fprintf(fp, DISK_DISK_MSG);
+    fclose(fp);
+
+    server->setPort(PORT);
+    server->setTimeout(TIMEOUT);
+    server->setDrainTimeout(TIMEOUT * 1000);
+    ASSERT_EQ(server->setDuplicateRequestWindow(5000),
+              TftpServerOperationResult::TFTP_SERVER_OK);
+    server->registerSectionStartedCallback(Duplicate_sectionStartedCbk, &context);
+    server->registerSectionFinishedCallback(Duplicate_sectionFinishedCbk, &context);
+    server->registerOpenFileCallback(Duplicate_openFileCbk, &context);
+    server->registerCloseFileCallback(Duplicate_closeFileCbk, &context);
+    std::thread serverThread([&]()
+                             { server->startListening(); });
+
+    client->setConnection(LOCALHOST, PORT);
+
+    char buffer[BUFSIZE];
+    memset(buffer, 0, BUFSIZE);
+    FILE *receiveFd = fmemopen(buffer, BUFSIZE, "w");
+    TftpClientOperationResult result =
+        client->fetchFile(FILENAME_DISK_DISK_SEND, receiveFd);
+    fclose(receiveFd);
+
+    server->stopListening();
+    serverThread.join();
+
+    uint64_t suppressed = 0;
+    server->getSuppressedDuplicates(&suppressed);
+
+    delete server;
+    delete client;
+
+    ASSERT_EQ(result, TftpClientOperationResult::TFTP_CLIENT_OK);
+    ASSERT_STREQ(buffer, DISK_DISK_MSG);
+    ASSERT_GE(suppressed, 1u);
+    ASSERT_EQ(context.opened, 1);
+    ASSERT_EQ(context.started, 1);
+    ASSERT_EQ(context.finished, 1);
+}
+
+TEST(TFTPLatencyHistogram, PercentilesAndMerge)
+{
+    TFTPLatencyHistogram first;
+    TFTPLatencyHistogram second;
+    for (uint64_t i = 1; i <= 1000; i++)
+    {
+        first.record(i * 1000);
+    }
+    second.record(5000000);
+
+    TFTPLatencySummary summary;
+    first.getSummary(&summary);
+    ASSERT_EQ(summary.count, 1000u);
+    ASSERT_EQ(summary.min, 1000u);
+    ASSERT_EQ(summary.max, 1000000u);
+    // Buckets are within 1/64 of the recorded value.
+    ASSERT_NEAR((double)summary.p50, 500000.0, 500000.0 / 64);
+    ASSERT_NEAR((double)summary.p99, 990000.0, 990000.0 / 64);
+
+    first.merge(second);
+    ASSERT_EQ(first.getCount(), 1001u);
+    ASSERT_EQ(first.getValueAtPercentile(100), 5000000u);
+
+    first.reset();
+    ASSERT_EQ(first.getCount(), 0u);
+    ASSERT_EQ(first.getValueAtPercentile(50), 0u);
+}
+
+TEST(TFTPClientServer, LatencyHistograms)
+{
+    ITFTPServer *server = new TFTPServer();
+    ITFTPClient *client = new TFTPClient();
+
+    std::vector<char> content(8 * 512 + 100, 'x');
+    FILE *fp = fopen(FILENAME_DISK_DISK_SEND, "w");
+    fwrite(content.data(), 1, content.size(), fp);
+    fclose(fp);
+
+    server->setPort(PORT);
+    server->setTimeout(TIMEOUT);
+    server->setDrainTimeout(TIMEOUT * 1000);
+    std::thread serverThread([&]()
+                             { server->startListening(); });
+
+    client->setConnection(LOCALHOST, PORT);
+
+    TFTPMappedSink sink;
+    sink.openAnonymous(content.size());
+    TftpClientOperationResult result =
+        client->fetchFile(FILENAME_DISK_DISK_SEND, sink);
+
+    server->stopListening();
+    serverThread.join();
+
+    TFTPLatencySummary serverSection, serverBlocks, serverOpen, clientBlocks;
+    server->getLatencySummary(TftpLatencyMetric::TFTP_LATENCY_SECTION_DURATION, &serverSection);
+    server->getLatencySummary(TftpLatencyMetric::TFTP_LATENCY_BLOCK_ROUND_TRIP, &serverBlocks);
+    server->getLatencySummary(TftpLatencyMetric::TFTP_LATENCY_OPEN_FILE, &serverOpen);
+    client->getLatencySummary(TftpLatencyMetric::TFTP_LATENCY_BLOCK_ROUND_TRIP, &clientBlocks);
+
+    TFTPLatencyHistogram combined;
+    server->getLatencyHistogram(TftpLatencyMetric::TFTP_LATENCY_FIRST_BLOCK, combined);
+    client->getLatencyHistogram(TftpLatencyMetric::TFTP_LATENCY_FIRST_BLOCK, combined);
+
+    delete server;
+    delete client;
+
+    ASSERT_EQ(result, TftpClientOperationResult::TFTP_CLIENT_OK);
+    ASSERT_EQ(serverSection.count, 1u);
+    ASSERT_EQ(serverOpen.count, 1u);
+    // Nine blocks, the first one is timed separately.
+    ASSERT_EQ(serverBlocks.count, 8u);
+    ASSERT_EQ(clientBlocks.count, 8u);
+    ASSERT_EQ(combined.getCount(), 2u);
+    ASSERT_LE(serverBlocks.p50, serverBlocks.p999);
+    ASSERT_LE(serverSection.max, serverSection.p999 + serverSection.max / 64);
+}
+
+/*
+ *******************************************************************************
+ *                                 COMPRESSION                                 *
+ *******************************************************************************
+ */
+
+TEST(TFTPClientServer, CompressedTransfers)
+{
+    ITFTPServer *server = new TFTPServer();
+    ITFTPClient *client = new TFTPClient();
+
+    std::string content;
+    for (int i = 0; content.size() < 64 * 1024; ++i) {
+        content += "line " + std::to_string(i % 100) + " of a compressible file\n";
+    }
+    FILE *fp = fopen(FILENAME_DISK_DISK_SEND, "w");
+    fwrite(content.data(), 1, content.size(), fp);
+    fclose(fp);
+    remove(FILENAME_DISK_DISK_RECEIVE);
+
+    server->setPort(PORT);
+    server->setTimeout(TIMEOUT);
+    server->setDrainTimeout(TIMEOUT * 1000);
+    server->setCompression(true);
+    std::thread serverThread([&]()
+                             { server->startListening(); });
+
+    client->setConnection(LOCALHOST, PORT);
+    client->setCompression(true);
+
+    // The second fetch is served from the compressed file cache.
+    TFTPMappedSink first, second;
+    first.openAnonymous(content.size());
+    second.openAnonymous(content.size());
+    TftpClientOperationResult firstResult =
+        client->fetchFile(FILENAME_DISK_DISK_SEND, first);
+    TftpClientOperationResult secondResult =
+        client->fetchFile(FILENAME_DISK_DISK_SEND, second);
+
+    fp = fmemopen((void *) content.data(), content.size(), "r");
+    TftpClientOperationResult sendResult =
+        client->sendFile(FILENAME_DISK_DISK_RECEIVE, fp);
+    fclose(fp);
+
+    server->stopListening();
+    serverThread.join();
+
+    uint64_t serverPlain, serverCompressed, cacheHits, clientPlain, clientCompressed;
+    server->getCompressionStats(&serverPlain, &serverCompressed, &cacheHits);
+    client->getCompressionStats(&clientPlain, &clientCompressed);
+
+    delete server;
+    delete client;
+
+    std::string received;
+    fp = fopen(FILENAME_DISK_DISK_RECEIVE, "r");
+    ASSERT_TRUE(fp != NULL);
+    char buffer[4096];
+    size_t length;
+    while ((length = fread(buffer, 1, sizeof(buffer), fp)) > 0) {
+        received.append(buffer, length);
+    }
+    fclose(fp);
+
+    ASSERT_EQ(firstResult, TftpClientOperationResult::TFTP_CLIENT_OK);
+    ASSERT_EQ(secondResult, TftpClientOperationResult::TFTP_CLIENT_OK);
+    ASSERT_EQ(sendResult, TftpClientOperationResult::TFTP_CLIENT_OK);
+    ASSERT_EQ(std::string((const char *) first.getData(), first.getSize()), content);
+    ASSERT_EQ(std::string((const char *) second.getData(), second.getSize()), content);
+    ASSERT_EQ(received, content);
+    ASSERT_EQ(cacheHits, 1u);
+    ASSERT_EQ(serverPlain, 3 * content.size());
+    ASSERT_EQ(clientPlain, 3 * content.size());
+    ASSERT_EQ(serverCompressed, clientCompressed);
+    ASSERT_LT(clientCompressed * 4, clientPlain);
+}
+
+TftpServerOperationResult NamesSeen_openFileCbk(
+    ITFTPSection *sectionHandler,
+    FILE **fd,
+    char *filename,
+    char *mode,
+    size_t *fileSize,
+    void *context)
+{
+    std::vector<std::string> *names = (std::vector<std::string> *)context;
+    names->push_back(filename);
+    *fd = fopen(filename, mode);
+    return *fd != NULL ? TftpServerOperationResult::TFTP_SERVER_OK :
+                         TftpServerOperationResult::TFTP_SERVER_ERROR;
+}
+
+TEST(TFTPClientServer, CompressionFallsBackToPlainTransfer)
+{
+    ITFTPServer *server = new TFTPServer();
+    ITFTPClient *client = new TFTPClient();
+    std::vector<std::string> names;
+
+    std::vector<char> content(3 * 512 + 10, 'x');
+    FILE *fp = fopen(FILENAME_DISK_DISK_SEND, "w");
+    fwrite(content.data(), 1, content.size(), fp);
+    fclose(fp);
+
+    server->setPort(PORT);
+    server->setTimeout(TIMEOUT);
+    server->setDrainTimeout(TIMEOUT * 1000);
+    server->registerOpenFileCallback(NamesSeen_openFileCbk, &names);
+    server->registerCloseFileCallback(
+        ClientMemoryServerMemoryCommunication_closeFileCbk, nullptr);
+    std::thread serverThread([&]()
+                             { server->startListening(); });
+
+    client->setConnection(LOCALHOST, PORT);
+    client->setCompression(true);
+
+    TFTPMappedSink sink;
+    sink.openAnonymous(content.size());
+    TftpClientOperationResult result =
+        client->fetchFile(FILENAME_DISK_DISK_SEND, sink);
+
+    server->stopListening();
+    serverThread.join();
+
+    uint64_t clientPlain, clientCompressed;
+    client->getCompressionStats(&clientPlain, &clientCompressed);
+
+    delete server;
+    delete client;
+
+    ASSERT_EQ(result, TftpClientOperationResult::TFTP_CLIENT_OK);
+    ASSERT_EQ(sink.getSize(), content.size());
+    ASSERT_EQ(memcmp(sink.getData(), content.data(), content.size()), 0);
+    ASSERT_EQ(clientPlain, 0u);
+    ASSERT_EQ(clientCompressed, 0u);
+    // The probe never reaches the open callback.
+    ASSERT_EQ(names, std::vector<std::string>(1, FILENAME_DISK_DISK_SEND));
+}
+
+/*
+ *******************************************************************************
+ *                                    DELTA                                    *
+ *******************************************************************************
+ */
+
+static std::string applyDelta(
+    const std::vector<char> &delta,
+    const std::vector<char> &base,
+    bool *ok)
+{
+    char *buffer = NULL;
+    size_t size = 0;
+    FILE *target = open_memstream(&buffer, &size);
+    TFTPBlockHashes baseSum;
+    TFTPDelta::hash(base.data(), base.size(), baseSum);
+    FILE *baseFile = fmemopen((void *)base.data(), base.size(), "r");
+    TFTPDeltaStream deltaStream;
+    FILE *stream = deltaStream.open(target, baseFile, baseSum);
+    *ok = fwrite(delta.data(), 1, delta.size(), stream) == delta.size();
+    *ok = fclose(stream) == 0 && *ok;
+    fclose(baseFile);
+    fclose(target);
+    std::string result(buffer, size);
+    free(buffer);
+    return result;
+}
+
+TEST(TFTPDelta, RebuildsOnlyOnItsBase)
+{
+    std::vector<char> base(10 * TFTP_DELTA_BLOCK_SIZE + 123);
+    for (size_t i = 0; i < base.size(); i++) {
+        base[i] = (char) (i * 7 + i / 1000);
+    }
+    std::vector<char> content(base);
+    content[3 * TFTP_DELTA_BLOCK_SIZE + 5] ^= 1;
+    content.insert(content.end(), 5000, 'z');
+
+    TFTPBlockHashes hashes, decoded;
+    std::vector<char> encoded, delta;
+    TFTPDelta::hash(base.data(), base.size(), hashes);
+    TFTPDelta::encodeHashes(hashes, encoded);
+    ASSERT_TRUE(TFTPDelta::decodeHashes(encoded.data(), encoded.size(), decoded));
+    TFTPDelta::encodeDelta(content.data(), content.size(), decoded, delta);
+    // The changed block, the old short last block and the tail.
+    ASSERT_LT(delta.size(), 4 * TFTP_DELTA_BLOCK_SIZE);
+
+    bool ok = false;
+    std::string rebuilt = applyDelta(delta, base, &ok);
+    ASSERT_TRUE(ok);
+    ASSERT_EQ(rebuilt, std::string(content.data(), content.size()));
+
+    std::vector<char> other(base);
+    other[0] ^= 1;
+    applyDelta(delta, other, &ok);
+    ASSERT_FALSE(ok);
+}
+
+TEST(TFTPClientServer, DeltaSend)
+{
+    ITFTPServer *server = new TFTPServer();
+    ITFTPClient *client = new TFTPClient();
+
+    std::vector<char> base(64 * TFTP_DELTA_BLOCK_SIZE);
+    for (size_t i = 0; i < base.size(); i++) {
+        base[i] = (char) (i * 131 + i / 4096);
+    }
+    FILE *fp = fopen(FILENAME_DISK_DISK_RECEIVE, "w");
+    fwrite(base.data(), 1, base.size(), fp);
+    fclose(fp);
+    remove(FILENAME_DISK_DISK_SEND);
+
+    std::vector<char> content(base);
+    content[10 * TFTP_DELTA_BLOCK_SIZE] ^= 1;
+    content[40 * TFTP_DELTA_BLOCK_SIZE + 7] ^= 1;
+
+    server->setPort(PORT);
+    server->setTimeout(TIMEOUT);
+    server->setDrainTimeout(TIMEOUT * 1000);
+    server->setDeltaTransfer(true);
+    std::thread serverThread([&]()
+                             { server->startListening(); });
+
+    client->setConnection(LOCALHOST, PORT);
+    client->setDeltaTransfer(true);
+
+    // A regular file, its delta is built by reading it where needed.
+    fp = tmpfile();
+    fwrite(content.data(), 1, content.size(), fp);
+    rewind(fp);
+    TftpClientOperationResult deltaResult =
+        client->sendFile(FILENAME_DISK_DISK_RECEIVE, fp);
+    fclose(fp);
+    uint64_t fileBytes, sentBytes;
+    client->getDeltaStats(&fileBytes, &sentBytes);
+
+    // No copy on the server, the whole file is sent.
+    fp = fmemopen(content.data(), content.size(), "r");
+    TftpClientOperationResult fullResult =
+        client->sendFile(FILENAME_DISK_DISK_SEND, fp);
+    fclose(fp);
+    uint64_t fullFileBytes, fullSentBytes;
+    client->getDeltaStats(&fullFileBytes, &fullSentBytes);
+
+    server->stopListening();
+    serverThread.join();
+    delete server;
+    delete client;
+
+    std::vector<char> received, receivedFull;
+    fp = fopen(FILENAME_DISK_DISK_RECEIVE, "r");
+    ASSERT_TRUE(TFTPDelta::readAll(fp, received));
+    fclose(fp);
+    fp = fopen(FILENAME_DISK_DISK_SEND, "r");
+    ASSERT_TRUE(TFTPDelta::readAll(fp, receivedFull));
+    fclose(fp);
+
+    ASSERT_EQ(deltaResult, TftpClientOperationResult::TFTP_CLIENT_OK);
+    ASSERT_EQ(fullResult, TftpClientOperationResult::TFTP_CLIENT_OK);
+    ASSERT_TRUE(received == content);
+    ASSERT_TRUE(receivedFull == content);
+    ASSERT_EQ(fileBytes, content.size());
+    ASSERT_LT(sentBytes * 10, fileBytes);
+    ASSERT_EQ(fullSentBytes - sentBytes, content.size());
+}
+
+TEST(TFTPClientServer, DeltaKeepsTargetUntilRebuilt)
+{
+    std::vector<char> base(16 * TFTP_DELTA_BLOCK_SIZE);
+    for (size_t i = 0; i < base.size(); i++) {
+        base[i] = (char) (i * 13 + i / 4096);
+    }
+    std::vector<char> stale(base);
+    stale[0] ^= 1;
+    std::vector<char> content(base);
+    content[5 * TFTP_DELTA_BLOCK_SIZE] ^= 1;
+
+    TFTPBlockHashes baseHashes, staleHashes;
+    TFTPDelta::hash(base.data(), base.size(), baseHashes);
+    TFTPDelta::hash(stale.data(), stale.size(), staleHashes);
+    std::vector<char> goodDelta, staleDelta;
+    TFTPDelta::encodeDelta(content.data(), content.size(), baseHashes, goodDelta);
+    TFTPDelta::encodeDelta(content.data(), content.size(), staleHashes, staleDelta);
+    std::string deltaName = std::string(FILENAME_DISK_DISK_RECEIVE) + TFTP_DELTA_SUFFIX;
+
+    // Files the server opens itself, then files of the open file callback.
+    for (int withCallbacks = 0; withCallbacks < 2; withCallbacks++)
+    {
+        FILE *fp = fopen(FILENAME_DISK_DISK_RECEIVE, "w");
+        fwrite(base.data(), 1, base.size(), fp);
+        fclose(fp);
+
+        ITFTPServer *server = new TFTPServer();
+        ITFTPClient *client = new TFTPClient();
+        std::vector<std::string> names;
+        server->setPort(PORT);
+        server->setTimeout(TIMEOUT);
+        server->setDrainTimeout(TIMEOUT * 1000);
+        server->setDeltaTransfer(true);
+        if (withCallbacks)
+        {
+            server->registerOpenFileCallback(NamesSeen_openFileCbk, &names);
+            server->registerCloseFileCallback(
+                ClientMemoryServerMemoryCommunication_closeFileCbk, nullptr);
+        }
+        std::thread serverThread([&]()
+                                 { server->startListening(); });
+        client->setConnection(LOCALHOST, PORT);
+
+        // Whether the client hears of the rejection is up to the engine, the
+        // file on disk is what matters.
+        client->sendBuffer(deltaName.c_str(), staleDelta.data(), staleDelta.size());
+        std::vector<char> afterStale;
+        fp = fopen(FILENAME_DISK_DISK_RECEIVE, "r");
+        TFTPDelta::readAll(fp, afterStale);
+        fclose(fp);
+
+        TftpClientOperationResult goodResult = client->sendBuffer(
+            deltaName.c_str(), goodDelta.data(), goodDelta.size());
+
+        server->stopListening();
+        serverThread.join();
+        delete server;
+        delete client;
+
+        std::vector<char> afterGood;
+        fp = fopen(FILENAME_DISK_DISK_RECEIVE, "r");
+        TFTPDelta::readAll(fp, afterGood);
+        fclose(fp);
+
+        ASSERT_TRUE(afterStale == base);
+        ASSERT_EQ(goodResult, TftpClientOperationResult::TFTP_CLIENT_OK);
+        ASSERT_TRUE(afterGood == content);
+    }
+}
+
+/*
+ *******************************************************************************
+ *                               MEMORY BUFFERS                                *
+ *******************************************************************************
+ */
+
+TEST(TFTPClientServer, SendAndFetchBuffers)
+{
+    ITFTPServer *server = new TFTPServer();
+    ITFTPClient *client = new TFTPClient();
+
+    // Far past BUFSIZE, and not a whole number of blocks.
+    std::vector<uint8_t> content(64 * 1024 + 77);
+    for (size_t i = 0; i < content.size(); i++)
+    {
+        content[i] = (uint8_t)(i * 131 + i / 512);
+    }
+
+    server->setPort(PORT);
+    server->setTimeout(TIMEOUT);
+    std::thread serverThread([&]()
+                             { server->startListening(); });
+
+    client->setConnection(LOCALHOST, PORT);
+    TftpClientOperationResult sendResult =
+        client->sendBuffer(FILENAME_DISK_DISK_SEND, content.data(), content.size());
+    TftpClientOperationResult emptyResult =
+        client->sendBuffer(FILENAME_DISK_DISK_RECEIVE, nullptr, 0);
+
+    std::vector<uint8_t> received(16, 0xff);
+    TftpClientOperationResult fetchResult =
+        client->fetchToBuffer(FILENAME_DISK_DISK_SEND, received);
+    std::vector<uint8_t> empty(16, 0xff);
+    TftpClientOperationResult fetchEmptyResult =
+        client->fetchToBuffer(FILENAME_DISK_DISK_RECEIVE, empty);
+    std::vector<uint8_t> missing(16, 0xff);
+    TftpClientOperationResult missingResult =
+        client->fetchToBuffer("no_such_file.bin", missing);
+
+    server->stopListening();
+    serverThread.join();
+    delete server;
+    delete client;
+
+    ASSERT_EQ(sendResult, TftpClientOperationResult::TFTP_CLIENT_OK);
+    ASSERT_EQ(emptyResult, TftpClientOperationResult::TFTP_CLIENT_OK);
+    ASSERT_EQ(fetchResult, TftpClientOperationResult::TFTP_CLIENT_OK);
+    ASSERT_EQ(fetchEmptyResult, TftpClientOperationResult::TFTP_CLIENT_OK);
+    ASSERT_EQ(missingResult, TftpClientOperationResult::TFTP_CLIENT_ERROR);
+    ASSERT_TRUE(received == content);
+    ASSERT_TRUE(empty.empty());
+    ASSERT_TRUE(missing.empty());
+}
+
+struct ProgressReport
+{
+    TftpClientTransferDirection direction;
+    uint64_t bytes;
+    int64_t totalBytes;
+};
+
+static void recordProgress(
+    TftpClientTransferDirection direction,
+    uint64_t bytes,
+    int64_t totalBytes,
+    void *context)
+{
+    std::vector<ProgressReport> *reports = (std::vector<ProgressReport> *)context;
+    reports->push_back({direction, bytes, totalBytes});
+}
+
+TEST(TFTPClientServer, ProgressCallbacks)
+{
+    ITFTPServer *server = new TFTPServer();
+    ITFTPClient *client = new TFTPClient();
+
+    std::vector<uint8_t> content(40 * 1024 + 77, 'p');
+    std::vector<ProgressReport> sendReports, fetchReports, blockReports;
+
+    server->setPort(PORT);
+    server->setTimeout(TIMEOUT);
+    std::thread serverThread([&]()
+                             { server->startListening(); });
+
+    client->setConnection(LOCALHOST, PORT);
+    client->setProgressThreshold(8 * 1024, 0);
+    client->registerTftpProgressCallback(recordProgress, &sendReports);
+    TftpClientOperationResult sendResult =
+        client->sendBuffer(FILENAME_DISK_DISK_SEND, content.data(), content.size());
+    client->registerTftpProgressCallback(recordProgress, &fetchReports);
+    std::vector<uint8_t> received;
+    TftpClientOperationResult fetchResult =
+        client->fetchToBuffer(FILENAME_DISK_DISK_SEND, received);
+    client->setProgressThreshold(0, 0);
+    client->registerTftpProgressCallback(recordProgress, &blockReports);
+    TftpClientOperationResult blockResult =
+        client->fetchToBuffer(FILENAME_DISK_DISK_SEND, received);
+
+    server->stopListening();
+    serverThread.join();
+    delete server;
+    delete client;
+
+    ASSERT_EQ(sendResult, TftpClientOperationResult::TFTP_CLIENT_OK);
+    ASSERT_EQ(fetchResult, TftpClientOperationResult::TFTP_CLIENT_OK);
+    ASSERT_EQ(blockResult, TftpClientOperationResult::TFTP_CLIENT_OK);
+
+    // One report per 8 KiB, and the last one for the tail.
+    ASSERT_EQ(sendReports.size(), 6u);
+    ASSERT_EQ(fetchReports.size(), 6u);
+    for (size_t i = 0; i < sendReports.size(); i++)
+    {
+        ASSERT_EQ(sendReports[i].direction, TftpClientTransferDirection::TFTP_CLIENT_TRANSFER_SEND);
+        ASSERT_EQ(sendReports[i].totalBytes, (int64_t)content.size());
+        ASSERT_EQ(fetchReports[i].direction, TftpClientTransferDirection::TFTP_CLIENT_TRANSFER_FETCH);
+        ASSERT_EQ(fetchReports[i].totalBytes, -1);
+        ASSERT_TRUE(i == 0 || sendReports[i].bytes > sendReports[i - 1].bytes);
+    }
+    ASSERT_EQ(sendReports.back().bytes, content.size());
+    ASSERT_EQ(fetchReports.back().bytes, content.size());
+    ASSERT_EQ(blockReports.size(), content.size() / 512 + 1);
+    ASSERT_EQ(blockReports.back().bytes, content.size());
+}
+
+/*
+ *******************************************************************************
+ *                                SECTION TABLE                                *
+ *******************************************************************************
+ */
+
+#define SLOW_FILE_BLOCKS 20
+
+static ssize_t slowRead(
+    void *cookie,
+    char *buffer,
+    size_t size)
+{
+    int *blocksLeft = (int *)cookie;
+    if (*blocksLeft == 0)
+    {
+        return 0;
+    }
+    (*blocksLeft)--;
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    size = std::min<size_t>(size, 512);
+    memset(buffer, 'x', size);
+    return size;
+}
+
+TftpServerOperationResult ListSections_openFileCbk(
+    ITFTPSection *sectionHandler,
+    FILE **fd,
+    char *filename,
+    char *mode,
+    size_t *fileSize,
+    void *context)
+{
+    cookie_io_functions_t functions;
+    memset(&functions, 0, sizeof(functions));
+    functions.read = slowRead;
+    *fd = fopencookie(context, "r", functions);
+    return TftpServerOperationResult::TFTP_SERVER_OK;
+}
+
+TEST(TFTPClientServer, ListSections)
+{
+    ITFTPServer *server = new TFTPServer();
+    ITFTPClient *client = new TFTPClient();
+    int blocksLeft = SLOW_FILE_BLOCKS;
+
+    server->setPort(PORT);
+    server->setTimeout(TIMEOUT);
+    server->registerOpenFileCallback(ListSections_openFileCbk, &blocksLeft);
+    server->registerCloseFileCallback(
+        ClientMemoryServerMemoryCommunication_closeFileCbk, nullptr);
+    std::thread serverThread([&]()
+                             { server->startListening(); });
+
+    client->setConnection(LOCALHOST, PORT);
+    std::vector<uint8_t> received;
+    std::thread fetchThread([&]()
+                            { client->fetchToBuffer(FILENAME_MEM_MEM, received); });
+
+    TFTPSectionInfo seen;
+    bool found = false;
+    for (int i = 0; i < 200 && !found; i++)
+    {
+        std::vector<TFTPSectionInfo> sections;
+        server->listSections(sections);
+        found = sections.size() == 1 && sections[0].bytes >= 4 * 512;
+        if (found)
+        {
+            seen = sections[0];
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    fetchThread.join();
+    // The section ends on the server shortly after the client is done.
+    std::vector<TFTPSectionInfo> after;
+    for (int i = 0; i < 100; i++)
+    {
+        server->listSections(after);
+        if (after.empty())
+        {
+            break;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+
+    server->stopListening();
+    serverThread.join();
+    delete server;
+    delete client;
+
+    ASSERT_TRUE(found);
+    ASSERT_EQ(seen.filename, FILENAME_MEM_MEM);
+    ASSERT_EQ(seen.clientIp, LOCALHOST);
+    ASSERT_EQ(seen.serverPort, PORT);
+    ASSERT_EQ(seen.direction, TftpTransferDirection::TFTP_TRANSFER_READ);
+    ASSERT_LT(seen.bytes, (uint64_t)SLOW_FILE_BLOCKS * 512);
+    ASSERT_GT(seen.bytesPerSecond, 0);
+    ASSERT_GT(seen.ageMs, 0u);
+    ASSERT_EQ(seen.window, 1);
+    ASSERT_EQ(received.size(), (size_t)SLOW_FILE_BLOCKS * 512);
+    ASSERT_TRUE(after.empty());
+}
+
+/*
+ *******************************************************************************
+ *                              ADMISSION CONTROL                              *
+ *******************************************************************************
+ */
+
+struct AdmissionContext
+{
+    int blocksLeft[3];
+    std::atomic<int> opened;
+};
+
+TftpServerOperationResult Admission_openFileCbk(
+    ITFTPSection *sectionHandler,
+    FILE **fd,
+    char *filename,
+    char *mode,
+    size_t *fileSize,
+    void *context)
+{
+    AdmissionContext *ctx = (AdmissionContext *)context;
+    cookie_io_functions_t functions;
+    memset(&functions, 0, sizeof(functions));
+    functions.read = slowRead;
+    *fd = fopencookie(&ctx->blocksLeft[ctx->opened++ % 3], "r", functions);
+    return TftpServerOperationResult::TFTP_SERVER_OK;
+}
+
+TEST(TFTPClientServer, AdmissionControl)
+{
+    ITFTPServer *server = new TFTPServer();
+    ITFTPClient *first = new TFTPClient();
+    ITFTPClient *queued = new TFTPClient();
+    ITFTPClient *rejected = new TFTPClient();
+    AdmissionContext admission;
+    ClientServerContext context;
+    for (int &blocks : admission.blocksLeft)
+    {
+        blocks = SLOW_FILE_BLOCKS;
+    }
+    admission.opened = 0;
+
+    server->setPort(PORT);
+    server->setTimeout(TIMEOUT);
+    server->setAdmissionLimits(1, 0, 1, 2000);
+    server->setAdmissionRejectMessage("WAIT:2");
+    server->registerOpenFileCallback(Admission_openFileCbk, &admission);
+    server->registerCloseFileCallback(
+        ClientMemoryServerMemoryCommunication_closeFileCbk, nullptr);
+    std::thread serverThread([&]()
+                             { server->startListening(); });
+
+    first->setConnection(LOCALHOST, PORT);
+    queued->setConnection(LOCALHOST, PORT);
+    rejected->setConnection(LOCALHOST, PORT);
+    rejected->registerTftpErrorCallback(
+        CustomTftpErrorMessage_tftpErrorCbk, &context);
+
+    std::vector<uint8_t> firstData, queuedData, rejectedData;
+    TftpClientOperationResult firstResult, queuedResult;
+    std::thread firstThread([&]()
+                            { firstResult = first->fetchToBuffer(FILENAME_MEM_MEM, firstData); });
+    for (int i = 0; i < 100 && admission.opened == 0; i++)
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    }
+    std::thread queuedThread([&]()
+                             { queuedResult = queued->fetchToBuffer(FILENAME_MEM_MEM, queuedData); });
+    uint64_t queuedCount = 0;
+    for (int i = 0; i < 100 && queuedCount == 0; i++)
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(5));
+        server->getAdmissionStats(&queuedCount, nullptr);
+    }
+
+    // The queue is full, the answer comes without waiting for a slot.
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    TftpClientOperationResult rejectedResult =
+        rejected->fetchToBuffer(FILENAME_MEM_MEM, rejectedData);
+    std::chrono::steady_clock::duration rejectTime = std::chrono::steady_clock::now() - start;
+
+    firstThread.join();
+    queuedThread.join();
+    uint64_t rejectedCount = 0;
+    server->getAdmissionStats(&queuedCount, &rejectedCount);
+
+    server->stopListening();
+    serverThread.join();
+    delete server;
+    delete first;
+    delete queued;
+    delete rejected;
+
+    ASSERT_EQ(firstResult, TftpClientOperationResult::TFTP_CLIENT_OK);
+    ASSERT_EQ(queuedResult, TftpClientOperationResult::TFTP_CLIENT_OK);
+    ASSERT_EQ(rejectedResult, TftpClientOperationResult::TFTP_CLIENT_ERROR);
+    ASSERT_EQ(firstData.size(), (size_t)SLOW_FILE_BLOCKS * 512);
+    ASSERT_EQ(queuedData.size(), (size_t)SLOW_FILE_BLOCKS * 512);
+    ASSERT_EQ(context.tftpErrorMsg, "WAIT:2");
+    ASSERT_LT(rejectTime, std::chrono::milliseconds(200));
+    ASSERT_EQ(queuedCount, 1u);
+    ASSERT_EQ(rejectedCount, 1u);
+    ASSERT_EQ(admission.opened, 2);
+}
+
+struct AdmissionCallbacks
+{
+    std::atomic<int> started;
+    std::atomic<int> finished;
+};
+
+TftpServerOperationResult Admission_sectionStartedCbk(
+    ITFTPSection *sectionHandler,
+    void *context)
+{
+    ((AdmissionCallbacks *)context)->started++;
+    return TftpServerOperationResult::TFTP_SERVER_OK;
+}
+
+TftpServerOperationResult Admission_sectionFinishedCbk(
+    ITFTPSection *sectionHandler,
+    void *context)
+{
+    ((AdmissionCallbacks *)context)->finished++;
+    return TftpServerOperationResult::TFTP_SERVER_OK;
+}
+
+TEST(TFTPClientServer, AdmissionCountsRequestBytes)
+{
+    ITFTPServer *server = new TFTPServer();
+    ITFTPClient *first = new TFTPClient();
+    ITFTPClient *rejected = new TFTPClient();
+    AdmissionCallbacks callbacks;
+    ClientServerContext context;
+    callbacks.started = 0;
+    callbacks.finished = 0;
+
+    // Two reads of the file don't fit the limit, one does.
+    std::vector<char> content(16 * 1024 * 1024, 'a');
+    server->setPort(PORT);
+    server->setTimeout(TIMEOUT);
+    server->setAdmissionLimits(0, 24 * 1024 * 1024, 0, 0);
+    server->registerVirtualFile(FILENAME_MEM_MEM, content.data(), content.size());
+    server->registerSectionStartedCallback(Admission_sectionStartedCbk, &callbacks);
+    server->registerSectionFinishedCallback(Admission_sectionFinishedCbk, &callbacks);
+    std::thread serverThread([&]()
+                             { server->startListening(); });
+
+    first->setConnection(LOCALHOST, PORT);
+    rejected->setConnection(LOCALHOST, PORT);
+    rejected->registerTftpErrorCallback(
+        CustomTftpErrorMessage_tftpErrorCbk, &context);
+
+    std::vector<uint8_t> firstData, rejectedData;
+    TftpClientOperationResult firstResult;
+    std::thread firstThread([&]()
+                            { firstResult = first->fetchToBuffer(FILENAME_MEM_MEM, firstData); });
+    std::vector<TFTPSectionInfo> sections;
+    for (int i = 0; i < 1000 && sections.empty(); i++)
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        server->listSections(sections);
+    }
+
+    TftpClientOperationResult rejectedResult =
+        rejected->fetchToBuffer(FILENAME_MEM_MEM, rejectedData);
+    firstThread.join();
+    uint64_t rejectedCount = 0;
+    server->getAdmissionStats(nullptr, &rejectedCount);
+
+    server->stopListening();
+    serverThread.join();
+    delete server;
+    delete first;
+    delete rejected;
+
+    ASSERT_EQ(firstResult, TftpClientOperationResult::TFTP_CLIENT_OK);
+    ASSERT_EQ(firstData.size(), content.size());
+    ASSERT_EQ(rejectedResult, TftpClientOperationResult::TFTP_CLIENT_ERROR);
+    ASSERT_EQ(context.tftpErrorMsg, WAIT_TFTP_MSG);
+    ASSERT_EQ(rejectedCount, 1u);
+    ASSERT_EQ(callbacks.started, 1);
+    ASSERT_EQ(callbacks.finished, 1);
+}
+
+/*
+ *******************************************************************************
+ *                                 DURABILITY                                  *
+ *******************************************************************************
+ */
+
+static std::string readWholeFile(
+    const char *filename)
+{
+    std::vector<char> content;
+    FILE *fp = fopen(filename, "r");
+    if (fp != NULL)
+    {
+        TFTPDelta::readAll(fp, content);
+        fclose(fp);
+    }
+    return std::string(content.begin(), content.end());
+}
+
+TEST(TFTPClientServer, DurabilityModes)
+{
+    const TftpDurabilityMode modes[] = {
+        TftpDurabilityMode::TFTP_DURABILITY_FDATASYNC,
+        TftpDurabilityMode::TFTP_DURABILITY_GROUP_COMMIT,
+        TftpDurabilityMode::TFTP_DURABILITY_ATOMIC_RENAME};
+    const int clients = 3;
+
+    for (TftpDurabilityMode mode : modes)
+    {
+        ITFTPServer *server = new TFTPServer();
+        server->setPort(PORT);
+        server->setTimeout(TIMEOUT);
+        server->setDrainTimeout(TIMEOUT * 1000);
+        server->setDurabilityMode(mode);
+        server->setGroupCommitInterval(300);
+        std::thread serverThread([&]()
+                                 { server->startListening(); });
+
+        std::vector<std::thread> uploads;
+        std::atomic<int> uploaded(0);
+        for (int i = 0; i < clients; i++)
+        {
+            uploads.push_back(std::thread([&, i]()
+                                          {
+                TFTPClient client;
+                client.setConnection(LOCALHOST, PORT);
+                std::string name = "durability_" + std::to_string(i) + ".txt";
+                std::string content = DISK_DISK_MSG + name;
+                FILE *fp = fmemopen(&content[0], content.size(), "r");
+                if (client.sendFile(name.c_str(), fp) == TftpClientOperationResult::TFTP_CLIENT_OK)
+                {
+                    uploaded++;
+                }
+                fclose(fp); }));
+        }
+        for (std::thread &upload : uploads)
+        {
+            upload.join();
+        }
+
+        server->stopListening();
+        serverThread.join();
+        uint64_t files, syncs, failed;
+        server->getDurabilityStats(&files, &syncs, &failed);
+        TFTPLatencySummary summary;
+        server->getLatencySummary(TftpLatencyMetric::TFTP_LATENCY_DURABILITY, &summary);
+        delete server;
+
+        ASSERT_EQ(uploaded, clients);
+        for (int i = 0; i < clients; i++)
+        {
+            std::string name = "durability_" + std::to_string(i) + ".txt";
+            ASSERT_EQ(readWholeFile(name.c_str()), DISK_DISK_MSG + name);
+            remove(name.c_str());
+        }
+        ASSERT_EQ(files, (uint64_t)clients);
+        ASSERT_EQ(failed, 0u);
+        ASSERT_EQ(summary.count, (uint64_t)clients);
+        if (mode == TftpDurabilityMode::TFTP_DURABILITY_GROUP_COMMIT)
+        {
+            // Concurrent uploads share syncs.
+            ASSERT_LT(syncs, (uint64_t)clients);
+        }
+        else
+        {
+            ASSERT_GE(syncs, (uint64_t)clients);
+        }
+    }
+}
+
+TftpServerOperationResult FailedRename_sectionFinishedCbk(
+    ITFTPSection *sectionHandler,
+    void *context)
+{
+    std::atomic<int> *status = (std::atomic<int> *)context;
+    TftpServerSectionStatus sectionStatus;
+    sectionHandler->getSectionStatus(&sectionStatus);
+    *status = (int)sectionStatus;
+    return TftpServerOperationResult::TFTP_SERVER_OK;
+}
+
+TEST(TFTPClientServer, DurabilityReportsFailedRename)
+{
+    // A directory where the file goes, the upload can't be renamed over it.
+    const char *name = "durability_dir";
+    ASSERT_EQ(mkdir(name, 0755), 0);
+
+    ITFTPServer *server = new TFTPServer();
+    server->setPort(PORT);
+    server->setTimeout(TIMEOUT);
+    server->setDrainTimeout(TIMEOUT * 1000);
+    server->setDurabilityMode(TftpDurabilityMode::TFTP_DURABILITY_ATOMIC_RENAME);
+    std::atomic<int> status(-1);
+    server->registerSectionFinishedCallback(FailedRename_sectionFinishedCbk, &status);
+    std::thread serverThread([&]()
+                             { server->startListening(); });
+
+    TFTPClient client;
+    client.setConnection(LOCALHOST, PORT);
+    std::string content = DISK_DISK_MSG;
+    client.sendBuffer(name, &content[0], content.size());
+
+    server->stopListening();
+    serverThread.join();
+    uint64_t files, syncs, failed;
+    server->getDurabilityStats(&files, &syncs, &failed);
+    delete server;
+
+    struct stat info;
+    bool isDirectory = stat(name, &info) == 0 && S_ISDIR(info.st_mode);
+    DIR *directory = opendir(".");
+    bool leftTemp = false;
+    struct dirent *entry;
+    while ((entry = readdir(directory)) != NULL)
+    {
+        leftTemp |= strncmp(entry->d_name, "durability_dir.tftp-", 20) == 0;
+    }
+    closedir(directory);
+    rmdir(name);
+
+    ASSERT_EQ(status, (int)TftpServerSectionStatus::TFTP_SERVER_SECTION_ERROR);
+    ASSERT_EQ(files, 0u);
+    ASSERT_EQ(failed, 1u);
+    ASSERT_TRUE(isDirectory);
+    ASSERT_FALSE(leftTemp);
+}
+
+/*
+ *******************************************************************************
+ *                               LOCAL TRANSPORT                               *
+ *******************************************************************************
+ */
+
+TEST(TFTPClientServer, LocalTransport)
+{
+    ITFTPServer *server = new TFTPServer();
+    ITFTPClient *client = new TFTPClient();
+    ClientServerContext context;
+    ClientServerContext errorContext;
+    context.matchSection = 0;
+    errorContext.tftpErrorCode = -1;
+
+    // Whole blocks only, the empty last block must end the transfer.
+    std::vector<uint8_t> content(8 * 512);
+    for (size_t i = 0; i < content.size(); i++)
+    {
+        content[i] = (uint8_t)(i * 7 + i / 512);
+    }
+
+    server->setPort(PORT);
+    server->setTimeout(TIMEOUT);
+    server->registerSectionStartedCallback(
+        ClientDiskServerDiskCommunication_sectionStartedCbk, &context);
+    server->registerSectionFinishedCallback(
+        ClientDiskServerDiskCommunication_sectionFinishedCbk, &context);
+    std::thread serverThread([&]()
+                             { server->startListening(); });
+
+    // Until then, transfers would go over UDP.
+    for (int i = 0; i < 100 && !TFTPLocalTransport::isServed(PORT); i++)
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    }
+    client->setConnection(LOCALHOST, PORT);
+    client->setTransport(TftpClientTransport::TFTP_CLIENT_TRANSPORT_LOCAL);
+    client->registerTftpErrorCallback(
+        CustomTftpErrorMessage_tftpErrorCbk, &errorContext);
+    TftpClientOperationResult sendResult =
+        client->sendBuffer(FILENAME_DISK_DISK_SEND, content.data(), content.size());
+    // Set by the server before the client returns, no waiting needed.
+    SectionId sendId = context.sectionId;
+    TftpServerSectionStatus sendStatus = context.status;
+
+    std::vector<uint8_t> received;
+    TftpClientOperationResult fetchResult =
+        client->fetchToBuffer(FILENAME_DISK_DISK_SEND, received);
+    int fetchMatched = context.matchSection;
+    std::string fetchIp = context.clientIp;
+
+    std::vector<uint8_t> missing;
+    TftpClientOperationResult missingResult =
+        client->fetchToBuffer("no_such_file.bin", missing);
+    TftpServerSectionStatus missingStatus = context.status;
+
+    server->stopListening();
+    serverThread.join();
+    delete server;
+    delete client;
+
+    ASSERT_EQ(sendResult, TftpClientOperationResult::TFTP_CLIENT_OK);
+    ASSERT_EQ(fetchResult, TftpClientOperationResult::TFTP_CLIENT_OK);
+    ASSERT_EQ(missingResult, TftpClientOperationResult::TFTP_CLIENT_ERROR);
+    ASSERT_TRUE(received == content);
+    ASSERT_EQ(readWholeFile(FILENAME_DISK_DISK_SEND).size(), content.size());
+    // Local sections are numbered apart from the engine's.
+    ASSERT_GE(sendId, 1ULL << 62);
+    ASSERT_EQ(sendStatus, TftpServerSectionStatus::TFTP_SERVER_SECTION_OK);
+    ASSERT_EQ(fetchMatched, 1);
+    ASSERT_EQ(fetchIp, LOCALHOST);
+    ASSERT_EQ(missingStatus, TftpServerSectionStatus::TFTP_SERVER_SECTION_ERROR);
+    ASSERT_EQ(errorContext.tftpErrorCode, 1);
+    ASSERT_EQ(errorContext.tftpErrorMsg, "File not found");
+}
+
+/*
+ *******************************************************************************
+ *                               LARGE FILE MODE                               *
+ *******************************************************************************
+ */
+
+static size_t residentPages(
+    const char *filename)
+{
+    size_t resident = 0;
+    FILE *fp = fopen(filename, "r");
+    struct stat info;
+    if (fp != NULL && fstat(fileno(fp), &info) == 0 && info.st_size > 0)
+    {
+        void *mapped = mmap(NULL, info.st_size, PROT_READ, MAP_SHARED, fileno(fp), 0);
+        if (mapped != MAP_FAILED)
+        {
+            long page = sysconf(_SC_PAGESIZE);
+            std::vector<unsigned char> pages((info.st_size + page - 1) / page);
+            if (mincore(mapped, info.st_size, pages.data()) == 0)
+            {
+                for (unsigned char flag : pages)
+                {
+                    resident += flag & 1;
+                }
+            }
+            munmap(mapped, info.st_size);
+        }
+    }
+    if (fp != NULL)
+    {
+        fclose(fp);
+    }
+    return resident;
+}
+
+TftpServerOperationResult LargeFile_sectionFinishedCbk(
+    ITFTPSection *sectionHandler,
+    void *context)
+{
+    std::atomic<int> *finished = (std::atomic<int> *)context;
+    (*finished)++;
+    return TftpServerOperationResult::TFTP_SERVER_OK;
+}
+
+TEST(TFTPClientServer, LargeFileMode)
+{
+    ITFTPServer *server = new TFTPServer();
+    ITFTPClient *client = new TFTPClient();
+
+    // Over one buffer, with an unaligned tail.
+    std::vector<uint8_t> content(3 * 1024 * 1024 + 1234);
+    for (size_t i = 0; i < content.size(); i++)
+    {
+        content[i] = (uint8_t)(i * 13 + i / 4096);
+    }
+    std::vector<uint8_t> small(content.begin(), content.begin() + 1000);
+
+    server->setPort(PORT);
+    server->setTimeout(TIMEOUT);
+    server->setLargeFileMode(1024 * 1024, true);
+    std::atomic<int> finished(0);
+    server->registerSectionFinishedCallback(LargeFile_sectionFinishedCbk, &finished);
+    std::thread serverThread([&]()
+                             { server->startListening(); });
+
+    // The tail of a written file lands when the server closes it, after
+    // the client is done.
+    auto waitFinished = [&](const int count)
+    {
+        for (int wait = 0; wait < 1000 && finished != count; wait++)
+        {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+    };
+
+    client->setConnection(LOCALHOST, PORT);
+    TftpClientOperationResult sendResult =
+        client->sendBuffer(FILENAME_DISK_DISK_SEND, content.data(), content.size());
+    waitFinished(1);
+    size_t residentAfterSend = residentPages(FILENAME_DISK_DISK_SEND);
+    std::vector<uint8_t> received;
+    TftpClientOperationResult fetchResult =
+        client->fetchToBuffer(FILENAME_DISK_DISK_SEND, received);
+    waitFinished(2);
+    size_t residentAfterFetch = residentPages(FILENAME_DISK_DISK_SEND);
+
+    std::vector<uint8_t> smallReceived;
+    TftpClientOperationResult smallSendResult =
+        client->sendBuffer(FILENAME_DISK_DISK_RECEIVE, small.data(), small.size());
+    waitFinished(3);
+    TftpClientOperationResult smallFetchResult =
+        client->fetchToBuffer(FILENAME_DISK_DISK_RECEIVE, smallReceived);
+
+    server->stopListening();
+    serverThread.join();
+    uint64_t files, bytes, buffered;
+    server->getLargeFileStats(&files, &bytes, &buffered);
+    delete server;
+    delete client;
+
+    ASSERT_EQ(sendResult, TftpClientOperationResult::TFTP_CLIENT_OK);
+    ASSERT_EQ(fetchResult, TftpClientOperationResult::TFTP_CLIENT_OK);
+    ASSERT_TRUE(received == content);
+    ASSERT_EQ(smallSendResult, TftpClientOperationResult::TFTP_CLIENT_OK);
+    ASSERT_EQ(smallFetchResult, TftpClientOperationResult::TFTP_CLIENT_OK);
+    ASSERT_TRUE(smallReceived == small);
+    // Only the large file counts, once each way.
+    ASSERT_EQ(files, 2u);
+    ASSERT_EQ(bytes, 2 * (uint64_t)content.size());
+    // Either way, the file mustn't be left in the page cache.
+    size_t pages = (content.size() + 4095) / 4096;
+    ASSERT_LT(residentAfterSend, pages / 4);
+    ASSERT_LT(residentAfterFetch, pages / 4);
+    (void)buffered;
+}
+
+/*
+ *******************************************************************************
+ *                               METADATA INDEX                                *
+ *******************************************************************************
+ */
+
+#define INDEX_DIRECTORY "tftp_index"
+#define INDEX_IMAGE INDEX_DIRECTORY "/image.bin"
+#define INDEX_OTHER INDEX_DIRECTORY "/other.bin"
+
+static void writeWholeFile(
+    const char *filename,
+    const std::vector<char> &content)
+{
+    FILE *fp = fopen(filename, "w");
+    if (fp != NULL)
+    {
+        fwrite(content.data(), 1, content.size(), fp);
+        fclose(fp);
+    }
+}
+
+// The index catches up with the filesystem in the background.
+static bool waitIndexed(
+    ITFTPServer *server,
+    const char *filename,
+    const uint32_t checksum,
+    const bool indexed)
+{
+    for (int wait = 0; wait < 1000; wait++)
+    {
+        TFTPFileMetadata metadata;
+        bool found = server->getFileMetadata(filename, metadata) ==
+                     TftpServerOperationResult::TFTP_SERVER_OK;
+        if (found == indexed && (!found || metadata.hashes.checksum == checksum))
+        {
+            return true;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    return false;
+}
+
+TEST(TFTPClientServer, MetadataIndex)
+{
+    mkdir(INDEX_DIRECTORY, 0755);
+    std::vector<char> base(16 * TFTP_DELTA_BLOCK_SIZE + 100);
+    for (size_t i = 0; i < base.size(); i++)
+    {
+        base[i] = (char)(i * 29 + i / 4096);
+    }
+    std::vector<char> content(base);
+    content[3 * TFTP_DELTA_BLOCK_SIZE] ^= 1;
+    writeWholeFile(INDEX_IMAGE, base);
+    writeWholeFile(INDEX_OTHER, content);
+    TFTPBlockHashes baseHashes, contentHashes;
+    TFTPDelta::hash(base.data(), base.size(), baseHashes);
+    TFTPDelta::hash(content.data(), content.size(), contentHashes);
+
+    ITFTPServer *server = new TFTPServer();
+    ITFTPClient *client = new TFTPClient();
+    server->setPort(PORT);
+    server->setTimeout(TIMEOUT);
+    server->setDrainTimeout(TIMEOUT * 1000);
+    server->setDeltaTransfer(true);
+    TftpServerOperationResult indexResult = server->setMetadataIndex(INDEX_DIRECTORY, 2);
+    uint64_t builtFiles = 0;
+    server->getMetadataIndexStats(&builtFiles, nullptr, nullptr);
+    TFTPFileMetadata built;
+    TftpServerOperationResult builtResult = server->getFileMetadata(INDEX_IMAGE, built);
+    std::thread serverThread([&]()
+                             { server->startListening(); });
+
+    // The hashes of the server's copy come from the index.
+    client->setConnection(LOCALHOST, PORT);
+    client->setDeltaTransfer(true);
+    FILE *fp = fmemopen(content.data(), content.size(), "r");
+    TftpClientOperationResult deltaResult = client->sendFile(INDEX_IMAGE, fp);
+    fclose(fp);
+    uint64_t hits = 0;
+    server->getMetadataIndexStats(nullptr, &hits, nullptr);
+
+    // Written by the upload, renamed and deleted behind the server's back.
+    bool uploadIndexed = waitIndexed(server, INDEX_IMAGE, contentHashes.checksum, true);
+    rename(INDEX_OTHER, INDEX_DIRECTORY "/renamed.bin");
+    bool renameIndexed =
+        waitIndexed(server, INDEX_DIRECTORY "/renamed.bin", contentHashes.checksum, true);
+    remove(INDEX_IMAGE);
+    bool deleteIndexed = waitIndexed(server, INDEX_IMAGE, 0, false);
+    uint64_t files = 0;
+    server->getMetadataIndexStats(&files, nullptr, nullptr);
+
+    server->stopListening();
+    serverThread.join();
+    delete server;
+    delete client;
+    remove(INDEX_DIRECTORY "/renamed.bin");
+    rmdir(INDEX_DIRECTORY);
+
+    ASSERT_EQ(indexResult, TftpServerOperationResult::TFTP_SERVER_OK);
+    ASSERT_EQ(builtFiles, 2u);
+    ASSERT_EQ(builtResult, TftpServerOperationResult::TFTP_SERVER_OK);
+    ASSERT_EQ(built.size, (uint64_t)base.size());
+    ASSERT_EQ(built.hashes.checksum, baseHashes.checksum);
+    ASSERT_TRUE(built.hashes.hashes == baseHashes.hashes);
+    ASSERT_EQ(deltaResult, TftpClientOperationResult::TFTP_CLIENT_OK);
+    ASSERT_GE(hits, 1u);
+    ASSERT_TRUE(uploadIndexed);
+    ASSERT_TRUE(renameIndexed);
+    ASSERT_TRUE(deleteIndexed);
+    ASSERT_EQ(files, 1u);
+}
+
+/*
+ *******************************************************************************
+ *                              STRIPED TRANSFER                               *
+ *******************************************************************************
+ */
+
+TEST(TFTPRangeStream, ParsesRanges)
+{
+    TFTPRange range;
+    ASSERT_TRUE(TFTPRangeStream::decodeRange("512:1024:4096", range));
+    ASSERT_EQ(range.offset, 512u);
+    ASSERT_EQ(range.length, 1024u);
+    ASSERT_EQ(range.total, 4096u);
+    ASSERT_EQ(TFTPRangeStream::encodeRange(range), "512:1024:4096");
+    ASSERT_TRUE(TFTPRangeStream::decodeRange("0:10", range));
+    ASSERT_EQ(range.total, 0u);
+    ASSERT_FALSE(TFTPRangeStream::decodeRange("4000:1024:4096", range));
+    ASSERT_FALSE(TFTPRangeStream::decodeRange("-1:10", range));
+    ASSERT_FALSE(TFTPRangeStream::decodeRange("1:", range));
+    ASSERT_FALSE(TFTPRangeStream::decodeRange("18446744073709551615:2", range));
+}
+
+TEST(TFTPClientServer, StripedTransfer)
+{
+    ITFTPServer *server = new TFTPServer();
+    ITFTPClient *client = new TFTPClient();
+
+    // Several ranges, the last one shorter.
+    std::vector<uint8_t> content(300 * 1024 + 777);
+    for (size_t i = 0; i < content.size(); i++)
+    {
+        content[i] = (uint8_t)(i * 7 + i / 1000);
+    }
+    std::vector<uint8_t> small(content.begin(), content.begin() + 1000);
+
+    server->setPort(PORT);
+    server->setTimeout(TIMEOUT);
+    server->setStripedTransfer(true);
+    std::thread serverThread([&]()
+                             { server->startListening(); });
+
+    client->setConnection(LOCALHOST, PORT);
+    client->setStriping(4, 64 * 1024);
+    TftpClientOperationResult sendResult =
+        client->sendBuffer(FILENAME_DISK_DISK_SEND, content.data(), content.size());
+    std::vector<uint8_t> received;
+    TftpClientOperationResult fetchResult =
+        client->fetchToBuffer(FILENAME_DISK_DISK_SEND, received);
+
+    // Into a regular file, the FILE is left past the data.
+    FILE *fp = fopen(FILENAME_DISK_DISK_RECEIVE, "w+");
+    TftpClientOperationResult fileResult = client->fetchFile(FILENAME_DISK_DISK_SEND, fp);
+    off_t fileEnd = ftello(fp);
+    std::vector<uint8_t> fileContent(content.size());
+    rewind(fp);
+    size_t fileRead = fread(fileContent.data(), 1, fileContent.size() + 1, fp);
+    fclose(fp);
+
+    // A shorter file over it, the server's copy doesn't keep the tail.
+    std::vector<uint8_t> shorter(content.begin(), content.begin() + 200 * 1024);
+    TftpClientOperationResult shorterResult =
+        client->sendBuffer(FILENAME_DISK_DISK_SEND, shorter.data(), shorter.size());
+    std::vector<uint8_t> shorterReceived;
+    client->fetchToBuffer(FILENAME_DISK_DISK_SEND, shorterReceived);
+
+    // Past the server's limit, no range is written.
+    server->setStripedFileLimit(100 * 1024);
+    TftpClientOperationResult limitResult =
+        client->sendBuffer(FILENAME_DISK_DISK_RECEIVE, content.data(), content.size());
+    server->setStripedFileLimit(1024 * 1024);
+
+    // Under the threshold, one session.
+    std::vector<uint8_t> smallReceived;
+    TftpClientOperationResult smallResult =
+        client->sendBuffer(FILENAME_DISK_DISK_RECEIVE, small.data(), small.size());
+    client->fetchToBuffer(FILENAME_DISK_DISK_RECEIVE, smallReceived);
+    uint64_t files = 0, bytes = 0;
+    client->getStripingStats(&files, &bytes, nullptr, nullptr);
+
+    // A server without ranges gets the whole file in one session.
+    server->setStripedTransfer(false);
+    client->setConnection(LOCALHOST, PORT);
+    TftpClientOperationResult plainResult =
+        client->sendBuffer(FILENAME_DISK_DISK_SEND, content.data(), content.size());
+    std::vector<uint8_t> plainReceived;
+    client->fetchToBuffer(FILENAME_DISK_DISK_SEND, plainReceived);
+    uint64_t plainFiles = 0;
+    client->getStripingStats(&plainFiles, nullptr, nullptr, nullptr);
+
+    server->stopListening();
+    serverThread.join();
+    delete server;
+    delete client;
+
+    ASSERT_EQ(sendResult, TftpClientOperationResult::TFTP_CLIENT_OK);
+    ASSERT_EQ(fetchResult, TftpClientOperationResult::TFTP_CLIENT_OK);
+    ASSERT_TRUE(received == content);
+    ASSERT_EQ(fileResult, TftpClientOperationResult::TFTP_CLIENT_OK);
+    ASSERT_EQ(fileEnd, (off_t)content.size());
+    ASSERT_EQ(fileRead, content.size());
+    ASSERT_TRUE(fileContent == content);
+    ASSERT_EQ(shorterResult, TftpClientOperationResult::TFTP_CLIENT_OK);
+    ASSERT_TRUE(shorterReceived == shorter);
+    ASSERT_EQ(limitResult, TftpClientOperationResult::TFTP_CLIENT_ERROR);
+    ASSERT_EQ(smallResult, TftpClientOperationResult::TFTP_CLIENT_OK);
+    ASSERT_TRUE(smallReceived == small);
+    ASSERT_EQ(files, 5u);
+    ASSERT_EQ(bytes, 3 * (uint64_t)content.size() + 2 * (uint64_t)shorter.size());
+    ASSERT_EQ(plainResult, TftpClientOperationResult::TFTP_CLIENT_OK);
+    ASSERT_TRUE(plainReceived == content);
+    ASSERT_EQ(plainFiles, 5u);
+}
+
+typedef struct CountedFile
+{
+    const std::vector<uint8_t> *content;
+    std::atomic<uint64_t> *bytesRead;
+    off64_t position;
+} CountedFile;
+
+static ssize_t countedRead(
+    void *cookie,
+    char *buffer,
+    size_t size)
+{
+    CountedFile *file = (CountedFile *)cookie;
+    size = std::min<size_t>(size, file->content->size() - file->position);
+    memcpy(buffer, file->content->data() + file->position, size);
+    file->position += size;
+    *file->bytesRead += size;
+    return size;
+}
+
+static int countedSeek(
+    void *cookie,
+    off64_t *offset,
+    int whence)
+{
+    CountedFile *file = (CountedFile *)cookie;
+    off64_t base = whence == SEEK_SET ? 0 : whence == SEEK_CUR ? file->position
+                                                               : (off64_t)file->content->size();
+    file->position = std::min<off64_t>(base + *offset, file->content->size());
+    *offset = file->position;
+    return 0;
+}
+
+static int countedClose(
+    void *cookie)
+{
+    delete (CountedFile *)cookie;
+    return 0;
+}
+
+static std::vector<uint8_t> countedContent(1000, 'c');
+
+TftpServerOperationResult Counted_openFileCbk(
+    ITFTPSection *sectionHandler,
+    FILE **fd,
+    char *filename,
+    char *mode,
+    size_t *fileSize,
+    void *context)
+{
+    cookie_io_functions_t functions;
+    memset(&functions, 0, sizeof(functions));
+    functions.read = countedRead;
+    functions.seek = countedSeek;
+    functions.close = countedClose;
+    CountedFile *file = new CountedFile();
+    file->content = &countedContent;
+    file->bytesRead = (std::atomic<uint64_t> *)context;
+    file->position = 0;
+    *fd = fopencookie(file, "r", functions);
+    return TftpServerOperationResult::TFTP_SERVER_OK;
+}
+
+TEST(TFTPClientServer, StripingAsksSizeFirst)
+{
+    ITFTPServer *server = new TFTPServer();
+    ITFTPClient *client = new TFTPClient();
+    std::atomic<uint64_t> bytesRead(0);
+
+    server->setPort(PORT);
+    server->setTimeout(TIMEOUT);
+    server->setStripedTransfer(true);
+    server->registerOpenFileCallback(Counted_openFileCbk, &bytesRead);
+    server->registerCloseFileCallback(
+        ClientMemoryServerMemoryCommunication_closeFileCbk, nullptr);
+    std::thread serverThread([&]()
+                             { server->startListening(); });
+
+    // Under the threshold, the file isn't read for a checksum.
+    client->setConnection(LOCALHOST, PORT);
+    client->setStriping(4, 64 * 1024);
+    std::vector<uint8_t> received;
+    TftpClientOperationResult result = client->fetchToBuffer("counted", received);
+    std::vector<uint8_t> size;
+    client->fetchToBuffer("counted" TFTP_SIZE_SUFFIX, size);
+
+    server->stopListening();
+    serverThread.join();
+    delete server;
+    delete client;
+
+    ASSERT_EQ(result, TftpClientOperationResult::TFTP_CLIENT_OK);
+    ASSERT_TRUE(received == countedContent);
+    ASSERT_EQ(bytesRead, (uint64_t)countedContent.size());
+    ASSERT_EQ(std::string(size.begin(), size.end()), std::to_string(countedContent.size()));
+}
+
+TEST(TFTPCongestionWindow, SlowStartAndBackOff)
+{
+    TFTPCongestionWindow window;
+    window.reset(8, true);
+    int slowStart[4];
+    for (int round = 0; round < 4; round++)
+    {
+        // A whole window in flight, then moved cleanly.
+        slowStart[round] = window.getWindow();
+        std::vector<uint64_t> epochs;
+        for (int i = 0; i < slowStart[round]; i++)
+        {
+            epochs.push_back(window.acquire());
+        }
+        for (uint64_t epoch : epochs)
+        {
+            window.release(epoch, false, true);
+        }
+    }
+
+    // Losses of units in flight together halve the window once.
+    uint64_t first = window.acquire();
+    uint64_t second = window.acquire();
+    window.release(first, true, false);
+    window.release(second, true, false);
+    int afterLoss = window.getWindow();
+    for (int i = 0; i < 4; i++)
+    {
+        window.release(window.acquire(), false, true);
+    }
+    int afterRound = window.getWindow();
+    uint64_t losses = window.getLosses();
+
+    window.reset(8, false);
+    window.release(window.acquire(), true, false);
+    int fixed = window.getWindow();
+
+    ASSERT_EQ(slowStart[0], 1);
+    ASSERT_EQ(slowStart[1], 2);
+    ASSERT_EQ(slowStart[2], 4);
+    ASSERT_EQ(slowStart[3], 8);
+    ASSERT_EQ(afterLoss, 4);
+    ASSERT_EQ(afterRound, 5);
+    ASSERT_EQ(losses, 2u);
+    ASSERT_EQ(fixed, 8);
+}
+
+TEST(TFTPClientServer, AdaptiveStriping)
+{
+    ITFTPServer *server = new TFTPServer();
+    ITFTPClient *client = new TFTPClient();
+
+    std::vector<uint8_t> content(1024 * 1024);
+    for (size_t i = 0; i < content.size(); i++)
+    {
+        content[i] = (uint8_t)(i * 13 + i / 4096);
+    }
+
+    // Past two sessions the server is busy, the window has to stay below.
+    server->setPort(PORT);
+    server->setTimeout(TIMEOUT);
+    server->setStripedTransfer(true);
+    server->setAdmissionLimits(2, 0, 0, 0);
+    std::thread serverThread([&]()
+                             { server->startListening(); });
+
+    client->setConnection(LOCALHOST, PORT);
+    client->setStriping(4, 64 * 1024);
+    client->setAdaptiveStriping(true);
+    std::atomic<bool> done(false);
+    int largestWindow = 0;
+    std::thread pollThread([&]()
+                           {
+        while (!done)
+        {
+            std::vector<TFTPSectionInfo> sections;
+            server->listSections(sections);
+            for (const TFTPSectionInfo &info : sections)
+            {
+                largestWindow = std::max(largestWindow, info.window);
+            }
+            std::this_thread::yield();
+        } });
+    TftpClientOperationResult sendResult =
+        client->sendBuffer(FILENAME_DISK_DISK_SEND, content.data(), content.size());
+    std::vector<uint8_t> received;
+    TftpClientOperationResult fetchResult =
+        client->fetchToBuffer(FILENAME_DISK_DISK_SEND, received);
+    done = true;
+    pollThread.join();
+    uint64_t files = 0, losses = 0;
+    int window = 0;
+    client->getStripingStats(&files, nullptr, &window, &losses);
+
+    server->stopListening();
+    serverThread.join();
+    delete server;
+    delete client;
+
+    ASSERT_EQ(sendResult, TftpClientOperationResult::TFTP_CLIENT_OK);
+    ASSERT_EQ(fetchResult, TftpClientOperationResult::TFTP_CLIENT_OK);
+    ASSERT_TRUE(received == content);
+    ASSERT_EQ(files, 2u);
+    ASSERT_GE(losses, 1u);
+    ASSERT_GE(window, 1);
+    ASSERT_LE(window, 4);
+    ASSERT_GE(largestWindow, 1);
+    ASSERT_LE(largestWindow, 2);
+}
+
+/*
+ *******************************************************************************
+ *                                  HOT SWAP                                   *
+ *******************************************************************************
+ */
+
+typedef struct SwapBackend
+{
+    ITFTPServer *server;
+    struct SwapBackend *next;
+    char buffer[BUFSIZE];
+    int opens;
+    int closes;
+} SwapBackend;
+
+TftpServerOperationResult HotSwap_closeFileCbk(
+    ITFTPSection *sectionHandler,
+    FILE *fd,
+    void *context);
+
+TftpServerOperationResult HotSwap_openFileCbk(
+    ITFTPSection *sectionHandler,
+    FILE **fd,
+    char *filename,
+    char *mode,
+    size_t *fileSize,
+    void *context)
+{
+    SwapBackend *backend = (SwapBackend *)context;
+    backend->opens++;
+    if (backend->next != nullptr)
+    {
+        // Swapped mid-section, the section still closes on this backend.
+        backend->server->registerOpenFileCallback(HotSwap_openFileCbk, backend->next);
+        backend->server->registerCloseFileCallback(HotSwap_closeFileCbk, backend->next);
+        backend->next = nullptr;
+    }
+    *fd = fmemopen(backend->buffer, BUFSIZE, mode);
+    return TftpServerOperationResult::TFTP_SERVER_OK;
+}
+
+TftpServerOperationResult HotSwap_closeFileCbk(
+    ITFTPSection *sectionHandler,
+    FILE *fd,
+    void *context)
+{
+    SwapBackend *backend = (SwapBackend *)context;
+    backend->closes++;
+    return fclose(fd) == 0 ? TftpServerOperationResult::TFTP_SERVER_OK : TftpServerOperationResult::TFTP_SERVER_ERROR;
+}
+
+TEST(TFTPClientServer, HotSwapCallbacks)
+{
+    ITFTPServer *server = new TFTPServer();
+    ITFTPClient *client = new TFTPClient();
+    SwapBackend first, second;
+    memset(&first, 0, sizeof(first));
+    memset(&second, 0, sizeof(second));
+    first.server = server;
+    first.next = &second;
+    second.server = server;
+
+    server->setPort(PORT);
+    server->setTimeout(TIMEOUT);
+    server->registerOpenFileCallback(HotSwap_openFileCbk, &first);
+    server->registerCloseFileCallback(HotSwap_closeFileCbk, &first);
+    std::thread serverThread([&]()
+                             { server->startListening(); });
+
+    client->setConnection(LOCALHOST, PORT);
+
+    char message[BUFSIZE];
+    memset(message, 0, BUFSIZE);
+    strcpy(message, MEM_MEM_MSG);
+    FILE *fp = fmemopen(message, BUFSIZE, "r");
+    TftpClientOperationResult firstResult = client->sendFile(FILENAME_MEM_MEM, fp);
+    fclose(fp);
+    fp = fmemopen(message, BUFSIZE, "r");
+    TftpClientOperationResult secondResult = client->sendFile(FILENAME_MEM_MEM, fp);
+    fclose(fp);
+
+    server->stopListening();
+    serverThread.join();
+    delete server;
+    delete client;
+
+    ASSERT_EQ(firstResult, TftpClientOperationResult::TFTP_CLIENT_OK);
+    ASSERT_EQ(secondResult, TftpClientOperationResult::TFTP_CLIENT_OK);
+    ASSERT_EQ(first.opens, 1);
+    ASSERT_EQ(first.closes, 1);
+    ASSERT_EQ(second.opens, 1);
+    ASSERT_EQ(second.closes, 1);
+    ASSERT_STREQ(first.buffer, MEM_MEM_MSG);
+    ASSERT_STREQ(second.buffer, MEM_MEM_MSG);
+}
+
+/*
+ *******************************************************************************
+ *                                    POOLS                                    *
+ *******************************************************************************
+ */
+
+typedef struct
+{
+    std::atomic<int> startedSections;
+    std::atomic<int> finishedSections;
+    std::atomic<int> steadySections;
+    std::atomic<uint64_t> steadyAllocations;
+} AllocationContext;
+
+// Sections of one server may overlap, so each section thread keeps its own
+// starting point.
+static thread_local int sectionIndex = 0;
+static thread_local uint64_t sectionStartAllocations = 0;
+
+TftpServerOperationResult AllocationCounting_sectionStartedCbk(
+    ITFTPSection *sectionHandler,
+    void *context)
+{
+    AllocationContext *ctx = (AllocationContext *)context;
+    sectionIndex = ctx->startedSections++;
+    sectionStartAllocations = threadAllocations;
+    return TftpServerOperationResult::TFTP_SERVER_OK;
+}
+
+TftpServerOperationResult AllocationCounting_sectionFinishedCbk(
+    ITFTPSection *sectionHandler,
+    void *context)
+{
+    AllocationContext *ctx = (AllocationContext *)context;
+    // The first section fills the pools.
+    if (sectionIndex > 0)
+    {
+        ctx->steadyAllocations += threadAllocations - sectionStartAllocations;
+        ctx->steadySections++;
+    }
+    ctx->finishedSections++;
+    return TftpServerOperationResult::TFTP_SERVER_OK;
+}
+
+TEST(TFTPObjectPool, RecyclesObjects)
+{
+    AllocationCounting counting;
+    TFTPObjectPool<std::vector<char>> pool;
+    std::vector<char> *first = pool.acquire();
+    first->resize(512);
+    pool.release(first);
+
+    uint64_t before = threadAllocations;
+    for (int i = 0; i < 100; i++)
+    {
+        std::vector<char> *object = pool.acquire();
+        ASSERT_EQ(object, first);
+        object->resize(512);
+        pool.release(object);
+    }
+
+    ASSERT_EQ(threadAllocations - before, 0u);
+    ASSERT_EQ(pool.getAllocatedCount(), 1u);
+}
+
+TEST(TFTPClientServer, SteadyStateSectionsDoNotAllocate)
+{
+    AllocationCounting counting;
+    ITFTPServer *server = new TFTPServer();
+    ITFTPClient *client = new TFTPClient();
+    AllocationContext context;
+    context.startedSections = 0;
+    context.finishedSections = 0;
+    context.steadySections = 0;
+    context.steadyAllocations = 0;
+
+    FILE *fp = fopen(FILENAME_DISK_DISK_SEND, "w");
+    fprintf(fp, DISK_DISK_MSG);
+    fclose(fp);
+
+    server->setPort(PORT);
+    server->setTimeout(TIMEOUT);
+    server->setReadAheadDepth(4);
+    server->setDrainTimeout(TIMEOUT * 1000);
+    server->registerSectionStartedCallback(
+        AllocationCounting_sectionStartedCbk, &context);
+    server->registerSectionFinishedCallback(
+        AllocationCounting_sectionFinishedCbk, &context);
+    std::thread serverThread([&]()
+                             { server->startListening(); });
+
+    client->setConnection(LOCALHOST, PORT);
+
+    char buffer[BUFSIZE];
+    for (int i = 0; i < 3; i++)
+    {
+        memset(buffer, 0, BUFSIZE);
+        FILE *receiveFd = fmemopen(buffer, BUFSIZE, "w");
+        client->fetchFile(FILENAME_DISK_DISK_SEND, receiveFd);
+        fclose(receiveFd);
+
+        // The server finishes a section after the client is done with it,
+        // let it go back to the pools before the next one starts.
+        for (int wait = 0; wait < 1000 && context.finishedSections != i + 1; wait++)
+        {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+    }
+
+    server->stopListening();
+    serverThread.join();
+
+    delete server;
+    delete client;
+
+    ASSERT_STREQ(buffer, DISK_DISK_MSG);
+    ASSERT_EQ(context.steadySections, 2);
+    ASSERT_EQ(context.steadyAllocations, 0u);
+}
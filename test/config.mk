@@ -12,7 +12,7 @@ CXXFLAGS		+= -pthread
 CXXFLAGS 		+= -fprofile-arcs -ftest-coverage --coverage
 COBJFLAGS 		:= $(CXXFLAGS) -c
 LDFLAGS  		:= -L$(GTEST_ROOT)/lib -L$(DEP_PATH)/lib
-LDLIBS   		:= -ltransfer -ltftp -ltftpd -lgtest -fprofile-arcs -lgcov -lpthread
+LDLIBS   		:= -ltransfer -ltftp -ltftpd -lz -lgtest -fprofile-arcs -lgcov -lpthread
 INCFLAGS 		:= -I$(DEP_PATH)/include
 
 debug: COBJFLAGS 		+= $(DBGFLAGS)
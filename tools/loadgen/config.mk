@@ -0,0 +1,19 @@
+# version
+VERSION = 0.1
+
+DESTDIR 	?= /tmp
+DEP_PATH 	?= $(DESTDIR)
+
+CXX				?=
+CXXFLAGS 		+= -Wall
+CXXFLAGS 		+= -Werror
+CXXFLAGS 		+= -std=c++11
+CXXFLAGS		+= -pthread
+CXXFLAGS 		+= -O2
+COBJFLAGS 		:= $(CXXFLAGS) -c
+LDFLAGS  		:= -L$(DEP_PATH)/lib
+LDLIBS   		:= -ltransfer -ltftp -ltftpd -lz -lpthread
+INCFLAGS 		:= -I$(DEP_PATH)/include
+
+debug: COBJFLAGS 		+= $(DBGFLAGS)
+debugdeps: DEP_RULE    	:= debug
@@ -0,0 +1,1352 @@
+/*
+ * tftp-loadgen: simulates a fleet of target units talking to a TFTP server,
+ * to size loading stations without a hardware lab.
+ *
+ * Each unit is a thread with its own TFTPClient. It thinks for an
+ * exponentially distributed time, polling a small status file meanwhile,
+ * then either reads one of the seeded files (RRQ) or uploads a new one
+ * (WRQ). Without --host, an in-process TFTPServer is started so server-side
+ * figures can be reported too. With --compress, units ask for compressed
+ * transfers and the goodput gain over the bytes actually moved is reported.
+ * With --delta, each unit keeps one image it reloads with a fraction of its
+ * blocks changed, sent as deltas against the server's copy. --server-cpus
+ * and --unit-cpus pin the server and the units, to compare placements.
+ * --durability picks how the server makes uploads durable, and the cost of
+ * each mode is reported. --list-ms polls the server's section table like a
+ * dashboard would, to check it doesn't slow transfers down. --max-sections
+ * and --queue turn on the server's admission control, rejected requests
+ * count as errors. --large-files moves big files with O_DIRECT, the share
+ * of the served files left in the page cache is reported to compare.
+ * --stripes splits large files into ranges moved over concurrent sessions,
+ * run it against --stripes 1 for the speedup over a single stream.
+ * --adaptive sizes the window of those sessions to the losses seen.
+ * --loss and --link-kbps relay the units' datagrams through a proxy that
+ * drops some at random, or queues them on a link of that rate and drops
+ * them when the queue is full, to compare fixed and adaptive windows on a
+ * lossy or congested link. --trace records the client and server events
+ * of the run into a Chrome trace file, when the library is built with
+ * make trace; run without it for the cost of tracing.
+ */
+
+#include "TFTPClient.h"
+#include "TFTPCpuSet.h"
+#include "TFTPMappedSink.h"
+#include "TFTPServer.h"
+#include "TFTPTrace.h"
+
+#include <algorithm>
+#include <arpa/inet.h>
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <dirent.h>
+#include <getopt.h>
+#include <map>
+#include <math.h>
+#include <mutex>
+#include <netinet/in.h>
+#include <poll.h>
+#include <random>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+#define LOADGEN_DEFAULT_PORT 6969
+#define LOADGEN_STATUS_FILE "loadgen_status.txt"
+#define LOADGEN_STATUS_SIZE 64
+#define LOADGEN_STRIPE_THRESHOLD (1024 * 1024)
+// Relayed transfers idle for longer are forgotten.
+#define LOADGEN_PROXY_IDLE_MS 30000
+// Datagrams waiting for the proxy link, past it they are dropped.
+#define LOADGEN_LINK_QUEUE 16
+
+typedef std::chrono::steady_clock LoadgenClock;
+
+enum LoadgenOperation {
+    LOADGEN_RRQ = 0,
+    LOADGEN_WRQ,
+    LOADGEN_POLL,
+    LOADGEN_OPERATIONS
+};
+
+static const char *operationNames[LOADGEN_OPERATIONS] = {"rrq", "wrq", "poll"};
+
+enum class SizeDistribution {
+    FIXED,
+    UNIFORM,
+    LOGNORMAL
+};
+
+struct LoadgenOptions {
+    int units;
+    int duration;
+    std::string host;
+    int port;
+    double readRatio;
+    std::string sizeSpec;
+    size_t maxSize;
+    int files;
+    int thinkMs;
+    int pollMs;
+    int serverTimeout;
+    std::string root;
+    unsigned seed;
+    bool compress;
+    double entropy;
+    double delta;
+    std::vector<int> serverCpus;
+    std::vector<int> unitCpus;
+    TftpDurabilityMode durability;
+    int groupCommitMs;
+    int listMs;
+    int maxSections;
+    int queueLength;
+    uint64_t largeFiles;
+    bool hugePages;
+    int stripes;
+    bool adaptive;
+    double loss;
+    int linkKbps;
+    std::string tracePath;
+    // Where units connect, the loss proxy when there is one.
+    std::string unitHost;
+    int unitPort;
+};
+
+struct ListingTotals {
+    uint64_t polls;
+    size_t peakSections;
+    int peakWindow;
+    double totalUs;
+    double maxUs;
+};
+
+static const char *durabilityNames[] = {"none", "fdatasync", "group", "rename"};
+
+struct CompressionTotals {
+    std::atomic<uint64_t> plainBytes;
+    std::atomic<uint64_t> compressedBytes;
+    std::atomic<uint64_t> deltaFileBytes;
+    std::atomic<uint64_t> deltaSentBytes;
+    std::atomic<uint64_t> stripedFiles;
+    std::atomic<uint64_t> stripedBytes;
+    std::atomic<uint64_t> stripeLosses;
+    std::atomic<uint64_t> windowSum;
+};
+
+struct OperationStats {
+    uint64_t count;
+    uint64_t errors;
+    uint64_t bytes;
+    std::vector<double> latencies;
+
+    OperationStats() : count(0), errors(0), bytes(0) {}
+
+    void record(const double latency, const size_t size, const bool ok) {
+        count++;
+        latencies.push_back(latency);
+        if (ok) {
+            bytes += size;
+        } else {
+            errors++;
+        }
+    }
+
+    void merge(const OperationStats &other) {
+        count += other.count;
+        errors += other.errors;
+        bytes += other.bytes;
+        latencies.insert(latencies.end(), other.latencies.begin(),
+                         other.latencies.end());
+    }
+};
+
+class SizeModel {
+public:
+    bool parse(const std::string &spec, const size_t maxSize) {
+        this->maxSize = maxSize;
+        std::string name = spec.substr(0, spec.find(':'));
+        double a = 0, b = 0;
+        int fields = sscanf(spec.c_str() + name.size(), ":%lf:%lf", &a, &b);
+
+        if (name == "fixed" && fields == 1) {
+            type = SizeDistribution::FIXED;
+        } else if (name == "uniform" && fields == 2 && a <= b) {
+            type = SizeDistribution::UNIFORM;
+        } else if (name == "lognormal" && fields == 2) {
+            type = SizeDistribution::LOGNORMAL;
+        } else {
+            return false;
+        }
+        first = a;
+        second = b;
+        return a >= 1;
+    }
+
+    size_t sample(std::mt19937 &rng) const {
+        double size = first;
+        if (type == SizeDistribution::UNIFORM) {
+            size = std::uniform_real_distribution<double>(first, second)(rng);
+        } else if (type == SizeDistribution::LOGNORMAL) {
+            // first is the median, second the sigma of the underlying normal.
+            size = std::lognormal_distribution<double>(log(first), second)(rng);
+        }
+        size = std::max(1.0, std::min(size, (double) maxSize));
+        return (size_t) size;
+    }
+
+private:
+    SizeDistribution type;
+    double first;
+    double second;
+    size_t maxSize;
+};
+
+struct SeededFile {
+    std::string name;
+    size_t size;
+};
+
+/*
+ *******************************************************************************
+ *                                SERVER SIDE                                  *
+ *******************************************************************************
+ */
+
+struct ServerStats {
+    std::mutex mutex;
+    std::string root;
+    std::map<TftpSectionId, LoadgenClock::time_point> started;
+    std::map<TftpSectionId, size_t> transferred;
+    OperationStats sections;
+};
+
+TftpServerOperationResult Loadgen_sectionStartedCbk(
+        ITFTPSection *sectionHandler,
+        void *context)
+{
+    ServerStats *stats = (ServerStats *) context;
+    TftpSectionId id;
+    if (sectionHandler->getSectionId(&id) == TftpServerOperationResult::TFTP_SERVER_OK) {
+        std::lock_guard<std::mutex> lock(stats->mutex);
+        stats->started[id] = LoadgenClock::now();
+    }
+    return TftpServerOperationResult::TFTP_SERVER_OK;
+}
+
+TftpServerOperationResult Loadgen_sectionFinishedCbk(
+        ITFTPSection *sectionHandler,
+        void *context)
+{
+    ServerStats *stats = (ServerStats *) context;
+    TftpSectionId id;
+    if (sectionHandler->getSectionId(&id) != TftpServerOperationResult::TFTP_SERVER_OK) {
+        return TftpServerOperationResult::TFTP_SERVER_ERROR;
+    }
+
+    TftpServerSectionStatus status = TftpServerSectionStatus::TFTP_SERVER_SECTION_UNDEFINED;
+    sectionHandler->getSectionStatus(&status);
+
+    std::lock_guard<std::mutex> lock(stats->mutex);
+    std::map<TftpSectionId, LoadgenClock::time_point>::iterator it = stats->started.find(id);
+    if (it == stats->started.end()) {
+        return TftpServerOperationResult::TFTP_SERVER_ERROR;
+    }
+
+    std::chrono::duration<double, std::milli> latency = LoadgenClock::now() - it->second;
+    stats->started.erase(it);
+    stats->sections.record(latency.count(), stats->transferred[id],
+                           status == TftpServerSectionStatus::TFTP_SERVER_SECTION_OK);
+    stats->transferred.erase(id);
+    return TftpServerOperationResult::TFTP_SERVER_OK;
+}
+
+TftpServerOperationResult Loadgen_openFileCbk(
+        ITFTPSection *sectionHandler,
+        FILE **fd,
+        char *filename,
+        char *mode,
+        size_t *bufferSize,
+        void *context)
+{
+    ServerStats *stats = (ServerStats *) context;
+    // Clients only get to touch files inside the root.
+    if (strchr(filename, '/') != NULL) {
+        *fd = NULL;
+        return TftpServerOperationResult::TFTP_SERVER_ERROR;
+    }
+
+    std::string path = stats->root + "/" + filename;
+    *fd = fopen(path.c_str(), mode);
+    if (*fd == NULL) {
+        return TftpServerOperationResult::TFTP_SERVER_ERROR;
+    }
+
+    // A compressed read may be served from the server's cache without
+    // touching the FILE, so count reads by the file size.
+    struct stat info;
+    TftpSectionId id;
+    if (mode[0] == 'r' && fstat(fileno(*fd), &info) == 0 &&
+        sectionHandler->getSectionId(&id) == TftpServerOperationResult::TFTP_SERVER_OK) {
+        std::lock_guard<std::mutex> lock(stats->mutex);
+        stats->transferred[id] = (size_t) info.st_size;
+    }
+    return TftpServerOperationResult::TFTP_SERVER_OK;
+}
+
+TftpServerOperationResult Loadgen_closeFileCbk(
+        ITFTPSection *sectionHandler,
+        FILE *fd,
+        void *context)
+{
+    ServerStats *stats = (ServerStats *) context;
+    if (fd == NULL) {
+        return TftpServerOperationResult::TFTP_SERVER_ERROR;
+    }
+
+    // Writes are sequential, so the position is the amount moved.
+    long position = ftell(fd);
+    TftpSectionId id;
+    if (position > 0 &&
+        sectionHandler->getSectionId(&id) == TftpServerOperationResult::TFTP_SERVER_OK) {
+        std::lock_guard<std::mutex> lock(stats->mutex);
+        stats->transferred[id] = (size_t) position;
+    }
+    fclose(fd);
+    return TftpServerOperationResult::TFTP_SERVER_OK;
+}
+
+/*
+ *******************************************************************************
+ *                                 LOSS PROXY                                  *
+ *******************************************************************************
+ */
+
+// Datagram queued on the proxy link.
+struct LinkDatagram {
+    LoadgenClock::time_point departure;
+    int socket;
+    struct sockaddr_in destination;
+    std::string data;
+};
+
+// UDP relay between the units and the server dropping a fraction of the
+// datagrams, both ways. With a link rate, datagrams of both ways share one
+// link and its queue, as on a half-duplex bus, and are dropped when the
+// queue is full. Each unit socket is relayed through a socket of its own,
+// so the server sees one client port per transfer as without it, and the
+// units see the relay's port as the server's.
+struct LossProxy {
+    int socket;
+    int port;
+    struct sockaddr_in server;
+    double loss;
+    int linkKbps;
+    unsigned seed;
+    std::atomic<bool> running;
+    std::thread thread;
+    std::deque<LinkDatagram> link;
+    LoadgenClock::time_point linkFree;
+    std::atomic<uint64_t> relayed;
+    std::atomic<uint64_t> dropped;
+    std::atomic<uint64_t> overflowed;
+};
+
+struct ProxyFlow {
+    struct sockaddr_in client;
+    struct sockaddr_in peer;
+    int socket;
+    LoadgenClock::time_point lastSeen;
+};
+
+static uint64_t flowKey(
+        const struct sockaddr_in &address)
+{
+    return ((uint64_t) address.sin_addr.s_addr << 16) | address.sin_port;
+}
+
+static void relay(
+        LossProxy *proxy,
+        std::mt19937 &rng,
+        const int from,
+        const int to,
+        struct sockaddr_in *source,
+        const struct sockaddr_in &destination)
+{
+    char datagram[2048];
+    socklen_t length = sizeof(*source);
+    ssize_t size = recvfrom(from, datagram, sizeof(datagram), 0,
+                            (struct sockaddr *) source, &length);
+    if (size < 0) {
+        return;
+    }
+    if (std::uniform_real_distribution<double>(0.0, 1.0)(rng) < proxy->loss) {
+        proxy->dropped++;
+        return;
+    }
+    if (proxy->linkKbps <= 0) {
+        proxy->relayed++;
+        sendto(to, datagram, size, 0, (const struct sockaddr *) &destination,
+               sizeof(destination));
+        return;
+    }
+    if (proxy->link.size() >= LOADGEN_LINK_QUEUE) {
+        proxy->overflowed++;
+        return;
+    }
+
+    // Leaves once the datagrams ahead of it and itself are on the wire.
+    LoadgenClock::time_point now = LoadgenClock::now();
+    proxy->linkFree = std::max(proxy->linkFree, now) +
+                      std::chrono::duration_cast<LoadgenClock::duration>(
+                              std::chrono::duration<double>(size * 8.0 /
+                                                            (proxy->linkKbps * 1000.0)));
+    LinkDatagram queued;
+    queued.departure = proxy->linkFree;
+    queued.socket = to;
+    queued.destination = destination;
+    queued.data.assign(datagram, size);
+    proxy->link.push_back(queued);
+}
+
+static int sendLinked(
+        LossProxy *proxy)
+{
+    LoadgenClock::time_point now = LoadgenClock::now();
+    while (!proxy->link.empty() && proxy->link.front().departure <= now) {
+        const LinkDatagram &datagram = proxy->link.front();
+        proxy->relayed++;
+        sendto(datagram.socket, datagram.data.data(), datagram.data.size(), 0,
+               (const struct sockaddr *) &datagram.destination, sizeof(datagram.destination));
+        proxy->link.pop_front();
+    }
+    if (proxy->link.empty()) {
+        return 100;
+    }
+    // Rounded up, poll() takes milliseconds.
+    std::chrono::duration<double, std::milli> wait = proxy->link.front().departure - now;
+    return (int) ceil(wait.count());
+}
+
+static void runProxy(
+        LossProxy *proxy)
+{
+    std::mt19937 rng(proxy->seed);
+    std::map<uint64_t, ProxyFlow> flows;
+    std::vector<struct pollfd> descriptors;
+    std::vector<uint64_t> keys;
+    while (proxy->running) {
+        descriptors.assign(1, {proxy->socket, POLLIN, 0});
+        keys.clear();
+        for (const std::pair<const uint64_t, ProxyFlow> &flow : flows) {
+            descriptors.push_back({flow.second.socket, POLLIN, 0});
+            keys.push_back(flow.first);
+        }
+        int timeout = sendLinked(proxy);
+        if (poll(descriptors.data(), descriptors.size(), timeout) <= 0) {
+            continue;
+        }
+        LoadgenClock::time_point now = LoadgenClock::now();
+
+        if (descriptors[0].revents & POLLIN) {
+            // From a unit, a new socket starts a flow towards the server.
+            struct sockaddr_in client;
+            memset(&client, 0, sizeof(client));
+            socklen_t length = sizeof(client);
+            char probe;
+            if (recvfrom(proxy->socket, &probe, 1, MSG_PEEK, (struct sockaddr *) &client,
+                         &length) >= 0) {
+                std::map<uint64_t, ProxyFlow>::iterator it = flows.find(flowKey(client));
+                if (it == flows.end()) {
+                    ProxyFlow flow;
+                    flow.client = client;
+                    flow.peer = proxy->server;
+                    flow.socket = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+                    it = flows.insert(std::make_pair(flowKey(client), flow)).first;
+                }
+                it->second.lastSeen = now;
+                if (it->second.socket >= 0) {
+                    relay(proxy, rng, proxy->socket, it->second.socket, &client,
+                          it->second.peer);
+                } else {
+                    recv(proxy->socket, &probe, 1, 0);
+                }
+            }
+        }
+        for (size_t i = 1; i < descriptors.size(); i++) {
+            ProxyFlow &flow = flows[keys[i - 1]];
+            if (descriptors[i].revents & POLLIN) {
+                // From the server, which answers from the transfer's port.
+                flow.lastSeen = now;
+                relay(proxy, rng, flow.socket, proxy->socket, &flow.peer, flow.client);
+            }
+        }
+
+        for (std::map<uint64_t, ProxyFlow>::iterator it = flows.begin(); it != flows.end();) {
+            if (now - it->second.lastSeen > std::chrono::milliseconds(LOADGEN_PROXY_IDLE_MS)) {
+                if (it->second.socket >= 0) {
+                    close(it->second.socket);
+                }
+                it = flows.erase(it);
+            } else {
+                ++it;
+            }
+        }
+    }
+
+    for (const std::pair<const uint64_t, ProxyFlow> &flow : flows) {
+        if (flow.second.socket >= 0) {
+            close(flow.second.socket);
+        }
+    }
+}
+
+static bool startProxy(
+        LossProxy &proxy,
+        const std::string &host,
+        const int port,
+        const double loss,
+        const int linkKbps,
+        const unsigned seed)
+{
+    memset(&proxy.server, 0, sizeof(proxy.server));
+    proxy.server.sin_family = AF_INET;
+    proxy.server.sin_port = htons(port);
+    if (inet_pton(AF_INET, host.c_str(), &proxy.server.sin_addr) != 1) {
+        return false;
+    }
+
+    proxy.socket = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    struct sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t length = sizeof(address);
+    if (proxy.socket < 0 ||
+        bind(proxy.socket, (struct sockaddr *) &address, sizeof(address)) != 0 ||
+        getsockname(proxy.socket, (struct sockaddr *) &address, &length) != 0) {
+        if (proxy.socket >= 0) {
+            close(proxy.socket);
+        }
+        return false;
+    }
+
+    proxy.port = ntohs(address.sin_port);
+    proxy.loss = loss;
+    proxy.linkKbps = linkKbps;
+    proxy.seed = seed;
+    proxy.link.clear();
+    proxy.linkFree = LoadgenClock::now();
+    proxy.relayed = 0;
+    proxy.dropped = 0;
+    proxy.overflowed = 0;
+    proxy.running = true;
+    proxy.thread = std::thread(runProxy, &proxy);
+    return true;
+}
+
+static void stopProxy(
+        LossProxy &proxy)
+{
+    proxy.running = false;
+    if (proxy.thread.joinable()) {
+        proxy.thread.join();
+        close(proxy.socket);
+    }
+}
+
+/*
+ *******************************************************************************
+ *                                CLIENT SIDE                                  *
+ *******************************************************************************
+ */
+
+static bool fetch(
+        TFTPClient &client,
+        const char *filename,
+        const size_t expectedSize,
+        const bool striped)
+{
+    if (striped) {
+        // Ranges are written in place, which a buffer allows.
+        std::vector<uint8_t> buffer;
+        return client.fetchToBuffer(filename, buffer) == TftpClientOperationResult::TFTP_CLIENT_OK &&
+               buffer.size() == expectedSize;
+    }
+
+    TFTPMappedSink sink;
+    if (sink.openAnonymous(expectedSize) != TftpClientOperationResult::TFTP_CLIENT_OK) {
+        return false;
+    }
+    bool ok = client.fetchFile(filename, sink) == TftpClientOperationResult::TFTP_CLIENT_OK &&
+              sink.getSize() == expectedSize;
+    sink.close();
+    return ok;
+}
+
+static bool send(
+        TFTPClient &client,
+        const char *filename,
+        const std::vector<char> &payload,
+        const size_t size)
+{
+    return client.sendBuffer(filename, payload.data(), size) ==
+           TftpClientOperationResult::TFTP_CLIENT_OK;
+}
+
+static double elapsedMs(
+        const LoadgenClock::time_point start)
+{
+    std::chrono::duration<double, std::milli> elapsed = LoadgenClock::now() - start;
+    return elapsed.count();
+}
+
+static void runUnit(
+        const int unit,
+        const LoadgenOptions &options,
+        const SizeModel &sizes,
+        const std::vector<SeededFile> &files,
+        const std::vector<char> &payload,
+        const LoadgenClock::time_point deadline,
+        OperationStats *stats,
+        CompressionTotals *compression)
+{
+    TFTPCpuSet cpus;
+    cpus.assign(options.unitCpus);
+    cpus.pinCurrentThread();
+
+    TFTPClient client;
+    client.setConnection(options.unitHost.c_str(), options.unitPort);
+    client.setCompression(options.compress);
+    client.setDeltaTransfer(options.delta >= 0);
+    client.setStriping(options.stripes, LOADGEN_STRIPE_THRESHOLD);
+    client.setAdaptiveStriping(options.adaptive);
+
+    std::mt19937 rng(options.seed + unit);
+    std::uniform_real_distribution<double> uniform(0.0, 1.0);
+    std::uniform_int_distribution<size_t> pickFile(0, files.size() - 1);
+    std::exponential_distribution<double> think(
+            options.thinkMs > 0 ? 1.0 / options.thinkMs : 1.0);
+
+    std::string uploadName = "loadgen_unit_" + std::to_string(unit) + ".bin";
+    // The image a unit reloads, only touched in delta mode.
+    std::vector<char> image;
+    if (options.delta >= 0) {
+        image.assign(payload.begin(), payload.begin() + sizes.sample(rng));
+    }
+    LoadgenClock::time_point nextPoll = LoadgenClock::now();
+
+    while (LoadgenClock::now() < deadline) {
+        LoadgenClock::time_point thinkEnd = LoadgenClock::now();
+        if (options.thinkMs > 0) {
+            thinkEnd += std::chrono::microseconds((long long) (think(rng) * 1000));
+        }
+        thinkEnd = std::min(thinkEnd, deadline);
+
+        // A unit waiting for its next load keeps polling its status.
+        for (;;) {
+            LoadgenClock::time_point wake = thinkEnd;
+            if (options.pollMs > 0) {
+                wake = std::min(wake, nextPoll);
+            }
+            std::this_thread::sleep_until(wake);
+            if (options.pollMs <= 0 || LoadgenClock::now() < nextPoll) {
+                break;
+            }
+
+            LoadgenClock::time_point start = LoadgenClock::now();
+            bool ok = fetch(client, LOADGEN_STATUS_FILE, LOADGEN_STATUS_SIZE, false);
+            stats[LOADGEN_POLL].record(elapsedMs(start), LOADGEN_STATUS_SIZE, ok);
+            nextPoll = std::max(nextPoll + std::chrono::milliseconds(options.pollMs),
+                                LoadgenClock::now());
+            if (LoadgenClock::now() >= thinkEnd) {
+                break;
+            }
+        }
+
+        if (LoadgenClock::now() >= deadline) {
+            break;
+        }
+
+        LoadgenClock::time_point start = LoadgenClock::now();
+        if (uniform(rng) < options.readRatio) {
+            const SeededFile &file = files[pickFile(rng)];
+            bool ok = fetch(client, file.name.c_str(), file.size, options.stripes > 1);
+            stats[LOADGEN_RRQ].record(elapsedMs(start), file.size, ok);
+        } else if (options.delta >= 0) {
+            for (size_t block = 0; block < image.size(); block += TFTP_DELTA_BLOCK_SIZE) {
+                if (uniform(rng) < options.delta) {
+                    image[block] = (char) rng();
+                }
+            }
+            bool ok = send(client, uploadName.c_str(), image, image.size());
+            stats[LOADGEN_WRQ].record(elapsedMs(start), image.size(), ok);
+        } else {
+            size_t size = sizes.sample(rng);
+            bool ok = send(client, uploadName.c_str(), payload, size);
+            stats[LOADGEN_WRQ].record(elapsedMs(start), size, ok);
+        }
+    }
+
+    uint64_t plainBytes = 0, compressedBytes = 0;
+    client.getCompressionStats(&plainBytes, &compressedBytes);
+    compression->plainBytes += plainBytes;
+    compression->compressedBytes += compressedBytes;
+
+    uint64_t fileBytes = 0, sentBytes = 0;
+    client.getDeltaStats(&fileBytes, &sentBytes);
+    compression->deltaFileBytes += fileBytes;
+    compression->deltaSentBytes += sentBytes;
+
+    uint64_t stripedFiles = 0, stripedBytes = 0, stripeLosses = 0;
+    int window = 0;
+    client.getStripingStats(&stripedFiles, &stripedBytes, &window, &stripeLosses);
+    compression->stripedFiles += stripedFiles;
+    compression->stripedBytes += stripedBytes;
+    compression->stripeLosses += stripeLosses;
+    compression->windowSum += window;
+}
+
+/*
+ *******************************************************************************
+ *                                  REPORT                                     *
+ *******************************************************************************
+ */
+
+static double percentile(
+        const std::vector<double> &sorted,
+        const double p)
+{
+    if (sorted.empty()) {
+        return 0;
+    }
+    size_t index = (size_t) ceil(p * sorted.size());
+    return sorted[index > 0 ? index - 1 : 0];
+}
+
+static void printHeader()
+{
+    printf("%-8s %9s %8s %7s %10s %9s %9s %9s %9s\n", "op", "count", "errors",
+           "err%", "MB/s", "p50 ms", "p90 ms", "p99 ms", "max ms");
+}
+
+static void printStats(
+        const char *name,
+        OperationStats &stats,
+        const double seconds)
+{
+    std::sort(stats.latencies.begin(), stats.latencies.end());
+    double errorRate = stats.count > 0 ? 100.0 * stats.errors / stats.count : 0;
+    double throughput = seconds > 0 ? stats.bytes / seconds / (1024 * 1024) : 0;
+    printf("%-8s %9llu %8llu %7.2f %10.2f %9.2f %9.2f %9.2f %9.2f\n", name,
+           (unsigned long long) stats.count, (unsigned long long) stats.errors,
+           errorRate, throughput, percentile(stats.latencies, 0.50),
+           percentile(stats.latencies, 0.90), percentile(stats.latencies, 0.99),
+           stats.latencies.empty() ? 0 : stats.latencies.back());
+}
+
+static void printDurability(
+        TFTPServer *server,
+        const TftpDurabilityMode mode)
+{
+    uint64_t files = 0, syncs = 0, failed = 0;
+    TFTPLatencySummary summary;
+    server->getDurabilityStats(&files, &syncs, &failed);
+    server->getLatencySummary(TftpLatencyMetric::TFTP_LATENCY_DURABILITY, &summary);
+    printf("durability %s: %llu files, %llu syncs, %llu failed, p50 %.2f ms, p99 %.2f ms, "
+           "max %.2f ms\n",
+           durabilityNames[(int) mode], (unsigned long long) files, (unsigned long long) syncs,
+           (unsigned long long) failed, summary.p50 / 1e6, summary.p99 / 1e6, summary.max / 1e6);
+}
+
+static void printPageCache(
+        const std::string &root)
+{
+    // mincore() on a mapping of each file tells which pages are cached.
+    uint64_t total = 0, resident = 0;
+    long page = sysconf(_SC_PAGESIZE);
+    DIR *directory = opendir(root.c_str());
+    struct dirent *entry;
+    while (directory != NULL && (entry = readdir(directory)) != NULL) {
+        std::string path = root + "/" + entry->d_name;
+        struct stat info;
+        FILE *fp = fopen(path.c_str(), "r");
+        if (fp == NULL) {
+            continue;
+        }
+        if (fstat(fileno(fp), &info) == 0 && S_ISREG(info.st_mode) && info.st_size > 0) {
+            void *mapped = mmap(NULL, info.st_size, PROT_READ, MAP_SHARED, fileno(fp), 0);
+            if (mapped != MAP_FAILED) {
+                std::vector<unsigned char> pages((info.st_size + page - 1) / page);
+                if (mincore(mapped, info.st_size, pages.data()) == 0) {
+                    for (unsigned char flag : pages) {
+                        resident += flag & 1;
+                    }
+                    total += pages.size();
+                }
+                munmap(mapped, info.st_size);
+            }
+        }
+        fclose(fp);
+    }
+    if (directory != NULL) {
+        closedir(directory);
+    }
+    printf("page cache: %.2f of %.2f MB of served files resident (%.1f%%)\n",
+           resident * page / (1024.0 * 1024.0), total * page / (1024.0 * 1024.0),
+           total > 0 ? 100.0 * resident / total : 0);
+}
+
+static void pollSections(
+        TFTPServer *server,
+        const int period,
+        const LoadgenClock::time_point deadline,
+        ListingTotals *totals)
+{
+    std::vector<TFTPSectionInfo> sections;
+    while (LoadgenClock::now() < deadline) {
+        LoadgenClock::time_point start = LoadgenClock::now();
+        server->listSections(sections);
+        double us = elapsedMs(start) * 1000;
+        totals->polls++;
+        totals->totalUs += us;
+        totals->maxUs = std::max(totals->maxUs, us);
+        totals->peakSections = std::max(totals->peakSections, sections.size());
+        for (const TFTPSectionInfo &section : sections) {
+            totals->peakWindow = std::max(totals->peakWindow, section.window);
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(period));
+    }
+}
+
+static void printCompression(
+        const uint64_t plainBytes,
+        const uint64_t compressedBytes,
+        const double seconds)
+{
+    // Lockstep TFTP pays per block moved, so the goodput gain is the
+    // ratio of file bytes to bytes on the wire.
+    double plain = plainBytes / (1024.0 * 1024.0);
+    double wire = compressedBytes / (1024.0 * 1024.0);
+    printf("compressed transfers: %.2f MB of files in %.2f MB on the wire\n", plain, wire);
+    printf("goodput %.2f MB/s over %.2f MB/s on the wire, gain %.2fx\n",
+           seconds > 0 ? plain / seconds : 0, seconds > 0 ? wire / seconds : 0,
+           compressedBytes > 0 ? (double) plainBytes / compressedBytes : 0);
+}
+
+/*
+ *******************************************************************************
+ *                                   MAIN                                      *
+ *******************************************************************************
+ */
+
+static void usage(
+        const char *program)
+{
+    printf("Usage: %s [options]\n"
+           "  -n, --units N         simulated target units (default 100)\n"
+           "  -d, --duration S      test duration in seconds (default 10)\n"
+           "  -H, --host HOST       server to load; without it an in-process\n"
+           "                        server is started on 127.0.0.1\n"
+           "  -p, --port PORT       server port (default %d)\n"
+           "  -r, --read-ratio R    fraction of transfers that are RRQ (default 0.8)\n"
+           "  -s, --sizes SPEC      file sizes: fixed:B, uniform:MIN:MAX or\n"
+           "                        lognormal:MEDIAN:SIGMA (default uniform:1024:1048576)\n"
+           "  -m, --max-size B      cap for sampled sizes (default 16777216)\n"
+           "  -f, --files K         distinct files seeded for RRQ (default 16)\n"
+           "  -t, --think-ms MS     mean think time between transfers (default 500)\n"
+           "  -P, --poll-ms MS      status poll period while thinking, 0 disables\n"
+           "                        (default 0)\n"
+           "  -T, --timeout S       in-process server timeout (default 5)\n"
+           "  -R, --root DIR        in-process server directory (default: temporary)\n"
+           "  -S, --seed N          random seed (default 1)\n"
+           "  -z, --compress        ask for compressed transfers\n"
+           "  -e, --entropy F       fraction of random bytes in the files, the\n"
+           "                        rest is a repeating pattern (default 0.25)\n"
+           "  -D, --delta F         units reload one image with this fraction of\n"
+           "                        its blocks changed, sent as deltas\n"
+           "  -c, --server-cpus L   pin the in-process server to CPUs, e.g. 0-3,8\n"
+           "  -u, --unit-cpus L     pin the units to CPUs\n"
+           "  -y, --durability M    how the in-process server makes uploads\n"
+           "                        durable: none, fdatasync, group or rename\n"
+           "                        (default none)\n"
+           "  -g, --group-commit MS group commit interval (default 10)\n"
+           "  -L, --list-ms MS      poll the in-process server's section table\n"
+           "                        this often, 0 disables (default 0)\n"
+           "  -A, --max-sections N  in-process server admits at most N sections,\n"
+           "                        0 disables (default 0)\n"
+           "  -Q, --queue N         requests waiting for admission, up to a\n"
+           "                        second each (default 0)\n"
+           "  -O, --large-files B   in-process server moves files of B bytes\n"
+           "                        and more with O_DIRECT, 0 disables (default 0)\n"
+           "  -G, --hugepages       back the O_DIRECT buffers with huge pages\n"
+           "  -W, --stripes N       move files of 1 MiB and more over N concurrent\n"
+           "                        sessions, 1 disables (default 1)\n"
+           "  -a, --adaptive        adapt the window of striped sessions to losses\n"
+           "  -l, --loss F          relay the units through a proxy dropping this\n"
+           "                        fraction of the datagrams each way (default 0)\n"
+           "  -k, --link-kbps K     relay the units over a link of K kbit/s\n"
+           "                        that drops datagrams when its queue is full,\n"
+           "                        0 disables (default 0)\n"
+           "  -x, --trace FILE      record events into a Chrome trace file,\n"
+           "                        needs the library built with make trace\n",
+           program, LOADGEN_DEFAULT_PORT);
+}
+
+static bool parseCpuList(
+        const char *list,
+        std::vector<int> &cpus)
+{
+    cpus.clear();
+    const char *position = list;
+    while (*position != '\0') {
+        int first, last, length;
+        if (sscanf(position, "%d%n", &first, &length) != 1) {
+            return false;
+        }
+        position += length;
+        last = first;
+        if (*position == '-') {
+            if (sscanf(++position, "%d%n", &last, &length) != 1) {
+                return false;
+            }
+            position += length;
+        }
+        if (first < 0 || last < first || last >= CPU_SETSIZE) {
+            return false;
+        }
+        for (int cpu = first; cpu <= last; cpu++) {
+            cpus.push_back(cpu);
+        }
+        if (*position == ',') {
+            position++;
+        } else if (*position != '\0') {
+            return false;
+        }
+    }
+    return !cpus.empty();
+}
+
+static bool parseDurability(
+        const char *name,
+        TftpDurabilityMode &mode)
+{
+    for (int i = 0; i < (int) (sizeof(durabilityNames) / sizeof(durabilityNames[0])); i++) {
+        if (strcmp(name, durabilityNames[i]) == 0) {
+            mode = (TftpDurabilityMode) i;
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool parseOptions(
+        int argc,
+        char **argv,
+        LoadgenOptions &options)
+{
+    static const struct option longOptions[] = {
+            {"units",      required_argument, 0, 'n'},
+            {"duration",   required_argument, 0, 'd'},
+            {"host",       required_argument, 0, 'H'},
+            {"port",       required_argument, 0, 'p'},
+            {"read-ratio", required_argument, 0, 'r'},
+            {"sizes",      required_argument, 0, 's'},
+            {"max-size",   required_argument, 0, 'm'},
+            {"files",      required_argument, 0, 'f'},
+            {"think-ms",   required_argument, 0, 't'},
+            {"poll-ms",    required_argument, 0, 'P'},
+            {"timeout",    required_argument, 0, 'T'},
+            {"root",       required_argument, 0, 'R'},
+            {"seed",       required_argument, 0, 'S'},
+            {"compress",   no_argument,       0, 'z'},
+            {"entropy",    required_argument, 0, 'e'},
+            {"delta",      required_argument, 0, 'D'},
+            {"server-cpus", required_argument, 0, 'c'},
+            {"unit-cpus",  required_argument, 0, 'u'},
+            {"durability", required_argument, 0, 'y'},
+            {"group-commit", required_argument, 0, 'g'},
+            {"list-ms",    required_argument, 0, 'L'},
+            {"max-sections", required_argument, 0, 'A'},
+            {"queue",      required_argument, 0, 'Q'},
+            {"large-files", required_argument, 0, 'O'},
+            {"hugepages",  no_argument,       0, 'G'},
+            {"stripes",    required_argument, 0, 'W'},
+            {"adaptive",   no_argument,       0, 'a'},
+            {"loss",       required_argument, 0, 'l'},
+            {"link-kbps",  required_argument, 0, 'k'},
+            {"trace",      required_argument, 0, 'x'},
+            {"help",       no_argument,       0, 'h'},
+            {0, 0, 0, 0}
+    };
+
+    options.units = 100;
+    options.duration = 10;
+    options.port = LOADGEN_DEFAULT_PORT;
+    options.readRatio = 0.8;
+    options.sizeSpec = "uniform:1024:1048576";
+    options.maxSize = 16 * 1024 * 1024;
+    options.files = 16;
+    options.thinkMs = 500;
+    options.pollMs = 0;
+    options.serverTimeout = 5;
+    options.seed = 1;
+    options.compress = false;
+    options.entropy = 0.25;
+    options.delta = -1;
+    options.durability = TftpDurabilityMode::TFTP_DURABILITY_NONE;
+    options.groupCommitMs = 10;
+    options.listMs = 0;
+    options.maxSections = 0;
+    options.queueLength = 0;
+    options.largeFiles = 0;
+    options.hugePages = false;
+    options.stripes = 1;
+    options.adaptive = false;
+    options.loss = 0;
+    options.linkKbps = 0;
+
+    int option;
+    while ((option = getopt_long(argc, argv, "n:d:H:p:r:s:m:f:t:P:T:R:S:ze:D:c:u:y:g:L:A:Q:O:GW:al:k:x:h",
+                                 longOptions, NULL)) != -1) {
+        switch (option) {
+            case 'n': options.units = atoi(optarg); break;
+            case 'd': options.duration = atoi(optarg); break;
+            case 'H': options.host = optarg; break;
+            case 'p': options.port = atoi(optarg); break;
+            case 'r': options.readRatio = atof(optarg); break;
+            case 's': options.sizeSpec = optarg; break;
+            case 'm': options.maxSize = strtoull(optarg, NULL, 10); break;
+            case 'f': options.files = atoi(optarg); break;
+            case 't': options.thinkMs = atoi(optarg); break;
+            case 'P': options.pollMs = atoi(optarg); break;
+            case 'T': options.serverTimeout = atoi(optarg); break;
+            case 'R': options.root = optarg; break;
+            case 'S': options.seed = (unsigned) strtoul(optarg, NULL, 10); break;
+            case 'z': options.compress = true; break;
+            case 'e': options.entropy = atof(optarg); break;
+            case 'D': options.delta = atof(optarg); break;
+            case 'c':
+                if (!parseCpuList(optarg, options.serverCpus)) {
+                    return false;
+                }
+                break;
+            case 'u':
+                if (!parseCpuList(optarg, options.unitCpus)) {
+                    return false;
+                }
+                break;
+            case 'y':
+                if (!parseDurability(optarg, options.durability)) {
+                    return false;
+                }
+                break;
+            case 'g': options.groupCommitMs = atoi(optarg); break;
+            case 'L': options.listMs = atoi(optarg); break;
+            case 'A': options.maxSections = atoi(optarg); break;
+            case 'Q': options.queueLength = atoi(optarg); break;
+            case 'O': options.largeFiles = strtoull(optarg, NULL, 10); break;
+            case 'G': options.hugePages = true; break;
+            case 'W': options.stripes = atoi(optarg); break;
+            case 'a': options.adaptive = true; break;
+            case 'l': options.loss = atof(optarg); break;
+            case 'k': options.linkKbps = atoi(optarg); break;
+            case 'x': options.tracePath = optarg; break;
+            default: return false;
+        }
+    }
+
+    return options.units > 0 && options.duration > 0 && options.port > 0 &&
+           options.readRatio >= 0 && options.readRatio <= 1 &&
+           options.maxSize > 0 && options.files > 0 && options.thinkMs >= 0 &&
+           options.pollMs >= 0 && options.serverTimeout > 0 &&
+           options.entropy >= 0 && options.entropy <= 1 && options.delta <= 1 &&
+           options.groupCommitMs >= 0 && options.listMs >= 0 &&
+           options.maxSections >= 0 && options.queueLength >= 0 &&
+           options.stripes >= 1 && options.loss >= 0 && options.loss < 1 &&
+           options.linkKbps >= 0;
+}
+
+int main(int argc, char **argv)
+{
+    LoadgenOptions options;
+    SizeModel sizes;
+    if (!parseOptions(argc, argv, options) || !sizes.parse(options.sizeSpec, options.maxSize)) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    ServerStats serverStats;
+    TFTPServer *server = nullptr;
+    std::thread serverThread;
+    bool localServer = options.host.empty();
+
+    if (localServer) {
+        options.host = "127.0.0.1";
+        if (options.root.empty()) {
+            char root[] = "/tmp/tftp-loadgen-XXXXXX";
+            if (mkdtemp(root) == NULL) {
+                perror("mkdtemp");
+                return 1;
+            }
+            options.root = root;
+        }
+        serverStats.root = options.root;
+
+        server = new TFTPServer();
+        server->setPort(options.port);
+        server->setTimeout(options.serverTimeout);
+        server->setDrainTimeout(options.serverTimeout * 1000);
+        server->setCompression(options.compress);
+        server->setDeltaTransfer(options.delta >= 0);
+        server->setStripedTransfer(options.stripes > 1);
+        if (server->setCpuAffinity(options.port, options.serverCpus) !=
+            TftpServerOperationResult::TFTP_SERVER_OK) {
+            fprintf(stderr, "Can't pin the server to the CPUs\n");
+            delete server;
+            return 1;
+        }
+        server->registerSectionStartedCallback(Loadgen_sectionStartedCbk, &serverStats);
+        server->registerSectionFinishedCallback(Loadgen_sectionFinishedCbk, &serverStats);
+        server->setDurabilityMode(options.durability);
+        server->setGroupCommitInterval(options.groupCommitMs);
+        server->setAdmissionLimits(options.maxSections, 0, options.queueLength, 1000);
+        server->setLargeFileMode(options.largeFiles, options.hugePages);
+        if (options.durability == TftpDurabilityMode::TFTP_DURABILITY_ATOMIC_RENAME ||
+            options.largeFiles > 0 || options.stripes > 1) {
+            // The server only renames, and moves with O_DIRECT, files it
+            // opens itself, serve the root as the working directory. The
+            // callbacks count sequential transfers, not ranges.
+            if (chdir(options.root.c_str()) != 0) {
+                perror("chdir");
+                delete server;
+                return 1;
+            }
+        } else {
+            server->registerOpenFileCallback(Loadgen_openFileCbk, &serverStats);
+        }
+        server->registerCloseFileCallback(Loadgen_closeFileCbk, &serverStats);
+        serverThread = std::thread([server]() { server->startListening(); });
+        printf("In-process server on port %d, root %s\n", options.port, options.root.c_str());
+    }
+
+    // Seed the files units read, through the server so --host works too.
+    std::mt19937 rng(options.seed);
+    std::vector<SeededFile> files(options.files);
+    size_t largest = LOADGEN_STATUS_SIZE;
+    for (int i = 0; i < options.files; i++) {
+        files[i].name = "loadgen_file_" + std::to_string(i) + ".bin";
+        files[i].size = sizes.sample(rng);
+        largest = std::max(largest, files[i].size);
+    }
+
+    std::vector<char> payload(std::max(largest, options.maxSize));
+    std::uniform_real_distribution<double> uniform(0.0, 1.0);
+    for (size_t i = 0; i < payload.size(); i++) {
+        payload[i] = uniform(rng) < options.entropy ? (char) rng() : (char) (i * 131 + 7);
+    }
+
+    bool seeded = true;
+    {
+        TFTPClient seeder;
+        seeder.setConnection(options.host.c_str(), options.port);
+        seeded = send(seeder, LOADGEN_STATUS_FILE, payload, LOADGEN_STATUS_SIZE);
+        for (size_t i = 0; seeded && i < files.size(); i++) {
+            seeded = send(seeder, files[i].name.c_str(), payload, files[i].size);
+        }
+    }
+
+    if (!seeded) {
+        fprintf(stderr, "Failed to seed files on %s:%d\n", options.host.c_str(), options.port);
+    } else {
+        // The server finishes a section after its client, don't count the
+        // seeding in the results.
+        for (int wait = 0; localServer && wait < 1000; wait++) {
+            {
+                std::lock_guard<std::mutex> lock(serverStats.mutex);
+                if (serverStats.started.empty()) {
+                    serverStats.sections = OperationStats();
+                    break;
+                }
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+
+        // Seeded directly, only the units go through the proxy.
+        LossProxy proxy;
+        options.unitHost = options.host;
+        options.unitPort = options.port;
+        bool proxied = options.loss > 0 || options.linkKbps > 0;
+        if (proxied) {
+            if (!startProxy(proxy, options.host, options.port, options.loss,
+                            options.linkKbps, options.seed)) {
+                fprintf(stderr, "Can't relay to %s:%d\n", options.host.c_str(), options.port);
+                proxied = false;
+            } else {
+                options.unitHost = "127.0.0.1";
+                options.unitPort = proxy.port;
+                printf("Relaying through port %d, dropping %.2f%%, link %d kbps\n",
+                       proxy.port, options.loss * 100, options.linkKbps);
+            }
+        }
+
+        printf("Running %d units for %d s against %s:%d\n", options.units,
+               options.duration, options.host.c_str(), options.port);
+
+        std::vector<OperationStats> unitStats(options.units * LOADGEN_OPERATIONS);
+        CompressionTotals compression;
+        compression.plainBytes = 0;
+        compression.compressedBytes = 0;
+        compression.deltaFileBytes = 0;
+        compression.deltaSentBytes = 0;
+        compression.stripedFiles = 0;
+        compression.stripedBytes = 0;
+        compression.stripeLosses = 0;
+        compression.windowSum = 0;
+        std::vector<std::thread> units;
+        TFTPTrace::setEnabled(!options.tracePath.empty());
+        LoadgenClock::time_point start = LoadgenClock::now();
+        LoadgenClock::time_point deadline = start + std::chrono::seconds(options.duration);
+        for (int unit = 0; unit < options.units; unit++) {
+            units.push_back(std::thread(runUnit, unit, std::cref(options), std::cref(sizes),
+                                        std::cref(files), std::cref(payload), deadline,
+                                        &unitStats[unit * LOADGEN_OPERATIONS],
+                                        &compression));
+        }
+        ListingTotals listing;
+        memset(&listing, 0, sizeof(listing));
+        std::thread lister;
+        if (localServer && options.listMs > 0) {
+            lister = std::thread(pollSections, server, options.listMs, deadline, &listing);
+        }
+        for (std::thread &unit : units) {
+            unit.join();
+        }
+        double seconds = elapsedMs(start) / 1000;
+        if (!options.tracePath.empty()) {
+            TFTPTrace::setEnabled(false);
+            if (TFTPTrace::dumpToFile(options.tracePath.c_str()) !=
+                TftpTraceOperationResult::TFTP_TRACE_OK) {
+                fprintf(stderr, "Cannot write trace %s\n", options.tracePath.c_str());
+            }
+        }
+        if (lister.joinable()) {
+            lister.join();
+        }
+        if (proxied) {
+            stopProxy(proxy);
+        }
+
+        OperationStats total[LOADGEN_OPERATIONS];
+        OperationStats all;
+        for (int unit = 0; unit < options.units; unit++) {
+            for (int op = 0; op < LOADGEN_OPERATIONS; op++) {
+                total[op].merge(unitStats[unit * LOADGEN_OPERATIONS + op]);
+                all.merge(unitStats[unit * LOADGEN_OPERATIONS + op]);
+            }
+        }
+
+        printf("\nClient side (%.1f s)\n", seconds);
+        printHeader();
+        for (int op = 0; op < LOADGEN_OPERATIONS; op++) {
+            printStats(operationNames[op], total[op], seconds);
+        }
+        printStats("all", all, seconds);
+        if (options.compress) {
+            printf("\n");
+            printCompression(compression.plainBytes, compression.compressedBytes, seconds);
+        }
+        if (options.delta >= 0) {
+            uint64_t fileBytes = compression.deltaFileBytes;
+            uint64_t sentBytes = compression.deltaSentBytes;
+            printf("\ndelta sends: %.2f MB of images in %.2f MB sent, %.1f%% saved\n",
+                   fileBytes / (1024.0 * 1024.0), sentBytes / (1024.0 * 1024.0),
+                   fileBytes > 0 ? 100.0 * (fileBytes - sentBytes) / fileBytes : 0);
+        }
+        if (options.stripes > 1) {
+            uint64_t stripedBytes = compression.stripedBytes;
+            printf("\nstriped transfers: %llu files, %.2f MB over %d sessions each, %.2f MB/s\n",
+                   (unsigned long long) compression.stripedFiles,
+                   stripedBytes / (1024.0 * 1024.0), options.stripes,
+                   seconds > 0 ? stripedBytes / (1024.0 * 1024.0) / seconds : 0);
+            printf("%s window: %llu losses, mean final window %.1f\n",
+                   options.adaptive ? "adaptive" : "fixed",
+                   (unsigned long long) compression.stripeLosses,
+                   (double) compression.windowSum / options.units);
+        }
+        if (proxied) {
+            uint64_t dropped = proxy.dropped + proxy.overflowed;
+            uint64_t relayed = proxy.relayed;
+            printf("\nloss proxy: %llu datagrams relayed, %llu dropped (%.2f%%), "
+                   "%llu of them by the full link queue\n",
+                   (unsigned long long) relayed, (unsigned long long) dropped,
+                   relayed + dropped > 0 ? 100.0 * dropped / (relayed + dropped) : 0,
+                   (unsigned long long) proxy.overflowed);
+        }
+
+        if (localServer) {
+            server->stopListening();
+            serverThread.join();
+
+            std::lock_guard<std::mutex> lock(serverStats.mutex);
+            printf("\nServer side\n");
+            printHeader();
+            printStats("section", serverStats.sections, seconds);
+            if (options.stripes > 1) {
+                // The close callback counts a range up to its end offset.
+                printf("(striped: a section per range and checksum, range bytes overcounted)\n");
+            }
+            if (options.compress) {
+                uint64_t plainBytes = 0, compressedBytes = 0, cacheHits = 0;
+                server->getCompressionStats(&plainBytes, &compressedBytes, &cacheHits);
+                printf("\n");
+                printCompression(plainBytes, compressedBytes, seconds);
+                printf("compressed file cache hits: %llu\n", (unsigned long long) cacheHits);
+            }
+            if (options.durability != TftpDurabilityMode::TFTP_DURABILITY_NONE) {
+                printf("\n");
+                printDurability(server, options.durability);
+            }
+            if (options.maxSections > 0) {
+                uint64_t queued = 0, rejected = 0;
+                server->getAdmissionStats(&queued, &rejected);
+                printf("\nadmission: %llu queued, %llu rejected\n",
+                       (unsigned long long) queued, (unsigned long long) rejected);
+            }
+            if (options.largeFiles > 0) {
+                uint64_t largeFiles = 0, largeBytes = 0, buffered = 0;
+                server->getLargeFileStats(&largeFiles, &largeBytes, &buffered);
+                printf("\nlarge files: %llu files, %.2f MB at %.2f MB/s, %llu without O_DIRECT\n",
+                       (unsigned long long) largeFiles, largeBytes / (1024.0 * 1024.0),
+                       seconds > 0 ? largeBytes / (1024.0 * 1024.0) / seconds : 0,
+                       (unsigned long long) buffered);
+            }
+            printf("\n");
+            printPageCache(options.root);
+            if (listing.polls > 0) {
+                printf("\nsection table: %llu polls, peak %zu sections, mean %.1f us, max %.1f us\n",
+                       (unsigned long long) listing.polls, listing.peakSections,
+                       listing.totalUs / listing.polls, listing.maxUs);
+                if (options.stripes > 1) {
+                    printf("peak striping window seen: %d\n", listing.peakWindow);
+                }
+            }
+        }
+    }
+
+    if (localServer) {
+        if (serverThread.joinable()) {
+            server->stopListening();
+            serverThread.join();
+        }
+        delete server;
+    }
+    return seeded ? 0 : 1;
+}